@@ -14,6 +14,10 @@ $CFLAGS << ' -g'
 $CFLAGS << ' -O3' unless $CFLAGS[/-O\d/]
 $CFLAGS << ' -Wall -Wno-comment -Wno-sizeof-pointer-memaccess'
 
+have_library('pthread')
+have_library('rt')
+have_library('z')
+
 
 MAKE = find_executable('gmake') || find_executable('make')
 unless MAKE
@@ -0,0 +1,1248 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_commit_graph.h"
+#include "mysql_object_parse.h"
+
+#define GRAPH_COLUMNS "`oid`, `generation`, `commit_time`, `tree`, `parents`"
+#define GRAPH_BATCH 256
+#define GRAPH_WINDOW 128
+#define GRAPH_WINDOW_ROWS 2048
+#define GRAPH_UPDATE_BATCH 1000
+
+#define PARENT1 (1u << 0)
+#define PARENT2 (1u << 1)
+#define STALE (1u << 2)
+
+typedef struct {
+	mysql_commit_graph_entry entry;
+	git_oid *parents;
+	unsigned int flags;
+	uint32_t bound;		/* generation upper bound until loaded */
+	int loaded;
+	int queued;
+	int done;
+} graph_node;
+
+typedef struct {
+	graph_node **slots;
+	size_t size;
+	size_t count;
+} graph_map;
+
+typedef struct {
+	mysql_odb_backend *backend;
+	graph_map map;
+	graph_node **heap;
+	size_t heap_count;
+	size_t heap_alloc;
+	graph_node **missing;
+	size_t missing_count;
+	size_t missing_alloc;
+	size_t interesting;
+	int by_time;		/* a commit without a generation was met */
+} graph_walk;
+
+static size_t map_hash(const git_oid * oid)
+{
+	size_t hash;
+
+	memcpy(&hash, oid->id, sizeof(hash));
+	return hash;
+}
+
+static graph_node *map_get(graph_map * map, const git_oid * oid)
+{
+	size_t i;
+
+	if (map->size == 0) {
+		return NULL;
+	}
+
+	for (i = map_hash(oid) & (map->size - 1); map->slots[i] != NULL;
+	     i = (i + 1) & (map->size - 1)) {
+		if (git_oid_equal(&map->slots[i]->entry.oid, oid)) {
+			return map->slots[i];
+		}
+	}
+
+	return NULL;
+}
+
+static int map_grow(graph_map * map)
+{
+	size_t size = map->size ? map->size * 2 : 1024;
+	graph_node **slots = calloc(size, sizeof(graph_node *));
+	size_t i, j;
+
+	if (slots == NULL) {
+		return GIT_ERROR;
+	}
+
+	for (i = 0; i < map->size; i++) {
+		graph_node *node = map->slots[i];
+
+		if (node == NULL) {
+			continue;
+		}
+		for (j = map_hash(&node->entry.oid) & (size - 1);
+		     slots[j] != NULL; j = (j + 1) & (size - 1)) ;
+		slots[j] = node;
+	}
+
+	free(map->slots);
+	map->slots = slots;
+	map->size = size;
+	return GIT_OK;
+}
+
+static graph_node *map_insert(graph_map * map, const git_oid * oid)
+{
+	graph_node *node;
+	size_t i;
+
+	if ((node = map_get(map, oid)) != NULL) {
+		return node;
+	}
+
+	if ((map->count + 1) * 2 > map->size && map_grow(map) < 0) {
+		return NULL;
+	}
+
+	if ((node = calloc(1, sizeof(graph_node))) == NULL) {
+		return NULL;
+	}
+	git_oid_cpy(&node->entry.oid, oid);
+
+	for (i = map_hash(oid) & (map->size - 1); map->slots[i] != NULL;
+	     i = (i + 1) & (map->size - 1)) ;
+	map->slots[i] = node;
+	map->count++;
+
+	return node;
+}
+
+static void map_free(graph_map * map)
+{
+	size_t i;
+
+	for (i = 0; i < map->size; i++) {
+		if (map->slots[i] != NULL) {
+			free(map->slots[i]->parents);
+			free(map->slots[i]);
+		}
+	}
+	free(map->slots);
+}
+
+static void walk_init(graph_walk * walk, git_odb_backend * backend)
+{
+	memset(walk, 0, sizeof(*walk));
+	walk->backend = (mysql_odb_backend *) backend;
+}
+
+static void walk_free(graph_walk * walk)
+{
+	map_free(&walk->map);
+	free(walk->heap);
+	free(walk->missing);
+}
+
+static int push_node(graph_node *** array, size_t * count, size_t * alloc,
+		     graph_node * node)
+{
+	if (*count == *alloc) {
+		size_t size = *alloc ? *alloc * 2 : 64;
+		graph_node **grown = realloc(*array, size * sizeof(graph_node *));
+
+		if (grown == NULL) {
+			return GIT_ERROR;
+		}
+		*array = grown;
+		*alloc = size;
+	}
+
+	(*array)[(*count)++] = node;
+	return GIT_OK;
+}
+
+/*
+ * Newest generation first, commit time breaks ties. Generation numbers
+ * only order a walk when all of them are known, otherwise it goes by
+ * commit time, as a walk over the objects would.
+ */
+static int
+node_before(const graph_walk * walk, const graph_node * a,
+	    const graph_node * b)
+{
+	if (!walk->by_time && a->entry.generation != b->entry.generation) {
+		return a->entry.generation > b->entry.generation;
+	}
+	return a->entry.commit_time > b->entry.commit_time;
+}
+
+static void heap_sift_up(graph_walk * walk, size_t i)
+{
+	graph_node *node = walk->heap[i];
+
+	for (; i > 0; i = (i - 1) / 2) {
+		graph_node **parent = &walk->heap[(i - 1) / 2];
+
+		if (!node_before(walk, walk->heap[i], *parent)) {
+			break;
+		}
+		walk->heap[i] = *parent;
+		*parent = node;
+	}
+}
+
+static int heap_push(graph_walk * walk, graph_node * node)
+{
+	if (push_node(&walk->heap, &walk->heap_count, &walk->heap_alloc, node)
+	    < 0) {
+		return GIT_ERROR;
+	}
+
+	heap_sift_up(walk, walk->heap_count - 1);
+	return GIT_OK;
+}
+
+/* a commit without a generation turns the walk to commit time order */
+static void walk_by_time(graph_walk * walk)
+{
+	size_t i;
+
+	if (walk->by_time) {
+		return;
+	}
+
+	walk->by_time = 1;
+	for (i = 1; i < walk->heap_count; i++) {
+		heap_sift_up(walk, i);
+	}
+}
+
+static graph_node *heap_pop(graph_walk * walk)
+{
+	graph_node *top = walk->heap[0];
+	size_t i = 0;
+
+	walk->heap[0] = walk->heap[--walk->heap_count];
+
+	for (;;) {
+		size_t left = i * 2 + 1, right = left + 1, best = i;
+		graph_node *tmp;
+
+		if (left < walk->heap_count &&
+		    node_before(walk, walk->heap[left], walk->heap[best])) {
+			best = left;
+		}
+		if (right < walk->heap_count &&
+		    node_before(walk, walk->heap[right], walk->heap[best])) {
+			best = right;
+		}
+		if (best == i) {
+			break;
+		}
+
+		tmp = walk->heap[i];
+		walk->heap[i] = walk->heap[best];
+		walk->heap[best] = tmp;
+		i = best;
+	}
+
+	return top;
+}
+
+/*
+ * The connection is entered for each query rather than for a whole walk,
+ * which calls back into the caller in between.
+ */
+static int load_rows(graph_walk * walk, const char *sql, size_t sql_len,
+		     graph_node *** loaded, size_t * loaded_count,
+		     size_t * loaded_alloc)
+{
+	MYSQL *db;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	if (mysql_odb__enter(walk->backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	db = walk->backend->db;
+	if (mysql_real_query(db, sql, sql_len) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		mysql_odb__leave(walk->backend);
+		return GIT_ERROR;
+	}
+
+	res = mysql_store_result(db);
+	mysql_odb__leave(walk->backend);
+	if (res == NULL) {
+		return GIT_ERROR;
+	}
+
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		unsigned long *lengths = mysql_fetch_lengths(res);
+		graph_node *node;
+		git_oid oid;
+
+		if (lengths[0] != GIT_OID_RAWSZ || lengths[3] != GIT_OID_RAWSZ
+		    || lengths[4] % GIT_OID_RAWSZ != 0) {
+			continue;
+		}
+
+		git_oid_fromraw(&oid, (const unsigned char *)row[0]);
+		if ((node = map_insert(&walk->map, &oid)) == NULL) {
+			mysql_free_result(res);
+			return GIT_ERROR;
+		}
+		if (node->loaded) {
+			continue;
+		}
+
+		node->entry.generation = (uint32_t) strtoul(row[1], NULL, 10);
+		node->entry.commit_time = strtoll(row[2], NULL, 10);
+		git_oid_fromraw(&node->entry.tree,
+				(const unsigned char *)row[3]);
+
+		node->entry.parent_count = lengths[4] / GIT_OID_RAWSZ;
+		if (node->entry.parent_count > 0) {
+			node->parents = malloc(lengths[4]);
+			if (node->parents == NULL) {
+				mysql_free_result(res);
+				return GIT_ERROR;
+			}
+			memcpy(node->parents, row[4], lengths[4]);
+		}
+		node->entry.parents = node->parents;
+		node->loaded = 1;
+
+		if (node->entry.generation == 0) {
+			walk_by_time(walk);
+		}
+
+		if (loaded != NULL &&
+		    push_node(loaded, loaded_count, loaded_alloc, node) < 0) {
+			mysql_free_result(res);
+			return GIT_ERROR;
+		}
+	}
+
+	mysql_free_result(res);
+	return GIT_OK;
+}
+
+/* load the rows of every node that is not loaded yet, in batches */
+static int load_nodes(graph_walk * walk, graph_node ** nodes, size_t count)
+{
+	git_buf sql = GIT_BUF_INIT;
+	size_t i, batch = 0;
+	int error = GIT_OK;
+
+	for (i = 0; i < count && error == GIT_OK; i++) {
+		if (!nodes[i]->loaded) {
+			git_buf_puts(&sql, batch++ ? "," : "SELECT " GRAPH_COLUMNS
+				     " FROM `" GIT2_COMMIT_GRAPH_TABLE_NAME
+				     "` WHERE `oid` IN (");
+			mysql_buf_put_oid(&sql, &nodes[i]->entry.oid);
+		}
+
+		if (batch > 0 && (batch == GRAPH_BATCH || i + 1 == count)) {
+			git_buf_putc(&sql, ')');
+			error = git_buf_oom(&sql) ? GIT_ERROR :
+			    load_rows(walk, sql.ptr, sql.size, NULL, NULL, NULL);
+			git_buf_clear(&sql);
+			batch = 0;
+		}
+	}
+
+	git_buf_free(&sql);
+	return error;
+}
+
+/*
+ * A commit not in the graph yet, or any more, is read from its object. It
+ * has no generation, see walk_by_time().
+ */
+static int load_object(graph_walk * walk, graph_node * node)
+{
+	git_odb_backend *backend = &walk->backend->parent;
+	mysql_commit_info info;
+	void *data;
+	size_t len;
+	git_otype type;
+	int error;
+
+	if ((error = backend->read(&data, &len, &type, backend,
+				   &node->entry.oid)) < 0) {
+		if (error == GIT_ENOTFOUND) {
+			giterr_set_str(GITERR_ODB, "Commit not found");
+			error = GIT_ERROR;
+		}
+		return error;
+	}
+
+	mysql_commit_info_init(&info);
+
+	if (type != GIT_OBJ_COMMIT) {
+		giterr_set_str(GITERR_ODB, "Object is not a commit");
+		error = GIT_ERROR;
+	} else if ((error = mysql_parse_commit(&info, data, len)) == GIT_OK) {
+		node->entry.generation = 0;
+		node->entry.commit_time = info.commit_time;
+		git_oid_cpy(&node->entry.tree, &info.tree);
+
+		node->entry.parent_count = info.parent_count;
+		if (info.parent_count > 0 &&
+		    (node->parents = malloc(info.parents.size)) == NULL) {
+			giterr_set_oom();
+			error = GIT_ERROR;
+		} else if (info.parent_count > 0) {
+			memcpy(node->parents, info.parents.ptr,
+			       info.parents.size);
+		}
+		node->entry.parents = node->parents;
+		node->loaded = error == GIT_OK;
+	}
+
+	mysql_commit_info_free(&info);
+	free(data);
+
+	if (node->loaded) {
+		walk_by_time(walk);
+	}
+
+	return error;
+}
+
+/*
+ * Load everything the walk is waiting for. Parents of a commit with
+ * generation g sit at or below g - 1, and on mostly linear history they
+ * are right below it, so one window query usually brings in a whole page
+ * of ancestors; whatever it misses is loaded by OID.
+ */
+static int walk_resolve(graph_walk * walk)
+{
+	uint32_t bound = 0;
+	size_t i;
+	int error;
+
+	if (walk->missing_count == 0) {
+		return GIT_OK;
+	}
+
+	for (i = 0; i < walk->missing_count; i++) {
+		if (walk->missing[i]->bound > bound) {
+			bound = walk->missing[i]->bound;
+		}
+	}
+
+	if (bound > 0) {
+		git_buf sql = GIT_BUF_INIT;
+
+		git_buf_printf(&sql, "SELECT " GRAPH_COLUMNS " FROM `"
+			       GIT2_COMMIT_GRAPH_TABLE_NAME
+			       "` WHERE `generation` BETWEEN %u AND %u LIMIT %d",
+			       bound > GRAPH_WINDOW ? bound - GRAPH_WINDOW + 1 :
+			       1, bound, GRAPH_WINDOW_ROWS);
+		error = git_buf_oom(&sql) ? GIT_ERROR :
+		    load_rows(walk, sql.ptr, sql.size, NULL, NULL, NULL);
+		git_buf_free(&sql);
+
+		if (error < 0) {
+			return error;
+		}
+	}
+
+	if ((error = load_nodes(walk, walk->missing, walk->missing_count)) < 0) {
+		return error;
+	}
+
+	for (i = 0; i < walk->missing_count; i++) {
+		if (!walk->missing[i]->loaded &&
+		    (error = load_object(walk, walk->missing[i])) < 0) {
+			return error;
+		}
+		if (heap_push(walk, walk->missing[i]) < 0) {
+			return GIT_ERROR;
+		}
+	}
+
+	walk->missing_count = 0;
+	return GIT_OK;
+}
+
+static int walk_mark(graph_walk * walk, const git_oid * oid,
+		     unsigned int flags, uint32_t bound)
+{
+	graph_node *node = map_insert(&walk->map, oid);
+	unsigned int old;
+
+	if (node == NULL) {
+		return GIT_ERROR;
+	}
+	if (node->done) {
+		return GIT_OK;
+	}
+
+	old = node->flags;
+	node->flags |= flags;
+
+	if (node->queued) {
+		if (!(old & STALE) && (node->flags & STALE)) {
+			walk->interesting--;
+		}
+		if (bound > node->bound) {
+			node->bound = bound;
+		}
+		return GIT_OK;
+	}
+
+	node->queued = 1;
+	node->bound = bound;
+	if (!(node->flags & STALE)) {
+		walk->interesting++;
+	}
+
+	if (node->loaded) {
+		return heap_push(walk, node);
+	}
+
+	return push_node(&walk->missing, &walk->missing_count,
+			 &walk->missing_alloc, node);
+}
+
+static int walk_mark_parents(graph_walk * walk, graph_node * node,
+			     unsigned int flags)
+{
+	uint32_t gen = node->entry.generation;
+	size_t i;
+	int error;
+
+	for (i = 0; i < node->entry.parent_count; i++) {
+		if ((error = walk_mark(walk, &node->parents[i], flags,
+				       gen > 0 ? gen - 1 : 0)) < 0) {
+			return error;
+		}
+	}
+
+	return GIT_OK;
+}
+
+static int walk_next(graph_node ** out, graph_walk * walk)
+{
+	graph_node *node;
+	int error;
+
+	if ((error = walk_resolve(walk)) < 0) {
+		return error;
+	}
+
+	if (walk->heap_count == 0) {
+		return GIT_ITEROVER;
+	}
+
+	node = heap_pop(walk);
+	node->queued = 0;
+	node->done = 1;
+	if (!(node->flags & STALE)) {
+		walk->interesting--;
+	}
+
+	*out = node;
+	return GIT_OK;
+}
+
+int
+mysql_commit_graph_walk(git_odb_backend * backend, const git_oid * tips,
+			size_t tip_count, uint32_t min_generation, size_t limit,
+			mysql_commit_graph_cb cb, void *payload)
+{
+	graph_walk walk;
+	graph_node *node;
+	size_t i, visited = 0;
+	int error = GIT_OK;
+
+	assert(backend && cb);
+
+	walk_init(&walk, backend);
+
+	for (i = 0; i < tip_count && error == GIT_OK; i++) {
+		error = walk_mark(&walk, &tips[i], PARENT1, 0);
+	}
+
+	while (error == GIT_OK && (limit == 0 || visited < limit)) {
+		uint32_t gen;
+
+		if ((error = walk_next(&node, &walk)) < 0) {
+			break;
+		}
+
+		gen = node->entry.generation;
+		if (gen > 0 && gen < min_generation) {
+			continue;
+		}
+
+		if ((error = cb(&node->entry, payload)) != 0) {
+			break;
+		}
+		visited++;
+
+		// every parent would be below the cut-off
+		if (gen == 0 || gen > min_generation) {
+			error = walk_mark_parents(&walk, node, PARENT1);
+		}
+	}
+
+	if (error == GIT_ITEROVER) {
+		error = GIT_OK;
+	}
+
+	walk_free(&walk);
+	return error;
+}
+
+int
+mysql_commit_graph_ahead_behind(size_t * ahead, size_t * behind,
+				git_odb_backend * backend,
+				const git_oid * local, const git_oid * upstream)
+{
+	graph_walk walk;
+	graph_node *node;
+	int error;
+
+	assert(ahead && behind && backend && local && upstream);
+
+	*ahead = *behind = 0;
+
+	if (mysql_odb__enter((mysql_odb_backend *) backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	walk_init(&walk, backend);
+
+	if ((error = walk_mark(&walk, local, PARENT1, 0)) < 0 ||
+	    (error = walk_mark(&walk, upstream, PARENT2, 0)) < 0) {
+		goto done;
+	}
+
+	// stop once only commits reachable from both sides are left
+	while (walk.interesting > 0) {
+		unsigned int flags;
+
+		if ((error = walk_next(&node, &walk)) < 0) {
+			break;
+		}
+
+		flags = node->flags;
+		if ((flags & (PARENT1 | PARENT2)) == PARENT1) {
+			(*ahead)++;
+		} else if ((flags & (PARENT1 | PARENT2)) == PARENT2) {
+			(*behind)++;
+		} else {
+			flags |= STALE;
+		}
+
+		if ((error = walk_mark_parents(&walk, node, flags)) < 0) {
+			break;
+		}
+	}
+
+	if (error == GIT_ITEROVER) {
+		error = GIT_OK;
+	}
+
+ done:
+	walk_free(&walk);
+	mysql_odb__leave((mysql_odb_backend *) backend);
+	return error;
+}
+
+int
+mysql_commit_graph_merge_base(git_oid * out, git_odb_backend * backend,
+			      const git_oid * one, const git_oid * two)
+{
+	graph_walk walk;
+	graph_node *node, **results = NULL;
+	size_t result_count = 0, result_alloc = 0, i;
+	int error;
+
+	assert(out && backend && one && two);
+
+	if (git_oid_equal(one, two)) {
+		git_oid_cpy(out, one);
+		return GIT_OK;
+	}
+
+	if (mysql_odb__enter((mysql_odb_backend *) backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	walk_init(&walk, backend);
+
+	if ((error = walk_mark(&walk, one, PARENT1, 0)) < 0 ||
+	    (error = walk_mark(&walk, two, PARENT2, 0)) < 0) {
+		goto done;
+	}
+
+	// in generation order the first common commit is a best merge base;
+	// in commit time order, the first one nothing else found is above
+	while (walk.interesting > 0) {
+		unsigned int flags;
+
+		if ((error = walk_next(&node, &walk)) < 0) {
+			break;
+		}
+
+		flags = node->flags & (PARENT1 | PARENT2 | STALE);
+		if (flags == (PARENT1 | PARENT2)) {
+			if (!walk.by_time) {
+				git_oid_cpy(out, &node->entry.oid);
+				goto done;
+			}
+			if ((error = push_node(&results, &result_count,
+					       &result_alloc, node)) < 0) {
+				goto done;
+			}
+			flags |= STALE;
+		}
+
+		if ((error = walk_mark_parents(&walk, node, flags)) < 0) {
+			break;
+		}
+	}
+
+	if (error < 0 && error != GIT_ITEROVER) {
+		goto done;
+	}
+
+	error = GIT_ENOTFOUND;
+	for (i = 0; i < result_count; i++) {
+		if (!(results[i]->flags & STALE)) {
+			git_oid_cpy(out, &results[i]->entry.oid);
+			error = GIT_OK;
+			break;
+		}
+	}
+
+ done:
+	free(results);
+	walk_free(&walk);
+	mysql_odb__leave((mysql_odb_backend *) backend);
+	return error;
+}
+
+int mysql_commit_graph__init(mysql_odb_backend * backend)
+{
+	static const char *sql_create =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_COMMIT_GRAPH_TABLE_NAME "` ("
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `generation` int(10) unsigned NOT NULL,"
+	    "  `commit_time` bigint(20) NOT NULL,"
+	    "  `tree` binary(20) NOT NULL,"
+	    "  `parents` blob NOT NULL,"
+	    "  PRIMARY KEY (`oid`),"
+	    "  KEY `generation` (`generation`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	static const char *sql_write =
+	    "INSERT IGNORE INTO `" GIT2_COMMIT_GRAPH_TABLE_NAME
+	    "` VALUES (?, ?, ?, ?, ?);";
+
+	static const char *sql_update =
+	    "UPDATE `" GIT2_COMMIT_GRAPH_TABLE_NAME
+	    "` SET `generation` = ? WHERE `oid` = ?;";
+
+	if (mysql_real_query(backend->db, sql_create, strlen(sql_create)) != 0) {
+		return GIT_ERROR;
+	}
+
+	backend->st_graph_write = mysql_stmt_init(backend->db);
+	if (backend->st_graph_write == NULL ||
+	    mysql_stmt_prepare(backend->st_graph_write, sql_write,
+			       strlen(sql_write)) != 0) {
+		return GIT_ERROR;
+	}
+
+	backend->st_graph_update = mysql_stmt_init(backend->db);
+	if (backend->st_graph_update == NULL ||
+	    mysql_stmt_prepare(backend->st_graph_update, sql_update,
+			       strlen(sql_update)) != 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+void mysql_commit_graph__free(mysql_odb_backend * backend)
+{
+	if (backend->st_graph_write) {
+		mysql_conn_stmt_close(backend->st_graph_write, backend->epoch);
+	}
+	if (backend->st_graph_update) {
+		mysql_conn_stmt_close(backend->st_graph_update, backend->epoch);
+	}
+
+	backend->st_graph_write = NULL;
+	backend->st_graph_update = NULL;
+}
+
+/* the generation of a new commit, or 0 while a parent is not in the graph */
+static uint32_t parent_generation(mysql_odb_backend * backend,
+				  const mysql_commit_info * info)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	uint32_t generation = 0;
+	size_t i;
+
+	if (info->parent_count == 0) {
+		return 1;
+	}
+
+	git_buf_puts(&sql, "SELECT COUNT(*), MIN(`generation`),"
+		     " MAX(`generation`) FROM `" GIT2_COMMIT_GRAPH_TABLE_NAME
+		     "` WHERE `oid` IN (");
+	for (i = 0; i < info->parent_count; i++) {
+		git_oid parent;
+
+		git_oid_fromraw(&parent, (const unsigned char *)
+				info->parents.ptr + i * GIT_OID_RAWSZ);
+		if (i > 0) {
+			git_buf_putc(&sql, ',');
+		}
+		mysql_buf_put_oid(&sql, &parent);
+	}
+	git_buf_putc(&sql, ')');
+
+	if (!git_buf_oom(&sql) &&
+	    mysql_real_query(backend->db, sql.ptr, sql.size) == 0 &&
+	    (res = mysql_store_result(backend->db)) != NULL) {
+		if ((row = mysql_fetch_row(res)) != NULL && row[1] != NULL &&
+		    strtoul(row[0], NULL, 10) == info->parent_count &&
+		    strtoul(row[1], NULL, 10) > 0) {
+			generation = (uint32_t) strtoul(row[2], NULL, 10) + 1;
+		}
+		mysql_free_result(res);
+	}
+
+	git_buf_free(&sql);
+	return generation;
+}
+
+int
+mysql_commit_graph__add(mysql_odb_backend * backend, const git_oid * oid,
+			const void *data, size_t len)
+{
+	mysql_commit_info info;
+	MYSQL_BIND bind_buffers[5];
+	unsigned long generation;
+	long long commit_time;
+	int error;
+
+	mysql_commit_info_init(&info);
+
+	if ((error = mysql_parse_commit(&info, data, len)) < 0) {
+		goto done;
+	}
+
+	generation = parent_generation(backend, &info);
+	commit_time = info.commit_time;
+
+	memset(bind_buffers, 0, sizeof(bind_buffers));
+
+	bind_buffers[0].buffer = (void *)oid->id;
+	bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+	bind_buffers[0].length = &bind_buffers[0].buffer_length;
+	bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+
+	bind_buffers[1].buffer = &generation;
+	bind_buffers[1].buffer_type = MYSQL_TYPE_LONG;
+	bind_buffers[1].is_unsigned = 1;
+
+	bind_buffers[2].buffer = &commit_time;
+	bind_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+
+	bind_buffers[3].buffer = info.tree.id;
+	bind_buffers[3].buffer_length = GIT_OID_RAWSZ;
+	bind_buffers[3].length = &bind_buffers[3].buffer_length;
+	bind_buffers[3].buffer_type = MYSQL_TYPE_BLOB;
+
+	bind_buffers[4].buffer = info.parents.ptr;
+	bind_buffers[4].buffer_length = info.parents.size;
+	bind_buffers[4].length = &bind_buffers[4].buffer_length;
+	bind_buffers[4].buffer_type = MYSQL_TYPE_BLOB;
+
+	if (mysql_stmt_bind_param(backend->st_graph_write, bind_buffers) != 0 ||
+	    mysql_stmt_execute(backend->st_graph_write) != 0) {
+		giterr_set_str(GITERR_ODB, "Error writing to the commit graph");
+		error = GIT_ERROR;
+	}
+
+	mysql_stmt_reset(backend->st_graph_write);
+
+ done:
+	mysql_commit_info_free(&info);
+	return error;
+}
+
+static int update_generations(mysql_odb_backend * backend,
+			      graph_node ** nodes, size_t count)
+{
+	MYSQL_BIND bind_buffers[2];
+	unsigned long generation;
+	size_t i;
+
+	memset(bind_buffers, 0, sizeof(bind_buffers));
+
+	bind_buffers[0].buffer = &generation;
+	bind_buffers[0].buffer_type = MYSQL_TYPE_LONG;
+	bind_buffers[0].is_unsigned = 1;
+
+	bind_buffers[1].buffer_length = GIT_OID_RAWSZ;
+	bind_buffers[1].length = &bind_buffers[1].buffer_length;
+	bind_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
+
+	for (i = 0; i < count; i++) {
+		if (i % GRAPH_UPDATE_BATCH == 0 &&
+		    mysql_real_query(backend->db, "START TRANSACTION", 17) != 0) {
+			return GIT_ERROR;
+		}
+
+		generation = nodes[i]->entry.generation;
+		bind_buffers[1].buffer = nodes[i]->entry.oid.id;
+
+		if (mysql_stmt_bind_param(backend->st_graph_update,
+					  bind_buffers) != 0 ||
+		    mysql_stmt_execute(backend->st_graph_update) != 0) {
+			mysql_real_query(backend->db, "ROLLBACK", 8);
+			return GIT_ERROR;
+		}
+
+		if ((i + 1) % GRAPH_UPDATE_BATCH == 0 || i + 1 == count) {
+			if (mysql_real_query(backend->db, "COMMIT", 6) != 0) {
+				return GIT_ERROR;
+			}
+		}
+	}
+
+	return GIT_OK;
+}
+
+/* the rows of `oids` that have no generation yet */
+static int
+load_pending(graph_walk * walk, const git_oid * oids, size_t count,
+	     graph_node *** pending, size_t * pending_count,
+	     size_t * pending_alloc)
+{
+	git_buf sql = GIT_BUF_INIT;
+	size_t i, batch = 0;
+	int error = GIT_OK;
+
+	for (i = 0; i < count && error == GIT_OK; i++) {
+		git_buf_puts(&sql, batch++ ? "," : "SELECT " GRAPH_COLUMNS
+			     " FROM `" GIT2_COMMIT_GRAPH_TABLE_NAME
+			     "` WHERE `generation` = 0 AND `oid` IN (");
+		mysql_buf_put_oid(&sql, &oids[i]);
+
+		if (batch == GRAPH_BATCH || i + 1 == count) {
+			git_buf_putc(&sql, ')');
+			error = git_buf_oom(&sql) ? GIT_ERROR :
+			    load_rows(walk, sql.ptr, sql.size, pending,
+				      pending_count, pending_alloc);
+			git_buf_clear(&sql);
+			batch = 0;
+		}
+	}
+
+	git_buf_free(&sql);
+	return error;
+}
+
+/*
+ * Compute generation numbers for the rows of `oids` that still have none,
+ * or for every such row if `oids` is NULL. Commits can arrive in any
+ * order, so this runs after bulk writes and backfills.
+ */
+int
+mysql_commit_graph__fix_generations(mysql_odb_backend * backend,
+				    const git_oid * oids, size_t count)
+{
+	graph_walk walk;
+	graph_node **pending = NULL, **parents = NULL, **fixed = NULL;
+	size_t pending_count = 0, pending_alloc = 0;
+	size_t parent_count = 0, parent_alloc = 0;
+	size_t fixed_count = 0, fixed_alloc = 0;
+	git_buf sql = GIT_BUF_INIT;
+	git_oid cursor;
+	size_t i, j, before;
+	int error = GIT_OK;
+
+	walk_init(&walk, (git_odb_backend *) backend);
+	memset(&cursor, 0, sizeof(cursor));
+
+	if (oids != NULL) {
+		if ((error = load_pending(&walk, oids, count, &pending,
+					  &pending_count, &pending_alloc)) < 0) {
+			goto done;
+		}
+	} else do {
+		before = pending_count;
+
+		git_buf_clear(&sql);
+		git_buf_puts(&sql, "SELECT " GRAPH_COLUMNS " FROM `"
+			     GIT2_COMMIT_GRAPH_TABLE_NAME
+			     "` WHERE `generation` = 0 AND `oid` > ");
+		mysql_buf_put_oid(&sql, &cursor);
+		git_buf_printf(&sql, " ORDER BY `oid` LIMIT %d",
+			       GRAPH_WINDOW_ROWS);
+
+		if (git_buf_oom(&sql) ||
+		    (error = load_rows(&walk, sql.ptr, sql.size, &pending,
+				       &pending_count, &pending_alloc)) < 0) {
+			goto done;
+		}
+
+		if (pending_count > before) {
+			git_oid_cpy(&cursor,
+				    &pending[pending_count - 1]->entry.oid);
+		}
+	} while (pending_count - before == GRAPH_WINDOW_ROWS);
+
+	for (i = 0; i < pending_count; i++) {
+		for (j = 0; j < pending[i]->entry.parent_count; j++) {
+			graph_node *parent =
+			    map_insert(&walk.map, &pending[i]->parents[j]);
+
+			if (parent == NULL ||
+			    (!parent->loaded &&
+			     push_node(&parents, &parent_count, &parent_alloc,
+				       parent) < 0)) {
+				error = GIT_ERROR;
+				goto done;
+			}
+		}
+	}
+
+	if ((error = load_nodes(&walk, parents, parent_count)) < 0) {
+		goto done;
+	}
+
+	/*
+	 * Depth-first over the pending rows: `queued` marks nodes on the
+	 * stack, `done` nodes whose generation is final (0 if unknowable).
+	 */
+	for (i = 0; i < pending_count; i++) {
+		graph_node **stack = NULL;
+		size_t stack_count = 0, stack_alloc = 0;
+
+		if (pending[i]->done) {
+			continue;
+		}
+
+		pending[i]->queued = 1;
+		if (push_node(&stack, &stack_count, &stack_alloc, pending[i]) <
+		    0) {
+			error = GIT_ERROR;
+			goto done;
+		}
+
+		while (stack_count > 0) {
+			graph_node *node = stack[stack_count - 1];
+			graph_node *next = NULL;
+			uint32_t max = 0;
+			int known = 1;
+
+			for (j = 0; j < node->entry.parent_count; j++) {
+				graph_node *parent =
+				    map_get(&walk.map, &node->parents[j]);
+
+				if (parent == NULL || !parent->loaded ||
+				    parent->queued) {
+					known = 0;
+				} else if (parent->entry.generation == 0 &&
+					   !parent->done) {
+					next = parent;
+					break;
+				} else if (parent->entry.generation == 0) {
+					known = 0;
+				} else if (parent->entry.generation > max) {
+					max = parent->entry.generation;
+				}
+			}
+
+			if (next != NULL) {
+				next->queued = 1;
+				if (push_node(&stack, &stack_count,
+					      &stack_alloc, next) < 0) {
+					free(stack);
+					error = GIT_ERROR;
+					goto done;
+				}
+				continue;
+			}
+
+			node->entry.generation = known ? max + 1 : 0;
+			node->queued = 0;
+			node->done = 1;
+			stack_count--;
+
+			if (node->entry.generation > 0 &&
+			    push_node(&fixed, &fixed_count, &fixed_alloc,
+				      node) < 0) {
+				free(stack);
+				error = GIT_ERROR;
+				goto done;
+			}
+		}
+
+		free(stack);
+	}
+
+	error = update_generations(backend, fixed, fixed_count);
+
+ done:
+	git_buf_free(&sql);
+	free(pending);
+	free(parents);
+	free(fixed);
+	walk_free(&walk);
+	return error;
+}
+
+static int collect_missing(git_oid ** oids, size_t * count, MYSQL * db,
+			   const char *table, const git_oid * cursor)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error = GIT_ERROR;
+
+	git_buf_printf(&sql, "SELECT o.`oid` FROM `%s` o LEFT JOIN `"
+		       GIT2_COMMIT_GRAPH_TABLE_NAME "` g ON g.`oid` = o.`oid`"
+		       " WHERE o.`type` = %d AND g.`oid` IS NULL AND o.`oid` > ",
+		       table, GIT_OBJ_COMMIT);
+	mysql_buf_put_oid(&sql, cursor);
+	git_buf_printf(&sql, " ORDER BY o.`oid` LIMIT %d", GRAPH_BATCH);
+
+	*count = 0;
+
+	if (git_buf_oom(&sql) ||
+	    mysql_real_query(db, sql.ptr, sql.size) != 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		goto done;
+	}
+
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		if (mysql_fetch_lengths(res)[0] == GIT_OID_RAWSZ) {
+			git_oid_fromraw(&(*oids)[(*count)++],
+					(const unsigned char *)row[0]);
+		}
+	}
+
+	mysql_free_result(res);
+	error = GIT_OK;
+
+ done:
+	git_buf_free(&sql);
+	return error;
+}
+
+/* with the connection entered */
+static int backfill(size_t * added, mysql_odb_backend * backend, size_t limit)
+{
+	git_odb_backend *_backend = &backend->parent;
+	const char *tables[2] = { GIT2_ODB_TABLE_NAME,
+		GIT2_PACK_INDEX_TABLE_NAME
+	};
+	git_oid *oids;
+	size_t t, i, count;
+	int error = GIT_OK;
+
+	if (!backend->commit_graph) {
+		giterr_set_str(GITERR_ODB, "The commit graph is not enabled");
+		return GIT_ERROR;
+	}
+
+	if ((oids = malloc(GRAPH_BATCH * sizeof(git_oid))) == NULL) {
+		return GIT_ERROR;
+	}
+
+	for (t = 0; t < (backend->packed ? 2 : 1) && error == GIT_OK; t++) {
+		git_oid cursor;
+
+		memset(&cursor, 0, sizeof(cursor));
+
+		do {
+			if ((error = collect_missing(&oids, &count, backend->db,
+						     tables[t], &cursor)) < 0) {
+				break;
+			}
+
+			for (i = 0; i < count && error == GIT_OK; i++) {
+				void *data;
+				size_t len;
+				git_otype type;
+
+				if (limit > 0 && *added >= limit) {
+					break;
+				}
+
+				error = _backend->read(&data, &len, &type,
+						       _backend, &oids[i]);
+				if (error == GIT_OK) {
+					error = mysql_commit_graph__add(backend,
+									&oids
+									[i],
+									data,
+									len);
+					free(data);
+					(*added)++;
+				}
+			}
+
+			if (count > 0) {
+				git_oid_cpy(&cursor, &oids[count - 1]);
+			}
+		} while (error == GIT_OK && count == GRAPH_BATCH &&
+			 (limit == 0 || *added < limit));
+	}
+
+	free(oids);
+
+	if (error == GIT_OK) {
+		error = mysql_commit_graph__fix_generations(backend, NULL, 0);
+	}
+
+	return error;
+}
+
+int
+mysql_commit_graph_backfill(size_t * added, git_odb_backend * _backend,
+			    size_t limit)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	int error;
+
+	assert(added && backend);
+
+	*added = 0;
+
+	if ((error = mysql_odb__enter(backend)) == GIT_OK) {
+		error = backfill(added, backend, limit);
+		mysql_odb__leave(backend);
+	}
+
+	return error;
+}
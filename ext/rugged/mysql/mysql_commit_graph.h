@@ -0,0 +1,57 @@
+#ifndef MYSQL_COMMIT_GRAPH_H
+#define MYSQL_COMMIT_GRAPH_H
+
+#include <stdint.h>
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+/*
+ * Auxiliary commit-graph table.
+ *
+ * `git2_commit_graph` keeps one narrow row per commit: its parents, its
+ * generation number, its commit time and its root tree. History queries
+ * read it in batches instead of loading and inflating commit objects, and
+ * stop early using generation numbers. Rows are added as commits are
+ * written, or by mysql_commit_graph_backfill() for existing data.
+ */
+
+typedef struct {
+	git_oid oid;
+	uint32_t generation;	/* 0 while an ancestor is unknown */
+	int64_t commit_time;
+	git_oid tree;
+	size_t parent_count;
+	const git_oid *parents;
+} mysql_commit_graph_entry;
+
+typedef int (*mysql_commit_graph_cb) (const mysql_commit_graph_entry *
+				      entry, void *payload);
+
+/*
+ * Add rows for up to `limit` commits (0 for all) that are missing from the
+ * graph, then compute their generation numbers.
+ */
+int mysql_commit_graph_backfill(size_t * added, git_odb_backend * backend,
+				size_t limit);
+
+/*
+ * Visit the ancestry of `tips` in generation order, newest first, or in
+ * commit time order once a commit without a generation is met: one that
+ * is not in the graph is read from its object. Commits below
+ * `min_generation` are neither visited nor expanded. Stops after
+ * `limit` commits (0 for no limit) or when `cb` returns non-zero.
+ */
+int mysql_commit_graph_walk(git_odb_backend * backend, const git_oid * tips,
+			    size_t tip_count, uint32_t min_generation,
+			    size_t limit, mysql_commit_graph_cb cb,
+			    void *payload);
+
+int mysql_commit_graph_ahead_behind(size_t * ahead, size_t * behind,
+				    git_odb_backend * backend,
+				    const git_oid * local,
+				    const git_oid * upstream);
+
+int mysql_commit_graph_merge_base(git_oid * out, git_odb_backend * backend,
+				  const git_oid * one, const git_oid * two);
+
+#endif
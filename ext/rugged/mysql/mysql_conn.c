@@ -0,0 +1,372 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <git2.h>
+#include <mysql.h>
+
+#include "mysql_conn.h"
+
+struct mysql_conn {
+	mysql_conn_params params;
+	int shared;
+	unsigned int refcount;	/* under conns_lock */
+	pthread_mutex_t lock;	/* recursive, held around backend calls */
+	MYSQL *db;		/* NULL until first use */
+	unsigned int generation;	/* fork_generation of db */
+	unsigned int epoch;
+	struct mysql_conn *next;
+};
+
+typedef struct checked_table {
+	struct checked_table *next;
+	char key[1];
+} checked_table;
+
+static volatile unsigned int fork_generation = 0;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static mysql_conn *conns = NULL;
+static unsigned int last_epoch = 0;
+/* connections up to this epoch were made before the last fork */
+static unsigned int fork_epoch = 0;
+static pthread_mutex_t conns_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static checked_table *checked_tables = NULL;
+static pthread_mutex_t checked_tables_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void conn_init_lock(pthread_mutex_t * lock)
+{
+	pthread_mutexattr_t attr;
+
+	// a refdb reads tags through an ODB backend on the same handle
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void conn_atfork_child(void)
+{
+	mysql_conn *conn;
+
+	fork_generation++;
+	fork_epoch = last_epoch;
+
+	// only the forking thread lives on, locks held by the others are
+	// never released
+	pthread_mutex_init(&conns_lock, NULL);
+	pthread_mutex_init(&checked_tables_lock, NULL);
+	for (conn = conns; conn != NULL; conn = conn->next) {
+		conn_init_lock(&conn->lock);
+	}
+}
+
+static void conn_register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, conn_atfork_child);
+}
+
+static int dup_param(char **out, const char *value)
+{
+	*out = NULL;
+
+	if (value != NULL && (*out = strdup(value)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int
+mysql_conn_params_init(mysql_conn_params * params, const char *host,
+		       unsigned int port, const char *unix_socket,
+		       const char *db, const char *user, const char *passwd,
+		       unsigned long client_flag)
+{
+	memset(params, 0, sizeof(*params));
+
+	params->port = port;
+	params->client_flag = client_flag;
+
+	if (dup_param(&params->host, host) < 0 ||
+	    dup_param(&params->unix_socket, unix_socket) < 0 ||
+	    dup_param(&params->db, db) < 0 ||
+	    dup_param(&params->user, user) < 0 ||
+	    dup_param(&params->passwd, passwd) < 0) {
+		mysql_conn_params_free(params);
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+void mysql_conn_params_free(mysql_conn_params * params)
+{
+	free(params->host);
+	free(params->unix_socket);
+	free(params->db);
+	free(params->user);
+	free(params->passwd);
+	memset(params, 0, sizeof(*params));
+}
+
+int mysql_conn_open(MYSQL ** out, const mysql_conn_params * params)
+{
+	MYSQL *db;
+	my_bool reconnect = 1;
+
+	*out = NULL;
+
+	// before the first connection, so no fork goes unnoticed
+	pthread_once(&atfork_once, conn_register_atfork);
+
+	if ((db = mysql_init(NULL)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	// allow libmysql to reconnect gracefully
+	if (mysql_options(db, MYSQL_OPT_RECONNECT, &reconnect) != 0 ||
+	    mysql_real_connect(db, params->host, params->user,
+			       params->passwd, params->db, params->port,
+			       params->unix_socket,
+			       params->client_flag) != db) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		mysql_close(db);
+		return GIT_ERROR;
+	}
+
+	*out = db;
+	return GIT_OK;
+}
+
+unsigned int mysql_conn_generation(void)
+{
+	return fork_generation;
+}
+
+void mysql_conn_stmt_close(MYSQL_STMT * stmt, unsigned int epoch)
+{
+	// its handle was left open in this child, see conn_close()
+	if (stmt == NULL || (epoch != 0 && epoch <= fork_epoch)) {
+		return;
+	}
+
+	mysql_stmt_close(stmt);
+}
+
+static int same_param(const char *a, const char *b)
+{
+	return a == b || (a != NULL && b != NULL && strcmp(a, b) == 0);
+}
+
+static int same_params(const mysql_conn_params * a,
+		       const mysql_conn_params * b)
+{
+	return a->port == b->port && a->client_flag == b->client_flag &&
+	    same_param(a->host, b->host) &&
+	    same_param(a->unix_socket, b->unix_socket) &&
+	    same_param(a->db, b->db) && same_param(a->user, b->user) &&
+	    same_param(a->passwd, b->passwd);
+}
+
+int
+mysql_conn_get(mysql_conn ** out, const mysql_conn_params * params,
+	       int shared)
+{
+	mysql_conn *conn;
+
+	*out = NULL;
+
+	pthread_once(&atfork_once, conn_register_atfork);
+	pthread_mutex_lock(&conns_lock);
+
+	for (conn = conns; shared && conn != NULL; conn = conn->next) {
+		if (conn->shared && same_params(&conn->params, params)) {
+			conn->refcount++;
+			pthread_mutex_unlock(&conns_lock);
+			*out = conn;
+			return GIT_OK;
+		}
+	}
+
+	if ((conn = calloc(1, sizeof(mysql_conn))) == NULL ||
+	    mysql_conn_params_init(&conn->params, params->host, params->port,
+				   params->unix_socket, params->db,
+				   params->user, params->passwd,
+				   params->client_flag) < 0) {
+		pthread_mutex_unlock(&conns_lock);
+		free(conn);
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	conn->shared = shared;
+	conn->refcount = 1;
+	conn_init_lock(&conn->lock);
+
+	conn->next = conns;
+	conns = conn;
+
+	pthread_mutex_unlock(&conns_lock);
+
+	*out = conn;
+	return GIT_OK;
+}
+
+static void conn_close(mysql_conn * conn)
+{
+	if (conn->db == NULL) {
+		return;
+	}
+
+	// a handle from before a fork is leaked with its statements:
+	// closing it would send the parent's session a COM_QUIT
+	if (conn->generation == fork_generation) {
+		mysql_close(conn->db);
+	}
+	conn->db = NULL;
+}
+
+void mysql_conn_put(mysql_conn * conn)
+{
+	mysql_conn **p;
+
+	if (conn == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&conns_lock);
+
+	if (--conn->refcount > 0) {
+		pthread_mutex_unlock(&conns_lock);
+		return;
+	}
+
+	for (p = &conns; *p != NULL; p = &(*p)->next) {
+		if (*p == conn) {
+			*p = conn->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&conns_lock);
+
+	conn_close(conn);
+	pthread_mutex_destroy(&conn->lock);
+	mysql_conn_params_free(&conn->params);
+	free(conn);
+}
+
+int mysql_conn_enter(MYSQL ** db, unsigned int *epoch, mysql_conn * conn)
+{
+	unsigned int generation = fork_generation;
+
+	pthread_mutex_lock(&conn->lock);
+
+	// the statements of every backend on it go stale with it
+	if (conn->db != NULL && conn->generation != generation) {
+		conn_close(conn);
+	}
+
+	if (conn->db == NULL) {
+		if (mysql_conn_open(&conn->db, &conn->params) < 0) {
+			pthread_mutex_unlock(&conn->lock);
+			return GIT_ERROR;
+		}
+
+		conn->generation = generation;
+
+		pthread_mutex_lock(&conns_lock);
+		conn->epoch = ++last_epoch;
+		pthread_mutex_unlock(&conns_lock);
+	}
+
+	*db = conn->db;
+	*epoch = conn->epoch;
+	return GIT_OK;
+}
+
+void mysql_conn_lock(unsigned int *epoch, mysql_conn * conn)
+{
+	pthread_mutex_lock(&conn->lock);
+
+	if (conn->db != NULL && conn->generation != fork_generation) {
+		conn_close(conn);
+	}
+
+	*epoch = conn->db != NULL ? conn->epoch : 0;
+}
+
+void mysql_conn_leave(mysql_conn * conn)
+{
+	pthread_mutex_unlock(&conn->lock);
+}
+
+static int table_key(git_buf * key, const mysql_conn_params * params,
+		     const char *table)
+{
+	git_buf_printf(key, "%s:%u:%s/%s/%s",
+		       params->host ? params->host : "",
+		       params->port,
+		       params->unix_socket ? params->unix_socket : "",
+		       params->db ? params->db : "", table);
+
+	return git_buf_oom(key) ? GIT_ERROR : GIT_OK;
+}
+
+static int table_checked(const char *key)
+{
+	checked_table *entry;
+	int found = 0;
+
+	pthread_mutex_lock(&checked_tables_lock);
+	for (entry = checked_tables; entry != NULL && !found;
+	     entry = entry->next) {
+		found = strcmp(entry->key, key) == 0;
+	}
+	pthread_mutex_unlock(&checked_tables_lock);
+
+	return found;
+}
+
+int
+mysql_conn_init_table(MYSQL * db, const mysql_conn_params * params,
+		      const char *table, int (*init) (MYSQL * db))
+{
+	git_buf key = GIT_BUF_INIT;
+	checked_table *entry;
+	int error;
+
+	if (table_key(&key, params, table) < 0) {
+		git_buf_free(&key);
+		return init(db);
+	}
+
+	if (table_checked(key.ptr)) {
+		git_buf_free(&key);
+		return GIT_OK;
+	}
+
+	// two backends may both run the check, it is idempotent
+	if ((error = init(db)) == GIT_OK &&
+	    (entry = malloc(sizeof(checked_table) + key.size)) != NULL) {
+		memcpy(entry->key, key.ptr, key.size + 1);
+
+		pthread_mutex_lock(&checked_tables_lock);
+		entry->next = checked_tables;
+		checked_tables = entry;
+		pthread_mutex_unlock(&checked_tables_lock);
+	}
+
+	git_buf_free(&key);
+	return error;
+}
+
+void mysql_buf_put_oid(git_buf * sql, const git_oid * oid)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+
+	git_oid_tostr(hex, sizeof(hex), oid);
+	git_buf_printf(sql, "x'%s'", hex);
+}
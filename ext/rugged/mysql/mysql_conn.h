@@ -0,0 +1,88 @@
+#ifndef MYSQL_CONN_H
+#define MYSQL_CONN_H
+
+#include <git2.h>
+#include <buffer.h>
+#include <mysql.h>
+
+/*
+ * Connection parameters, kept so that worker threads can open their own
+ * connections: a MYSQL handle must not be shared between threads.
+ */
+
+typedef struct {
+	char *host;
+	unsigned int port;
+	char *unix_socket;
+	char *db;
+	char *user;
+	char *passwd;
+	unsigned long client_flag;
+} mysql_conn_params;
+
+int mysql_conn_params_init(mysql_conn_params * params, const char *host,
+			   unsigned int port, const char *unix_socket,
+			   const char *db, const char *user,
+			   const char *passwd, unsigned long client_flag);
+void mysql_conn_params_free(mysql_conn_params * params);
+
+/* connect with reconnects enabled; *out is NULL on failure */
+int mysql_conn_open(MYSQL ** out, const mysql_conn_params * params);
+
+/*
+ * A child of fork() shares its parent's sockets, so handles opened before
+ * the fork must neither be used nor closed the usual way there: whatever
+ * they send ends up in the parent's session. Backends note the generation
+ * when they connect and open new connections when it changes.
+ */
+unsigned int mysql_conn_generation(void);
+
+/*
+ * Close a statement prepared on the connection of `epoch`. Connections
+ * inherited through a fork are left open in the child, and so are their
+ * statements, since closing either would talk to the parent's session.
+ */
+void mysql_conn_stmt_close(MYSQL_STMT * stmt, unsigned int epoch);
+
+/*
+ * A connection handle that connects on first use. Handles asked for as
+ * shared are handed to every backend of the process that uses the same
+ * server, database, user and flags, so one process holds one connection
+ * instead of one per backend. Backends take the handle's lock around each
+ * callback: statements of several backends can live on one connection, but
+ * only one thread may talk over it at a time.
+ */
+typedef struct mysql_conn mysql_conn;
+
+int mysql_conn_get(mysql_conn ** out, const mysql_conn_params * params,
+		   int shared);
+void mysql_conn_put(mysql_conn * conn);
+
+/*
+ * Lock `conn` and connect it if it is not connected yet, or was connected
+ * before a fork. `*epoch` changes with every new connection, so a backend
+ * can tell that the statements it prepared belong to an older one. Nothing
+ * stays locked on error.
+ */
+int mysql_conn_enter(MYSQL ** db, unsigned int *epoch, mysql_conn * conn);
+void mysql_conn_leave(mysql_conn * conn);
+
+/*
+ * Lock `conn` without connecting it, to close statements. `*epoch` is 0
+ * when it is not connected; a connection inherited through a fork is
+ * closed first, without a word to the server.
+ */
+void mysql_conn_lock(unsigned int *epoch, mysql_conn * conn);
+
+/*
+ * Run `init`, which checks for `table` and creates it, unless it succeeded
+ * for the same table and database in this process already. Opening a
+ * backend then costs no query once the schema is known to be there.
+ */
+int mysql_conn_init_table(MYSQL * db, const mysql_conn_params * params,
+			  const char *table, int (*init) (MYSQL * db));
+
+/* append `oid` as a binary SQL literal, for batched IN (...) lists */
+void mysql_buf_put_oid(git_buf * sql, const git_oid * oid);
+
+#endif
@@ -0,0 +1,785 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "mysql_disk_cache.h"
+
+#define DISK_CACHE_MAGIC 0x43444d52	/* "RMDC" */
+#define DISK_CACHE_VERSION 2
+#define DISK_CACHE_HEADER_SIZE 4096
+#define DISK_CACHE_SHARDS 16
+#define DISK_CACHE_MAX_PROBE 16
+#define DISK_CACHE_AVG_OBJECT 2048
+#define DISK_CACHE_MIN_SIZE (1 << 20)
+#define DISK_CACHE_MAX_REOPEN 8
+
+#define ALIGN8(n) (((n) + 7) & ~((uint64_t) 7))
+
+typedef struct {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t shards;
+	uint32_t slots;		/* index slots per shard */
+	uint64_t data_size;	/* ring bytes per shard */
+	uint64_t shard_size;	/* total bytes per shard */
+	uint64_t swept;		/* token of the last gc sweep, 0: none */
+} disk_cache_header;
+
+typedef struct {
+	uint64_t head;		/* next log position, never wraps */
+	union {
+		pthread_mutex_t lock;	/* shared-memory caches only */
+		uint64_t reserved[7];
+	} u;
+} disk_cache_shard;
+
+typedef struct {
+	unsigned char oid[GIT_OID_RAWSZ];
+	uint32_t len;
+	uint64_t pos;		/* log position + 1, 0 while unused */
+} disk_cache_slot;
+
+typedef struct {
+	unsigned char oid[GIT_OID_RAWSZ];
+	uint32_t len;
+	uint32_t type;
+	uint32_t crc;		/* of the fields above and the data */
+} disk_cache_record;
+
+struct mysql_disk_cache {
+	char *path;
+	int shared;		/* a shm segment with its locks inside */
+	int fd;
+	unsigned char *map;
+	size_t map_size;
+	disk_cache_header *header;
+	// fcntl() locks are per process, these order threads of this one;
+	// the process holds a shard's read lock while any thread reads it
+	pthread_rwlock_t locks[DISK_CACHE_SHARDS];
+	pthread_mutex_t reader_locks[DISK_CACHE_SHARDS];
+	unsigned int readers[DISK_CACHE_SHARDS];
+	int refcount;
+	struct mysql_disk_cache *next;
+};
+
+// one instance per path and process, see the note on locks above
+static mysql_disk_cache *open_caches = NULL;
+static pthread_mutex_t open_caches_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+/*
+ * The child of a fork has one thread left, but the locks of this process
+ * may have been copied while other threads held them.
+ */
+static void disk_cache__atfork_child(void)
+{
+	mysql_disk_cache *cache;
+	int i;
+
+	pthread_mutex_init(&open_caches_lock, NULL);
+
+	// fcntl() locks are not inherited either
+	for (cache = open_caches; cache != NULL; cache = cache->next) {
+		for (i = 0; i < DISK_CACHE_SHARDS; i++) {
+			pthread_rwlock_init(&cache->locks[i], NULL);
+			pthread_mutex_init(&cache->reader_locks[i], NULL);
+			cache->readers[i] = 0;
+		}
+	}
+}
+
+static void disk_cache__register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, disk_cache__atfork_child);
+}
+
+static uint32_t disk_cache__shard(const git_oid * oid)
+{
+	return oid->id[0] % DISK_CACHE_SHARDS;
+}
+
+static uint32_t disk_cache__bucket(const disk_cache_header * h,
+				   const git_oid * oid)
+{
+	uint32_t hash;
+
+	memcpy(&hash, &oid->id[1], sizeof(hash));
+	return hash % h->slots;
+}
+
+static unsigned char *disk_cache__shard_base(mysql_disk_cache * cache,
+					     uint32_t shard)
+{
+	return cache->map + DISK_CACHE_HEADER_SIZE +
+	    (size_t) shard *cache->header->shard_size;
+}
+
+static disk_cache_slot *disk_cache__slots(mysql_disk_cache * cache,
+					  uint32_t shard)
+{
+	return (disk_cache_slot *) (disk_cache__shard_base(cache, shard) +
+				    sizeof(disk_cache_shard));
+}
+
+static unsigned char *disk_cache__data(mysql_disk_cache * cache,
+				       uint32_t shard)
+{
+	return (unsigned char *)(disk_cache__slots(cache, shard) +
+				 cache->header->slots);
+}
+
+static int disk_cache__lock_shared(mysql_disk_cache * cache, uint32_t shard)
+{
+	disk_cache_shard *sh =
+	    (disk_cache_shard *) disk_cache__shard_base(cache, shard);
+	int error = pthread_mutex_lock(&sh->u.lock);
+
+	// its holder died halfway through an update, start the shard over
+	if (error == EOWNERDEAD) {
+		memset(disk_cache__slots(cache, shard), 0,
+		       cache->header->slots * sizeof(disk_cache_slot));
+		error = pthread_mutex_consistent(&sh->u.lock);
+	}
+
+	return error == 0 ? GIT_OK : GIT_ERROR;
+}
+
+static int disk_cache__file_lock(mysql_disk_cache * cache, uint32_t shard,
+				 short type)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = type;
+	fl.l_whence = SEEK_SET;
+	fl.l_start = disk_cache__shard_base(cache, shard) - cache->map;
+	fl.l_len = sizeof(disk_cache_shard);
+
+	while (fcntl(cache->fd, type == F_UNLCK ? F_SETLK : F_SETLKW, &fl) !=
+	       0) {
+		if (errno != EINTR)
+			return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int disk_cache__lock(mysql_disk_cache * cache, uint32_t shard,
+			    int exclusive)
+{
+	int error = GIT_OK;
+
+	if (cache->shared)
+		return disk_cache__lock_shared(cache, shard);
+
+	if (exclusive) {
+		pthread_rwlock_wrlock(&cache->locks[shard]);
+		if (disk_cache__file_lock(cache, shard, F_WRLCK) < 0)
+			error = GIT_ERROR;
+	} else {
+		pthread_rwlock_rdlock(&cache->locks[shard]);
+
+		// the first reader takes the file lock for the others, the
+		// last one gives it back
+		pthread_mutex_lock(&cache->reader_locks[shard]);
+		if (cache->readers[shard] == 0 &&
+		    disk_cache__file_lock(cache, shard, F_RDLCK) < 0)
+			error = GIT_ERROR;
+		else
+			cache->readers[shard]++;
+		pthread_mutex_unlock(&cache->reader_locks[shard]);
+	}
+
+	if (error < 0)
+		pthread_rwlock_unlock(&cache->locks[shard]);
+
+	return error;
+}
+
+static void disk_cache__unlock(mysql_disk_cache * cache, uint32_t shard,
+			       int exclusive)
+{
+	if (cache->shared) {
+		disk_cache_shard *sh =
+		    (disk_cache_shard *) disk_cache__shard_base(cache, shard);
+
+		pthread_mutex_unlock(&sh->u.lock);
+		return;
+	}
+
+	if (exclusive) {
+		disk_cache__file_lock(cache, shard, F_UNLCK);
+	} else {
+		pthread_mutex_lock(&cache->reader_locks[shard]);
+		if (--cache->readers[shard] == 0)
+			disk_cache__file_lock(cache, shard, F_UNLCK);
+		pthread_mutex_unlock(&cache->reader_locks[shard]);
+	}
+
+	pthread_rwlock_unlock(&cache->locks[shard]);
+}
+
+static uint32_t disk_cache__crc(const disk_cache_record * rec)
+{
+	uLong crc;
+
+	crc = crc32(0L, (const Bytef *)rec, offsetof(disk_cache_record, crc));
+	crc = crc32(crc, (const Bytef *)(rec + 1), rec->len);
+
+	return (uint32_t) crc;
+}
+
+/*
+ * A record at log position `pos` is intact as long as the ring has not
+ * advanced a full lap past it.
+ */
+static int disk_cache__live(const disk_cache_header * h,
+			    const disk_cache_shard * shard, uint64_t pos)
+{
+	return pos + h->data_size >= shard->head;
+}
+
+/*
+ * Find the record for `oid` in a locked shard. Slots are only emptied all
+ * at once, so probing can stop at the first unused one.
+ */
+static disk_cache_record *disk_cache__find(mysql_disk_cache * cache,
+					   uint32_t shard, const git_oid * oid)
+{
+	disk_cache_header *h = cache->header;
+	disk_cache_shard *sh =
+	    (disk_cache_shard *) disk_cache__shard_base(cache, shard);
+	disk_cache_slot *slots = disk_cache__slots(cache, shard);
+	unsigned char *data = disk_cache__data(cache, shard);
+	uint32_t bucket = disk_cache__bucket(h, oid);
+	uint32_t i;
+
+	for (i = 0; i < DISK_CACHE_MAX_PROBE; i++) {
+		disk_cache_slot *slot = &slots[(bucket + i) % h->slots];
+		disk_cache_record *rec;
+		uint64_t pos;
+
+		if (slot->pos == 0)
+			break;
+
+		if (memcmp(slot->oid, oid->id, GIT_OID_RAWSZ) != 0)
+			continue;
+
+		// an overwritten entry may have been cached again further on
+		pos = slot->pos - 1;
+		if (!disk_cache__live(h, sh, pos))
+			continue;
+
+		// a writer that died halfway leaves a torn record behind
+		rec = (disk_cache_record *) (data + pos % h->data_size);
+		if (memcmp(rec->oid, oid->id, GIT_OID_RAWSZ) != 0 ||
+		    rec->len != slot->len || rec->crc != disk_cache__crc(rec))
+			continue;
+
+		return rec;
+	}
+
+	return NULL;
+}
+
+int
+mysql_disk_cache_read(void **data_p, size_t * len_p, git_otype * type_p,
+		      mysql_disk_cache * cache, git_odb_backend * backend,
+		      const git_oid * oid)
+{
+	uint32_t shard = disk_cache__shard(oid);
+	disk_cache_record *rec;
+	int error = GIT_ENOTFOUND;
+
+	if (disk_cache__lock(cache, shard, 0) < 0)
+		return GIT_ENOTFOUND;
+
+	if ((rec = disk_cache__find(cache, shard, oid)) != NULL) {
+		void *data = git_odb_backend_malloc(backend, rec->len);
+
+		if (data != NULL) {
+			memcpy(data, rec + 1, rec->len);
+			*data_p = data;
+			*len_p = rec->len;
+			*type_p = (git_otype) rec->type;
+			error = GIT_OK;
+		} else {
+			error = GIT_ERROR;
+		}
+	}
+
+	disk_cache__unlock(cache, shard, 0);
+	return error;
+}
+
+int
+mysql_disk_cache_read_header(size_t * len_p, git_otype * type_p,
+			     mysql_disk_cache * cache, const git_oid * oid)
+{
+	uint32_t shard = disk_cache__shard(oid);
+	disk_cache_record *rec;
+	int error = GIT_ENOTFOUND;
+
+	if (disk_cache__lock(cache, shard, 0) < 0)
+		return GIT_ENOTFOUND;
+
+	if ((rec = disk_cache__find(cache, shard, oid)) != NULL) {
+		*len_p = rec->len;
+		*type_p = (git_otype) rec->type;
+		error = GIT_OK;
+	}
+
+	disk_cache__unlock(cache, shard, 0);
+	return error;
+}
+
+int
+mysql_disk_cache_write(mysql_disk_cache * cache, const git_oid * oid,
+		       const void *data, size_t len, git_otype type)
+{
+	disk_cache_header *h = cache->header;
+	uint32_t shard = disk_cache__shard(oid);
+	uint64_t reclen = ALIGN8(sizeof(disk_cache_record) + len);
+	disk_cache_shard *sh;
+	disk_cache_slot *slots, *victim;
+	disk_cache_record *rec;
+	uint64_t head, phys;
+	uint32_t bucket, i;
+
+	// large blobs would flush the whole shard for a single entry
+	if (reclen > h->data_size / 8)
+		return GIT_OK;
+
+	if (disk_cache__lock(cache, shard, 1) < 0)
+		return GIT_ERROR;
+
+	if (disk_cache__find(cache, shard, oid) != NULL) {
+		disk_cache__unlock(cache, shard, 1);
+		return GIT_OK;
+	}
+
+	sh = (disk_cache_shard *) disk_cache__shard_base(cache, shard);
+	slots = disk_cache__slots(cache, shard);
+
+	// records never straddle the end of the ring
+	head = sh->head;
+	phys = head % h->data_size;
+	if (phys + reclen > h->data_size) {
+		head += h->data_size - phys;
+		phys = 0;
+	}
+
+	rec = (disk_cache_record *) (disk_cache__data(cache, shard) + phys);
+	memcpy(rec->oid, oid->id, GIT_OID_RAWSZ);
+	rec->len = (uint32_t) len;
+	rec->type = (uint32_t) type;
+	memcpy(rec + 1, data, len);
+	rec->crc = disk_cache__crc(rec);
+
+	sh->head = head + reclen;
+
+	// take the first unused or overwritten slot, else evict the oldest
+	bucket = disk_cache__bucket(h, oid);
+	victim = &slots[bucket];
+	for (i = 0; i < DISK_CACHE_MAX_PROBE; i++) {
+		disk_cache_slot *slot = &slots[(bucket + i) % h->slots];
+
+		if (slot->pos == 0 || !disk_cache__live(h, sh, slot->pos - 1)) {
+			victim = slot;
+			break;
+		}
+		if (slot->pos < victim->pos)
+			victim = slot;
+	}
+
+	memcpy(victim->oid, oid->id, GIT_OID_RAWSZ);
+	victim->len = (uint32_t) len;
+	victim->pos = head + 1;
+
+	disk_cache__unlock(cache, shard, 1);
+	return GIT_OK;
+}
+
+int mysql_disk_cache_invalidate(mysql_disk_cache * cache, uint64_t token)
+{
+	uint32_t i;
+
+	if (cache->header->swept == token)
+		return GIT_OK;
+
+	for (i = 0; i < DISK_CACHE_SHARDS; i++) {
+		if (disk_cache__lock(cache, i, 1) < 0)
+			return GIT_ERROR;
+		memset(disk_cache__slots(cache, i), 0,
+		       cache->header->slots * sizeof(disk_cache_slot));
+		disk_cache__unlock(cache, i, 1);
+	}
+
+	// another process may empty it once more, which is harmless
+	cache->header->swept = token;
+	__sync_synchronize();
+
+	return GIT_OK;
+}
+
+static void disk_cache__geometry(disk_cache_header * h, size_t max_size)
+{
+	uint64_t shard_size =
+	    ((max_size - DISK_CACHE_HEADER_SIZE) / DISK_CACHE_SHARDS) &
+	    ~((uint64_t) 7);
+	uint64_t slots = shard_size / DISK_CACHE_AVG_OBJECT;
+
+	if (slots < 64)
+		slots = 64;
+
+	h->magic = DISK_CACHE_MAGIC;
+	h->version = DISK_CACHE_VERSION;
+	h->shards = DISK_CACHE_SHARDS;
+	h->slots = (uint32_t) slots;
+	h->shard_size = shard_size;
+	h->data_size = shard_size - sizeof(disk_cache_shard) -
+	    slots * sizeof(disk_cache_slot);
+}
+
+static int disk_cache__init_locks(mysql_disk_cache * cache)
+{
+	pthread_mutexattr_t attr;
+	uint32_t i;
+	int error = GIT_OK;
+
+	if (pthread_mutexattr_init(&attr) != 0)
+		return GIT_ERROR;
+
+	if (pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED) != 0 ||
+	    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST) != 0)
+		error = GIT_ERROR;
+
+	for (i = 0; i < DISK_CACHE_SHARDS && error == GIT_OK; i++) {
+		disk_cache_shard *sh =
+		    (disk_cache_shard *) disk_cache__shard_base(cache, i);
+
+		if (pthread_mutex_init(&sh->u.lock, &attr) != 0)
+			error = GIT_ERROR;
+	}
+
+	pthread_mutexattr_destroy(&attr);
+	return error;
+}
+
+static int disk_cache__open_fd(const mysql_disk_cache * cache, int flags)
+{
+	return cache->shared ?
+	    shm_open(cache->path, O_RDWR | O_CLOEXEC | flags, 0600) :
+	    open(cache->path, O_RDWR | O_CLOEXEC | flags, 0644);
+}
+
+/* whether `st` is still what the path names, it may have been replaced */
+static int disk_cache__current(const mysql_disk_cache * cache,
+			       const struct stat *st)
+{
+	struct stat now;
+	int fd, same;
+
+	if ((fd = disk_cache__open_fd(cache, 0)) < 0)
+		return 0;
+
+	same = fstat(fd, &now) == 0 && now.st_dev == st->st_dev &&
+	    now.st_ino == st->st_ino;
+	close(fd);
+
+	return same;
+}
+
+static int disk_cache__map_fd(mysql_disk_cache * cache, int fd, size_t total)
+{
+	cache->map = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED,
+			  fd, 0);
+	if (cache->map == MAP_FAILED) {
+		cache->map = NULL;
+		return GIT_ERROR;
+	}
+
+	cache->map_size = total;
+	cache->header = (disk_cache_header *) cache->map;
+	return GIT_OK;
+}
+
+/*
+ * Build the cache in a new file and put it in place of one that other
+ * processes still map with another layout; they keep the old one until
+ * they reopen. A segment cannot be renamed, so a new one takes the name
+ * over instead, and GIT_PASSTHROUGH means another process was first.
+ */
+static int disk_cache__replace(mysql_disk_cache * cache,
+			       const disk_cache_header * h, size_t total)
+{
+	static const char suffix[] = ".XXXXXX";
+	size_t path_len = strlen(cache->path);
+	char *tmp = NULL;
+	int fd, error = GIT_ERROR;
+
+	if (cache->shared) {
+		shm_unlink(cache->path);
+		fd = disk_cache__open_fd(cache, O_CREAT | O_EXCL);
+		if (fd < 0 && errno == EEXIST)
+			return GIT_PASSTHROUGH;
+	} else {
+		if ((tmp = malloc(path_len + sizeof(suffix))) == NULL)
+			return GIT_ERROR;
+		memcpy(tmp, cache->path, path_len);
+		memcpy(tmp + path_len, suffix, sizeof(suffix));
+
+		fd = mkstemp(tmp);
+		if (fd >= 0 && (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0 ||
+				fchmod(fd, 0644) != 0)) {
+			close(fd);
+			unlink(tmp);
+			fd = -1;
+		}
+	}
+
+	if (fd < 0) {
+		free(tmp);
+		return GIT_ERROR;
+	}
+
+	// openers of the new name wait for the header
+	if (flock(fd, LOCK_EX) != 0 || ftruncate(fd, total) != 0 ||
+	    disk_cache__map_fd(cache, fd, total) < 0 ||
+	    (cache->shared && disk_cache__init_locks(cache) < 0))
+		goto done;
+
+	memcpy(cache->header, h, sizeof(*h));
+
+	if (tmp != NULL && rename(tmp, cache->path) != 0)
+		goto done;
+
+	close(cache->fd);
+	cache->fd = fd;
+	fd = -1;
+	error = GIT_OK;
+
+ done:
+	if (fd >= 0) {
+		if (tmp != NULL)
+			unlink(tmp);
+		close(fd);
+	}
+	free(tmp);
+	return error;
+}
+
+/*
+ * Every process holds a shared flock() on the file for as long as it has
+ * it mapped, so only one that gets it exclusively may size it. A file of
+ * another layout that others still map is replaced, never truncated under
+ * them. GIT_PASSTHROUGH when the file was replaced since it was opened.
+ */
+static int disk_cache__try_map(mysql_disk_cache * cache, size_t max_size)
+{
+	disk_cache_header h;
+	struct stat st;
+	size_t total;
+	int alone = 1;
+	int error = GIT_ERROR;
+
+	if (flock(cache->fd, LOCK_EX | LOCK_NB) != 0) {
+		// in use, or being set up: wait for its header
+		if (errno != EWOULDBLOCK || flock(cache->fd, LOCK_SH) != 0)
+			return GIT_ERROR;
+		alone = 0;
+	}
+
+	if (fstat(cache->fd, &st) != 0)
+		goto done;
+
+	if (!disk_cache__current(cache, &st)) {
+		error = GIT_PASSTHROUGH;
+		goto done;
+	}
+
+	memset(&h, 0, sizeof(h));
+	if (st.st_size >= DISK_CACHE_HEADER_SIZE &&
+	    pread(cache->fd, &h, sizeof(h), 0) == sizeof(h) &&
+	    h.magic == DISK_CACHE_MAGIC && h.version == DISK_CACHE_VERSION &&
+	    h.shards == DISK_CACHE_SHARDS &&
+	    (uint64_t) st.st_size ==
+	    DISK_CACHE_HEADER_SIZE + h.shards * h.shard_size) {
+		// another process created it, keep its geometry
+		total = st.st_size;
+		error = disk_cache__map_fd(cache, cache->fd, total);
+		goto done;
+	}
+
+	disk_cache__geometry(&h, max_size);
+	total = DISK_CACHE_HEADER_SIZE + h.shards * h.shard_size;
+
+	if (!alone) {
+		error = disk_cache__replace(cache, &h, total);
+		goto done;
+	}
+
+	if (ftruncate(cache->fd, 0) != 0 ||
+	    ftruncate(cache->fd, total) != 0 ||
+	    disk_cache__map_fd(cache, cache->fd, total) < 0 ||
+	    (cache->shared && disk_cache__init_locks(cache) < 0))
+		goto done;
+
+	// the header goes in last, it marks the segment as ready
+	memcpy(cache->header, &h, sizeof(h));
+	error = GIT_OK;
+
+ done:
+	// the shared lock is kept until close()
+	flock(cache->fd, error == GIT_OK ? LOCK_SH : LOCK_UN);
+	return error;
+}
+
+static int disk_cache__map(mysql_disk_cache * cache, size_t max_size)
+{
+	int attempts, error = GIT_ERROR;
+
+	for (attempts = 0; attempts < DISK_CACHE_MAX_REOPEN; attempts++) {
+		error = disk_cache__try_map(cache, max_size);
+		if (error != GIT_PASSTHROUGH)
+			return error;
+
+		close(cache->fd);
+		if ((cache->fd = disk_cache__open_fd(cache, O_CREAT)) < 0)
+			return GIT_ERROR;
+	}
+
+	return GIT_ERROR;
+}
+
+static void disk_cache__free(mysql_disk_cache * cache)
+{
+	int i;
+
+	if (cache->map != NULL)
+		munmap(cache->map, cache->map_size);
+	if (cache->fd >= 0)
+		close(cache->fd);
+	for (i = 0; i < DISK_CACHE_SHARDS; i++) {
+		pthread_rwlock_destroy(&cache->locks[i]);
+		pthread_mutex_destroy(&cache->reader_locks[i]);
+	}
+
+	free(cache->path);
+	free(cache);
+}
+
+static int
+disk_cache__open(mysql_disk_cache ** out, const char *path, size_t max_size,
+		 int shared)
+{
+	mysql_disk_cache *cache;
+	int i;
+
+	if (max_size < DISK_CACHE_MIN_SIZE) {
+		giterr_set_str(GITERR_ODB, "MySql disk cache is too small");
+		return GIT_ERROR;
+	}
+
+	pthread_once(&atfork_once, disk_cache__register_atfork);
+	pthread_mutex_lock(&open_caches_lock);
+
+	for (cache = open_caches; cache != NULL; cache = cache->next) {
+		if (cache->shared == shared && strcmp(cache->path, path) == 0) {
+			cache->refcount++;
+			*out = cache;
+			pthread_mutex_unlock(&open_caches_lock);
+			return GIT_OK;
+		}
+	}
+
+	cache = calloc(1, sizeof(mysql_disk_cache));
+	if (cache == NULL) {
+		pthread_mutex_unlock(&open_caches_lock);
+		return GIT_ERROR;
+	}
+
+	for (i = 0; i < DISK_CACHE_SHARDS; i++) {
+		pthread_rwlock_init(&cache->locks[i], NULL);
+		pthread_mutex_init(&cache->reader_locks[i], NULL);
+	}
+
+	cache->path = strdup(path);
+	cache->shared = shared;
+	cache->fd = cache->path != NULL ?
+	    disk_cache__open_fd(cache, O_CREAT) : -1;
+	if (cache->path == NULL || cache->fd < 0 ||
+	    disk_cache__map(cache, max_size) < 0) {
+		giterr_set_str(GITERR_OS, shared ?
+			       "Failed to open MySql shared cache" :
+			       "Failed to open MySql disk cache");
+		disk_cache__free(cache);
+		pthread_mutex_unlock(&open_caches_lock);
+		return GIT_ERROR;
+	}
+
+	cache->refcount = 1;
+	cache->next = open_caches;
+	open_caches = cache;
+
+	pthread_mutex_unlock(&open_caches_lock);
+
+	*out = cache;
+	return GIT_OK;
+}
+
+int
+mysql_disk_cache_open(mysql_disk_cache ** out, const char *path,
+		      size_t max_size)
+{
+	return disk_cache__open(out, path, max_size, 0);
+}
+
+int
+mysql_disk_cache_open_shared(mysql_disk_cache ** out, const char *name,
+			     size_t max_size)
+{
+	if (name[0] != '/' || strchr(name + 1, '/') != NULL) {
+		giterr_set_str(GITERR_INVALID,
+			       "Invalid MySql shared cache name");
+		return GIT_ERROR;
+	}
+
+	return disk_cache__open(out, name, max_size, 1);
+}
+
+void mysql_disk_cache_close(mysql_disk_cache * cache)
+{
+	mysql_disk_cache **p;
+
+	if (cache == NULL)
+		return;
+
+	pthread_mutex_lock(&open_caches_lock);
+
+	if (--cache->refcount > 0) {
+		pthread_mutex_unlock(&open_caches_lock);
+		return;
+	}
+
+	for (p = &open_caches; *p != NULL; p = &(*p)->next) {
+		if (*p == cache) {
+			*p = cache->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&open_caches_lock);
+
+	disk_cache__free(cache);
+}
@@ -0,0 +1,52 @@
+#ifndef MYSQL_DISK_CACHE_H
+#define MYSQL_DISK_CACHE_H
+
+#include <stdint.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+/*
+ * Persistent, content-addressed object cache in a memory-mapped file.
+ *
+ * The file is split into shards. Each shard is an append-only ring of
+ * records plus an open-addressing index keyed by OID; when the ring wraps
+ * the oldest records are overwritten, which bounds the file size. Shards
+ * are guarded by fcntl() byte-range locks so several processes can share
+ * one file. Objects are immutable, so entries only go stale when gc
+ * deletes them; every entry is dropped when a cache sees a new sweep.
+ * A file with another layout is only resized while no other process has
+ * it open; otherwise a new one is put in its place.
+ *
+ * The same layout can live in a POSIX shared-memory segment instead, for
+ * the workers of a preforking server. Shards are then guarded by robust,
+ * process-shared mutexes in the segment, which need no system call when
+ * there is no contention; a shard whose holder died is emptied.
+ */
+
+typedef struct mysql_disk_cache mysql_disk_cache;
+
+int mysql_disk_cache_open(mysql_disk_cache ** out, const char *path,
+			  size_t max_size);
+/* `name` is a shm_open() name, "/something" */
+int mysql_disk_cache_open_shared(mysql_disk_cache ** out, const char *name,
+				 size_t max_size);
+void mysql_disk_cache_close(mysql_disk_cache * cache);
+
+/* GIT_OK on a hit, GIT_ENOTFOUND on a miss. */
+int mysql_disk_cache_read(void **data_p, size_t * len_p, git_otype * type_p,
+			  mysql_disk_cache * cache, git_odb_backend * backend,
+			  const git_oid * oid);
+int mysql_disk_cache_read_header(size_t * len_p, git_otype * type_p,
+				 mysql_disk_cache * cache, const git_oid * oid);
+
+int mysql_disk_cache_write(mysql_disk_cache * cache, const git_oid * oid,
+			   const void *data, size_t len, git_otype type);
+
+/*
+ * Empty the cache unless it was already emptied for the sweep `token`,
+ * which the cache keeps in its header for every process sharing it.
+ */
+int mysql_disk_cache_invalidate(mysql_disk_cache * cache, uint64_t token);
+
+#endif
@@ -0,0 +1,1119 @@
+#include <arpa/inet.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+#include <buffer.h>
+#include <hash.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_object_parse.h"
+#include "mysql_export.h"
+
+#define EXPORT_PACK_MODE 0444
+/* tags pointing at tags */
+#define EXPORT_MAX_PEEL 16
+
+typedef struct {
+	git_oid oid;
+	uint32_t crc;
+	uint64_t offset;
+} export_entry;
+
+typedef struct {
+	FILE *file;
+	git_buf path;
+	uint64_t offset;
+	export_entry *entries;
+	size_t count;
+	size_t alloc;
+	size_t sorted;		/* entries before this one are in OID order */
+} export_pack;
+
+typedef struct {
+	FILE *file;
+	git_hash_ctx ctx;
+	int error;
+} export_index;
+
+typedef struct {
+	git_odb_backend parent;
+	git_odb_backend *backend;
+	pthread_mutex_t lock;
+} export_proxy;
+
+typedef struct {
+	git_odb *odb;
+	git_packbuilder *pb;
+	mysql_header_index *seen;
+} export_walk;
+
+static int entry_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp(&((const export_entry *)a)->oid,
+			   &((const export_entry *)b)->oid);
+}
+
+static size_t entry_header(unsigned char *out, git_otype type, size_t size)
+{
+	size_t len = 0;
+	unsigned char c;
+
+	c = (unsigned char)((type << 4) | (size & 15));
+	size >>= 4;
+	while (size) {
+		out[len++] = c | 0x80;
+		c = size & 0x7f;
+		size >>= 7;
+	}
+	out[len++] = c;
+
+	return len;
+}
+
+/* the length of the zlib stream at the start of `in` */
+static int stream_length(size_t * out, const unsigned char *in, size_t len)
+{
+	unsigned char discard[16384];
+	z_stream zs;
+	int status;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK) {
+		giterr_set_str(GITERR_ZLIB, "Failed to init zlib stream");
+		return GIT_ERROR;
+	}
+
+	zs.next_in = (Bytef *) in;
+	zs.avail_in = (uInt) len;
+
+	do {
+		zs.next_out = discard;
+		zs.avail_out = sizeof(discard);
+		status = inflate(&zs, Z_NO_FLUSH);
+	} while (status == Z_OK);
+
+	*out = len - zs.avail_in;
+	inflateEnd(&zs);
+
+	if (status != Z_STREAM_END) {
+		giterr_set_str(GITERR_ZLIB, "Corrupted object in MySql ODB");
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+/*
+ * The zlib stream inside a COMPRESS() value, which is a pack entry's body
+ * as it is. COMPRESS() appends a '.' to streams ending with a space, and
+ * stores empty strings as nothing at all.
+ */
+static int
+stored_stream(const unsigned char **out, size_t * out_len,
+	      const unsigned char *data, size_t len, git_buf * scratch)
+{
+	if (len == 0) {
+		uLongf zlen = compressBound(0);
+
+		if (git_buf_grow(scratch, zlen) < 0) {
+			return GIT_ERROR;
+		}
+		if (compress2((Bytef *) scratch->ptr, &zlen, (const Bytef *)"",
+			      0, Z_DEFAULT_COMPRESSION) != Z_OK) {
+			giterr_set_str(GITERR_ZLIB, "Failed to deflate object");
+			return GIT_ERROR;
+		}
+
+		*out = (const unsigned char *)scratch->ptr;
+		*out_len = zlen;
+		return GIT_OK;
+	}
+
+	if (len <= 4) {
+		giterr_set_str(GITERR_ODB, "Corrupted object in MySql ODB");
+		return GIT_ERROR;
+	}
+
+	data += 4;
+	len -= 4;
+
+	// a stream may also end with " ." by itself, only inflating it
+	// tells the two apart
+	if (len >= 2 && data[len - 1] == '.' && data[len - 2] == ' ' &&
+	    stream_length(&len, data, len) < 0) {
+		return GIT_ERROR;
+	}
+
+	*out = data;
+	*out_len = len;
+	return GIT_OK;
+}
+
+static int pack_write(export_pack * pack, const void *data, size_t len)
+{
+	if (len > 0 && fwrite(data, len, 1, pack->file) != 1) {
+		giterr_set_str(GITERR_OS, "Failed to write exported pack");
+		return GIT_ERROR;
+	}
+
+	pack->offset += len;
+	return GIT_OK;
+}
+
+static int
+pack_add(export_pack * pack, const git_oid * oid, const void *header,
+	 size_t header_len, const void *body, size_t body_len)
+{
+	export_entry *entry;
+	uLong crc;
+
+	if (pack->count == pack->alloc) {
+		size_t alloc = pack->alloc ? pack->alloc * 2 : 4096;
+		export_entry *entries =
+		    realloc(pack->entries, alloc * sizeof(export_entry));
+
+		if (entries == NULL) {
+			giterr_set_oom();
+			return GIT_ERROR;
+		}
+		pack->entries = entries;
+		pack->alloc = alloc;
+	}
+
+	crc = crc32(0L, header, (uInt) header_len);
+	if (body_len > 0) {
+		crc = crc32(crc, body, (uInt) body_len);
+	}
+
+	entry = &pack->entries[pack->count];
+	git_oid_cpy(&entry->oid, oid);
+	entry->crc = (uint32_t) crc;
+	entry->offset = pack->offset;
+
+	if (pack_write(pack, header, header_len) < 0 ||
+	    pack_write(pack, body, body_len) < 0) {
+		return GIT_ERROR;
+	}
+
+	pack->count++;
+	return GIT_OK;
+}
+
+static int pack_open(export_pack * pack, const char *dir)
+{
+	static const unsigned char header[12] = {
+		'P', 'A', 'C', 'K', 0, 0, 0, 2, 0, 0, 0, 0
+	};
+	int fd;
+
+	git_buf_printf(&pack->path, "%s/tmp_pack_XXXXXX", dir);
+	if (git_buf_oom(&pack->path)) {
+		return GIT_ERROR;
+	}
+
+	if ((fd = mkstemp(pack->path.ptr)) < 0) {
+		giterr_set_str(GITERR_OS, "Failed to create exported pack");
+		git_buf_clear(&pack->path);
+		return GIT_ERROR;
+	}
+
+	if ((pack->file = fdopen(fd, "w+b")) == NULL) {
+		close(fd);
+		giterr_set_str(GITERR_OS, "Failed to open exported pack");
+		return GIT_ERROR;
+	}
+
+	// the object count is filled in once the cursor is exhausted
+	return pack_write(pack, header, sizeof(header));
+}
+
+static void pack_free(export_pack * pack)
+{
+	if (pack->file != NULL) {
+		fclose(pack->file);
+	}
+	if (pack->path.size > 0) {
+		unlink(pack->path.ptr);
+	}
+
+	git_buf_free(&pack->path);
+	free(pack->entries);
+}
+
+/* patch the object count into the header and append the trailer */
+static int pack_finish(git_oid * trailer, export_pack * pack)
+{
+	unsigned char block[65536];
+	git_hash_ctx ctx;
+	uint32_t be = htonl((uint32_t) pack->count);
+	size_t len;
+	int error = GIT_OK;
+
+	if (fseek(pack->file, 8, SEEK_SET) != 0 ||
+	    fwrite(&be, 4, 1, pack->file) != 1 ||
+	    fseek(pack->file, 0, SEEK_SET) != 0) {
+		giterr_set_str(GITERR_OS, "Failed to write exported pack");
+		return GIT_ERROR;
+	}
+
+	if (git_hash_ctx_init(&ctx) < 0) {
+		return GIT_ERROR;
+	}
+
+	while ((len = fread(block, 1, sizeof(block), pack->file)) > 0) {
+		git_hash_update(&ctx, block, len);
+	}
+
+	if (ferror(pack->file)) {
+		giterr_set_str(GITERR_OS, "Failed to read exported pack");
+		error = GIT_ERROR;
+	} else {
+		error = git_hash_final(trailer, &ctx);
+	}
+	git_hash_ctx_cleanup(&ctx);
+
+	if (error == GIT_OK &&
+	    (fseek(pack->file, 0, SEEK_END) != 0 ||
+	     fwrite(trailer->id, GIT_OID_RAWSZ, 1, pack->file) != 1 ||
+	     fflush(pack->file) != 0 || fsync(fileno(pack->file)) != 0)) {
+		giterr_set_str(GITERR_OS, "Failed to write exported pack");
+		error = GIT_ERROR;
+	}
+
+	return error;
+}
+
+static int pack_has(export_pack * pack, const git_oid * oid)
+{
+	export_entry key;
+
+	git_oid_cpy(&key.oid, oid);
+	return bsearch(&key, pack->entries, pack->sorted, sizeof(export_entry),
+		       entry_cmp) != NULL;
+}
+
+/* stream rows of (oid, type, size, data), skipping what is exported already */
+static int export_rows(export_pack * pack, MYSQL * db, const char *sql,
+		       size_t sql_len)
+{
+	git_buf scratch = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error = GIT_OK;
+
+	if (mysql_real_query(db, sql, sql_len) != 0 ||
+	    (res = mysql_use_result(db)) == NULL) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+
+	while (error == GIT_OK && (row = mysql_fetch_row(res)) != NULL) {
+		unsigned long *lengths = mysql_fetch_lengths(res);
+		unsigned char header[16];
+		const unsigned char *stream;
+		size_t header_len, stream_len;
+		git_oid oid;
+
+		if (lengths[0] != GIT_OID_RAWSZ) {
+			continue;
+		}
+
+		git_oid_fromraw(&oid, (const unsigned char *)row[0]);
+		if (pack_has(pack, &oid)) {
+			continue;
+		}
+
+		header_len = entry_header(header, (git_otype) atoi(row[1]),
+					  (size_t) strtoull(row[2], NULL, 10));
+
+		if ((error = stored_stream(&stream, &stream_len,
+					   (const unsigned char *)row[3],
+					   lengths[3], &scratch)) == GIT_OK) {
+			error = pack_add(pack, &oid, header, header_len, stream,
+					 stream_len);
+		}
+	}
+
+	// a cursor cut short by the server ends like an exhausted one
+	if (error == GIT_OK && mysql_errno(db) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		error = GIT_ERROR;
+	}
+
+	mysql_free_result(res);
+	git_buf_free(&scratch);
+	return error;
+}
+
+static int export_loose(export_pack * pack, MYSQL * db)
+{
+	static const char *sql =
+	    "SELECT `oid`, `type`, `size`, `data` FROM `" GIT2_ODB_TABLE_NAME
+	    "`";
+
+	return export_rows(pack, db, sql, strlen(sql));
+}
+
+static int export_archive(export_pack * pack, MYSQL * db)
+{
+	static const char *sql =
+	    "SELECT `oid`, `type`, `size`, `data` FROM `"
+	    GIT2_ODB_ARCHIVE_TABLE_NAME "`";
+
+	return export_rows(pack, db, sql, strlen(sql));
+}
+
+/* the pool objects this repository refers to and does not hold itself */
+static int
+export_pool(export_pack * pack, MYSQL * db, mysql_odb_backend * backend)
+{
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	git_buf_printf(&sql, "SELECT o.`oid`, o.`type`, o.`size`, o.`data`"
+		       " FROM `%s`.`" GIT2_ODB_TABLE_NAME "` o JOIN `%s`.`"
+		       GIT2_POOL_REFS_TABLE_NAME "` r ON r.`oid` = o.`oid`"
+		       " WHERE r.`member` = %u", backend->pool, backend->pool,
+		       backend->pool_member);
+
+	if (git_buf_oom(&sql)) {
+		error = GIT_ERROR;
+	} else {
+		error = export_rows(pack, db, sql.ptr, sql.size);
+	}
+
+	git_buf_free(&sql);
+	return error;
+}
+
+/*
+ * A delta entry of a segment, resolved and deflated again: its base is
+ * found by its offset in the segment, which the exported pack does not keep.
+ */
+static int
+export_delta(export_pack * pack, const git_oid * oid, git_otype type,
+	     size_t size, const unsigned char *data, size_t len, size_t offset,
+	     git_buf * scratch)
+{
+	unsigned char header[16];
+	unsigned char *obj;
+	uLongf zlen = compressBound(size);
+	int error;
+
+	if ((obj = malloc(size + 1)) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	if ((error = mysql_odb_pack__unpack(obj, size, data, len,
+					    offset)) == GIT_OK) {
+		if (git_buf_grow(scratch, zlen) < 0) {
+			error = GIT_ERROR;
+		} else if (compress2((Bytef *) scratch->ptr, &zlen, obj, size,
+				     Z_DEFAULT_COMPRESSION) != Z_OK) {
+			giterr_set_str(GITERR_ZLIB, "Failed to deflate object");
+			error = GIT_ERROR;
+		}
+	}
+	free(obj);
+
+	if (error == GIT_OK) {
+		error = pack_add(pack, oid, header,
+				 entry_header(header, type, size),
+				 scratch->ptr, zlen);
+	}
+
+	return error;
+}
+
+/*
+ * Copy the indexed entries of one segment, they are pack entries already.
+ * Only deltas are written out in full.
+ */
+static int
+export_segment(export_pack * pack, MYSQL * db, unsigned long long pack_id,
+	       const unsigned char *data, size_t len)
+{
+	git_buf sql = GIT_BUF_INIT, scratch = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error = GIT_OK;
+
+	git_buf_printf(&sql, "SELECT `oid`, `offset`, `length`, `type`,"
+		       " `size`, `chain` FROM `"
+		       GIT2_PACK_INDEX_TABLE_NAME "` WHERE `pack_id` = %llu"
+		       " ORDER BY `offset`", pack_id);
+
+	if (git_buf_oom(&sql) ||
+	    mysql_real_query(db, sql.ptr, sql.size) != 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		git_buf_free(&sql);
+		return GIT_ERROR;
+	}
+	git_buf_free(&sql);
+
+	while (error == GIT_OK && (row = mysql_fetch_row(res)) != NULL) {
+		unsigned long long offset, length;
+		git_oid oid;
+
+		if (mysql_fetch_lengths(res)[0] != GIT_OID_RAWSZ) {
+			continue;
+		}
+
+		git_oid_fromraw(&oid, (const unsigned char *)row[0]);
+		offset = strtoull(row[1], NULL, 10);
+		length = strtoull(row[2], NULL, 10);
+
+		if (length == 0 || offset > len || length > len - offset) {
+			giterr_set_str(GITERR_ODB,
+				       "Corrupted pack segment in MySql ODB");
+			error = GIT_ERROR;
+			break;
+		}
+
+		// loose copies were exported first
+		if (pack_has(pack, &oid)) {
+			continue;
+		}
+
+		if (strtoull(row[5], NULL, 10) > 0) {
+			error = export_delta(pack, &oid,
+					     (git_otype) atoi(row[3]),
+					     (size_t) strtoull(row[4], NULL, 10),
+					     data, len, (size_t) offset,
+					     &scratch);
+		} else {
+			error = pack_add(pack, &oid, data + offset,
+					 (size_t) length, NULL, 0);
+		}
+	}
+
+	mysql_free_result(res);
+	git_buf_free(&scratch);
+	return error;
+}
+
+static int export_segments(export_pack * pack, MYSQL * stream_db, MYSQL * db)
+{
+	static const char *sql =
+	    "SELECT `pack_id`, `data` FROM `" GIT2_PACKS_TABLE_NAME
+	    "` ORDER BY `pack_id`";
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error = GIT_OK;
+
+	if (mysql_real_query(stream_db, sql, strlen(sql)) != 0 ||
+	    (res = mysql_use_result(stream_db)) == NULL) {
+		giterr_set_str(GITERR_ODB, mysql_error(stream_db));
+		return GIT_ERROR;
+	}
+
+	// one segment is held at a time, the index of each is read over the
+	// backend's own connection
+	while (error == GIT_OK && (row = mysql_fetch_row(res)) != NULL) {
+		error = export_segment(pack, db, strtoull(row[0], NULL, 10),
+				       (const unsigned char *)row[1],
+				       mysql_fetch_lengths(res)[1]);
+	}
+
+	if (error == GIT_OK && mysql_errno(stream_db) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(stream_db));
+		error = GIT_ERROR;
+	}
+
+	mysql_free_result(res);
+	return error;
+}
+
+static void index_write(export_index * index, const void *data, size_t len)
+{
+	if (index->error == GIT_OK &&
+	    (fwrite(data, len, 1, index->file) != 1 ||
+	     git_hash_update(&index->ctx, data, len) < 0)) {
+		index->error = GIT_ERROR;
+	}
+}
+
+static void index_write_u32(export_index * index, uint32_t value)
+{
+	uint32_t be = htonl(value);
+
+	index_write(index, &be, 4);
+}
+
+/* a version 2 .idx for the entries, which must be in OID order */
+static int
+write_index(const char *path, export_pack * pack, const git_oid * trailer)
+{
+	export_index index;
+	uint32_t fanout[256];
+	size_t i, large = 0;
+	git_oid checksum;
+
+	memset(&index, 0, sizeof(index));
+	if ((index.file = fopen(path, "wb")) == NULL) {
+		giterr_set_str(GITERR_OS, "Failed to create exported index");
+		return GIT_ERROR;
+	}
+
+	if (git_hash_ctx_init(&index.ctx) < 0) {
+		fclose(index.file);
+		return GIT_ERROR;
+	}
+
+	memset(fanout, 0, sizeof(fanout));
+	for (i = 0; i < pack->count; i++) {
+		fanout[pack->entries[i].oid.id[0]]++;
+	}
+	for (i = 1; i < 256; i++) {
+		fanout[i] += fanout[i - 1];
+	}
+
+	index_write(&index, "\377tOc", 4);
+	index_write_u32(&index, 2);
+
+	for (i = 0; i < 256; i++) {
+		index_write_u32(&index, fanout[i]);
+	}
+	for (i = 0; i < pack->count; i++) {
+		index_write(&index, pack->entries[i].oid.id, GIT_OID_RAWSZ);
+	}
+	for (i = 0; i < pack->count; i++) {
+		index_write_u32(&index, pack->entries[i].crc);
+	}
+
+	for (i = 0; i < pack->count; i++) {
+		uint64_t offset = pack->entries[i].offset;
+
+		if (offset < 0x80000000) {
+			index_write_u32(&index, (uint32_t) offset);
+		} else {
+			index_write_u32(&index, 0x80000000 | (uint32_t) large++);
+		}
+	}
+	for (i = 0; i < pack->count; i++) {
+		uint64_t offset = pack->entries[i].offset;
+
+		if (offset >= 0x80000000) {
+			index_write_u32(&index, (uint32_t) (offset >> 32));
+			index_write_u32(&index, (uint32_t) offset);
+		}
+	}
+
+	index_write(&index, trailer->id, GIT_OID_RAWSZ);
+
+	if (index.error == GIT_OK &&
+	    (git_hash_final(&checksum, &index.ctx) < 0 ||
+	     fwrite(checksum.id, GIT_OID_RAWSZ, 1, index.file) != 1 ||
+	     fflush(index.file) != 0 || fsync(fileno(index.file)) != 0)) {
+		index.error = GIT_ERROR;
+	}
+
+	git_hash_ctx_cleanup(&index.ctx);
+	if (fclose(index.file) != 0) {
+		index.error = GIT_ERROR;
+	}
+
+	if (index.error < 0) {
+		giterr_set_str(GITERR_OS, "Failed to write exported index");
+		unlink(path);
+	}
+
+	return index.error;
+}
+
+static int
+export_all(git_oid * name, size_t * objects, mysql_odb_backend * backend,
+	   const char *dir)
+{
+	export_pack pack;
+	MYSQL *stream_db = NULL;
+	git_buf idx_path = GIT_BUF_INIT, final_path = GIT_BUF_INIT;
+	char hex[GIT_OID_HEXSZ + 1];
+	size_t i;
+	int error;
+
+	memset(&pack, 0, sizeof(pack));
+	git_buf_init(&pack.path, 0);
+
+	if (mysql_odb__enter(backend) < 0) {
+		git_buf_free(&pack.path);
+		return GIT_ERROR;
+	}
+
+	// a second connection, so the backend's stays free for the pack
+	// index queries while the cursor is open
+	if ((error = mysql_conn_open(&stream_db, &backend->conn)) < 0 ||
+	    (error = pack_open(&pack, dir)) < 0) {
+		goto done;
+	}
+
+	// the cursor stalls while the pack is being written
+	mysql_real_query(stream_db, "SET SESSION net_write_timeout = 3600", 36);
+
+	if ((error = export_loose(&pack, stream_db)) < 0) {
+		goto done;
+	}
+
+	qsort(pack.entries, pack.count, sizeof(export_entry), entry_cmp);
+	pack.sorted = pack.count;
+
+	// an object being moved between the tiers can be in both
+	if (backend->tier_sample_rate != 0) {
+		if ((error = export_archive(&pack, stream_db)) < 0) {
+			goto done;
+		}
+
+		qsort(pack.entries, pack.count, sizeof(export_entry),
+		      entry_cmp);
+		pack.sorted = pack.count;
+	}
+
+	if (backend->packed &&
+	    (error = export_segments(&pack, stream_db, backend->db)) < 0) {
+		goto done;
+	}
+
+	if (backend->pool != NULL) {
+		qsort(pack.entries, pack.count, sizeof(export_entry),
+		      entry_cmp);
+		pack.sorted = pack.count;
+
+		if ((error = export_pool(&pack, stream_db, backend)) < 0) {
+			goto done;
+		}
+	}
+
+	if ((error = pack_finish(name, &pack)) < 0) {
+		goto done;
+	}
+
+	qsort(pack.entries, pack.count, sizeof(export_entry), entry_cmp);
+	for (i = 1; i < pack.count; i++) {
+		if (git_oid_equal(&pack.entries[i - 1].oid,
+				  &pack.entries[i].oid)) {
+			giterr_set_str(GITERR_ODB,
+				       "Object exported twice from MySql ODB");
+			error = GIT_ERROR;
+			goto done;
+		}
+	}
+
+	git_oid_tostr(hex, sizeof(hex), name);
+	git_buf_printf(&idx_path, "%s/pack-%s.idx", dir, hex);
+	git_buf_printf(&final_path, "%s/pack-%s.pack", dir, hex);
+	if (git_buf_oom(&idx_path) || git_buf_oom(&final_path)) {
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	// the pack goes in place first, an .idx is what makes it visible
+	if (chmod(pack.path.ptr, EXPORT_PACK_MODE) < 0 ||
+	    rename(pack.path.ptr, final_path.ptr) < 0) {
+		giterr_set_str(GITERR_OS, "Failed to move exported pack");
+		error = GIT_ERROR;
+		goto done;
+	}
+	git_buf_clear(&pack.path);
+
+	if ((error = write_index(idx_path.ptr, &pack, name)) < 0) {
+		unlink(final_path.ptr);
+		goto done;
+	}
+	chmod(idx_path.ptr, EXPORT_PACK_MODE);
+
+	*objects = pack.count;
+
+ done:
+	pack_free(&pack);
+	git_buf_free(&idx_path);
+	git_buf_free(&final_path);
+	if (stream_db != NULL) {
+		mysql_close(stream_db);
+	}
+	mysql_odb__leave(backend);
+	return error;
+}
+
+/*
+ * The pack builder reads through a git_odb, which takes ownership of its
+ * backends, and searches deltas on several threads, while the backend's
+ * connection serves one statement at a time.
+ */
+static int
+proxy_read(void **data_p, size_t * len_p, git_otype * type_p,
+	   git_odb_backend * _proxy, const git_oid * oid)
+{
+	export_proxy *proxy = (export_proxy *) _proxy;
+	int error;
+
+	pthread_mutex_lock(&proxy->lock);
+	error = proxy->backend->read(data_p, len_p, type_p, proxy->backend,
+				     oid);
+	pthread_mutex_unlock(&proxy->lock);
+
+	return error;
+}
+
+static int
+proxy_read_prefix(git_oid * out_oid, void **data_p, size_t * len_p,
+		  git_otype * type_p, git_odb_backend * _proxy,
+		  const git_oid * short_oid, size_t len)
+{
+	export_proxy *proxy = (export_proxy *) _proxy;
+	int error;
+
+	pthread_mutex_lock(&proxy->lock);
+	error = proxy->backend->read_prefix(out_oid, data_p, len_p, type_p,
+					    proxy->backend, short_oid, len);
+	pthread_mutex_unlock(&proxy->lock);
+
+	return error;
+}
+
+static int
+proxy_read_header(size_t * len_p, git_otype * type_p,
+		  git_odb_backend * _proxy, const git_oid * oid)
+{
+	export_proxy *proxy = (export_proxy *) _proxy;
+	int error;
+
+	pthread_mutex_lock(&proxy->lock);
+	error = proxy->backend->read_header(len_p, type_p, proxy->backend,
+					    oid);
+	pthread_mutex_unlock(&proxy->lock);
+
+	return error;
+}
+
+static int proxy_exists(git_odb_backend * _proxy, const git_oid * oid)
+{
+	export_proxy *proxy = (export_proxy *) _proxy;
+	int found;
+
+	pthread_mutex_lock(&proxy->lock);
+	found = proxy->backend->exists(proxy->backend, oid);
+	pthread_mutex_unlock(&proxy->lock);
+
+	return found;
+}
+
+static void proxy_free(git_odb_backend * _proxy)
+{
+	export_proxy *proxy = (export_proxy *) _proxy;
+
+	pthread_mutex_destroy(&proxy->lock);
+	free(proxy);
+}
+
+static int proxy_new(git_odb_backend ** out, git_odb_backend * backend)
+{
+	export_proxy *proxy = calloc(1, sizeof(export_proxy));
+
+	if (proxy == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	pthread_mutex_init(&proxy->lock, NULL);
+	proxy->backend = backend;
+
+	proxy->parent.version = GIT_ODB_BACKEND_VERSION;
+	proxy->parent.read = &proxy_read;
+	if (backend->read_prefix != NULL) {
+		proxy->parent.read_prefix = &proxy_read_prefix;
+	}
+	proxy->parent.read_header = &proxy_read_header;
+	proxy->parent.exists = &proxy_exists;
+	proxy->parent.free = &proxy_free;
+
+	*out = &proxy->parent;
+	return GIT_OK;
+}
+
+/* mark `oid` as inserted; GIT_OK the first time, GIT_EEXISTS after */
+static int walk_mark(export_walk * walk, const git_oid * oid, git_otype type)
+{
+	size_t len;
+	git_otype seen_type;
+
+	if (mysql_header_index_lookup(&len, &seen_type, walk->seen, oid) ==
+	    GIT_OK) {
+		return GIT_EEXISTS;
+	}
+
+	return mysql_header_index_insert(walk->seen, oid, 0, type);
+}
+
+static int walk_tree(export_walk * walk, const git_oid * oid);
+
+static int walk_tree_entry(const git_oid * oid, unsigned int mode,
+			   void *payload)
+{
+	export_walk *walk = payload;
+	int error;
+
+	// submodule commits live in another repository
+	if (mode == 0160000) {
+		return 0;
+	}
+
+	if (mode == 040000) {
+		return walk_tree(walk, oid);
+	}
+
+	if ((error = walk_mark(walk, oid, GIT_OBJ_BLOB)) == GIT_EEXISTS) {
+		return 0;
+	}
+
+	return error < 0 ? error : git_packbuilder_insert(walk->pb, oid, NULL);
+}
+
+/*
+ * git_packbuilder_insert_tree() descends into every subtree again for
+ * each commit; shared subtrees are only walked the first time here.
+ */
+static int walk_tree(export_walk * walk, const git_oid * oid)
+{
+	git_odb_object *tree;
+	int error;
+
+	if ((error = walk_mark(walk, oid, GIT_OBJ_TREE)) == GIT_EEXISTS) {
+		return 0;
+	}
+
+	if (error < 0 ||
+	    (error = git_packbuilder_insert(walk->pb, oid, NULL)) < 0 ||
+	    (error = git_odb_read(&tree, walk->odb, oid)) < 0) {
+		return error;
+	}
+
+	error = mysql_parse_tree(git_odb_object_data(tree),
+				 git_odb_object_size(tree), walk_tree_entry,
+				 walk);
+
+	git_odb_object_free(tree);
+	return error;
+}
+
+static int walk_commit(export_walk * walk, const git_oid * oid)
+{
+	mysql_commit_info info;
+	git_odb_object *commit;
+	int error;
+
+	if ((error = git_packbuilder_insert(walk->pb, oid, NULL)) < 0 ||
+	    (error = git_odb_read(&commit, walk->odb, oid)) < 0) {
+		return error;
+	}
+
+	mysql_commit_info_init(&info);
+	if ((error = mysql_parse_commit(&info, git_odb_object_data(commit),
+					git_odb_object_size(commit))) ==
+	    GIT_OK) {
+		error = walk_tree(walk, &info.tree);
+	}
+
+	mysql_commit_info_free(&info);
+	git_odb_object_free(commit);
+	return error;
+}
+
+/* insert what a ref points at; commits are queued on the revwalk */
+static int
+walk_tip(export_walk * walk, git_revwalk * revwalk, const git_oid * tip)
+{
+	git_odb_object *tag;
+	git_otype type;
+	git_oid oid;
+	size_t len;
+	int depth, error;
+
+	git_oid_cpy(&oid, tip);
+
+	for (depth = 0; depth < EXPORT_MAX_PEEL; depth++) {
+		if ((error = git_odb_read_header(&len, &type, walk->odb,
+						 &oid)) < 0) {
+			return error;
+		}
+
+		switch (type) {
+		case GIT_OBJ_COMMIT:
+			return git_revwalk_push(revwalk, &oid);
+		case GIT_OBJ_TREE:
+			return walk_tree(walk, &oid);
+		case GIT_OBJ_TAG:
+			break;
+		default:
+			if ((error = walk_mark(walk, &oid, type)) ==
+			    GIT_EEXISTS) {
+				return GIT_OK;
+			}
+			return error < 0 ? error :
+			    git_packbuilder_insert(walk->pb, &oid, NULL);
+		}
+
+		if ((error = walk_mark(walk, &oid, type)) == GIT_EEXISTS) {
+			return GIT_OK;
+		}
+
+		if (error < 0 ||
+		    (error = git_packbuilder_insert(walk->pb, &oid, NULL)) < 0 ||
+		    (error = git_odb_read(&tag, walk->odb, &oid)) < 0) {
+			return error;
+		}
+
+		error = mysql_parse_tag(&oid, git_odb_object_data(tag),
+					git_odb_object_size(tag));
+		git_odb_object_free(tag);
+		if (error < 0) {
+			return error;
+		}
+	}
+
+	giterr_set_str(GITERR_TAG, "Too many nested tags");
+	return GIT_ERROR;
+}
+
+static int walk_refs(export_walk * walk, git_repository * repo,
+		     git_refdb_backend * refdb)
+{
+	git_reference_iterator *iter;
+	git_reference *ref;
+	git_revwalk *revwalk;
+	git_oid oid;
+	int error;
+
+	if ((error = git_revwalk_new(&revwalk, repo)) < 0) {
+		return error;
+	}
+
+	if ((error = refdb->iterator(&iter, refdb, NULL)) < 0) {
+		git_revwalk_free(revwalk);
+		return error;
+	}
+
+	// symbolic refs end at a direct ref, which is listed as well
+	while ((error = iter->next(&ref, iter)) == GIT_OK) {
+		if (git_reference_type(ref) == GIT_REF_OID) {
+			error = walk_tip(walk, revwalk,
+					 git_reference_target(ref));
+		}
+		git_reference_free(ref);
+
+		if (error < 0) {
+			break;
+		}
+	}
+	iter->free(iter);
+
+	if (error == GIT_ITEROVER) {
+		error = GIT_OK;
+	}
+
+	while (error == GIT_OK &&
+	       (error = git_revwalk_next(&oid, revwalk)) == GIT_OK) {
+		error = walk_commit(walk, &oid);
+	}
+
+	if (error == GIT_ITEROVER) {
+		error = GIT_OK;
+	}
+
+	git_revwalk_free(revwalk);
+	return error;
+}
+
+static int
+export_reachable(git_oid * name, size_t * objects, git_odb_backend * backend,
+		 git_refdb_backend * refdb, const char *dir,
+		 unsigned int threads)
+{
+	git_odb_backend *proxy;
+	git_odb *odb = NULL;
+	git_repository *repo = NULL;
+	export_walk walk;
+	int error;
+
+	memset(&walk, 0, sizeof(walk));
+
+	if (refdb == NULL) {
+		giterr_set_str(GITERR_INVALID,
+			       "A refdb backend is needed to export reachable objects");
+		return GIT_ERROR;
+	}
+
+	if ((error = git_odb_new(&odb)) < 0) {
+		return error;
+	}
+
+	if ((error = proxy_new(&proxy, backend)) < 0) {
+		goto done;
+	}
+
+	if ((error = git_odb_add_backend(odb, proxy, 1)) < 0) {
+		proxy->free(proxy);
+		goto done;
+	}
+
+	if ((error = git_repository_wrap_odb(&repo, odb)) < 0 ||
+	    (error = git_packbuilder_new(&walk.pb, repo)) < 0 ||
+	    (error = mysql_header_index_new(&walk.seen)) < 0) {
+		goto done;
+	}
+
+	walk.odb = odb;
+	git_packbuilder_set_threads(walk.pb, threads);
+
+	if ((error = walk_refs(&walk, repo, refdb)) < 0 ||
+	    (error = git_packbuilder_write(walk.pb, dir, EXPORT_PACK_MODE,
+					   NULL, NULL)) < 0) {
+		goto done;
+	}
+
+	git_oid_cpy(name, git_packbuilder_hash(walk.pb));
+	*objects = git_packbuilder_object_count(walk.pb);
+
+ done:
+	if (walk.seen != NULL) {
+		mysql_header_index_free(walk.seen);
+	}
+	git_packbuilder_free(walk.pb);
+	git_repository_free(repo);
+	git_odb_free(odb);
+	return error;
+}
+
+int
+mysql_export(git_oid * name, size_t * objects, git_odb_backend * odb,
+	     git_refdb_backend * refdb, const char *dir,
+	     const mysql_export_opts * given_opts)
+{
+	mysql_export_opts opts = MYSQL_EXPORT_OPTS_INIT;
+
+	*objects = 0;
+
+	if (given_opts != NULL) {
+		opts = *given_opts;
+	}
+
+	// the pack builder reads on threads of its own, each read enters
+	// the connection; export_all() holds it throughout
+	if (opts.reachable) {
+		return export_reachable(name, objects, odb, refdb, dir,
+					opts.threads);
+	}
+
+	return export_all(name, objects, (mysql_odb_backend *) odb, dir);
+}
@@ -0,0 +1,37 @@
+#ifndef MYSQL_EXPORT_H
+#define MYSQL_EXPORT_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+
+/*
+ * Export of the object store to a packfile and its .idx on disk.
+ *
+ * By default every stored object is streamed from an unbuffered cursor
+ * into the pack as it arrives: loose rows keep the zlib stream MySQL's
+ * COMPRESS() already made, and packed-mode entries are copied verbatim
+ * from their segments. Only 32 bytes per object are held in memory, to
+ * write the index at the end. No deltas are searched in this mode.
+ *
+ * In reachable mode only the objects reachable from the refs are written,
+ * through libgit2's pack builder, which searches for deltas on `threads`
+ * threads. Object reads are serialized onto the backend's connection.
+ */
+
+typedef struct {
+	int reachable;		/* only objects reachable from the refs */
+	unsigned int threads;	/* delta search threads, 0 for one per CPU */
+} mysql_export_opts;
+
+#define MYSQL_EXPORT_OPTS_INIT { 0, 0 }
+
+/*
+ * Write `dir`/pack-<name>.pack and .idx. `refdb` is only used in
+ * reachable mode and may be NULL otherwise.
+ */
+int mysql_export(git_oid * name, size_t * objects, git_odb_backend * odb,
+		 git_refdb_backend * refdb, const char *dir,
+		 const mysql_export_opts * opts);
+
+#endif
@@ -0,0 +1,434 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_fetch.h"
+
+#define FETCH_CHUNK 128
+#define FETCH_MAX_WORKERS 64
+/* loaded but undelivered chunks allowed per worker */
+#define FETCH_WINDOW_PER_WORKER 2
+
+enum {
+	CHUNK_PENDING,
+	CHUNK_LOADING,
+	CHUNK_DONE,
+};
+
+typedef struct {
+	git_otype type;
+	size_t len;
+	void *data;
+	int found;
+} fetch_object;
+
+typedef struct {
+	git_oid oid;
+	size_t position;
+} fetch_key;
+
+typedef struct {
+	size_t start;
+	size_t count;
+	int state;
+	fetch_object *objects;
+	fetch_key *order;	/* the chunk's OIDs, sorted */
+	size_t done_next;	/* FIFO of loaded chunks, for unordered mode */
+} fetch_chunk;
+
+typedef struct {
+	mysql_odb_backend *backend;
+	const git_oid *oids;
+	int sequential;		/* `git2_odb` is clustered by `id` */
+	fetch_chunk *chunks;
+	size_t chunk_count;
+	size_t window;
+	int ordered;
+
+	pthread_mutex_t lock;
+	pthread_cond_t space;	/* a chunk was delivered, or stop */
+	pthread_cond_t ready;	/* a chunk was loaded, or a worker quit */
+	size_t next_claim;
+	size_t delivered;
+	size_t done_head;	/* chunk index + 1, 0 when empty */
+	size_t done_tail;
+	unsigned int alive;
+	int stop;
+} fetch_state;
+
+static int key_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp(&((const fetch_key *)a)->oid,
+			   &((const fetch_key *)b)->oid);
+}
+
+static fetch_object *chunk_find(fetch_chunk * chunk, const git_oid * oid)
+{
+	fetch_key key, *found;
+
+	git_oid_cpy(&key.oid, oid);
+	found = bsearch(&key, chunk->order, chunk->count, sizeof(fetch_key),
+			key_cmp);
+
+	return found ? &chunk->objects[found->position] : NULL;
+}
+
+static int chunk_prepare(fetch_state * state, fetch_chunk * chunk)
+{
+	size_t i;
+
+	chunk->objects = calloc(chunk->count, sizeof(fetch_object));
+	chunk->order = malloc(chunk->count * sizeof(fetch_key));
+	if (chunk->objects == NULL || chunk->order == NULL) {
+		return GIT_ERROR;
+	}
+
+	for (i = 0; i < chunk->count; i++) {
+		git_oid_cpy(&chunk->order[i].oid, &state->oids[chunk->start + i]);
+		chunk->order[i].position = i;
+	}
+
+	qsort(chunk->order, chunk->count, sizeof(fetch_key), key_cmp);
+
+	return GIT_OK;
+}
+
+static void chunk_load(fetch_state * state, fetch_chunk * chunk, MYSQL * db)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res = NULL;
+	MYSQL_ROW row;
+	size_t i;
+
+	git_buf_puts(&sql, "SELECT `oid`, `type`, UNCOMPRESS(`data`) FROM `"
+		     GIT2_ODB_TABLE_NAME "` WHERE `oid` IN (");
+	for (i = 0; i < chunk->count; i++) {
+		if (i > 0) {
+			git_buf_putc(&sql, ',');
+		}
+		mysql_buf_put_oid(&sql, &state->oids[chunk->start + i]);
+	}
+	git_buf_putc(&sql, ')');
+	// in a table clustered by insertion order, read the rows in it
+	if (state->sequential) {
+		git_buf_puts(&sql, " ORDER BY `id`");
+	}
+
+	if (!git_buf_oom(&sql) &&
+	    mysql_real_query(db, sql.ptr, sql.size) == 0) {
+		res = mysql_use_result(db);
+	}
+	git_buf_free(&sql);
+
+	// rows that do not arrive are read by the consumer on its own
+	while (res != NULL && (row = mysql_fetch_row(res)) != NULL) {
+		unsigned long *lengths = mysql_fetch_lengths(res);
+		fetch_object *object;
+		git_oid oid;
+
+		if (lengths[0] != GIT_OID_RAWSZ || row[2] == NULL) {
+			continue;
+		}
+
+		git_oid_fromraw(&oid, (const unsigned char *)row[0]);
+		if ((object = chunk_find(chunk, &oid)) == NULL ||
+		    object->found) {
+			continue;
+		}
+
+		if ((object->data = malloc(lengths[2] ? lengths[2] : 1)) ==
+		    NULL) {
+			continue;
+		}
+		memcpy(object->data, row[2], lengths[2]);
+		object->len = lengths[2];
+		object->type = (git_otype) atoi(row[1]);
+		object->found = 1;
+	}
+
+	if (res != NULL) {
+		mysql_free_result(res);
+	}
+}
+
+/* called with the lock held */
+static void chunk_finish(fetch_state * state, size_t index)
+{
+	fetch_chunk *chunk = &state->chunks[index];
+
+	chunk->state = CHUNK_DONE;
+	chunk->done_next = 0;
+
+	if (state->done_tail) {
+		state->chunks[state->done_tail - 1].done_next = index + 1;
+	} else {
+		state->done_head = index + 1;
+	}
+	state->done_tail = index + 1;
+
+	pthread_cond_broadcast(&state->ready);
+}
+
+static void chunk_free(fetch_chunk * chunk)
+{
+	size_t i;
+
+	if (chunk->objects != NULL) {
+		for (i = 0; i < chunk->count; i++) {
+			free(chunk->objects[i].data);
+		}
+	}
+
+	free(chunk->objects);
+	free(chunk->order);
+	chunk->objects = NULL;
+	chunk->order = NULL;
+}
+
+/* called with the lock held; returns the chunk index + 1, or 0 */
+static size_t chunk_claim(fetch_state * state)
+{
+	size_t index;
+
+	if (state->next_claim >= state->chunk_count ||
+	    state->next_claim >= state->delivered + state->window) {
+		return 0;
+	}
+
+	index = state->next_claim++;
+	state->chunks[index].state = CHUNK_LOADING;
+
+	// without room for the results the consumer falls back to
+	// single reads for every object of the chunk
+	if (chunk_prepare(state, &state->chunks[index]) < 0) {
+		chunk_free(&state->chunks[index]);
+		chunk_finish(state, index);
+		return chunk_claim(state);
+	}
+
+	return index + 1;
+}
+
+static void *fetch_worker(void *payload)
+{
+	fetch_state *state = payload;
+	MYSQL *db = NULL;
+	size_t claimed;
+
+	mysql_thread_init();
+
+	if (mysql_conn_open(&db, &state->backend->conn) < 0) {
+		giterr_clear();
+		pthread_mutex_lock(&state->lock);
+		goto quit;
+	}
+
+	pthread_mutex_lock(&state->lock);
+
+	while (!state->stop && state->next_claim < state->chunk_count) {
+		if ((claimed = chunk_claim(state)) == 0) {
+			pthread_cond_wait(&state->space, &state->lock);
+			continue;
+		}
+
+		pthread_mutex_unlock(&state->lock);
+		chunk_load(state, &state->chunks[claimed - 1], db);
+		pthread_mutex_lock(&state->lock);
+
+		chunk_finish(state, claimed - 1);
+	}
+
+ quit:
+	state->alive--;
+	pthread_cond_broadcast(&state->ready);
+	pthread_mutex_unlock(&state->lock);
+
+	if (db != NULL) {
+		mysql_close(db);
+	}
+	mysql_thread_end();
+	return NULL;
+}
+
+/* called with the lock held; the next chunk to deliver, or NULL */
+static fetch_chunk *next_done(fetch_state * state)
+{
+	fetch_chunk *chunk;
+	size_t claimed;
+
+	for (;;) {
+		if (state->ordered) {
+			chunk = &state->chunks[state->delivered];
+			if (chunk->state == CHUNK_DONE) {
+				return chunk;
+			}
+		} else if (state->done_head) {
+			chunk = &state->chunks[state->done_head - 1];
+			state->done_head = chunk->done_next;
+			if (state->done_head == 0) {
+				state->done_tail = 0;
+			}
+			return chunk;
+		}
+
+		if (state->alive > 0) {
+			pthread_cond_wait(&state->ready, &state->lock);
+			continue;
+		}
+
+		// no worker could connect, read the chunks ourselves
+		if ((claimed = chunk_claim(state)) == 0) {
+			return NULL;
+		}
+		chunk_finish(state, claimed - 1);
+	}
+}
+
+static int
+deliver(fetch_state * state, fetch_chunk * chunk, mysql_fetch_cb cb,
+	void *payload)
+{
+	git_odb_backend *backend = &state->backend->parent;
+	size_t i;
+	int error = GIT_OK;
+
+	for (i = 0; i < chunk->count && error == GIT_OK; i++) {
+		const git_oid *oid = &state->oids[chunk->start + i];
+		fetch_object *object, fallback;
+
+		object = chunk->objects ? &chunk->objects[i] : NULL;
+
+		// packed objects, and anything a worker could not load; the
+		// caller may run without the GVL, so the read holds the
+		// connection like any other user of the backend, but not
+		// across `cb`
+		if (object == NULL || !object->found) {
+			memset(&fallback, 0, sizeof(fallback));
+			if ((error = mysql_odb__enter(state->backend)) < 0) {
+				break;
+			}
+			error = backend->read(&fallback.data, &fallback.len,
+					      &fallback.type, backend, oid);
+			mysql_odb__leave(state->backend);
+			if (error < 0) {
+				break;
+			}
+			object = &fallback;
+		}
+
+		if (cb(oid, object->type, object->data, object->len, payload)
+		    != 0) {
+			error = GIT_EUSER;
+		}
+
+		free(object->data);
+		object->data = NULL;
+	}
+
+	return error;
+}
+
+int
+mysql_fetch_parallel(git_odb_backend * backend, const git_oid * oids,
+		     size_t count, unsigned int workers, int ordered,
+		     mysql_fetch_cb cb, void *payload)
+{
+	fetch_state state;
+	pthread_t threads[FETCH_MAX_WORKERS];
+	unsigned int started = 0, i;
+	size_t c;
+	int error = GIT_OK;
+
+	if (count == 0) {
+		return GIT_OK;
+	}
+
+	if (workers == 0) {
+		workers = 1;
+	} else if (workers > FETCH_MAX_WORKERS) {
+		workers = FETCH_MAX_WORKERS;
+	}
+
+	memset(&state, 0, sizeof(state));
+	state.backend = (mysql_odb_backend *) backend;
+	state.oids = oids;
+	state.ordered = ordered;
+	state.window = workers * FETCH_WINDOW_PER_WORKER;
+	state.chunk_count = (count + FETCH_CHUNK - 1) / FETCH_CHUNK;
+
+	// the workers have connections of their own, ask on ours
+	if (mysql_odb__enter(state.backend) == GIT_OK) {
+		state.sequential = mysql_odb__sequential(state.backend);
+		mysql_odb__leave(state.backend);
+	} else {
+		giterr_clear();
+	}
+
+	if ((state.chunks = calloc(state.chunk_count, sizeof(fetch_chunk))) ==
+	    NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	for (c = 0; c < state.chunk_count; c++) {
+		state.chunks[c].start = c * FETCH_CHUNK;
+		state.chunks[c].count = count - state.chunks[c].start;
+		if (state.chunks[c].count > FETCH_CHUNK) {
+			state.chunks[c].count = FETCH_CHUNK;
+		}
+	}
+
+	pthread_mutex_init(&state.lock, NULL);
+	pthread_cond_init(&state.space, NULL);
+	pthread_cond_init(&state.ready, NULL);
+
+	pthread_mutex_lock(&state.lock);
+	for (i = 0; i < workers; i++) {
+		if (pthread_create(&threads[started], NULL, fetch_worker,
+				   &state) == 0) {
+			started++;
+			state.alive++;
+		}
+	}
+
+	while (error == GIT_OK && state.delivered < state.chunk_count) {
+		fetch_chunk *chunk = next_done(&state);
+
+		if (chunk == NULL) {
+			break;
+		}
+
+		pthread_mutex_unlock(&state.lock);
+		error = deliver(&state, chunk, cb, payload);
+		chunk_free(chunk);
+		pthread_mutex_lock(&state.lock);
+
+		state.delivered++;
+		pthread_cond_broadcast(&state.space);
+	}
+
+	state.stop = 1;
+	pthread_cond_broadcast(&state.space);
+	pthread_mutex_unlock(&state.lock);
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (c = 0; c < state.chunk_count; c++) {
+		chunk_free(&state.chunks[c]);
+	}
+	free(state.chunks);
+
+	pthread_cond_destroy(&state.ready);
+	pthread_cond_destroy(&state.space);
+	pthread_mutex_destroy(&state.lock);
+
+	return error;
+}
@@ -0,0 +1,29 @@
+#ifndef MYSQL_FETCH_H
+#define MYSQL_FETCH_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+/*
+ * Parallel bulk object reads.
+ *
+ * The OIDs are split into chunks that `workers` native threads load on
+ * their own connections with batched queries. Loaded chunks wait in a
+ * bounded window until the calling thread hands them to `cb`. Workers
+ * stall when the window is full, so a slow consumer bounds memory use.
+ * With `ordered` set, objects are delivered in the order of `oids`;
+ * otherwise chunks are delivered as soon as they are loaded.
+ */
+
+typedef int (*mysql_fetch_cb) (const git_oid * oid, git_otype type,
+			       const void *data, size_t len, void *payload);
+
+/*
+ * Returns GIT_ENOTFOUND if an object does not exist, GIT_EUSER if `cb`
+ * returned non-zero.
+ */
+int mysql_fetch_parallel(git_odb_backend * backend, const git_oid * oids,
+			 size_t count, unsigned int workers, int ordered,
+			 mysql_fetch_cb cb, void *payload);
+
+#endif
@@ -0,0 +1,1067 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_object_parse.h"
+#include "mysql_pipeline.h"
+#include "mysql_gc.h"
+
+#define GIT2_GC_MARKS_TABLE_NAME "git2_gc_marks"
+#define GC_LOCK_NAME "git2_gc"
+#define GC_ROWS_PER_INSERT 500
+#define GC_RECHECK 10
+
+enum {
+	GC_IDLE,
+	GC_MARK,		/* walking from the refs as they were at the start */
+	GC_REMARK,		/* walking from the refs moved since */
+	GC_SWEEP_LOOSE,
+	GC_SWEEP_PACKED,
+	GC_SWEEP_POOL,		/* this repository's references into the pool */
+	GC_SWEEP_ARCHIVE,	/* swept right after GC_SWEEP_LOOSE */
+};
+
+typedef struct {
+	git_oid oid;
+	int visited;		/* blobs have no links to walk */
+} gc_mark;
+
+typedef struct {
+	mysql_odb_backend *backend;
+	git_refdb_backend *refdb;
+	mysql_gc_opts opts;
+	mysql_gc_stats *stats;
+	int phase;
+	git_oid last_oid;	/* sweep position */
+	size_t rows;		/* rows handled by this run */
+
+	gc_mark *marks;		/* found by the current mark step */
+	size_t mark_count;
+	size_t mark_alloc;
+	int error;
+} gc_state;
+
+typedef struct {
+	git_oid *oids;
+	size_t count;
+} gc_batch;
+
+static int run_query(MYSQL * db, const char *sql, size_t len)
+{
+	if (mysql_real_query(db, sql, len) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int run_buf(MYSQL * db, git_buf * sql)
+{
+	if (git_buf_oom(sql)) {
+		return GIT_ERROR;
+	}
+
+	return run_query(db, sql->ptr, sql->size);
+}
+
+/* the tables every backend reads, see mysql_gc__check() */
+static int init_shared(MYSQL * db)
+{
+	static const char *sql_candidates =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_GC_CANDIDATES_TABLE_NAME "` ("
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `first_seen` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,"
+	    "  PRIMARY KEY (`oid`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	static const char *sql_state =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_GC_STATE_TABLE_NAME "` ("
+	    "  `id` tinyint(1) unsigned NOT NULL,"
+	    "  `phase` tinyint(1) unsigned NOT NULL,"
+	    "  `last_oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `updated_at` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP"
+	    "    ON UPDATE CURRENT_TIMESTAMP,"
+	    "  PRIMARY KEY (`id`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	// a new token for every sweep that deletes rows
+	static const char *sql_swept =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_GC_SWEPT_TABLE_NAME "` ("
+	    "  `id` tinyint(1) unsigned NOT NULL,"
+	    "  `token` bigint(20) unsigned NOT NULL,"
+	    "  PRIMARY KEY (`id`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	if (run_query(db, sql_candidates, strlen(sql_candidates)) < 0 ||
+	    run_query(db, sql_state, strlen(sql_state)) < 0 ||
+	    run_query(db, sql_swept, strlen(sql_swept)) < 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int init_tables(MYSQL * db)
+{
+	static const char *sql_marks =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_GC_MARKS_TABLE_NAME "` ("
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `visited` tinyint(1) unsigned NOT NULL DEFAULT 0,"
+	    "  PRIMARY KEY (`oid`),"
+	    "  KEY `visited` (`visited`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	if (run_query(db, sql_marks, strlen(sql_marks)) < 0 ||
+	    init_shared(db) < 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int lock_gc(MYSQL * db)
+{
+	static const char *sql = "SELECT GET_LOCK('" GC_LOCK_NAME "', 0)";
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int locked = 0;
+
+	if (run_query(db, sql, strlen(sql)) < 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	if ((row = mysql_fetch_row(res)) != NULL && row[0] != NULL) {
+		locked = atoi(row[0]) == 1;
+	}
+	mysql_free_result(res);
+
+	if (!locked) {
+		giterr_set_str(GITERR_ODB,
+			       "Another garbage collection is running");
+		return GIT_ELOCKED;
+	}
+
+	return GIT_OK;
+}
+
+static void unlock_gc(MYSQL * db)
+{
+	static const char *sql = "DO RELEASE_LOCK('" GC_LOCK_NAME "')";
+
+	mysql_real_query(db, sql, strlen(sql));
+}
+
+/*
+ * Objects are immutable, so the local caches never expire an entry; once
+ * a sweep deleted rows, some of their entries may be gone from MySQL. The
+ * first token a backend sees may be older than what it has cached, which
+ * only the disk cache can tell, since it keeps the token it was emptied for.
+ */
+static void seen_sweep(mysql_odb_backend * backend, unsigned long long token)
+{
+	int known = backend->gc_active >= 0;
+
+	if (token == backend->gc_swept) {
+		return;
+	}
+	backend->gc_swept = token;
+
+	if (backend->disk_cache != NULL) {
+		mysql_disk_cache_invalidate(backend->disk_cache, token);
+	}
+	if (known && backend->header_index != NULL) {
+		mysql_header_index_clear(backend->header_index);
+	}
+	if (known && backend->prefetch != NULL) {
+		mysql_prefetch_cancel(backend->prefetch);
+	}
+}
+
+static int read_state(gc_state * state)
+{
+	static const char *sql =
+	    "SELECT `phase`, `last_oid` FROM `" GIT2_GC_STATE_TABLE_NAME
+	    "` WHERE `id` = 1";
+	MYSQL *db = state->backend->db;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	state->phase = GC_IDLE;
+	memset(&state->last_oid, 0, sizeof(git_oid));
+
+	if (run_query(db, sql, strlen(sql)) < 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	if ((row = mysql_fetch_row(res)) != NULL) {
+		state->phase = atoi(row[0]);
+		if (mysql_fetch_lengths(res)[1] == GIT_OID_RAWSZ) {
+			git_oid_fromraw(&state->last_oid,
+					(const unsigned char *)row[1]);
+		}
+	}
+
+	mysql_free_result(res);
+	return GIT_OK;
+}
+
+static int write_state(gc_state * state)
+{
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	git_buf_printf(&sql, "INSERT INTO `" GIT2_GC_STATE_TABLE_NAME
+		       "` (`id`, `phase`, `last_oid`) VALUES (1, %d, ",
+		       state->phase);
+	mysql_buf_put_oid(&sql, &state->last_oid);
+	git_buf_puts(&sql, ") ON DUPLICATE KEY UPDATE"
+		     " `phase` = VALUES(`phase`),"
+		     " `last_oid` = VALUES(`last_oid`)");
+
+	error = run_buf(state->backend->db, &sql);
+	git_buf_free(&sql);
+	return error;
+}
+
+static void put_oid_list(git_buf * sql, const git_oid * oids, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			git_buf_putc(sql, ',');
+		}
+		mysql_buf_put_oid(sql, &oids[i]);
+	}
+}
+
+static int add_mark(gc_state * state, const git_oid * oid, int visited)
+{
+	if (state->mark_count == state->mark_alloc) {
+		size_t alloc = state->mark_alloc ? state->mark_alloc * 2 : 1024;
+		gc_mark *marks = realloc(state->marks, alloc * sizeof(gc_mark));
+
+		if (marks == NULL) {
+			giterr_set_oom();
+			return GIT_ERROR;
+		}
+		state->marks = marks;
+		state->mark_alloc = alloc;
+	}
+
+	git_oid_cpy(&state->marks[state->mark_count].oid, oid);
+	state->marks[state->mark_count].visited = visited;
+	state->mark_count++;
+
+	return GIT_OK;
+}
+
+/* store the marks found so far, keeping the ones already there */
+static int flush_marks(gc_state * state)
+{
+	git_buf sql = GIT_BUF_INIT;
+	size_t i;
+	int error = GIT_OK;
+
+	for (i = 0; i < state->mark_count && error == GIT_OK; i++) {
+		git_buf_puts(&sql, sql.size ? "," :
+			     "INSERT IGNORE INTO `" GIT2_GC_MARKS_TABLE_NAME
+			     "` (`oid`, `visited`) VALUES ");
+		git_buf_putc(&sql, '(');
+		mysql_buf_put_oid(&sql, &state->marks[i].oid);
+		git_buf_printf(&sql, ",%d)", state->marks[i].visited);
+
+		if ((i + 1) % GC_ROWS_PER_INSERT == 0 ||
+		    i + 1 == state->mark_count) {
+			error = run_buf(state->backend->db, &sql);
+			git_buf_clear(&sql);
+		}
+	}
+
+	state->mark_count = 0;
+	git_buf_free(&sql);
+	return error;
+}
+
+static int seed_refs(gc_state * state, size_t * refs)
+{
+	git_reference_iterator *iter;
+	git_reference *ref;
+	int error;
+
+	*refs = 0;
+
+	if ((error = state->refdb->iterator(&iter, state->refdb, NULL)) < 0) {
+		return error;
+	}
+
+	// symbolic refs end at a direct ref, which is listed as well
+	while ((error = iter->next(&ref, iter)) == GIT_OK) {
+		if (git_reference_type(ref) == GIT_REF_OID) {
+			error = add_mark(state, git_reference_target(ref), 0);
+			(*refs)++;
+		}
+		git_reference_free(ref);
+
+		if (error < 0) {
+			break;
+		}
+	}
+	iter->free(iter);
+
+	if (error != GIT_ITEROVER) {
+		state->mark_count = 0;
+		return error;
+	}
+
+	return flush_marks(state);
+}
+
+static int mark_tree_entry(const git_oid * oid, unsigned int mode,
+			   void *payload)
+{
+	// submodule commits live in another repository
+	if (mode == 0160000) {
+		return 0;
+	}
+
+	return add_mark(payload, oid, mode != 040000);
+}
+
+static int
+mark_object(size_t i, const git_oid * oid, int error, void *data, size_t len,
+	    git_otype type, void *payload)
+{
+	gc_state *state = payload;
+	mysql_commit_info info;
+	git_oid target;
+	size_t p;
+
+	// missing history has nothing to keep alive
+	if (error == GIT_ENOTFOUND) {
+		return 0;
+	}
+	if (error < 0) {
+		state->error = error;
+		return -1;
+	}
+
+	switch (type) {
+	case GIT_OBJ_COMMIT:
+		mysql_commit_info_init(&info);
+		if ((error = mysql_parse_commit(&info, data, len)) == GIT_OK) {
+			error = add_mark(state, &info.tree, 0);
+		}
+		for (p = 0; p < info.parent_count && error == GIT_OK; p++) {
+			git_oid_fromraw(&target, (const unsigned char *)
+					info.parents.ptr + p * GIT_OID_RAWSZ);
+			error = add_mark(state, &target, 0);
+		}
+		mysql_commit_info_free(&info);
+		break;
+	case GIT_OBJ_TREE:
+		error = mysql_parse_tree(data, len, mark_tree_entry, state);
+		break;
+	case GIT_OBJ_TAG:
+		if ((error = mysql_parse_tag(&target, data, len)) == GIT_OK) {
+			error = add_mark(state, &target, 0);
+		}
+		break;
+	default:
+		break;
+	}
+
+	free(data);
+
+	if (error < 0) {
+		state->error = error;
+		return -1;
+	}
+
+	return 0;
+}
+
+static int select_oids(gc_batch * batch, MYSQL * db, git_buf * sql,
+		       size_t limit)
+{
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	batch->count = 0;
+
+	if (run_buf(db, sql) < 0 || (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	while ((row = mysql_fetch_row(res)) != NULL && batch->count < limit) {
+		if (mysql_fetch_lengths(res)[0] == GIT_OID_RAWSZ) {
+			git_oid_fromraw(&batch->oids[batch->count++],
+					(const unsigned char *)row[0]);
+		}
+	}
+
+	mysql_free_result(res);
+	return GIT_OK;
+}
+
+/* walk one batch of the frontier; `visited` is 0 once it is empty */
+static int mark_step(gc_state * state, gc_batch * batch, size_t * visited)
+{
+	MYSQL *db = state->backend->db;
+	mysql_pipeline *pipeline = NULL;
+	git_buf sql = GIT_BUF_INIT;
+	size_t i;
+	int error;
+
+	*visited = 0;
+
+	git_buf_printf(&sql, "SELECT `oid` FROM `" GIT2_GC_MARKS_TABLE_NAME
+		       "` WHERE `visited` = 0 LIMIT %llu",
+		       (unsigned long long)state->opts.batch_size);
+	error = select_oids(batch, db, &sql, state->opts.batch_size);
+	git_buf_clear(&sql);
+
+	if (error < 0 || batch->count == 0) {
+		goto done;
+	}
+
+	if ((error = mysql_pipeline_new(&pipeline, &state->backend->parent))
+	    < 0) {
+		goto done;
+	}
+
+	for (i = 0; i < batch->count && error == GIT_OK; i++) {
+		error = mysql_pipeline_read(pipeline, &batch->oids[i]);
+	}
+
+	state->error = GIT_OK;
+	if (error == GIT_OK &&
+	    mysql_pipeline_flush(pipeline, mark_object, state) < 0) {
+		error = state->error < 0 ? state->error : GIT_ERROR;
+	}
+
+	// the links go in before the batch is marked visited, so a run cut
+	// short here only walks the batch again
+	if (error == GIT_OK && (error = flush_marks(state)) == GIT_OK) {
+		git_buf_puts(&sql, "UPDATE `" GIT2_GC_MARKS_TABLE_NAME
+			     "` SET `visited` = 1 WHERE `oid` IN (");
+		put_oid_list(&sql, batch->oids, batch->count);
+		git_buf_putc(&sql, ')');
+		error = run_buf(db, &sql);
+	}
+
+	// objects read from the pool are this repository's as much as the
+	// ones it wrote there, and the pool sweep settles the ones it stops
+	// reaching
+	if (error == GIT_OK && state->backend->pool != NULL) {
+		git_buf_clear(&sql);
+		git_buf_printf(&sql, "INSERT IGNORE INTO `%s`.`"
+			       GIT2_POOL_REFS_TABLE_NAME "` (`oid`, `member`)"
+			       " SELECT `oid`, %u FROM `%s`.`"
+			       GIT2_ODB_TABLE_NAME "` WHERE `oid` IN (",
+			       state->backend->pool,
+			       state->backend->pool_member,
+			       state->backend->pool);
+		put_oid_list(&sql, batch->oids, batch->count);
+		git_buf_putc(&sql, ')');
+		error = run_buf(db, &sql);
+	}
+
+	if (error == GIT_OK) {
+		*visited = batch->count;
+	}
+
+ done:
+	state->mark_count = 0;
+	mysql_pipeline_free(pipeline);
+	git_buf_free(&sql);
+	return error;
+}
+
+static void throttle(gc_state * state, size_t rows,
+		     const struct timespec *start)
+{
+	struct timespec now, wait;
+	double due, spent;
+
+	if (state->opts.rows_per_second == 0 || rows == 0) {
+		return;
+	}
+
+	due = (double)rows / state->opts.rows_per_second;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	spent = (double)(now.tv_sec - start->tv_sec) +
+	    (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+
+	if (spent < due) {
+		wait.tv_sec = (time_t) (due - spent);
+		wait.tv_nsec = (long)((due - spent - wait.tv_sec) * 1e9);
+		nanosleep(&wait, NULL);
+	}
+}
+
+/* the table swept in the current phase and the filter on its rows */
+static void sweep_source(gc_state * state, git_buf * table, git_buf * filter)
+{
+	switch (state->phase) {
+	case GC_SWEEP_LOOSE:
+		git_buf_puts(table, "`" GIT2_ODB_TABLE_NAME "`");
+		break;
+	case GC_SWEEP_ARCHIVE:
+		git_buf_puts(table, "`" GIT2_ODB_ARCHIVE_TABLE_NAME "`");
+		break;
+	case GC_SWEEP_PACKED:
+		git_buf_puts(table, "`" GIT2_PACK_INDEX_TABLE_NAME "`");
+		break;
+	default:
+		git_buf_printf(table, "`%s`.`" GIT2_POOL_REFS_TABLE_NAME "`",
+			       state->backend->pool);
+		git_buf_printf(filter, " AND `member` = %u",
+			       state->backend->pool_member);
+	}
+}
+
+/* delete the rows of `batch` that were unreachable for the grace period */
+static int delete_expired(gc_state * state, gc_batch * batch,
+			  git_buf * table, git_buf * filter, size_t * deleted)
+{
+	static const char *sql_swept =
+	    "INSERT INTO `" GIT2_GC_SWEPT_TABLE_NAME "` (`id`, `token`)"
+	    " VALUES (1, LAST_INSERT_ID(UUID_SHORT()))"
+	    " ON DUPLICATE KEY UPDATE `token` = LAST_INSERT_ID(UUID_SHORT())";
+	MYSQL *db = state->backend->db;
+	git_buf sql = GIT_BUF_INIT, keep = GIT_BUF_INIT, where = GIT_BUF_INIT;
+	unsigned long long token = 0;
+	size_t i;
+	int error;
+
+	*deleted = 0;
+
+	// the unreachable rows of this batch become candidates, and keep
+	// the time they were first seen over later runs
+	git_buf_puts(&sql, "INSERT IGNORE INTO `" GIT2_GC_CANDIDATES_TABLE_NAME
+		     "` (`oid`) VALUES ");
+	for (i = 0; i < batch->count; i++) {
+		git_buf_puts(&sql, i ? ",(" : "(");
+		mysql_buf_put_oid(&sql, &batch->oids[i]);
+		git_buf_putc(&sql, ')');
+	}
+	if ((error = run_buf(db, &sql)) < 0) {
+		goto done;
+	}
+
+	if ((error = run_query(db, "START TRANSACTION", 17)) < 0) {
+		goto done;
+	}
+
+	// the rows stay locked until the delete commits, so an object found
+	// again in the meantime, see mysql_gc__touch(), is either kept or
+	// already gone when it is looked up
+	git_buf_clear(&sql);
+	git_buf_printf(&sql, "SELECT `oid` FROM `"
+		       GIT2_GC_CANDIDATES_TABLE_NAME "` WHERE `first_seen` <"
+		       " NOW() - INTERVAL %u SECOND AND `oid` IN (",
+		       state->opts.grace_period);
+	put_oid_list(&sql, batch->oids, batch->count);
+	git_buf_puts(&sql, ") FOR UPDATE");
+	if ((error = select_oids(batch, db, &sql, batch->count)) < 0) {
+		goto rollback;
+	}
+	if (batch->count == 0) {
+		error = run_query(db, "COMMIT", 6);
+		goto done;
+	}
+
+	// in packed mode a loose copy can go while the packed one stays
+	if ((state->phase == GC_SWEEP_LOOSE ||
+	     state->phase == GC_SWEEP_ARCHIVE) && state->backend->packed) {
+		git_buf_puts(&keep, " AND `oid` NOT IN (SELECT `oid` FROM `"
+			     GIT2_PACK_INDEX_TABLE_NAME "` WHERE `oid` IN (");
+		put_oid_list(&keep, batch->oids, batch->count);
+		git_buf_puts(&keep, "))");
+	}
+
+	// and the pool's copy stays for as long as this repository refers
+	// to it, the candidate is settled in the pool phase
+	if (state->phase != GC_SWEEP_POOL && state->backend->pool != NULL) {
+		git_buf_printf(&keep, " AND `oid` NOT IN (SELECT `oid` FROM `%s`.`"
+			       GIT2_POOL_REFS_TABLE_NAME "` WHERE `member` = %u"
+			       " AND `oid` IN (", state->backend->pool,
+			       state->backend->pool_member);
+		put_oid_list(&keep, batch->oids, batch->count);
+		git_buf_puts(&keep, "))");
+	}
+
+	git_buf_puts(&where, "`oid` IN (");
+	put_oid_list(&where, batch->oids, batch->count);
+	git_buf_putc(&where, ')');
+	git_buf_put(&where, filter->ptr, filter->size);
+
+	// pool objects are not counted here, only this repository's rows
+	if (state->backend->stats && state->phase != GC_SWEEP_POOL &&
+	    (error = mysql_stats__apply_rows(state->backend,
+					     git_buf_cstr(table), &where,
+					     -1)) < 0) {
+		goto rollback;
+	}
+
+	git_buf_clear(&sql);
+	git_buf_puts(&sql, "DELETE FROM ");
+	git_buf_put(&sql, table->ptr, table->size);
+	git_buf_puts(&sql, " WHERE ");
+	git_buf_put(&sql, where.ptr, where.size);
+	if ((error = run_buf(db, &sql)) < 0) {
+		goto rollback;
+	}
+	*deleted = (size_t) mysql_affected_rows(db);
+
+	if (state->backend->commit_graph) {
+		git_buf_clear(&sql);
+		git_buf_puts(&sql, "DELETE FROM `" GIT2_COMMIT_GRAPH_TABLE_NAME
+			     "` WHERE `oid` IN (");
+		put_oid_list(&sql, batch->oids, batch->count);
+		git_buf_putc(&sql, ')');
+		git_buf_put(&sql, keep.ptr, keep.size);
+		if ((error = run_buf(db, &sql)) < 0) {
+			goto rollback;
+		}
+	}
+
+	// and the rows of its path history, through the indexed commits
+	if (state->backend->path_history) {
+		git_buf_clear(&sql);
+		git_buf_puts(&sql, "DELETE h, c FROM `"
+			     GIT2_PATH_HISTORY_COMMITS_TABLE_NAME "` c LEFT JOIN `"
+			     GIT2_PATH_HISTORY_TABLE_NAME "` h"
+			     " ON h.`commit_oid` = c.`oid` WHERE c.`oid` IN (");
+		put_oid_list(&sql, batch->oids, batch->count);
+		git_buf_putc(&sql, ')');
+		git_buf_put(&sql, keep.ptr, keep.size);
+		if ((error = run_buf(db, &sql)) < 0) {
+			goto rollback;
+		}
+	}
+
+	git_buf_clear(&sql);
+	git_buf_puts(&sql, "DELETE FROM `" GIT2_GC_CANDIDATES_TABLE_NAME
+		     "` WHERE `oid` IN (");
+	put_oid_list(&sql, batch->oids, batch->count);
+	git_buf_putc(&sql, ')');
+	git_buf_put(&sql, keep.ptr, keep.size);
+	if ((error = run_buf(db, &sql)) < 0) {
+		goto rollback;
+	}
+
+	// every backend drops its local copies once it sees the new token
+	if (*deleted > 0) {
+		if ((error = run_query(db, sql_swept, strlen(sql_swept))) < 0) {
+			goto rollback;
+		}
+		token = mysql_insert_id(db);
+	}
+
+	if ((error = run_query(db, "COMMIT", 6)) == GIT_OK && token != 0) {
+		seen_sweep(state->backend, token);
+	}
+	goto done;
+
+ rollback:
+	*deleted = 0;
+	run_query(db, "ROLLBACK", 8);
+
+ done:
+	git_buf_free(&where);
+	git_buf_free(&keep);
+	git_buf_free(&sql);
+	return error;
+}
+
+/* sweep the next unmarked rows of the phase's table; `found` is 0 at its end */
+static int sweep_step(gc_state * state, gc_batch * batch, size_t * found)
+{
+	git_buf sql = GIT_BUF_INIT, table = GIT_BUF_INIT, filter = GIT_BUF_INIT;
+	struct timespec start;
+	size_t deleted;
+	int error;
+
+	*found = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	sweep_source(state, &table, &filter);
+
+	git_buf_puts(&sql, "SELECT t.`oid` FROM ");
+	git_buf_put(&sql, table.ptr, table.size);
+	git_buf_puts(&sql, " t LEFT JOIN `" GIT2_GC_MARKS_TABLE_NAME
+		     "` m ON m.`oid` = t.`oid` WHERE m.`oid` IS NULL");
+	git_buf_put(&sql, filter.ptr, filter.size);
+	git_buf_puts(&sql, " AND t.`oid` > ");
+	mysql_buf_put_oid(&sql, &state->last_oid);
+	git_buf_printf(&sql, " ORDER BY t.`oid` LIMIT %llu",
+		       (unsigned long long)state->opts.batch_size);
+
+	if (git_buf_oom(&table) || git_buf_oom(&filter)) {
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	error = select_oids(batch, state->backend->db, &sql,
+			    state->opts.batch_size);
+	if (error < 0 || batch->count == 0) {
+		goto done;
+	}
+
+	*found = batch->count;
+	git_oid_cpy(&state->last_oid, &batch->oids[batch->count - 1]);
+
+	if ((error = delete_expired(state, batch, &table, &filter,
+				    &deleted)) < 0) {
+		goto done;
+	}
+
+	state->stats->swept += *found;
+	state->stats->deleted += deleted;
+	throttle(state, deleted, &start);
+
+ done:
+	git_buf_free(&filter);
+	git_buf_free(&table);
+	git_buf_free(&sql);
+	return error;
+}
+
+/* the sweep after `phase`, for the tables this backend has */
+static int next_sweep(mysql_odb_backend * backend, int phase)
+{
+	switch (phase) {
+	case GC_REMARK:
+		return GC_SWEEP_LOOSE;
+	case GC_SWEEP_LOOSE:
+		if (backend->tier_sample_rate != 0) {
+			return GC_SWEEP_ARCHIVE;
+		}
+		/* fall through */
+	case GC_SWEEP_ARCHIVE:
+		if (backend->packed) {
+			return GC_SWEEP_PACKED;
+		}
+		/* fall through */
+	case GC_SWEEP_PACKED:
+		if (backend->pool != NULL) {
+			return GC_SWEEP_POOL;
+		}
+		/* fall through */
+	default:
+		return GC_IDLE;
+	}
+}
+
+static int sweep_enabled(mysql_odb_backend * backend, int phase)
+{
+	switch (phase) {
+	case GC_SWEEP_ARCHIVE:
+		return backend->tier_sample_rate != 0;
+	case GC_SWEEP_PACKED:
+		return backend->packed;
+	case GC_SWEEP_POOL:
+		return backend->pool != NULL;
+	default:
+		return 1;
+	}
+}
+
+/* candidates reachable again, say through a restored ref, are kept */
+static int drop_marked_candidates(MYSQL * db)
+{
+	static const char *sql =
+	    "DELETE c FROM `" GIT2_GC_CANDIDATES_TABLE_NAME "` c JOIN `"
+	    GIT2_GC_MARKS_TABLE_NAME "` m ON m.`oid` = c.`oid`";
+
+	return run_query(db, sql, strlen(sql));
+}
+
+static int step(gc_state * state, gc_batch * batch)
+{
+	static const char *sql_truncate =
+	    "TRUNCATE TABLE `" GIT2_GC_MARKS_TABLE_NAME "`";
+	MYSQL *db = state->backend->db;
+	size_t count = 0;
+	int error = GIT_OK;
+
+	switch (state->phase) {
+	case GC_IDLE:
+		if ((error = run_query(db, sql_truncate, strlen(sql_truncate)))
+		    < 0 || (error = seed_refs(state, &count)) < 0) {
+			break;
+		}
+
+		// without refs everything would look unreachable, which is
+		// far more likely a wrong database than an empty repository
+		if (count == 0) {
+			giterr_set_str(GITERR_REFERENCE,
+				       "No refs to collect garbage from");
+			error = GIT_ENOTFOUND;
+			break;
+		}
+
+		state->phase = GC_MARK;
+		break;
+
+	case GC_MARK:
+	case GC_REMARK:
+		if ((error = mark_step(state, batch, &count)) < 0) {
+			break;
+		}
+		state->stats->marked += count;
+		state->rows += count;
+
+		if (count > 0) {
+			break;
+		}
+
+		if (state->phase == GC_MARK) {
+			// refs moved while marking may point at old objects
+			if ((error = seed_refs(state, &count)) == GIT_OK) {
+				state->phase = GC_REMARK;
+			}
+		} else if ((error = drop_marked_candidates(db)) == GIT_OK) {
+			state->phase = next_sweep(state->backend, state->phase);
+			memset(&state->last_oid, 0, sizeof(git_oid));
+		}
+		break;
+
+	case GC_SWEEP_LOOSE:
+	case GC_SWEEP_PACKED:
+	case GC_SWEEP_POOL:
+	case GC_SWEEP_ARCHIVE:
+		// a run left there by a backend opened with other options
+		// skips the tables this one does not have
+		if (sweep_enabled(state->backend, state->phase) &&
+		    (error = sweep_step(state, batch, &count)) < 0) {
+			break;
+		}
+		state->rows += count;
+
+		if (count > 0) {
+			break;
+		}
+
+		memset(&state->last_oid, 0, sizeof(git_oid));
+		state->phase = next_sweep(state->backend, state->phase);
+		if (state->phase == GC_IDLE) {
+			state->stats->done = 1;
+		}
+		break;
+
+	default:
+		giterr_set_str(GITERR_ODB, "Unknown garbage collection state");
+		error = GIT_ERROR;
+	}
+
+	if (error == GIT_OK) {
+		error = write_state(state);
+	}
+
+	return error;
+}
+
+int
+mysql_gc(mysql_gc_stats * stats, git_odb_backend * odb,
+	 git_refdb_backend * refdb, const mysql_gc_opts * given_opts)
+{
+	mysql_gc_opts opts = MYSQL_GC_OPTS_INIT;
+	gc_state state;
+	gc_batch batch;
+	int error;
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&state, 0, sizeof(state));
+	memset(&batch, 0, sizeof(batch));
+
+	state.opts = opts;
+	if (given_opts != NULL) {
+		state.opts = *given_opts;
+	}
+	if (state.opts.batch_size == 0) {
+		state.opts.batch_size = 500;
+	}
+
+	state.backend = (mysql_odb_backend *) odb;
+	state.refdb = refdb;
+	state.stats = stats;
+
+	if ((batch.oids = malloc(state.opts.batch_size * sizeof(git_oid))) ==
+	    NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	// the connection stays locked for the whole run
+	if (mysql_odb__enter(state.backend) < 0) {
+		free(batch.oids);
+		return GIT_ERROR;
+	}
+
+	if ((error = init_tables(state.backend->db)) < 0 ||
+	    (error = lock_gc(state.backend->db)) < 0) {
+		mysql_odb__leave(state.backend);
+		free(batch.oids);
+		return error;
+	}
+
+	// this backend knows a run is under way without asking
+	state.backend->gc_active = 1;
+
+	if ((error = read_state(&state)) == GIT_OK) {
+		// a run ends after one whole collection, or at its row budget
+		do {
+			error = step(&state, &batch);
+		} while (error == GIT_OK && !stats->done &&
+			 (state.opts.max_rows == 0 ||
+			  state.rows < state.opts.max_rows));
+	}
+
+	unlock_gc(state.backend->db);
+	mysql_odb__leave(state.backend);
+	free(state.marks);
+	free(batch.oids);
+	return error;
+}
+
+/*
+ * Every backend creates the candidates table, so that any of them can
+ * take an object off it, see mysql_gc__touch(), and the tables that
+ * mysql_gc__check() reads.
+ */
+int mysql_gc__init(mysql_odb_backend * backend)
+{
+	return mysql_conn_init_table(backend->db, &backend->conn,
+				     GIT2_GC_CANDIDATES_TABLE_NAME,
+				     init_shared);
+}
+
+void mysql_gc__free(mysql_odb_backend * backend)
+{
+	if (backend->st_gc_touch) {
+		mysql_conn_stmt_close(backend->st_gc_touch, backend->epoch);
+	}
+
+	backend->st_gc_touch = NULL;
+}
+
+/* with the connection entered */
+static int touch(mysql_odb_backend * backend, const git_oid * oid)
+{
+	static const char *sql =
+	    "DELETE FROM `" GIT2_GC_CANDIDATES_TABLE_NAME "` WHERE `oid` = ?;";
+	MYSQL_BIND bind;
+	unsigned long oid_len = GIT_OID_RAWSZ;
+
+	if (backend->st_gc_touch == NULL) {
+		backend->st_gc_touch = mysql_stmt_init(backend->db);
+		if (backend->st_gc_touch == NULL ||
+		    mysql_stmt_prepare(backend->st_gc_touch, sql,
+				       strlen(sql)) != 0) {
+			giterr_set_str(GITERR_ODB, mysql_error(backend->db));
+			mysql_gc__free(backend);
+			return GIT_ERROR;
+		}
+	}
+
+	memset(&bind, 0, sizeof(bind));
+	bind.buffer = (void *)oid->id;
+	bind.buffer_length = GIT_OID_RAWSZ;
+	bind.length = &oid_len;
+	bind.buffer_type = MYSQL_TYPE_BLOB;
+
+	if (mysql_stmt_bind_param(backend->st_gc_touch, &bind) != 0 ||
+	    mysql_stmt_execute(backend->st_gc_touch) != 0) {
+		giterr_set_str(GITERR_ODB,
+			       mysql_stmt_error(backend->st_gc_touch));
+		mysql_stmt_reset(backend->st_gc_touch);
+		return GIT_ERROR;
+	}
+
+	mysql_stmt_reset(backend->st_gc_touch);
+	return GIT_OK;
+}
+
+/*
+ * An object found by exists, or written again, is about to be used, say by
+ * a push that did not send it because it is here: if a run found it
+ * unreachable, it waits out a whole grace period again from the next one.
+ * Callers skip this while mysql_gc__check() saw neither a run nor any
+ * candidate, since the next run marks whatever a new ref points at.
+ */
+int mysql_gc__touch(mysql_odb_backend * backend, const git_oid * oid)
+{
+	int error;
+
+	if ((error = mysql_odb__enter(backend)) == GIT_OK) {
+		error = touch(backend, oid);
+		mysql_odb__leave(backend);
+	}
+
+	return error;
+}
+
+/*
+ * Read the state every GC_RECHECK seconds: whether a run is under way or
+ * has left candidates, and the token of the last sweep. Until it can be
+ * read, objects are touched as if a run was under way.
+ */
+void mysql_gc__check(mysql_odb_backend * backend)
+{
+	static const char *sql =
+	    "SELECT (SELECT `phase` FROM `" GIT2_GC_STATE_TABLE_NAME
+	    "` WHERE `id` = 1), EXISTS (SELECT 1 FROM `"
+	    GIT2_GC_CANDIDATES_TABLE_NAME "`), (SELECT `token` FROM `"
+	    GIT2_GC_SWEPT_TABLE_NAME "` WHERE `id` = 1)";
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	time_t now = time(NULL);
+
+	if (now - backend->gc_checked < GC_RECHECK) {
+		return;
+	}
+
+	if (mysql_odb__enter(backend) < 0) {
+		giterr_clear();
+		return;
+	}
+
+	// another thread may have read it while this one waited
+	if (now - backend->gc_checked >= GC_RECHECK) {
+		backend->gc_checked = now;
+
+		if (run_query(backend->db, sql, strlen(sql)) < 0 ||
+		    (res = mysql_store_result(backend->db)) == NULL) {
+			giterr_clear();
+		} else {
+			if ((row = mysql_fetch_row(res)) != NULL) {
+				seen_sweep(backend, row[2] != NULL ?
+					   strtoull(row[2], NULL, 10) : 0);
+				backend->gc_active =
+				    (row[0] != NULL && atoi(row[0]) != GC_IDLE)
+				    || (row[1] != NULL && atoi(row[1]) != 0);
+			}
+			mysql_free_result(res);
+		}
+	}
+
+	mysql_odb__leave(backend);
+}
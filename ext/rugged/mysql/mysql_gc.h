@@ -0,0 +1,45 @@
+#ifndef MYSQL_GC_H
+#define MYSQL_GC_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+
+/*
+ * Incremental garbage collection of unreachable objects.
+ *
+ * Marking walks from the refs in small batches and keeps its frontier in
+ * `git2_gc_marks`, so it can stop at any point and resume in a later run.
+ * Once the refs have been walked twice, the second time for refs moved in
+ * the meantime, unmarked objects are swept in OID order. A swept object is
+ * recorded in `git2_gc_candidates` and only deleted once it has stayed
+ * unreachable for the grace period, which protects objects that are
+ * written before the ref pointing at them. A candidate that a backend finds
+ * with exists, or is asked to write again, is taken off the list, since a
+ * new ref may be about to point at it; backends only do that while a run
+ * is under way or candidates are waiting, see mysql_gc__check(). A sweep
+ * that deletes rows stores a new token in `git2_gc_swept`, and backends
+ * empty their local caches when they see it. Deletes are throttled to a
+ * number of rows per second. One run at a time holds a named lock.
+ */
+
+typedef struct {
+	size_t batch_size;	/* objects per mark or sweep step, default 500 */
+	unsigned int rows_per_second;	/* delete throttle, 0 for none */
+	unsigned int grace_period;	/* seconds, default two weeks */
+	size_t max_rows;	/* stop after this many rows, 0 to finish */
+} mysql_gc_opts;
+
+#define MYSQL_GC_OPTS_INIT { 500, 1000, 14 * 24 * 3600, 0 }
+
+typedef struct {
+	int done;		/* a whole collection finished in this run */
+	size_t marked;		/* objects walked */
+	size_t swept;		/* unreachable objects found */
+	size_t deleted;
+} mysql_gc_stats;
+
+int mysql_gc(mysql_gc_stats * stats, git_odb_backend * odb,
+	     git_refdb_backend * refdb, const mysql_gc_opts * opts);
+
+#endif
@@ -0,0 +1,259 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <git2.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_header_index.h"
+
+#define HEADER_SLOT_SIZE (GIT_OID_RAWSZ + 8)
+#define HEADER_TYPE_BITS 3
+#define HEADER_MIN_SLOTS (1 << 16)
+
+/* an empty slot has a zero meta word: every object type is non-zero */
+#define HEADER_META(len, type) \
+	(((uint64_t) (len) << HEADER_TYPE_BITS) | (uint64_t) (type))
+
+struct mysql_header_index {
+	pthread_rwlock_t lock;
+	unsigned char *slots;
+	size_t size;		/* power of two */
+	size_t count;
+};
+
+static size_t slot_hash(const unsigned char *oid)
+{
+	size_t hash;
+
+	memcpy(&hash, oid, sizeof(hash));
+	return hash;
+}
+
+static unsigned char *slot_at(unsigned char *slots, size_t i)
+{
+	return slots + i * HEADER_SLOT_SIZE;
+}
+
+static uint64_t slot_meta(const unsigned char *slot)
+{
+	uint64_t meta;
+
+	memcpy(&meta, slot + GIT_OID_RAWSZ, sizeof(meta));
+	return meta;
+}
+
+/* the slot holding `oid`, or the empty slot where it would go */
+static unsigned char *slot_find(unsigned char *slots, size_t size,
+				const unsigned char *oid)
+{
+	size_t i;
+
+	for (i = slot_hash(oid) & (size - 1);;
+	     i = (i + 1) & (size - 1)) {
+		unsigned char *slot = slot_at(slots, i);
+
+		if (slot_meta(slot) == 0 ||
+		    memcmp(slot, oid, GIT_OID_RAWSZ) == 0) {
+			return slot;
+		}
+	}
+}
+
+static int grow(mysql_header_index * index)
+{
+	size_t size = index->size * 2, i;
+	unsigned char *slots = calloc(size, HEADER_SLOT_SIZE);
+
+	if (slots == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	for (i = 0; i < index->size; i++) {
+		unsigned char *slot = slot_at(index->slots, i);
+
+		if (slot_meta(slot) != 0) {
+			memcpy(slot_find(slots, size, slot), slot,
+			       HEADER_SLOT_SIZE);
+		}
+	}
+
+	free(index->slots);
+	index->slots = slots;
+	index->size = size;
+	return GIT_OK;
+}
+
+/* called with the write lock held */
+static int insert_locked(mysql_header_index * index, const unsigned char *oid,
+			 uint64_t meta)
+{
+	unsigned char *slot;
+
+	// keep the load factor at or below 3/4
+	if ((index->count + 1) * 4 > index->size * 3 && grow(index) < 0) {
+		return GIT_ERROR;
+	}
+
+	slot = slot_find(index->slots, index->size, oid);
+	if (slot_meta(slot) == 0) {
+		index->count++;
+	}
+
+	memcpy(slot, oid, GIT_OID_RAWSZ);
+	memcpy(slot + GIT_OID_RAWSZ, &meta, sizeof(meta));
+
+	return GIT_OK;
+}
+
+int mysql_header_index_new(mysql_header_index ** out)
+{
+	mysql_header_index *index;
+
+	*out = NULL;
+
+	if ((index = calloc(1, sizeof(mysql_header_index))) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	index->size = HEADER_MIN_SLOTS;
+	if ((index->slots = calloc(index->size, HEADER_SLOT_SIZE)) == NULL) {
+		free(index);
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	pthread_rwlock_init(&index->lock, NULL);
+
+	*out = index;
+	return GIT_OK;
+}
+
+void mysql_header_index_free(mysql_header_index * index)
+{
+	if (index == NULL) {
+		return;
+	}
+
+	pthread_rwlock_destroy(&index->lock);
+	free(index->slots);
+	free(index);
+}
+
+int
+mysql_header_index_load(mysql_header_index * index, MYSQL * db,
+			const char *table)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error = GIT_OK;
+
+	git_buf_printf(&sql, "SELECT `oid`, `type`, `size` FROM `%s`", table);
+	if (git_buf_oom(&sql)) {
+		return GIT_ERROR;
+	}
+
+	// stream the rows, the result of a large table does not fit in memory
+	if (mysql_real_query(db, sql.ptr, sql.size) != 0 ||
+	    (res = mysql_use_result(db)) == NULL) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		git_buf_free(&sql);
+		return GIT_ERROR;
+	}
+	git_buf_free(&sql);
+
+	pthread_rwlock_wrlock(&index->lock);
+
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		unsigned long *lengths = mysql_fetch_lengths(res);
+		uint64_t type, len;
+
+		if (lengths[0] != GIT_OID_RAWSZ) {
+			continue;
+		}
+
+		type = strtoull(row[1], NULL, 10);
+		len = strtoull(row[2], NULL, 10);
+		if (type == 0 || type >= (1 << HEADER_TYPE_BITS)) {
+			continue;
+		}
+
+		if ((error = insert_locked(index, (const unsigned char *)row[0],
+					   HEADER_META(len, type))) < 0) {
+			break;
+		}
+	}
+
+	pthread_rwlock_unlock(&index->lock);
+
+	if (error == GIT_OK && mysql_errno(db) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		error = GIT_ERROR;
+	}
+
+	// drains the rest of the result if the scan stopped early
+	mysql_free_result(res);
+	return error;
+}
+
+int
+mysql_header_index_lookup(size_t * len_p, git_otype * type_p,
+			  mysql_header_index * index, const git_oid * oid)
+{
+	unsigned char *slot;
+	uint64_t meta;
+
+	pthread_rwlock_rdlock(&index->lock);
+	slot = slot_find(index->slots, index->size, oid->id);
+	meta = slot_meta(slot);
+	pthread_rwlock_unlock(&index->lock);
+
+	if (meta == 0) {
+		return GIT_ENOTFOUND;
+	}
+
+	*len_p = (size_t) (meta >> HEADER_TYPE_BITS);
+	*type_p = (git_otype) (meta & ((1 << HEADER_TYPE_BITS) - 1));
+	return GIT_OK;
+}
+
+int
+mysql_header_index_insert(mysql_header_index * index, const git_oid * oid,
+			  size_t len, git_otype type)
+{
+	int error;
+
+	if (type <= 0 || type >= (1 << HEADER_TYPE_BITS)) {
+		return GIT_OK;
+	}
+
+	pthread_rwlock_wrlock(&index->lock);
+	error = insert_locked(index, oid->id, HEADER_META(len, type));
+	pthread_rwlock_unlock(&index->lock);
+
+	return error;
+}
+
+size_t mysql_header_index_count(mysql_header_index * index)
+{
+	size_t count;
+
+	pthread_rwlock_rdlock(&index->lock);
+	count = index->count;
+	pthread_rwlock_unlock(&index->lock);
+
+	return count;
+}
+
+void mysql_header_index_clear(mysql_header_index * index)
+{
+	pthread_rwlock_wrlock(&index->lock);
+	memset(index->slots, 0, index->size * HEADER_SLOT_SIZE);
+	index->count = 0;
+	pthread_rwlock_unlock(&index->lock);
+}
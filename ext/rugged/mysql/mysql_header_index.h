@@ -0,0 +1,41 @@
+#ifndef MYSQL_HEADER_INDEX_H
+#define MYSQL_HEADER_INDEX_H
+
+#include <git2.h>
+#include <mysql.h>
+
+/*
+ * In-memory map from OID to object type and size.
+ *
+ * Entries are 28 bytes: the raw OID followed by the size and type packed
+ * into one 64-bit word. The table uses open addressing. It is filled by
+ * one streaming scan of the metadata columns and then kept up to date as
+ * objects are written. Objects are immutable, so a hit is right until gc
+ * deletes the object, and the index is cleared when a sweep is seen; a
+ * miss only means the object was written elsewhere after the scan.
+ */
+
+typedef struct mysql_header_index mysql_header_index;
+
+int mysql_header_index_new(mysql_header_index ** out);
+void mysql_header_index_free(mysql_header_index * index);
+
+/* scan `table`, which has `oid`, `type` and `size` columns */
+int mysql_header_index_load(mysql_header_index * index, MYSQL * db,
+			    const char *table);
+
+/* GIT_OK on a hit, GIT_ENOTFOUND on a miss */
+int mysql_header_index_lookup(size_t * len_p, git_otype * type_p,
+			      mysql_header_index * index,
+			      const git_oid * oid);
+
+int mysql_header_index_insert(mysql_header_index * index,
+			      const git_oid * oid, size_t len,
+			      git_otype type);
+
+size_t mysql_header_index_count(mysql_header_index * index);
+
+/* drop every entry, misses then go to MySQL */
+void mysql_header_index_clear(mysql_header_index * index);
+
+#endif
@@ -0,0 +1,723 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+#include <buffer.h>
+#include <hash.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_commit_graph.h"
+#include "mysql_path_history.h"
+#include "mysql_import.h"
+
+#define GIT2_IMPORT_TABLE_NAME "git2_import_checkpoints"
+#define IMPORT_MAX_WORKERS 64
+#define IMPORT_MAX_ROWS 10000
+/* room for the statement around the rows */
+#define IMPORT_PACKET_SLACK 1024
+
+typedef struct {
+	git_oid *oids;
+	size_t count;
+	size_t alloc;
+} import_oid_list;
+
+typedef struct {
+	git_oid oid;
+	git_odb_object *object;
+	git_buf row;		/* "(x'<oid>',<type>,<size>,'<data>')" */
+	int error;
+} import_object;
+
+typedef struct {
+	MYSQL *db;
+	import_object *objects;
+	size_t count;
+	unsigned int stride;
+	unsigned int first;
+} import_job;
+
+static int collect_oid(const git_oid * oid, void *payload)
+{
+	import_oid_list *list = payload;
+
+	if (list->count == list->alloc) {
+		size_t alloc = list->alloc ? list->alloc * 2 : 4096;
+		git_oid *oids = realloc(list->oids, alloc * sizeof(git_oid));
+
+		if (oids == NULL) {
+			giterr_set_oom();
+			return GIT_ERROR;
+		}
+		list->oids = oids;
+		list->alloc = alloc;
+	}
+
+	git_oid_cpy(&list->oids[list->count++], oid);
+	return GIT_OK;
+}
+
+static int oid_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp(a, b);
+}
+
+/*
+ * The format of COMPRESS(): nothing for an empty string, otherwise the
+ * length as four little-endian bytes and a zlib stream, plus a '.' if
+ * the stream ends with a space.
+ */
+static int compress_like_mysql(git_buf * out, const void *data, size_t len)
+{
+	uLongf zlen = compressBound(len);
+	unsigned char *dst;
+
+	git_buf_clear(out);
+
+	if (len == 0) {
+		return GIT_OK;
+	}
+
+	if (git_buf_grow(out, 4 + zlen + 2) < 0) {
+		return GIT_ERROR;
+	}
+
+	dst = (unsigned char *)out->ptr;
+	dst[0] = len & 0xff;
+	dst[1] = (len >> 8) & 0xff;
+	dst[2] = (len >> 16) & 0xff;
+	dst[3] = (len >> 24) & 0x3f;
+
+	if (compress2(dst + 4, &zlen, data, len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		giterr_set_str(GITERR_ZLIB, "Failed to compress object");
+		return GIT_ERROR;
+	}
+
+	out->size = 4 + zlen;
+	if (out->ptr[out->size - 1] == ' ') {
+		out->ptr[out->size++] = '.';
+	}
+	out->ptr[out->size] = '\0';
+
+	return GIT_OK;
+}
+
+static int build_row(MYSQL * db, import_object * object, git_buf * scratch)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+	size_t len;
+
+	if (compress_like_mysql(scratch, git_odb_object_data(object->object),
+				git_odb_object_size(object->object)) < 0) {
+		return GIT_ERROR;
+	}
+
+	git_oid_tostr(hex, sizeof(hex), &object->oid);
+	git_buf_printf(&object->row, "(x'%s',%d,%llu,'", hex,
+		       (int)git_odb_object_type(object->object),
+		       (unsigned long long)git_odb_object_size(object->object));
+
+	if (git_buf_grow(&object->row, object->row.size + scratch->size * 2 + 3)
+	    < 0) {
+		return GIT_ERROR;
+	}
+
+	// only reads the connection's character set
+	len = mysql_real_escape_string(db, object->row.ptr + object->row.size,
+				       scratch->ptr, scratch->size);
+	object->row.size += len;
+	git_buf_puts(&object->row, "')");
+
+	return git_buf_oom(&object->row) ? GIT_ERROR : GIT_OK;
+}
+
+static void *import_worker(void *payload)
+{
+	import_job *job = payload;
+	git_buf scratch = GIT_BUF_INIT;
+	size_t i;
+
+	for (i = job->first; i < job->count; i += job->stride) {
+		job->objects[i].error = build_row(job->db, &job->objects[i],
+						  &scratch);
+	}
+
+	git_buf_free(&scratch);
+	return NULL;
+}
+
+static int compress_batch(MYSQL * db, import_object * objects, size_t count,
+			  unsigned int workers)
+{
+	pthread_t threads[IMPORT_MAX_WORKERS];
+	import_job jobs[IMPORT_MAX_WORKERS];
+	unsigned int i, started = 0;
+
+	for (i = 0; i < workers; i++) {
+		jobs[i].db = db;
+		jobs[i].objects = objects;
+		jobs[i].count = count;
+		jobs[i].stride = workers;
+		jobs[i].first = i;
+
+		if (pthread_create(&threads[started], NULL, import_worker,
+				   &jobs[i]) == 0) {
+			started++;
+		} else {
+			// do this share on the calling thread
+			import_worker(&jobs[i]);
+		}
+	}
+
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (objects[i].error < 0) {
+			return GIT_ERROR;
+		}
+	}
+
+	return GIT_OK;
+}
+
+static int run_query(MYSQL * db, const char *sql, size_t len)
+{
+	if (mysql_real_query(db, sql, len) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int init_checkpoints(MYSQL * db)
+{
+	static const char *sql_create =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_IMPORT_TABLE_NAME "` ("
+	    "  `source` binary(20) NOT NULL,"
+	    "  `path` text NOT NULL,"
+	    "  `fingerprint` binary(20) NOT NULL DEFAULT '',"
+	    "  `last_oid` binary(20) NOT NULL,"
+	    "  `objects` bigint(20) unsigned NOT NULL,"
+	    "  `updated_at` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP"
+	    "    ON UPDATE CURRENT_TIMESTAMP,"
+	    "  PRIMARY KEY (`source`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	static const char *sql_check =
+	    "SHOW COLUMNS FROM `" GIT2_IMPORT_TABLE_NAME "` LIKE 'fingerprint'";
+
+	// checkpoints from before have no fingerprint and are never resumed
+	static const char *sql_add =
+	    "ALTER TABLE `" GIT2_IMPORT_TABLE_NAME "` ADD COLUMN"
+	    " `fingerprint` binary(20) NOT NULL DEFAULT '' AFTER `path`";
+
+	MYSQL_RES *res;
+	my_ulonglong num_rows;
+
+	if (run_query(db, sql_create, strlen(sql_create)) < 0 ||
+	    run_query(db, sql_check, strlen(sql_check)) < 0) {
+		return GIT_ERROR;
+	}
+
+	if ((res = mysql_store_result(db)) == NULL) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+	num_rows = mysql_num_rows(res);
+	mysql_free_result(res);
+
+	return num_rows > 0 ? GIT_OK : run_query(db, sql_add, strlen(sql_add));
+}
+
+static int name_cmp(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * A hash of the source's refs and what they point at. A checkpoint is only
+ * resumed while it is the same, objects pushed in between may sort before
+ * the checkpoint and would be skipped.
+ */
+static int ref_fingerprint(git_oid * out, git_repository * repo)
+{
+	git_strarray names;
+	git_buf buf = GIT_BUF_INIT;
+	size_t i;
+	int error;
+
+	if ((error = git_reference_list(&names, repo)) < 0) {
+		return error;
+	}
+
+	qsort(names.strings, names.count, sizeof(char *), name_cmp);
+
+	for (i = 0; i < names.count; i++) {
+		git_oid oid;
+		char hex[GIT_OID_HEXSZ + 1];
+
+		// a dangling symbolic ref has no tip
+		if (git_reference_name_to_id(&oid, repo, names.strings[i]) < 0) {
+			giterr_clear();
+			continue;
+		}
+
+		git_oid_tostr(hex, sizeof(hex), &oid);
+		git_buf_printf(&buf, "%s %s\n", hex, names.strings[i]);
+	}
+
+	if (git_buf_oom(&buf)) {
+		error = GIT_ERROR;
+	} else {
+		error = git_hash_buf(out, buf.ptr, buf.size);
+	}
+
+	git_buf_free(&buf);
+	git_strarray_free(&names);
+	return error;
+}
+
+static int delete_checkpoint(MYSQL * db, const git_oid * source)
+{
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	git_buf_puts(&sql, "DELETE FROM `" GIT2_IMPORT_TABLE_NAME
+		     "` WHERE `source` = ");
+	mysql_buf_put_oid(&sql, source);
+
+	error = git_buf_oom(&sql) ? GIT_ERROR :
+	    run_query(db, sql.ptr, sql.size);
+
+	git_buf_free(&sql);
+	return error;
+}
+
+/*
+ * last_oid is left zeroed when there is no checkpoint. One taken while the
+ * source had other refs is dropped, and the import starts over.
+ */
+static int read_checkpoint(git_oid * last_oid, MYSQL * db,
+			   const git_oid * source, const git_oid * fingerprint)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	unsigned long *lengths;
+	int stale = 0;
+
+	memset(last_oid, 0, sizeof(*last_oid));
+
+	git_buf_puts(&sql, "SELECT `last_oid`, `fingerprint` FROM `"
+		     GIT2_IMPORT_TABLE_NAME "` WHERE `source` = ");
+	mysql_buf_put_oid(&sql, source);
+
+	if (git_buf_oom(&sql) || run_query(db, sql.ptr, sql.size) < 0) {
+		git_buf_free(&sql);
+		return GIT_ERROR;
+	}
+	git_buf_free(&sql);
+
+	if ((res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	if ((row = mysql_fetch_row(res)) != NULL) {
+		lengths = mysql_fetch_lengths(res);
+
+		if (lengths[0] == GIT_OID_RAWSZ &&
+		    lengths[1] == GIT_OID_RAWSZ &&
+		    memcmp(row[1], fingerprint->id, GIT_OID_RAWSZ) == 0) {
+			git_oid_fromraw(last_oid, (const unsigned char *)row[0]);
+		} else {
+			stale = 1;
+		}
+	}
+
+	mysql_free_result(res);
+	return stale ? delete_checkpoint(db, source) : GIT_OK;
+}
+
+static int write_checkpoint(MYSQL * db, const git_oid * source,
+			    const char *path, const git_oid * fingerprint,
+			    const git_oid * last_oid, size_t objects)
+{
+	git_buf sql = GIT_BUF_INIT;
+	char *escaped;
+	size_t path_len = strlen(path);
+	int error;
+
+	if ((escaped = malloc(path_len * 2 + 1)) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+	mysql_real_escape_string(db, escaped, path, path_len);
+
+	git_buf_puts(&sql, "INSERT INTO `" GIT2_IMPORT_TABLE_NAME
+		     "` (`source`, `path`, `fingerprint`, `last_oid`,"
+		     " `objects`) VALUES (");
+	mysql_buf_put_oid(&sql, source);
+	git_buf_printf(&sql, ", '%s', ", escaped);
+	mysql_buf_put_oid(&sql, fingerprint);
+	git_buf_puts(&sql, ", ");
+	mysql_buf_put_oid(&sql, last_oid);
+	git_buf_printf(&sql, ", %llu) ON DUPLICATE KEY UPDATE"
+		       " `last_oid` = VALUES(`last_oid`),"
+		       " `objects` = `objects` + VALUES(`objects`)",
+		       (unsigned long long)objects);
+
+	error = git_buf_oom(&sql) ? GIT_ERROR :
+	    run_query(db, sql.ptr, sql.size);
+
+	free(escaped);
+	git_buf_free(&sql);
+	return error;
+}
+
+static size_t max_statement_size(MYSQL * db)
+{
+	static const char *sql = "SELECT @@max_allowed_packet";
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	size_t size = 1024 * 1024;
+
+	if (mysql_real_query(db, sql, strlen(sql)) == 0 &&
+	    (res = mysql_store_result(db)) != NULL) {
+		if ((row = mysql_fetch_row(res)) != NULL && row[0] != NULL) {
+			size = (size_t) strtoull(row[0], NULL, 10);
+		}
+		mysql_free_result(res);
+	}
+
+	return size > IMPORT_PACKET_SLACK * 2 ? size - IMPORT_PACKET_SLACK :
+	    size;
+}
+
+/* insert the compressed rows, as few statements as the packet size allows */
+static int insert_batch(mysql_odb_backend * backend, import_object * objects,
+			size_t count, size_t max_statement)
+{
+	static const char *prefix =
+	    "INSERT IGNORE INTO `" GIT2_ODB_TABLE_NAME
+	    "` (`oid`, `type`, `size`, `data`) VALUES ";
+	git_buf sql = GIT_BUF_INIT;
+	size_t i;
+	int error = GIT_OK;
+
+	for (i = 0; i < count && error == GIT_OK; i++) {
+		import_object *object = &objects[i];
+
+		// too large for any statement, let the server compress it;
+		// the counters take it with the rest of the batch
+		if (strlen(prefix) + object->row.size > max_statement) {
+			int stats = backend->stats;
+
+			backend->stats = 0;
+			error = backend->parent.write(&backend->parent,
+						      &object->oid,
+						      git_odb_object_data
+						      (object->object),
+						      git_odb_object_size
+						      (object->object),
+						      git_odb_object_type
+						      (object->object));
+			backend->stats = stats;
+			continue;
+		}
+
+		if (sql.size > 0 &&
+		    sql.size + 1 + object->row.size > max_statement) {
+			error = run_query(backend->db, sql.ptr, sql.size);
+			git_buf_clear(&sql);
+		}
+
+		git_buf_puts(&sql, sql.size ? "," : prefix);
+		git_buf_put(&sql, object->row.ptr, object->row.size);
+		if (git_buf_oom(&sql)) {
+			error = GIT_ERROR;
+		}
+	}
+
+	if (error == GIT_OK && sql.size > 0) {
+		error = run_query(backend->db, sql.ptr, sql.size);
+	}
+
+	git_buf_free(&sql);
+	return error;
+}
+
+/*
+ * Rows of the batch that were there before the insert are taken away first
+ * and added back after it, so the counters only grow by the new ones.
+ */
+static int count_batch(mysql_odb_backend * backend, import_object * objects,
+		       size_t count, int sign)
+{
+	git_buf where = GIT_BUF_INIT;
+	size_t i;
+	int error;
+
+	if (!backend->stats || count == 0) {
+		return GIT_OK;
+	}
+
+	git_buf_puts(&where, "`oid` IN (");
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			git_buf_putc(&where, ',');
+		}
+		mysql_buf_put_oid(&where, &objects[i].oid);
+	}
+	git_buf_putc(&where, ')');
+
+	error = mysql_stats__apply_rows(backend, "`" GIT2_ODB_TABLE_NAME "`",
+					&where, sign);
+	git_buf_free(&where);
+	return error;
+}
+
+static void free_batch(import_object * objects, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		git_odb_object_free(objects[i].object);
+		git_buf_free(&objects[i].row);
+	}
+}
+
+static int import_refs(size_t * imported, git_repository * repo,
+		       git_refdb_backend * refdb)
+{
+	git_strarray names;
+	size_t i;
+	int error;
+
+	*imported = 0;
+
+	if ((error = git_reference_list(&names, repo)) < 0) {
+		return error;
+	}
+
+	for (i = 0; i < names.count && error == GIT_OK; i++) {
+		git_reference *ref;
+
+		if ((error = git_reference_lookup(&ref, repo,
+						  names.strings[i])) < 0) {
+			break;
+		}
+
+		error = refdb->write(refdb, ref, 1, NULL, NULL);
+		git_reference_free(ref);
+		(*imported)++;
+	}
+
+	git_strarray_free(&names);
+	return error;
+}
+
+int
+mysql_import(mysql_import_stats * stats, git_odb_backend * odb,
+	     git_refdb_backend * refdb, const char *path,
+	     const mysql_import_opts * given_opts)
+{
+	mysql_import_opts opts = MYSQL_IMPORT_OPTS_INIT;
+	mysql_odb_backend *backend = (mysql_odb_backend *) odb;
+	import_oid_list list;
+	import_object *batch = NULL;
+	git_repository *repo = NULL;
+	git_odb *source = NULL;
+	git_oid source_id, fingerprint, last_oid;
+	size_t next, max_statement;
+	int entered, error;
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&list, 0, sizeof(list));
+
+	// held for the whole import, but for the progress callback
+	if (mysql_odb__enter(backend) < 0) {
+		return GIT_ERROR;
+	}
+	entered = 1;
+
+	if (given_opts != NULL) {
+		opts = *given_opts;
+	}
+	if (opts.workers == 0) {
+		opts.workers = 1;
+	} else if (opts.workers > IMPORT_MAX_WORKERS) {
+		opts.workers = IMPORT_MAX_WORKERS;
+	}
+	if (opts.batch_size == 0) {
+		opts.batch_size = 8 * 1024 * 1024;
+	}
+
+	if ((error = git_repository_open(&repo, path)) < 0 ||
+	    (error = git_repository_odb(&source, repo)) < 0) {
+		goto done;
+	}
+
+	// checkpoints are keyed by the repository's resolved location
+	path = git_repository_path(repo);
+	if ((error = git_hash_buf(&source_id, path, strlen(path))) < 0 ||
+	    (error = ref_fingerprint(&fingerprint, repo)) < 0 ||
+	    (error = init_checkpoints(backend->db)) < 0 ||
+	    (error = read_checkpoint(&last_oid, backend->db, &source_id,
+				     &fingerprint)) < 0) {
+		goto done;
+	}
+
+	if ((error = git_odb_foreach(source, collect_oid, &list)) < 0) {
+		goto done;
+	}
+
+	// OID order makes "everything up to last_oid" a valid checkpoint;
+	// packs may also repeat loose objects
+	qsort(list.oids, list.count, sizeof(git_oid), oid_cmp);
+	stats->total = list.count;
+
+	for (next = 0; next < list.count; next++) {
+		if (git_oid_iszero(&last_oid) ||
+		    git_oid_cmp(&list.oids[next], &last_oid) > 0) {
+			break;
+		}
+	}
+	stats->skipped = next;
+
+	max_statement = max_statement_size(backend->db);
+
+	if ((batch = calloc(IMPORT_MAX_ROWS, sizeof(import_object))) == NULL) {
+		giterr_set_oom();
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	while (next < list.count) {
+		size_t count = 0, bytes = 0;
+
+		for (; next < list.count && count < IMPORT_MAX_ROWS &&
+		     bytes < opts.batch_size; next++) {
+			import_object *object = &batch[count];
+
+			if (count > 0 &&
+			    git_oid_equal(&list.oids[next], &batch[count - 1].oid)) {
+				stats->skipped++;
+				continue;
+			}
+
+			git_oid_cpy(&object->oid, &list.oids[next]);
+			git_buf_init(&object->row, 0);
+			if ((error = git_odb_read(&object->object, source,
+						  &object->oid)) < 0) {
+				break;
+			}
+
+			bytes += git_odb_object_size(object->object);
+			count++;
+		}
+
+		if (error == GIT_OK) {
+			error = compress_batch(backend->db, batch, count,
+					       opts.workers);
+		}
+
+		if (error == GIT_OK &&
+		    (error = run_query(backend->db, "START TRANSACTION", 17))
+		    == GIT_OK) {
+			if ((error = count_batch(backend, batch, count, -1)) < 0
+			    || (error = insert_batch(backend, batch, count,
+						     max_statement)) < 0
+			    || (error = count_batch(backend, batch, count,
+						    1)) < 0
+			    || (error = write_checkpoint(backend->db,
+							 &source_id, path,
+							 &fingerprint,
+							 &batch[count - 1].oid,
+							 count)) < 0) {
+				run_query(backend->db, "ROLLBACK", 8);
+			} else {
+				error = run_query(backend->db, "COMMIT", 6);
+			}
+		}
+
+		if (error == GIT_OK && backend->header_index != NULL) {
+			size_t i;
+
+			for (i = 0; i < count; i++) {
+				mysql_header_index_insert(backend->header_index,
+							  &batch[i].oid,
+							  git_odb_object_size
+							  (batch[i].object),
+							  git_odb_object_type
+							  (batch[i].object));
+			}
+		}
+
+		free_batch(batch, count);
+		memset(batch, 0, count * sizeof(import_object));
+
+		if (error < 0) {
+			goto done;
+		}
+
+		stats->objects += count;
+		if (opts.progress != NULL) {
+			int stop;
+
+			mysql_odb__leave(backend);
+			stop = opts.progress(stats, opts.progress_payload);
+			if (mysql_odb__enter(backend) < 0) {
+				entered = 0;
+				error = GIT_ERROR;
+				goto done;
+			}
+			if (stop != 0) {
+				error = GIT_EUSER;
+				goto done;
+			}
+		}
+	}
+
+	// refs go last, so they never point at objects not imported yet
+	if (refdb != NULL &&
+	    (error = import_refs(&stats->refs, repo, refdb)) < 0) {
+		goto done;
+	}
+
+	// a finished import is not resumed, running it again copies again
+	if ((error = delete_checkpoint(backend->db, &source_id)) < 0) {
+		goto done;
+	}
+
+	if (backend->commit_graph) {
+		size_t added;
+
+		error = mysql_commit_graph_backfill(&added, odb, 0);
+	}
+
+	if (error == GIT_OK && backend->path_history) {
+		size_t added;
+
+		error = mysql_path_history_backfill(&added, odb, 0);
+	}
+
+ done:
+	if (entered) {
+		mysql_odb__leave(backend);
+	}
+	free(batch);
+	free(list.oids);
+	git_odb_free(source);
+	git_repository_free(repo);
+	return error;
+}
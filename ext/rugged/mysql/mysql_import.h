@@ -0,0 +1,42 @@
+#ifndef MYSQL_IMPORT_H
+#define MYSQL_IMPORT_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+
+/*
+ * Bulk import of an on-disk repository.
+ *
+ * Objects are read from the repository's packs and loose files in OID
+ * order, compressed by worker threads in the format of MySQL's COMPRESS(),
+ * and loaded with multi-row INSERTs. After every batch the last imported
+ * OID is recorded in `git2_import_checkpoints`, so an interrupted import
+ * picks up where it stopped, as long as the source's refs are unchanged.
+ * References are copied last, and then the checkpoint is removed.
+ */
+
+typedef struct {
+	size_t objects;		/* imported by this run */
+	size_t skipped;		/* imported by an earlier run */
+	size_t total;
+	size_t refs;
+} mysql_import_stats;
+
+typedef int (*mysql_import_progress_cb) (const mysql_import_stats * stats,
+					 void *payload);
+
+typedef struct {
+	unsigned int workers;	/* compression threads, default 4 */
+	size_t batch_size;	/* bytes of object data per batch, default 8MB */
+	mysql_import_progress_cb progress;
+	void *progress_payload;
+} mysql_import_opts;
+
+#define MYSQL_IMPORT_OPTS_INIT { 4, 8 * 1024 * 1024, NULL, NULL }
+
+int mysql_import(mysql_import_stats * stats, git_odb_backend * odb,
+		 git_refdb_backend * refdb, const char *path,
+		 const mysql_import_opts * opts);
+
+#endif
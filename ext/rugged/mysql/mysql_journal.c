@@ -0,0 +1,1258 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_conn.h"
+#include "mysql_journal.h"
+
+#define JOURNAL_MAGIC 0x4a4d5247	/* "GRMJ" */
+#define JOURNAL_FILE_MAGIC 0x464d5247	/* "GRMF" */
+#define JOURNAL_PREFIX "journal-"
+#define JOURNAL_QUARANTINE_PREFIX "quarantine-"
+#define JOURNAL_MIN_BUCKETS 1024
+#define JOURNAL_BATCH_OBJECTS 512
+#define JOURNAL_BATCH_BYTES (16 * 1024 * 1024)
+#define JOURNAL_RETRY_SECONDS 1
+#define JOURNAL_CREATE_ATTEMPTS 8
+
+/* at the start of every file, followed by the database's identity */
+typedef struct {
+	uint32_t magic;
+	uint32_t identity_len;
+} journal_header;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t crc;		/* of the rest of the header and the data */
+	unsigned char oid[GIT_OID_RAWSZ];
+	uint32_t type;
+	uint64_t len;
+} journal_record;
+
+typedef struct journal_file {
+	int fd;
+	char *path;
+	uint64_t start;		/* of the first record */
+	uint64_t size;		/* end of the last record */
+	size_t pending;		/* records not stored yet, or set aside */
+	int adopted;		/* left behind by another process */
+	int quarantine;		/* never replayed, only read */
+	struct journal_file *next;
+} journal_file;
+
+typedef struct journal_entry {
+	git_oid oid;
+	git_otype type;
+	size_t len;
+	uint64_t offset;	/* of the data in `file` */
+	journal_file *file;
+	struct journal_entry *bucket_next;
+	struct journal_entry *queue_next;
+} journal_entry;
+
+struct mysql_journal {
+	char *dir;
+	char *identity;		/* of the database, in every file */
+	size_t max_len;		/* of an object the database takes */
+	unsigned int refcount;	/* under journals_lock */
+	unsigned int generation;	/* mysql_conn_generation() of the thread */
+	struct mysql_journal *next;
+
+	mysql_journal_store_cb store;
+	void (*free_payload) (void *payload);
+	void *payload;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* something was queued, or shutdown */
+	pthread_cond_t stored;	/* a batch was stored or failed */
+	int shutdown;
+	unsigned int failures;
+	char *error;		/* of the last failed batch */
+	size_t quarantined;	/* entries read from quarantine- files */
+
+	journal_file *own;
+	journal_file *files;	/* own and adopted */
+
+	journal_entry **buckets;
+	size_t bucket_count;	/* a power of two */
+	size_t entries;
+	journal_entry *queue_head;	/* oldest first */
+	journal_entry *queue_tail;
+};
+
+static mysql_journal *journals = NULL;
+static pthread_mutex_t journals_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static void journal_atfork_child(void)
+{
+	// the journals themselves stay with the parent, see mysql_journal_open()
+	pthread_mutex_init(&journals_lock, NULL);
+}
+
+static void journal_register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, journal_atfork_child);
+}
+
+static size_t bucket_of(const git_oid * oid, size_t bucket_count)
+{
+	size_t hash;
+
+	memcpy(&hash, oid->id, sizeof(hash));
+	return hash & (bucket_count - 1);
+}
+
+static journal_entry *entry_find(mysql_journal * j, const git_oid * oid)
+{
+	journal_entry *entry;
+
+	for (entry = j->buckets[bucket_of(oid, j->bucket_count)];
+	     entry != NULL; entry = entry->bucket_next) {
+		if (git_oid_equal(&entry->oid, oid)) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+/* a failure only makes the chains longer */
+static void grow_buckets(mysql_journal * j)
+{
+	size_t count = j->bucket_count * 2, i;
+	journal_entry **buckets, *entry, *next;
+
+	if ((buckets = calloc(count, sizeof(journal_entry *))) == NULL) {
+		return;
+	}
+
+	for (i = 0; i < j->bucket_count; i++) {
+		for (entry = j->buckets[i]; entry != NULL; entry = next) {
+			size_t b = bucket_of(&entry->oid, count);
+
+			next = entry->bucket_next;
+			entry->bucket_next = buckets[b];
+			buckets[b] = entry;
+		}
+	}
+
+	free(j->buckets);
+	j->buckets = buckets;
+	j->bucket_count = count;
+}
+
+/* called with the lock held; an entry set aside is not queued */
+static int
+entry_add(mysql_journal * j, journal_file * file,
+	  const journal_record * record, uint64_t offset, int queued)
+{
+	journal_entry *entry;
+	size_t b;
+
+	if (j->entries >= j->bucket_count * 2) {
+		grow_buckets(j);
+	}
+
+	if ((entry = calloc(1, sizeof(journal_entry))) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	git_oid_fromraw(&entry->oid, record->oid);
+	entry->type = (git_otype) record->type;
+	entry->len = (size_t) record->len;
+	entry->offset = offset;
+	entry->file = file;
+
+	b = bucket_of(&entry->oid, j->bucket_count);
+	entry->bucket_next = j->buckets[b];
+	j->buckets[b] = entry;
+	j->entries++;
+	file->pending++;
+
+	if (!queued) {
+		j->quarantined++;
+		return GIT_OK;
+	}
+
+	if (j->queue_tail != NULL) {
+		j->queue_tail->queue_next = entry;
+	} else {
+		j->queue_head = entry;
+	}
+	j->queue_tail = entry;
+
+	return GIT_OK;
+}
+
+static void entry_unlink(mysql_journal * j, journal_entry * entry)
+{
+	journal_entry **link;
+
+	for (link = &j->buckets[bucket_of(&entry->oid, j->bucket_count)];
+	     *link != NULL; link = &(*link)->bucket_next) {
+		if (*link == entry) {
+			*link = entry->bucket_next;
+			j->entries--;
+			return;
+		}
+	}
+}
+
+static uint32_t record_crc(const journal_record * record, const void *data)
+{
+	const unsigned char *p = data;
+	uint64_t left = record->len;
+	uLong crc;
+
+	crc = crc32(0L, record->oid,
+		    sizeof(journal_record) - offsetof(journal_record, oid));
+
+	// crc32() takes an uInt
+	while (left > 0) {
+		uInt n = left > (1U << 30) ? (1U << 30) : (uInt) left;
+
+		crc = crc32(crc, p, n);
+		p += n;
+		left -= n;
+	}
+
+	return (uint32_t) crc;
+}
+
+static int pwrite_all(int fd, const void *buf, size_t len, uint64_t offset)
+{
+	const char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = pwrite(fd, p, len, (off_t) offset);
+
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		p += n;
+		len -= (size_t) n;
+		offset += (uint64_t) n;
+	}
+
+	return 0;
+}
+
+static int pread_all(int fd, void *buf, size_t len, uint64_t offset)
+{
+	char *p = buf;
+
+	while (len > 0) {
+		ssize_t n = pread(fd, p, len, (off_t) offset);
+
+		if (n < 0 && errno == EINTR) {
+			continue;
+		}
+		if (n <= 0) {
+			return -1;
+		}
+
+		p += n;
+		len -= (size_t) n;
+		offset += (uint64_t) n;
+	}
+
+	return 0;
+}
+
+static int lock_file(int fd)
+{
+	struct flock fl;
+
+	memset(&fl, 0, sizeof(fl));
+	fl.l_type = F_WRLCK;
+	fl.l_whence = SEEK_SET;
+
+	return fcntl(fd, F_SETLK, &fl);
+}
+
+static void file_free(journal_file * file)
+{
+	if (file->fd >= 0) {
+		close(file->fd);
+	}
+	free(file->path);
+	free(file);
+}
+
+/* make the creation or removal of a file in the directory durable */
+static int sync_dir(mysql_journal * j)
+{
+	int fd, error;
+
+	if ((fd = open(j->dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) < 0) {
+		return -1;
+	}
+
+	while ((error = fsync(fd)) < 0 && errno == EINTR) ;
+
+	close(fd);
+	return error;
+}
+
+static int file_listed(mysql_journal * j, const char *path)
+{
+	journal_file *file;
+
+	for (file = j->files; file != NULL; file = file->next) {
+		if (strcmp(file->path, path) == 0) {
+			return 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Whether a journal of this process has `path` open, another database's
+ * maybe. Called with journals_lock held.
+ */
+static int file_known(mysql_journal * j, const char *path)
+{
+	mysql_journal *other;
+	int known = file_listed(j, path);
+
+	// a journal inherited through fork() has no lock on its files here
+	for (other = journals; other != NULL && !known; other = other->next) {
+		if (other->generation != mysql_conn_generation()) {
+			continue;
+		}
+
+		pthread_mutex_lock(&other->lock);
+		known = file_listed(other, path);
+		pthread_mutex_unlock(&other->lock);
+	}
+
+	return known;
+}
+
+static int write_header(mysql_journal * j, int fd, uint64_t * start)
+{
+	journal_header header;
+	size_t len = strlen(j->identity);
+
+	header.magic = JOURNAL_FILE_MAGIC;
+	header.identity_len = (uint32_t) len;
+
+	if (pwrite_all(fd, &header, sizeof(header), 0) < 0 ||
+	    pwrite_all(fd, j->identity, len, sizeof(header)) < 0) {
+		return -1;
+	}
+
+	*start = sizeof(header) + len;
+	return 0;
+}
+
+/* where the records start in a file of this journal's database, else 0 */
+static uint64_t read_header(mysql_journal * j, int fd)
+{
+	journal_header header;
+	size_t len = strlen(j->identity);
+	char *identity;
+	uint64_t start = 0;
+
+	if (pread_all(fd, &header, sizeof(header), 0) < 0 ||
+	    header.magic != JOURNAL_FILE_MAGIC || header.identity_len != len ||
+	    (identity = malloc(len)) == NULL) {
+		return 0;
+	}
+
+	if (pread_all(fd, identity, len, sizeof(header)) == 0 &&
+	    memcmp(identity, j->identity, len) == 0) {
+		start = sizeof(header) + len;
+	}
+
+	free(identity);
+	return start;
+}
+
+/* called with the lock held, once every record of `file` is stored */
+static void release_file(mysql_journal * j, journal_file * file)
+{
+	journal_file **p;
+
+	if (!file->adopted) {
+		if (file->size > file->start &&
+		    ftruncate(file->fd, (off_t) file->start) == 0) {
+			file->size = file->start;
+		}
+		return;
+	}
+
+	// while still locked, see create_own()
+	if (unlink(file->path) == 0) {
+		sync_dir(j);
+	}
+
+	for (p = &j->files; *p != NULL; p = &(*p)->next) {
+		if (*p == file) {
+			*p = file->next;
+			break;
+		}
+	}
+	file_free(file);
+}
+
+/*
+ * Another process may take over a fresh file before it is locked, and
+ * delete it as empty; such a file is given up for a new one.
+ */
+static int create_own(mysql_journal * j)
+{
+	git_buf path = GIT_BUF_INIT;
+	journal_file *file;
+	struct stat st;
+	uint64_t start = 0;
+	int attempt, fd = -1;
+
+	for (attempt = 0; attempt < JOURNAL_CREATE_ATTEMPTS; attempt++) {
+		git_buf_clear(&path);
+		git_buf_printf(&path, "%s/" JOURNAL_PREFIX "XXXXXX", j->dir);
+		if (git_buf_oom(&path) || (fd = mkstemp(path.ptr)) < 0) {
+			break;
+		}
+
+		if (lock_file(fd) == 0 && fstat(fd, &st) == 0 &&
+		    st.st_nlink > 0) {
+			break;
+		}
+
+		close(fd);
+		fd = -1;
+	}
+
+	// the records are only as durable as the name of the file
+	if (fd < 0 || write_header(j, fd, &start) < 0 || fdatasync(fd) < 0 ||
+	    sync_dir(j) < 0 ||
+	    (file = calloc(1, sizeof(journal_file))) == NULL) {
+		if (fd >= 0) {
+			unlink(path.ptr);
+			close(fd);
+		}
+		git_buf_free(&path);
+		giterr_set_str(GITERR_OS,
+			       "Failed to create the write-behind journal");
+		return GIT_ERROR;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	file->fd = fd;
+	file->path = git_buf_detach(&path);
+	file->start = start;
+	file->size = start;
+	file->next = j->files;
+	j->files = file;
+	j->own = file;
+
+	return GIT_OK;
+}
+
+/* index the records of an adopted file; a torn record ends it */
+static int replay_file(mysql_journal * j, journal_file * file)
+{
+	journal_record record;
+	struct stat st;
+	uint64_t offset = file->start, end;
+	void *data = NULL;
+	size_t capacity = 0;
+	int error = GIT_OK;
+
+	if (fstat(file->fd, &st) < 0) {
+		return GIT_OK;
+	}
+	end = (uint64_t) st.st_size;
+
+	while (offset + sizeof(record) <= end) {
+		if (pread_all(file->fd, &record, sizeof(record), offset) < 0 ||
+		    record.magic != JOURNAL_MAGIC ||
+		    record.len > end - offset - sizeof(record)) {
+			break;
+		}
+
+		if (data == NULL || record.len > capacity) {
+			free(data);
+			capacity = (size_t) record.len;
+			if ((data = malloc(capacity ? capacity : 1)) == NULL) {
+				giterr_set_oom();
+				error = GIT_ERROR;
+				break;
+			}
+		}
+
+		if (pread_all(file->fd, data, (size_t) record.len,
+			      offset + sizeof(record)) < 0 ||
+		    record_crc(&record, data) != record.crc) {
+			break;
+		}
+
+		if (entry_find(j, (const git_oid *)record.oid) == NULL &&
+		    (error = entry_add(j, file, &record,
+				       offset + sizeof(record),
+				       !file->quarantine)) < 0) {
+			break;
+		}
+
+		offset += sizeof(record) + record.len;
+	}
+
+	file->size = offset;
+	free(data);
+	return error;
+}
+
+/*
+ * Take over the files whose process is gone: a living process holds the
+ * lock on its own. Files open in this process are skipped before they are
+ * opened, as closing any descriptor of a file drops the process's lock.
+ * Files of another database are left alone, and the objects set aside in
+ * quarantine- files are indexed to be read, but never stored.
+ */
+static int adopt_files(mysql_journal * j)
+{
+	git_buf path = GIT_BUF_INIT;
+	struct dirent *de;
+	DIR *dir;
+	int error = GIT_OK;
+
+	if ((dir = opendir(j->dir)) == NULL) {
+		giterr_set_str(GITERR_OS,
+			       "Failed to open the write-behind journal directory");
+		return GIT_ERROR;
+	}
+
+	while (error == GIT_OK && (de = readdir(dir)) != NULL) {
+		journal_file *file;
+		struct stat st;
+		uint64_t start;
+		int quarantine, fd;
+
+		// named after its object, so not one still being written
+		quarantine = strncmp(de->d_name, JOURNAL_QUARANTINE_PREFIX,
+				     strlen(JOURNAL_QUARANTINE_PREFIX)) == 0;
+		if (quarantine ? strlen(de->d_name) !=
+		    strlen(JOURNAL_QUARANTINE_PREFIX) + GIT_OID_HEXSZ :
+		    strncmp(de->d_name, JOURNAL_PREFIX,
+			    strlen(JOURNAL_PREFIX)) != 0) {
+			continue;
+		}
+
+		git_buf_clear(&path);
+		git_buf_printf(&path, "%s/%s", j->dir, de->d_name);
+		if (git_buf_oom(&path) || file_known(j, path.ptr)) {
+			continue;
+		}
+
+		if ((fd = open(path.ptr, (quarantine ? O_RDONLY : O_RDWR) |
+			       O_CLOEXEC)) < 0) {
+			continue;
+		}
+
+		// a quarantine- file never changes, nobody locks it
+		if ((!quarantine && lock_file(fd) < 0) || fstat(fd, &st) < 0 ||
+		    st.st_nlink == 0) {
+			close(fd);
+			continue;
+		}
+
+		// an empty file was given up before it had a header
+		start = read_header(j, fd);
+		if ((start == 0 && (quarantine || st.st_size > 0)) ||
+		    (file = calloc(1, sizeof(journal_file))) == NULL) {
+			close(fd);
+			continue;
+		}
+
+		file->fd = fd;
+		file->start = start;
+		file->adopted = !quarantine;
+		file->quarantine = quarantine;
+		if ((file->path = strdup(path.ptr)) == NULL) {
+			file_free(file);
+			continue;
+		}
+		file->next = j->files;
+		j->files = file;
+
+		error = replay_file(j, file);
+		if (file->pending == 0 && quarantine) {
+			j->files = file->next;
+			file_free(file);
+		} else if (file->pending == 0) {
+			release_file(j, file);
+		}
+	}
+
+	closedir(dir);
+	git_buf_free(&path);
+	return error;
+}
+
+static size_t take_batch(mysql_journal * j, journal_entry ** batch)
+{
+	journal_entry *entry;
+	size_t count = 0, bytes = 0;
+
+	for (entry = j->queue_head;
+	     entry != NULL && count < JOURNAL_BATCH_OBJECTS;
+	     entry = entry->queue_next) {
+		if (count > 0 && bytes + entry->len > JOURNAL_BATCH_BYTES) {
+			break;
+		}
+
+		batch[count++] = entry;
+		bytes += entry->len;
+	}
+
+	return count;
+}
+
+/* called without the lock; only the thread frees entries */
+static int
+store_batch(mysql_journal * j, journal_entry ** batch,
+	    mysql_journal_object * objects, size_t count)
+{
+	char *data;
+	size_t bytes = 0, pos = 0, i;
+	int error;
+
+	for (i = 0; i < count; i++) {
+		bytes += batch[i]->len;
+	}
+
+	if ((data = malloc(bytes ? bytes : 1)) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	for (i = 0; i < count; i++) {
+		journal_entry *entry = batch[i];
+
+		if (pread_all(entry->file->fd, data + pos, entry->len,
+			      entry->offset) < 0) {
+			giterr_set_str(GITERR_OS,
+				       "Failed to read the write-behind journal");
+			free(data);
+			return GIT_ERROR;
+		}
+
+		git_oid_cpy(&objects[i].oid, &entry->oid);
+		objects[i].type = entry->type;
+		objects[i].len = entry->len;
+		objects[i].data = data + pos;
+		pos += entry->len;
+	}
+
+	error = j->store(objects, count, j->payload);
+
+	free(data);
+	return error;
+}
+
+/* called with the lock held */
+static void queue_unlink(mysql_journal * j, journal_entry * entry)
+{
+	journal_entry **link, *prev = NULL;
+
+	for (link = &j->queue_head; *link != NULL;
+	     prev = *link, link = &(*link)->queue_next) {
+		if (*link == entry) {
+			*link = entry->queue_next;
+			break;
+		}
+	}
+	if (j->queue_tail == entry) {
+		j->queue_tail = prev;
+	}
+	entry->queue_next = NULL;
+}
+
+/* called with the lock held */
+static void forget_entry(mysql_journal * j, journal_entry * entry)
+{
+	journal_file *file = entry->file;
+
+	queue_unlink(j, entry);
+	entry_unlink(j, entry);
+	free(entry);
+
+	if (--file->pending == 0) {
+		release_file(j, file);
+	}
+}
+
+/* called with the lock held; the batch is at the head of the queue */
+static void forget_batch(mysql_journal * j, journal_entry ** batch,
+			 size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		forget_entry(j, batch[i]);
+	}
+}
+
+static void note_failure(mysql_journal * j)
+{
+	const git_error *e = giterr_last();
+
+	free(j->error);
+	j->error = strdup(e != NULL ? e->message :
+			  "Failed to store journaled objects");
+	j->failures++;
+	giterr_clear();
+}
+
+static void wait_retry(mysql_journal * j)
+{
+	struct timespec deadline;
+
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += JOURNAL_RETRY_SECONDS;
+
+	while (!j->shutdown &&
+	       pthread_cond_timedwait(&j->work, &j->lock, &deadline) !=
+	       ETIMEDOUT) ;
+}
+
+/*
+ * Copy the record of `entry` to a file of its own, which is never
+ * replayed, and read the object from there from now on: it was
+ * acknowledged, so it stays readable here until someone deals with it.
+ * Called with the lock held.
+ */
+static int
+quarantine_entry(mysql_journal * j, journal_entry * entry, const char *why)
+{
+	git_buf path = GIT_BUF_INIT, tmp = GIT_BUF_INIT;
+	journal_record record;
+	journal_file *file = NULL, *from = entry->file;
+	char hex[GIT_OID_HEXSZ + 1];
+	uint64_t start;
+	void *data;
+	int fd = -1, error = GIT_ERROR;
+
+	git_oid_tostr(hex, sizeof(hex), &entry->oid);
+	git_buf_printf(&path, "%s/" JOURNAL_QUARANTINE_PREFIX "%s", j->dir,
+		       hex);
+	git_buf_printf(&tmp, "%s.XXXXXX", path.ptr);
+
+	if ((data = malloc(entry->len ? entry->len : 1)) == NULL ||
+	    git_buf_oom(&path) || git_buf_oom(&tmp) ||
+	    (file = calloc(1, sizeof(journal_file))) == NULL) {
+		giterr_set_oom();
+		goto done;
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.magic = JOURNAL_MAGIC;
+	memcpy(record.oid, entry->oid.id, GIT_OID_RAWSZ);
+	record.type = (uint32_t) entry->type;
+	record.len = entry->len;
+
+	// written in full under another name, as other processes of the
+	// directory may be reading a file of this name already
+	if (pread_all(from->fd, data, entry->len, entry->offset) < 0 ||
+	    (fd = mkstemp(tmp.ptr)) < 0) {
+		giterr_set_str(GITERR_OS,
+			       "Failed to set aside a journaled object");
+		goto done;
+	}
+
+	record.crc = record_crc(&record, data);
+
+	if (write_header(j, fd, &start) < 0 ||
+	    pwrite_all(fd, &record, sizeof(record), start) < 0 ||
+	    pwrite_all(fd, data, entry->len, start + sizeof(record)) < 0 ||
+	    fdatasync(fd) < 0 || rename(tmp.ptr, path.ptr) < 0 ||
+	    sync_dir(j) < 0) {
+		giterr_set_str(GITERR_OS,
+			       "Failed to set aside a journaled object");
+		unlink(tmp.ptr);
+		goto done;
+	}
+
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+	file->fd = fd;
+	file->path = git_buf_detach(&path);
+	file->start = start;
+	file->size = start + sizeof(record) + entry->len;
+	file->pending = 1;
+	file->quarantine = 1;
+	file->next = j->files;
+	j->files = file;
+	fd = -1;
+
+	queue_unlink(j, entry);
+	entry->file = file;
+	entry->offset = start + sizeof(record);
+	j->quarantined++;
+
+	if (--from->pending == 0) {
+		release_file(j, from);
+	}
+
+	git_buf_clear(&tmp);
+	git_buf_printf(&tmp, "Object %s failed to store and was set aside "
+		       "in %s: %s", hex, file->path, why);
+	giterr_set_str(GITERR_ODB, git_buf_oom(&tmp) ?
+		       "Failed to store a journaled object" : tmp.ptr);
+	file = NULL;
+	error = GIT_OK;
+
+done:
+	if (fd >= 0) {
+		close(fd);
+	}
+	free(file);
+	free(data);
+	git_buf_free(&tmp);
+	git_buf_free(&path);
+	return error;
+}
+
+/*
+ * Called with the lock held once `batch` failed as a whole: store its
+ * objects one by one, and set aside those that still fail while others
+ * get stored, as no retry would ever get the batch in. When none gets
+ * stored, the server is more likely at fault and the batch is retried.
+ * GIT_OK once nothing of the batch is left in the queue.
+ */
+static int isolate_batch(mysql_journal * j, journal_entry ** batch,
+			 size_t count)
+{
+	mysql_journal_object object;
+	unsigned char failed[JOURNAL_BATCH_OBJECTS];
+	char *why[JOURNAL_BATCH_OBJECTS];
+	size_t stored = 0, i;
+	int error = GIT_OK;
+
+	for (i = 0; i < count; i++) {
+		const git_error *e;
+
+		pthread_mutex_unlock(&j->lock);
+		why[i] = NULL;
+		failed[i] = store_batch(j, &batch[i], &object, 1) < 0;
+		if (failed[i]) {
+			e = giterr_last();
+			why[i] = e != NULL ? strdup(e->message) : NULL;
+			giterr_clear();
+		}
+		pthread_mutex_lock(&j->lock);
+
+		if (!failed[i]) {
+			forget_entry(j, batch[i]);
+			stored++;
+		}
+	}
+
+	for (i = 0; i < count; i++) {
+		if (!failed[i]) {
+			continue;
+		}
+
+		if (stored == 0 ||
+		    quarantine_entry(j, batch[i], why[i] != NULL ? why[i] :
+				     "unknown error") < 0) {
+			error = GIT_ERROR;
+		}
+		if (stored > 0) {
+			note_failure(j);
+		}
+		free(why[i]);
+	}
+
+	return error;
+}
+
+static void *journal_thread(void *payload)
+{
+	mysql_journal *j = payload;
+	journal_entry *batch[JOURNAL_BATCH_OBJECTS];
+	mysql_journal_object objects[JOURNAL_BATCH_OBJECTS];
+	size_t count;
+	int error;
+
+	mysql_thread_init();
+	pthread_mutex_lock(&j->lock);
+
+	for (;;) {
+		if (j->queue_head == NULL) {
+			if (j->shutdown) {
+				break;
+			}
+			pthread_cond_wait(&j->work, &j->lock);
+			continue;
+		}
+
+		count = take_batch(j, batch);
+
+		pthread_mutex_unlock(&j->lock);
+		error = store_batch(j, batch, objects, count);
+		pthread_mutex_lock(&j->lock);
+
+		if (error == GIT_OK) {
+			forget_batch(j, batch, count);
+		} else {
+			note_failure(j);
+
+			// a large object makes a batch of its own, the next
+			// one tells whether the server takes anything
+			if (count == 1 && batch[0]->queue_next != NULL) {
+				batch[count++] = batch[0]->queue_next;
+			}
+			if (count > 1) {
+				error = isolate_batch(j, batch, count);
+			}
+		}
+		pthread_cond_broadcast(&j->stored);
+
+		// the batch stays in the files, for a retry or the next process
+		if (error < 0) {
+			if (j->shutdown) {
+				break;
+			}
+			wait_retry(j);
+		}
+	}
+
+	pthread_mutex_unlock(&j->lock);
+	mysql_thread_end();
+	return NULL;
+}
+
+/* everything but the thread */
+static void journal_free(mysql_journal * j)
+{
+	journal_entry *entry;
+	journal_file *file;
+	size_t i;
+	int removed = 0;
+
+	// the queue and the entries set aside
+	for (i = 0; i < j->bucket_count; i++) {
+		while ((entry = j->buckets[i]) != NULL) {
+			j->buckets[i] = entry->bucket_next;
+			free(entry);
+		}
+	}
+
+	// files with records left stay for the next process
+	while ((file = j->files) != NULL) {
+		j->files = file->next;
+		if (file->pending == 0 && unlink(file->path) == 0) {
+			removed = 1;
+		}
+		file_free(file);
+	}
+
+	if (removed) {
+		sync_dir(j);
+	}
+
+	pthread_cond_destroy(&j->stored);
+	pthread_cond_destroy(&j->work);
+	pthread_mutex_destroy(&j->lock);
+
+	if (j->free_payload != NULL) {
+		j->free_payload(j->payload);
+	}
+
+	free(j->buckets);
+	free(j->error);
+	free(j->identity);
+	free(j->dir);
+	free(j);
+}
+
+static int
+journal_new(mysql_journal ** out, const char *dir, const char *identity,
+	    size_t max_len, mysql_journal_store_cb store,
+	    void (*free_payload) (void *payload), void *payload)
+{
+	mysql_journal *j;
+
+	if ((j = calloc(1, sizeof(mysql_journal))) == NULL ||
+	    (j->dir = strdup(dir)) == NULL ||
+	    (j->identity = strdup(identity)) == NULL ||
+	    (j->buckets = calloc(JOURNAL_MIN_BUCKETS,
+				 sizeof(journal_entry *))) == NULL) {
+		if (j != NULL) {
+			free(j->identity);
+			free(j->dir);
+			free(j);
+		}
+		free_payload(payload);
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	j->bucket_count = JOURNAL_MIN_BUCKETS;
+	j->max_len = max_len;
+	j->refcount = 1;
+	j->generation = mysql_conn_generation();
+	j->store = store;
+	j->free_payload = free_payload;
+	j->payload = payload;
+
+	pthread_mutex_init(&j->lock, NULL);
+	pthread_cond_init(&j->work, NULL);
+	pthread_cond_init(&j->stored, NULL);
+
+	if (mkdir(dir, 0700) < 0 && errno != EEXIST) {
+		giterr_set_str(GITERR_OS,
+			       "Failed to create the write-behind journal directory");
+		journal_free(j);
+		return GIT_ERROR;
+	}
+
+	if (create_own(j) < 0 || adopt_files(j) < 0) {
+		journal_free(j);
+		return GIT_ERROR;
+	}
+
+	if (pthread_create(&j->thread, NULL, journal_thread, j) != 0) {
+		giterr_set_str(GITERR_OS, "Failed to start the write-behind thread");
+		journal_free(j);
+		return GIT_ERROR;
+	}
+
+	*out = j;
+	return GIT_OK;
+}
+
+int
+mysql_journal_open(mysql_journal ** out, const char *dir,
+		   const char *identity, size_t max_len,
+		   mysql_journal_store_cb store,
+		   void (*free_payload) (void *payload), void *payload)
+{
+	mysql_journal *j;
+	int error;
+
+	*out = NULL;
+
+	pthread_once(&atfork_once, journal_register_atfork);
+	pthread_mutex_lock(&journals_lock);
+
+	// a journal inherited through fork() has no thread to drain it
+	for (j = journals; j != NULL; j = j->next) {
+		if (j->generation == mysql_conn_generation() &&
+		    strcmp(j->dir, dir) == 0 &&
+		    strcmp(j->identity, identity) == 0) {
+			j->refcount++;
+			pthread_mutex_unlock(&journals_lock);
+
+			free_payload(payload);
+			*out = j;
+			return GIT_OK;
+		}
+	}
+
+	if ((error = journal_new(&j, dir, identity, max_len, store,
+				 free_payload, payload)) == GIT_OK) {
+		j->next = journals;
+		journals = j;
+		*out = j;
+	}
+
+	pthread_mutex_unlock(&journals_lock);
+	return error;
+}
+
+void mysql_journal_close(mysql_journal * j)
+{
+	mysql_journal **p;
+
+	// its thread is in the parent, and its lock may look held
+	if (j == NULL || j->generation != mysql_conn_generation()) {
+		return;
+	}
+
+	pthread_mutex_lock(&journals_lock);
+
+	if (--j->refcount > 0) {
+		pthread_mutex_unlock(&journals_lock);
+		return;
+	}
+
+	for (p = &journals; *p != NULL; p = &(*p)->next) {
+		if (*p == j) {
+			*p = j->next;
+			break;
+		}
+	}
+
+	pthread_mutex_unlock(&journals_lock);
+
+	pthread_mutex_lock(&j->lock);
+	j->shutdown = 1;
+	pthread_cond_signal(&j->work);
+	pthread_mutex_unlock(&j->lock);
+
+	pthread_join(j->thread, NULL);
+	journal_free(j);
+}
+
+const char *mysql_journal_dir(mysql_journal * j)
+{
+	return j->dir;
+}
+
+int
+mysql_journal_append(mysql_journal * j, const git_oid * oid,
+		     const void *data, size_t len, git_otype type)
+{
+	journal_record record;
+	journal_file *file;
+	uint64_t offset;
+	int error = GIT_OK;
+
+	// one the database would refuse is refused before it is acknowledged
+	if (len > j->max_len) {
+		giterr_set_str(GITERR_ODB, "Object is too large for the "
+			       "database's max_allowed_packet");
+		return GIT_ERROR;
+	}
+
+	memset(&record, 0, sizeof(record));
+	record.magic = JOURNAL_MAGIC;
+	memcpy(record.oid, oid->id, GIT_OID_RAWSZ);
+	record.type = (uint32_t) type;
+	record.len = len;
+	record.crc = record_crc(&record, data);
+
+	pthread_mutex_lock(&j->lock);
+
+	if (entry_find(j, oid) != NULL) {
+		pthread_mutex_unlock(&j->lock);
+		return GIT_OK;
+	}
+
+	file = j->own;
+	offset = file->size;
+
+	// a record cut short is written over by the next one
+	if (pwrite_all(file->fd, &record, sizeof(record), offset) < 0 ||
+	    pwrite_all(file->fd, data, len, offset + sizeof(record)) < 0 ||
+	    fdatasync(file->fd) < 0) {
+		giterr_set_str(GITERR_OS,
+			       "Failed to write the write-behind journal");
+		error = GIT_ERROR;
+	} else {
+		file->size = offset + sizeof(record) + len;
+		error = entry_add(j, file, &record, offset + sizeof(record),
+				  1);
+		pthread_cond_signal(&j->work);
+	}
+
+	pthread_mutex_unlock(&j->lock);
+	return error;
+}
+
+int
+mysql_journal_read(void **data_p, size_t * len_p, git_otype * type_p,
+		   mysql_journal * j, git_odb_backend * backend,
+		   const git_oid * oid)
+{
+	journal_entry *entry;
+	void *data;
+	int error = GIT_ENOTFOUND;
+
+	pthread_mutex_lock(&j->lock);
+
+	if ((entry = entry_find(j, oid)) != NULL) {
+		data = git_odb_backend_malloc(backend,
+					      entry->len ? entry->len : 1);
+		if (data == NULL) {
+			error = GIT_ERROR;
+		} else if (pread_all(entry->file->fd, data, entry->len,
+				     entry->offset) < 0) {
+			giterr_set_str(GITERR_OS,
+				       "Failed to read the write-behind journal");
+			free(data);
+			error = GIT_ERROR;
+		} else {
+			*data_p = data;
+			*len_p = entry->len;
+			*type_p = entry->type;
+			error = GIT_OK;
+		}
+	}
+
+	pthread_mutex_unlock(&j->lock);
+	return error;
+}
+
+int
+mysql_journal_read_header(size_t * len_p, git_otype * type_p,
+			  mysql_journal * j, const git_oid * oid)
+{
+	journal_entry *entry;
+	int error = GIT_ENOTFOUND;
+
+	pthread_mutex_lock(&j->lock);
+
+	if ((entry = entry_find(j, oid)) != NULL) {
+		*len_p = entry->len;
+		*type_p = entry->type;
+		error = GIT_OK;
+	}
+
+	pthread_mutex_unlock(&j->lock);
+	return error;
+}
+
+int mysql_journal_flush(mysql_journal * j)
+{
+	unsigned int failures;
+	int error = GIT_OK;
+
+	pthread_mutex_lock(&j->lock);
+
+	failures = j->failures;
+	while (j->queue_head != NULL && j->failures == failures) {
+		pthread_cond_wait(&j->stored, &j->lock);
+	}
+
+	if (j->failures != failures) {
+		giterr_set_str(GITERR_ODB, j->error != NULL ? j->error :
+			       "Failed to store journaled objects");
+		error = GIT_ERROR;
+	} else if (j->quarantined > 0) {
+		// acknowledged but not in MySQL, until someone stores them
+		giterr_set_str(GITERR_ODB, "Journaled objects were set aside "
+			       "in quarantine- files and are not stored");
+		error = GIT_ERROR;
+	}
+
+	pthread_mutex_unlock(&j->lock);
+	return error;
+}
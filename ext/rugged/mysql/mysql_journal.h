@@ -0,0 +1,80 @@
+#ifndef MYSQL_JOURNAL_H
+#define MYSQL_JOURNAL_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+/*
+ * Write-behind journal.
+ *
+ * An object handed to mysql_journal_append() is written to a local file
+ * and fdatasync()ed, which is all the writer waits for. A background
+ * thread hands the journaled objects to a store callback in large batches,
+ * and forgets them once it succeeds. Until then they are read from the
+ * file.
+ *
+ * Every process has a file of its own in the journal directory, locked
+ * with fcntl() while the process lives. Each file starts with the identity
+ * of the database it is for. A file left behind by a process that is gone
+ * is taken over and replayed by the next one that opens the directory for
+ * the same database; files of other databases are left alone. Journals are
+ * shared in a process: opening a directory that is open already for the
+ * same database returns the same journal.
+ *
+ * An object larger than the database takes is refused by append. A failed
+ * batch is stored again object by object. An object that still fails while
+ * others get stored would fail every retry, so its record is moved to a
+ * quarantine- file of the directory, which is never replayed. It is still
+ * read from there, by this process and the ones that open the directory
+ * later, and every flush fails while any is set aside.
+ */
+
+typedef struct mysql_journal mysql_journal;
+
+typedef struct {
+	git_oid oid;
+	git_otype type;
+	size_t len;
+	const void *data;
+} mysql_journal_object;
+
+/* store a batch of objects, all or none */
+typedef int (*mysql_journal_store_cb) (const mysql_journal_object * objects,
+				       size_t count, void *payload);
+
+/*
+ * Open the journal in `dir` for the database named by `identity`, creating
+ * the directory if needed; objects over `max_len` bytes are refused.
+ * `payload` is passed to `store`, and handed to `free_payload` when the
+ * journal is closed, or right away if it is open already or on error.
+ */
+int mysql_journal_open(mysql_journal ** out, const char *dir,
+		       const char *identity, size_t max_len,
+		       mysql_journal_store_cb store,
+		       void (*free_payload) (void *payload), void *payload);
+
+/*
+ * Drop a reference. The last one stores what is still journaled, if it
+ * can, and stops the thread; the rest is replayed by the next process.
+ */
+void mysql_journal_close(mysql_journal * journal);
+
+const char *mysql_journal_dir(mysql_journal * journal);
+
+int mysql_journal_append(mysql_journal * journal, const git_oid * oid,
+			 const void *data, size_t len, git_otype type);
+
+/* GIT_OK for a journaled object, GIT_ENOTFOUND otherwise */
+int mysql_journal_read(void **data_p, size_t * len_p, git_otype * type_p,
+		       mysql_journal * journal, git_odb_backend * backend,
+		       const git_oid * oid);
+int mysql_journal_read_header(size_t * len_p, git_otype * type_p,
+			      mysql_journal * journal, const git_oid * oid);
+
+/*
+ * Wait until everything journaled so far is stored. Fails with the error
+ * of the store callback if a batch fails in the meantime.
+ */
+int mysql_journal_flush(mysql_journal * journal);
+
+#endif
@@ -0,0 +1,365 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_meta_migrate.h"
+
+#define META_LOCK_NAME "git2_odb_meta"
+#define META_INSERT_TRIGGER "git2_odb_meta_insert"
+#define META_DELETE_TRIGGER "git2_odb_meta_delete"
+
+typedef struct {
+	mysql_odb_backend *backend;
+	mysql_meta_migrate_opts opts;
+	mysql_meta_migrate_stats *stats;
+	git_oid last_oid;	/* copy position */
+	size_t rows;		/* rows handled by this run */
+} meta_state;
+
+static int run_query(MYSQL * db, const char *sql, size_t len)
+{
+	if (mysql_real_query(db, sql, len) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int run_buf(MYSQL * db, git_buf * sql)
+{
+	if (git_buf_oom(sql)) {
+		return GIT_ERROR;
+	}
+
+	return run_query(db, sql->ptr, sql->size);
+}
+
+static int trigger_exists(int *exists, MYSQL * db, const char *name)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error;
+
+	git_buf_printf(&sql, "SELECT COUNT(*) FROM information_schema.TRIGGERS"
+		       " WHERE `TRIGGER_SCHEMA` = DATABASE()"
+		       " AND `TRIGGER_NAME` = '%s'", name);
+	error = run_buf(db, &sql);
+	git_buf_free(&sql);
+
+	if (error < 0 || (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	*exists = (row = mysql_fetch_row(res)) != NULL && row[0] != NULL &&
+	    atoi(row[0]) > 0;
+	mysql_free_result(res);
+
+	return GIT_OK;
+}
+
+static int create_trigger(MYSQL * db, const char *name, const char *sql)
+{
+	int exists;
+
+	if (trigger_exists(&exists, db, name) < 0) {
+		return GIT_ERROR;
+	}
+
+	return exists ? GIT_OK : run_query(db, sql, strlen(sql));
+}
+
+/*
+ * The state table comes last: once it is there, the backends look in the
+ * narrow table, and from then on every new object must be there too.
+ */
+static int init_tables(MYSQL * db)
+{
+	// `codec` 0 is COMPRESS(), `location` 0 a row of `git2_odb`; the
+	// other values are left for payloads stored some other way
+	static const char *sql_meta =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_ODB_META_TABLE_NAME "` ("
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `type` tinyint(1) unsigned NOT NULL,"
+	    "  `size` bigint(20) unsigned NOT NULL,"
+	    "  `codec` tinyint(1) unsigned NOT NULL DEFAULT 0,"
+	    "  `location` tinyint(1) unsigned NOT NULL DEFAULT 0,"
+	    "  PRIMARY KEY (`oid`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	// every writer goes through them: the backends, the importer, the
+	// collector and the archiver alike
+	static const char *sql_insert =
+	    "CREATE TRIGGER `" META_INSERT_TRIGGER "` AFTER INSERT ON `"
+	    GIT2_ODB_TABLE_NAME "` FOR EACH ROW"
+	    " INSERT IGNORE INTO `" GIT2_ODB_META_TABLE_NAME
+	    "` (`oid`, `type`, `size`)"
+	    " VALUES (NEW.`oid`, NEW.`type`, NEW.`size`)";
+	static const char *sql_delete =
+	    "CREATE TRIGGER `" META_DELETE_TRIGGER "` AFTER DELETE ON `"
+	    GIT2_ODB_TABLE_NAME "` FOR EACH ROW"
+	    " DELETE FROM `" GIT2_ODB_META_TABLE_NAME
+	    "` WHERE `oid` = OLD.`oid`";
+
+	static const char *sql_state =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_ODB_META_STATE_TABLE_NAME "` ("
+	    "  `id` tinyint(1) unsigned NOT NULL,"
+	    "  `last_oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `done` tinyint(1) unsigned NOT NULL DEFAULT 0,"
+	    "  `updated_at` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP"
+	    "    ON UPDATE CURRENT_TIMESTAMP,"
+	    "  PRIMARY KEY (`id`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+	static const char *sql_start =
+	    "INSERT IGNORE INTO `" GIT2_ODB_META_STATE_TABLE_NAME
+	    "` (`id`) VALUES (1)";
+
+	if (run_query(db, sql_meta, strlen(sql_meta)) < 0 ||
+	    create_trigger(db, META_INSERT_TRIGGER, sql_insert) < 0 ||
+	    create_trigger(db, META_DELETE_TRIGGER, sql_delete) < 0 ||
+	    run_query(db, sql_state, strlen(sql_state)) < 0 ||
+	    run_query(db, sql_start, strlen(sql_start)) < 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int lock_meta(MYSQL * db)
+{
+	static const char *sql = "SELECT GET_LOCK('" META_LOCK_NAME "', 0)";
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int locked = 0;
+
+	if (run_query(db, sql, strlen(sql)) < 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	if ((row = mysql_fetch_row(res)) != NULL && row[0] != NULL) {
+		locked = atoi(row[0]) == 1;
+	}
+	mysql_free_result(res);
+
+	if (!locked) {
+		giterr_set_str(GITERR_ODB, "Another migration is running");
+		return GIT_ELOCKED;
+	}
+
+	return GIT_OK;
+}
+
+static void unlock_meta(MYSQL * db)
+{
+	static const char *sql = "DO RELEASE_LOCK('" META_LOCK_NAME "')";
+
+	mysql_real_query(db, sql, strlen(sql));
+}
+
+static int read_state(meta_state * state)
+{
+	static const char *sql =
+	    "SELECT `last_oid`, `done` FROM `" GIT2_ODB_META_STATE_TABLE_NAME
+	    "` WHERE `id` = 1";
+	MYSQL *db = state->backend->db;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	memset(&state->last_oid, 0, sizeof(git_oid));
+
+	if (run_query(db, sql, strlen(sql)) < 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	if ((row = mysql_fetch_row(res)) != NULL) {
+		if (mysql_fetch_lengths(res)[0] == GIT_OID_RAWSZ) {
+			git_oid_fromraw(&state->last_oid,
+					(const unsigned char *)row[0]);
+		}
+		state->stats->done = row[1] != NULL && atoi(row[1]) != 0;
+	}
+
+	mysql_free_result(res);
+	return GIT_OK;
+}
+
+static int write_state(meta_state * state)
+{
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	git_buf_puts(&sql, "UPDATE `" GIT2_ODB_META_STATE_TABLE_NAME
+		     "` SET `last_oid` = ");
+	mysql_buf_put_oid(&sql, &state->last_oid);
+	git_buf_printf(&sql, ", `done` = %d WHERE `id` = 1",
+		       state->stats->done);
+
+	error = run_buf(state->backend->db, &sql);
+	git_buf_free(&sql);
+	return error;
+}
+
+static void throttle(meta_state * state, size_t rows,
+		     const struct timespec *start)
+{
+	struct timespec now, wait;
+	double due, spent;
+
+	if (state->opts.rows_per_second == 0 || rows == 0) {
+		return;
+	}
+
+	due = (double)rows / state->opts.rows_per_second;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	spent = (double)(now.tv_sec - start->tv_sec) +
+	    (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+
+	if (spent < due) {
+		wait.tv_sec = (time_t) (due - spent);
+		wait.tv_nsec = (long)((due - spent - wait.tv_sec) * 1e9);
+		nanosleep(&wait, NULL);
+	}
+}
+
+/* find where the next batch ends; `found` is 0 at the end of the table */
+static int next_batch(meta_state * state, git_oid * last, size_t * found)
+{
+	MYSQL *db = state->backend->db;
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error;
+
+	*found = 0;
+
+	git_buf_puts(&sql, "SELECT `oid` FROM `" GIT2_ODB_TABLE_NAME
+		     "` WHERE `oid` > ");
+	mysql_buf_put_oid(&sql, &state->last_oid);
+	git_buf_printf(&sql, " ORDER BY `oid` LIMIT %llu",
+		       (unsigned long long)state->opts.batch_size);
+	error = run_buf(db, &sql);
+	git_buf_free(&sql);
+
+	if (error < 0 || (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		if (mysql_fetch_lengths(res)[0] == GIT_OID_RAWSZ) {
+			git_oid_fromraw(last, (const unsigned char *)row[0]);
+			(*found)++;
+		}
+	}
+
+	mysql_free_result(res);
+	return GIT_OK;
+}
+
+/* copy the headers of the next rows of `git2_odb` */
+static int step(meta_state * state, size_t * found)
+{
+	MYSQL *db = state->backend->db;
+	git_buf sql = GIT_BUF_INIT;
+	struct timespec start;
+	git_oid last;
+	int error;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	if ((error = next_batch(state, &last, found)) < 0 || *found == 0) {
+		return error;
+	}
+
+	// the shared locks hold off a delete until the copy is done, its
+	// trigger then removes the copy too; a plain read would let the
+	// copy land after the delete under READ COMMITTED
+	git_buf_puts(&sql, "INSERT IGNORE INTO `" GIT2_ODB_META_TABLE_NAME
+		     "` (`oid`, `type`, `size`)"
+		     " SELECT `oid`, `type`, `size` FROM `"
+		     GIT2_ODB_TABLE_NAME "` WHERE `oid` > ");
+	mysql_buf_put_oid(&sql, &state->last_oid);
+	git_buf_puts(&sql, " AND `oid` <= ");
+	mysql_buf_put_oid(&sql, &last);
+	git_buf_puts(&sql, " LOCK IN SHARE MODE");
+
+	if ((error = run_buf(db, &sql)) == GIT_OK) {
+		state->stats->copied += (size_t) mysql_affected_rows(db);
+		state->stats->scanned += *found;
+		state->rows += *found;
+		git_oid_cpy(&state->last_oid, &last);
+
+		throttle(state, *found, &start);
+	}
+
+	git_buf_free(&sql);
+	return error;
+}
+
+int
+mysql_meta_migrate(mysql_meta_migrate_stats * stats, git_odb_backend * odb,
+		   const mysql_meta_migrate_opts * given_opts)
+{
+	mysql_meta_migrate_opts opts = MYSQL_META_MIGRATE_OPTS_INIT;
+	meta_state state;
+	size_t found;
+	int error;
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&state, 0, sizeof(state));
+
+	state.opts = opts;
+	if (given_opts != NULL) {
+		state.opts = *given_opts;
+	}
+	if (state.opts.batch_size == 0) {
+		state.opts.batch_size = 1000;
+	}
+
+	state.backend = (mysql_odb_backend *) odb;
+	state.stats = stats;
+
+	// the connection stays locked for the whole run
+	if (mysql_odb__enter(state.backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	if ((error = lock_meta(state.backend->db)) < 0) {
+		mysql_odb__leave(state.backend);
+		return error;
+	}
+
+	if ((error = init_tables(state.backend->db)) == GIT_OK &&
+	    (error = read_state(&state)) == GIT_OK) {
+		while (!stats->done &&
+		       (state.opts.max_rows == 0 ||
+			state.rows < state.opts.max_rows)) {
+			if ((error = step(&state, &found)) < 0) {
+				break;
+			}
+
+			if (found == 0) {
+				stats->done = 1;
+			}
+
+			if ((error = write_state(&state)) < 0) {
+				break;
+			}
+		}
+	}
+
+	unlock_meta(state.backend->db);
+	mysql_odb__leave(state.backend);
+	return error;
+}
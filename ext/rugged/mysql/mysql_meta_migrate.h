@@ -0,0 +1,37 @@
+#ifndef MYSQL_META_MIGRATE_H
+#define MYSQL_META_MIGRATE_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+/*
+ * The online migration to the narrow header table, see mysql_odb_meta.c.
+ *
+ * The first run creates `git2_odb_meta` and the triggers that keep it in
+ * step with `git2_odb`, then `git2_odb_meta_state`, which tells the
+ * backends to look there. It then copies the headers of the existing
+ * objects in OID order, in batches, and keeps its place in the state
+ * table, so a run can stop at any point and the next one carries on. Once
+ * every object has been copied, the narrow table answers on its own.
+ * Copies are throttled to a number of rows per second. One run at a time
+ * holds a named lock.
+ */
+
+typedef struct {
+	size_t batch_size;	/* objects per step, default 1000 */
+	unsigned int rows_per_second;	/* copy throttle, 0 for none */
+	size_t max_rows;	/* stop after this many rows, 0 to finish */
+} mysql_meta_migrate_opts;
+
+#define MYSQL_META_MIGRATE_OPTS_INIT { 1000, 5000, 0 }
+
+typedef struct {
+	int done;		/* every object is in the narrow table */
+	size_t scanned;
+	size_t copied;
+} mysql_meta_migrate_stats;
+
+int mysql_meta_migrate(mysql_meta_migrate_stats * stats, git_odb_backend * odb,
+		       const mysql_meta_migrate_opts * opts);
+
+#endif
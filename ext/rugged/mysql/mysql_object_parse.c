@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "mysql_object_parse.h"
+
+void mysql_commit_info_init(mysql_commit_info * info)
+{
+	memset(info, 0, sizeof(*info));
+	git_buf_init(&info->parents, 0);
+}
+
+void mysql_commit_info_free(mysql_commit_info * info)
+{
+	git_buf_free(&info->parents);
+}
+
+static int parse_oid_line(git_oid * oid, const char **buf, const char *end,
+			  const char *header)
+{
+	size_t header_len = strlen(header);
+
+	if ((size_t)(end - *buf) < header_len + GIT_OID_HEXSZ + 1 ||
+	    memcmp(*buf, header, header_len) != 0 ||
+	    (*buf)[header_len + GIT_OID_HEXSZ] != '\n') {
+		return GIT_ENOTFOUND;
+	}
+
+	if (git_oid_fromstrn(oid, *buf + header_len, GIT_OID_HEXSZ) < 0) {
+		return GIT_ERROR;
+	}
+
+	*buf += header_len + GIT_OID_HEXSZ + 1;
+	return GIT_OK;
+}
+
+int mysql_parse_commit(mysql_commit_info * info, const char *data, size_t len)
+{
+	const char *buf = data, *end = data + len;
+	git_oid parent;
+	int error;
+
+	git_buf_clear(&info->parents);
+	info->parent_count = 0;
+	info->commit_time = 0;
+
+	if (parse_oid_line(&info->tree, &buf, end, "tree ") < 0) {
+		goto corrupted;
+	}
+
+	while ((error = parse_oid_line(&parent, &buf, end, "parent ")) == 0) {
+		if (git_buf_put(&info->parents, (const char *)parent.id,
+				GIT_OID_RAWSZ) < 0) {
+			return GIT_ERROR;
+		}
+		info->parent_count++;
+	}
+	if (error == GIT_ERROR) {
+		goto corrupted;
+	}
+
+	// the committer line ends with "<email> <time> <tz>"
+	while (buf < end) {
+		const char *eol = memchr(buf, '\n', end - buf);
+
+		if (eol == NULL || eol == buf) {
+			break;
+		}
+
+		if (eol - buf > 10 && memcmp(buf, "committer ", 10) == 0) {
+			const char *email_end = NULL, *p;
+
+			for (p = buf; p < eol; p++) {
+				if (*p == '>') {
+					email_end = p;
+				}
+			}
+			if (email_end == NULL) {
+				goto corrupted;
+			}
+
+			info->commit_time = strtoll(email_end + 1, NULL, 10);
+			return GIT_OK;
+		}
+
+		buf = eol + 1;
+	}
+
+ corrupted:
+	giterr_set_str(GITERR_OBJECT, "Failed to parse commit");
+	return GIT_ERROR;
+}
+
+int mysql_parse_tag(git_oid * target, const char *data, size_t len)
+{
+	const char *buf = data;
+
+	if (parse_oid_line(target, &buf, data + len, "object ") < 0) {
+		giterr_set_str(GITERR_TAG, "Failed to parse tag");
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int
+mysql_parse_tree_named(const char *data, size_t len,
+		       mysql_tree_named_entry_cb cb, void *payload)
+{
+	const char *buf = data, *end = data + len;
+	int error;
+
+	// each entry is "<octal mode> <name>\0<raw oid>"
+	while (buf < end) {
+		const char *nul = memchr(buf, '\0', end - buf);
+		unsigned int mode = 0;
+		git_oid oid;
+
+		if (nul == NULL || end - nul - 1 < GIT_OID_RAWSZ) {
+			goto corrupted;
+		}
+
+		for (; buf < nul && *buf >= '0' && *buf <= '7'; buf++) {
+			mode = (mode << 3) | (unsigned int)(*buf - '0');
+		}
+		if (buf == nul || *buf != ' ') {
+			goto corrupted;
+		}
+
+		git_oid_fromraw(&oid, (const unsigned char *)nul + 1);
+		if ((error = cb(buf + 1, (size_t) (nul - buf - 1), &oid, mode,
+				payload)) != 0) {
+			return error;
+		}
+
+		buf = nul + 1 + GIT_OID_RAWSZ;
+	}
+
+	return GIT_OK;
+
+ corrupted:
+	giterr_set_str(GITERR_OBJECT, "Failed to parse tree");
+	return GIT_ERROR;
+}
+
+typedef struct {
+	mysql_tree_entry_cb cb;
+	void *payload;
+} unnamed_payload;
+
+static int
+drop_name(const char *name, size_t name_len, const git_oid * oid,
+	  unsigned int mode, void *payload)
+{
+	unnamed_payload *unnamed = payload;
+
+	(void)name;
+	(void)name_len;
+
+	return unnamed->cb(oid, mode, unnamed->payload);
+}
+
+int
+mysql_parse_tree(const char *data, size_t len, mysql_tree_entry_cb cb,
+		 void *payload)
+{
+	unnamed_payload unnamed;
+
+	unnamed.cb = cb;
+	unnamed.payload = payload;
+
+	return mysql_parse_tree_named(data, len, drop_name, &unnamed);
+}
@@ -0,0 +1,44 @@
+#ifndef MYSQL_OBJECT_PARSE_H
+#define MYSQL_OBJECT_PARSE_H
+
+#include <stdint.h>
+#include <git2.h>
+#include <buffer.h>
+
+/*
+ * Minimal parsers for raw object buffers, for code that needs the links
+ * between objects without a repository at hand.
+ */
+
+typedef struct {
+	git_oid tree;
+	git_buf parents;	/* raw parent OIDs, GIT_OID_RAWSZ bytes each */
+	size_t parent_count;
+	int64_t commit_time;	/* committer timestamp */
+} mysql_commit_info;
+
+void mysql_commit_info_init(mysql_commit_info * info);
+void mysql_commit_info_free(mysql_commit_info * info);
+
+int mysql_parse_commit(mysql_commit_info * info, const char *data,
+		       size_t len);
+
+/* the object an annotated tag points at */
+int mysql_parse_tag(git_oid * target, const char *data, size_t len);
+
+typedef int (*mysql_tree_entry_cb) (const git_oid * oid,
+				    unsigned int mode, void *payload);
+
+/* call `cb` for every entry of a tree, stopping when it returns non-zero */
+int mysql_parse_tree(const char *data, size_t len, mysql_tree_entry_cb cb,
+		     void *payload);
+
+typedef int (*mysql_tree_named_entry_cb) (const char *name, size_t name_len,
+					  const git_oid * oid,
+					  unsigned int mode, void *payload);
+
+/* the same, with the name of each entry, which is not NUL-terminated */
+int mysql_parse_tree_named(const char *data, size_t len,
+			   mysql_tree_named_entry_cb cb, void *payload);
+
+#endif
@@ -8,221 +8,286 @@
 #include <git2/sys/odb_backend.h>
 #include <mysql.h>
 
-#define GIT2_ODB_TABLE_NAME "git2_odb"
-#define GIT2_STORAGE_ENGINE "InnoDB"
+#include "mysql_odb_backend.h"
+#include "mysql_trace.h"
 
-typedef struct {
-	git_odb_backend parent;
-	MYSQL *db;
-	MYSQL_STMT *st_read;
-	MYSQL_STMT *st_write;
-	MYSQL_STMT *st_read_header;
-} mysql_odb_backend;
+/*
+ * st_read and st_read_header keep their parameters bound to
+ * backend->read_oid; callers copy the OID in and execute.
+ */
+static int execute_read(MYSQL_STMT * stmt, mysql_odb_backend * backend,
+			const git_oid * oid)
+{
+	memcpy(backend->read_oid, oid->id, GIT_OID_RAWSZ);
+
+	if (mysql_stmt_execute(stmt) != 0 ||
+	    mysql_stmt_store_result(stmt) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_stmt_error(stmt));
+		mysql_stmt_reset(stmt);
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
 
+/*
+ * Read a row of a `git2_odb`-shaped table with `stmt`, which takes its OID
+ * from backend->read_params. The shared pool reads its table this way too.
+ */
 int
-mysql_odb_backend__read_header(size_t * len_p, git_otype * type_p,
-			       git_odb_backend * _backend, const git_oid * oid)
+mysql_odb__read_header(size_t * len_p, git_otype * type_p,
+		       mysql_odb_backend * backend, MYSQL_STMT * stmt,
+		       const git_oid * oid)
 {
-	mysql_odb_backend *backend;
 	int error;
-	MYSQL_BIND bind_buffers[1];
-	MYSQL_BIND result_buffers[2];
-
-	assert(len_p && type_p && _backend && oid);
-
-	backend = (mysql_odb_backend *) _backend;
-	error = GIT_ERROR;
 
-	memset(bind_buffers, 0, sizeof(bind_buffers));
-	memset(result_buffers, 0, sizeof(result_buffers));
+	assert(len_p && type_p && backend && stmt && oid);
 
-	// bind the oid passed to the statement
-	bind_buffers[0].buffer = (void *)oid->id;
-	bind_buffers[0].buffer_length = 20;
-	bind_buffers[0].length = &bind_buffers[0].buffer_length;
-	bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-	if (mysql_stmt_bind_param(backend->st_read_header, bind_buffers) != 0) {
-		return 0;
-	}
-	// execute the statement
-	if (mysql_stmt_execute(backend->st_read_header) != 0) {
-		return 0;
-	}
-	if (mysql_stmt_store_result(backend->st_read_header) != 0) {
-		return 0;
+	if ((error = execute_read(stmt, backend, oid)) < 0) {
+		return error;
 	}
 	// this should either be 0 or 1
 	// if it's > 1 MySQL's unique index failed and we should all fear for our lives
-	if (mysql_stmt_num_rows(backend->st_read_header) == 1) {
-		result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
-		result_buffers[0].buffer = type_p;
-		result_buffers[0].buffer_length = sizeof(type_p);
-		memset(type_p, 0, sizeof(type_p));
-
-		result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
-		result_buffers[1].buffer = len_p;
-		result_buffers[1].buffer_length = sizeof(len_p);
-		memset(len_p, 0, sizeof(len_p));
-
-		if (mysql_stmt_bind_result
-		    (backend->st_read_header, result_buffers) != 0) {
-			return GIT_ERROR;
-		}
-		// this should populate the buffers at *type_p and *len_p
-		if (mysql_stmt_fetch(backend->st_read_header) != 0) {
-			return GIT_ERROR;
+	if (mysql_stmt_num_rows(stmt) == 1) {
+		if (mysql_stmt_bind_result(stmt, backend->read_results) != 0 ||
+		    mysql_stmt_fetch(stmt) != 0) {
+			error = GIT_ERROR;
+		} else {
+			*type_p = (git_otype) backend->read_type;
+			*len_p = (size_t) backend->read_size;
+			error = GIT_OK;
 		}
-
-		error = GIT_OK;
 	} else {
 		error = GIT_ENOTFOUND;
 	}
 
 	// reset the statement for further use
-	if (mysql_stmt_reset(backend->st_read_header) != 0) {
-		return 0;
-	}
+	mysql_stmt_reset(stmt);
 
 	return error;
 }
 
+/*
+ * `stmt` selects the type, the size and the payload of a row, and
+ * `header_stmt` the first two: the payload is fetched straight into a
+ * buffer of the size the header gives. The header comes from the header
+ * index when it has the object, since the size is the object's own,
+ * whichever table it is in; otherwise it costs a statement of its own.
+ */
 int
-mysql_odb_backend__read(void **data_p, size_t * len_p, git_otype * type_p,
-			git_odb_backend * _backend, const git_oid * oid)
+mysql_odb__read(void **data_p, size_t * len_p, git_otype * type_p,
+		mysql_odb_backend * backend, MYSQL_STMT * header_stmt,
+		MYSQL_STMT * stmt, const git_oid * oid)
 {
-	mysql_odb_backend *backend;
-	int error;
-	MYSQL_BIND bind_buffers[1];
-	MYSQL_BIND result_buffers[3];
-	unsigned long data_len;
+	MYSQL_BIND *data_bind = &backend->read_results[2];
+	unsigned long data_len = 0;
+	size_t len;
+	git_otype type;
+	void *data;
+	int error = GIT_ENOTFOUND;
+
+	assert(len_p && type_p && backend && header_stmt && stmt && oid);
+
+	if (backend->header_index != NULL) {
+		error = mysql_header_index_lookup(&len, &type,
+						  backend->header_index, oid);
+	}
+	if (error == GIT_ENOTFOUND &&
+	    (error = mysql_odb__read_header(&len, &type, backend, header_stmt,
+					    oid)) < 0) {
+		return error;
+	}
 
-	assert(len_p && type_p && _backend && oid);
+	if ((data = git_odb_backend_malloc(&backend->parent,
+					   len ? len : 1)) == NULL) {
+		return GIT_ERROR;
+	}
 
-	backend = (mysql_odb_backend *) _backend;
-	error = GIT_ERROR;
+	if ((error = execute_read(stmt, backend, oid)) < 0) {
+		free(data);
+		return error;
+	}
 
-	memset(bind_buffers, 0, sizeof(bind_buffers));
-	memset(result_buffers, 0, sizeof(result_buffers));
+	data_bind->buffer = data;
+	data_bind->buffer_length = len;
+	data_bind->length = &data_len;
 
-	// bind the oid passed to the statement
-	bind_buffers[0].buffer = (void *)oid->id;
-	bind_buffers[0].buffer_length = 20;
-	bind_buffers[0].length = &bind_buffers[0].buffer_length;
-	bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-	if (mysql_stmt_bind_param(backend->st_read, bind_buffers) != 0) {
-		return 0;
+	// objects never change, so a payload of another size is corrupt
+	if (mysql_stmt_num_rows(stmt) != 1) {
+		error = GIT_ENOTFOUND;
+	} else if (mysql_stmt_bind_result(stmt, backend->read_results) != 0 ||
+		   mysql_stmt_fetch(stmt) != 0 || data_len != len) {
+		giterr_set_str(GITERR_ODB, "Error reading object from MySql");
+		error = GIT_ERROR;
 	}
-	// execute the statement
-	if (mysql_stmt_execute(backend->st_read) != 0) {
-		return 0;
+
+	if (error < 0) {
+		free(data);
+	} else {
+		*data_p = data;
+		*type_p = (git_otype) backend->read_type;
+		*len_p = len;
 	}
 
-	if (mysql_stmt_store_result(backend->st_read) != 0) {
-		return 0;
+	data_bind->buffer = NULL;
+	data_bind->buffer_length = 0;
+	data_bind->length = NULL;
+
+	// reset the statement for further use
+	mysql_stmt_reset(stmt);
+
+	return error;
+}
+
+static int prepare_statement(MYSQL * db, MYSQL_STMT ** out, const char *sql)
+{
+	my_bool truth = 1;
+
+	*out = mysql_stmt_init(db);
+	if (*out == NULL) {
+		return GIT_ERROR;
 	}
-	// this should either be 0 or 1
-	// if it's > 1 MySQL's unique index failed and we should all fear for our lives
-	if (mysql_stmt_num_rows(backend->st_read) == 1) {
-		result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
-		result_buffers[0].buffer = type_p;
-		result_buffers[0].buffer_length = sizeof(type_p);
-		memset(type_p, 0, sizeof(type_p));
-
-		result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
-		result_buffers[1].buffer = len_p;
-		result_buffers[1].buffer_length = sizeof(len_p);
-		memset(len_p, 0, sizeof(len_p));
-
-		// by setting buffer and buffer_length to 0, this tells libmysql
-		// we want it to set data_len to the *actual* length of that field
-		// this way we can malloc exactly as much memory as we need for the buffer
-		//
-		// come to think of it, we can probably just use the length set in *len_p
-		// once we fetch the result?
-		result_buffers[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
-		result_buffers[2].buffer = 0;
-		result_buffers[2].buffer_length = 0;
-		result_buffers[2].length = &data_len;
-
-		if (mysql_stmt_bind_result(backend->st_read, result_buffers) !=
-		    0) {
-			return GIT_ERROR;
-		}
-		// this should populate the buffers at *type_p, *len_p and &data_len
-		error = mysql_stmt_fetch(backend->st_read);
-		// if(error != 0 || error != MYSQL_DATA_TRUNCATED)
-		//   return GIT_ERROR;
-
-		if (data_len > 0) {
-			*data_p = malloc(data_len);
-			result_buffers[2].buffer = *data_p;
-			result_buffers[2].buffer_length = data_len;
-
-			if (mysql_stmt_fetch_column
-			    (backend->st_read, &result_buffers[2], 2, 0) != 0) {
-				return GIT_ERROR;
-			}
-		}
 
-		error = GIT_OK;
-	} else {
-		error = GIT_ENOTFOUND;
+	if (mysql_stmt_attr_set(*out, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0 ||
+	    mysql_stmt_prepare(*out, sql, strlen(sql)) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_stmt_error(*out));
+		mysql_stmt_close(*out);
+		*out = NULL;
+		return GIT_ERROR;
 	}
 
-	// reset the statement for further use
-	if (mysql_stmt_reset(backend->st_read) != 0) {
-		return 0;
+	return GIT_OK;
+}
+
+/*
+ * The statements on `git2_odb` are prepared when they are first needed: a
+ * process that only reads headers, or answers everything from its caches,
+ * never prepares the others.
+ */
+static int prepare_read(mysql_odb_backend * backend)
+{
+	static const char *sql_read =
+	    "SELECT `type`, `size`, UNCOMPRESS(`data`) FROM `"
+	    GIT2_ODB_TABLE_NAME "` WHERE `oid` = ?;";
+
+	if (backend->st_read != NULL) {
+		return GIT_OK;
+	}
+
+	if (prepare_statement(backend->db, &backend->st_read, sql_read) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_bind_param(backend->st_read, backend->read_params) != 0) {
+		mysql_stmt_close(backend->st_read);
+		backend->st_read = NULL;
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int prepare_read_header(mysql_odb_backend * backend)
+{
+	static const char *sql_read_header =
+	    "SELECT `type`, `size` FROM `" GIT2_ODB_TABLE_NAME
+	    "` WHERE `oid` = ?;";
+
+	if (backend->st_read_header != NULL) {
+		return GIT_OK;
+	}
+
+	if (prepare_statement(backend->db, &backend->st_read_header,
+			      sql_read_header) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_bind_param(backend->st_read_header,
+				  backend->read_params) != 0) {
+		mysql_stmt_close(backend->st_read_header);
+		backend->st_read_header = NULL;
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int prepare_write(mysql_odb_backend * backend)
+{
+	static const char *sql_write =
+	    "INSERT IGNORE INTO `" GIT2_ODB_TABLE_NAME
+	    "` (`oid`, `type`, `size`, `data`) VALUES (?, ?, ?, COMPRESS(?));";
+
+	if (backend->st_write != NULL) {
+		return GIT_OK;
+	}
+
+	return prepare_statement(backend->db, &backend->st_write, sql_write);
+}
+
+/*
+ * The header of an object of `git2_odb`, from `git2_odb_meta` when it is
+ * there. Until it holds every object, a miss is looked up in both.
+ */
+static int
+read_unpacked_header(size_t * len_p, git_otype * type_p,
+		     mysql_odb_backend * backend, const git_oid * oid)
+{
+	int meta = mysql_odb_meta__state(backend);
+	int error = GIT_ENOTFOUND;
+
+	if (meta != MYSQL_ODB_META_NONE) {
+		error = mysql_odb_meta__read_header(len_p, type_p, backend,
+						    oid);
+	}
+
+	if (error == GIT_ENOTFOUND && meta != MYSQL_ODB_META_COMPLETE &&
+	    (error = prepare_read_header(backend)) == GIT_OK) {
+		error = mysql_odb__read_header(len_p, type_p, backend,
+					       backend->st_read_header, oid);
 	}
 
 	return error;
 }
 
-int mysql_odb_backend__exists(git_odb_backend * _backend, const git_oid * oid)
+static int object_exists(git_odb_backend * _backend, const git_oid * oid)
 {
 	mysql_odb_backend *backend;
-	int found;
-	MYSQL_BIND bind_buffers[1];
+	size_t len;
+	git_otype type;
+	int meta, found;
 
 	assert(_backend && oid);
 
 	backend = (mysql_odb_backend *) _backend;
-	found = 0;
 
-	memset(bind_buffers, 0, sizeof(bind_buffers));
-
-	// bind the oid passed to the statement
-	bind_buffers[0].buffer = (void *)oid->id;
-	bind_buffers[0].buffer_length = 20;
-	bind_buffers[0].length = &bind_buffers[0].buffer_length;
-	bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
-	if (mysql_stmt_bind_param(backend->st_read_header, bind_buffers) != 0) {
-		return 0;
-	}
-	// execute the statement
-	if (mysql_stmt_execute(backend->st_read_header) != 0) {
-		return 0;
+	// the narrow table answers from a few dense index pages
+	if ((meta = mysql_odb_meta__state(backend)) != MYSQL_ODB_META_NONE) {
+		found = mysql_odb_meta__read_header(&len, &type, backend,
+						    oid) == GIT_OK;
+		if (found || meta == MYSQL_ODB_META_COMPLETE) {
+			return found;
+		}
 	}
 
-	if (mysql_stmt_store_result(backend->st_read_header) != 0) {
+	if (prepare_read_header(backend) < 0 ||
+	    execute_read(backend->st_read_header, backend, oid) < 0) {
 		return 0;
 	}
 	// now lets see if any rows matched our query
 	// this should either be 0 or 1
 	// if it's > 1 MySQL's unique index failed and we should all fear for our lives
-	if (mysql_stmt_num_rows(backend->st_read_header) == 1) {
-		found = 1;
-	}
+	found = mysql_stmt_num_rows(backend->st_read_header) == 1;
+
 	// reset the statement for further use
-	if (mysql_stmt_reset(backend->st_read_header) != 0) {
-		return 0;
-	}
+	mysql_stmt_reset(backend->st_read_header);
 
 	return found;
 }
 
-int
-mysql_odb_backend__write(git_odb_backend * _backend, const git_oid * oid,
-			 const void *data, size_t len, git_otype type)
+static int
+write_object(git_odb_backend * _backend, const git_oid * oid,
+	     const void *data, size_t len, git_otype type)
 {
 	int error;
 	mysql_odb_backend *backend;
@@ -237,6 +302,10 @@ mysql_odb_backend__write(git_odb_backend * _backend, const git_oid * oid,
 		return error;
 	}
 
+	if (prepare_write(backend) < 0) {
+		return GIT_ERROR;
+	}
+
 	memset(bind_buffers, 0, sizeof(bind_buffers));
 
 	// bind the oid
@@ -271,208 +340,1320 @@ mysql_odb_backend__write(git_odb_backend * _backend, const git_oid * oid,
 	if (mysql_stmt_execute(backend->st_write) != 0) {
 		return GIT_ERROR;
 	}
-	// now lets see if the insert worked
+	// INSERT IGNORE leaves a row that is there already alone
 	affected_rows = mysql_stmt_affected_rows(backend->st_write);
-	if (affected_rows != 1) {
+	if (affected_rows > 1) {
 		return GIT_ERROR;
 	}
 	// reset the statement for further use
-	if (mysql_stmt_reset(backend->st_read_header) != 0) {
+	if (mysql_stmt_reset(backend->st_write) != 0) {
 		return GIT_ERROR;
 	}
-
-	return GIT_OK;
-}
-
-void mysql_odb_backend__free(git_odb_backend * _backend)
-{
-	mysql_odb_backend *backend;
-	assert(_backend);
-	backend = (mysql_odb_backend *) _backend;
-
-	if (backend->st_read) {
-		mysql_stmt_close(backend->st_read);
-	}
-	if (backend->st_read_header) {
-		mysql_stmt_close(backend->st_read_header);
-	}
-	if (backend->st_write) {
-		mysql_stmt_close(backend->st_write);
+	// an object stored again may be one gc is about to delete
+	if (affected_rows == 0 && backend->gc_active != 0 &&
+	    mysql_gc__touch(backend, oid) < 0) {
+		return GIT_ERROR;
 	}
 
-	mysql_close(backend->db);
-
-	free(backend);
-}
-
-static int create_table(MYSQL * db)
-{
-	static const char *sql_create =
-	    "CREATE TABLE `" GIT2_ODB_TABLE_NAME "` ("
-	    "  `oid` binary(20) NOT NULL DEFAULT '',"
-	    "  `type` tinyint(1) unsigned NOT NULL,"
-	    "  `size` bigint(20) unsigned NOT NULL,"
-	    "  `data` longblob NOT NULL,"
-	    "  PRIMARY KEY (`oid`),"
-	    "  KEY `type` (`type`),"
-	    "  KEY `size` (`size`)"
-	    ") ENGINE=" GIT2_STORAGE_ENGINE
-	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
-
-	if (mysql_real_query(db, sql_create, strlen(sql_create)) != 0) {
+	if (affected_rows == 1 && backend->stats &&
+	    mysql_stats__add(backend, type, len) < 0) {
 		return GIT_ERROR;
 	}
 
 	return GIT_OK;
 }
 
-static int init_db(MYSQL * db)
+/*
+ * With counters, a row and its upsert go in one transaction, or in the
+ * caller's with `in_transaction`.
+ */
+static int
+write_counted(mysql_odb_backend * backend, const git_oid * oid,
+	      const void *data, size_t len, git_otype type, int in_transaction)
 {
-	static const char *sql_check =
-	    "SHOW TABLES LIKE '" GIT2_ODB_TABLE_NAME "';";
-
-	MYSQL_RES *res;
 	int error;
-	my_ulonglong num_rows;
 
-	if (mysql_real_query(db, sql_check, strlen(sql_check)) != 0)
-		return GIT_ERROR;
+	if (!backend->stats || in_transaction) {
+		return write_object(&backend->parent, oid, data, len, type);
+	}
 
-	res = mysql_store_result(db);
-	if (res == NULL)
+	if (mysql_real_query(backend->db, "START TRANSACTION", 17) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(backend->db));
 		return GIT_ERROR;
+	}
 
-	num_rows = mysql_num_rows(res);
-	if (num_rows == 0) {
-		/* the table was not found */
-		error = create_table(db);
-	} else if (num_rows > 0) {
-		/* the table was found */
-		error = GIT_OK;
-	} else {
+	error = write_object(&backend->parent, oid, data, len, type);
+	if (error == GIT_OK && mysql_real_query(backend->db, "COMMIT", 6) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(backend->db));
 		error = GIT_ERROR;
 	}
+	if (error < 0) {
+		mysql_real_query(backend->db, "ROLLBACK", 8);
+	}
 
-	mysql_free_result(res);
 	return error;
 }
 
-static int init_statements(mysql_odb_backend * backend)
-{
-	my_bool truth = 1;
+static int open_journal(mysql_journal ** out, mysql_odb_backend * backend,
+			const char *dir);
 
-	static const char *sql_read =
-	    "SELECT `type`, `size`, UNCOMPRESS(`data`) FROM `"
-	    GIT2_ODB_TABLE_NAME "` WHERE `oid` = ?;";
+/*
+ * The prefetch and write-behind threads stay behind in the parent of a
+ * fork. The child starts its own; the old prefetcher is left alone, see
+ * mysql_prefetch_after_fork(), and the parent stores what it journaled.
+ */
+static void check_fork(mysql_odb_backend * backend)
+{
+	mysql_journal *journal = backend->journal;
 
-	static const char *sql_read_header =
-	    "SELECT `type`, `size` FROM `" GIT2_ODB_TABLE_NAME
-	    "` WHERE `oid` = ?;";
+	if (backend->generation == mysql_conn_generation()) {
+		return;
+	}
 
-	static const char *sql_write =
-	    "INSERT IGNORE INTO `" GIT2_ODB_TABLE_NAME
-	    "` VALUES (?, ?, ?, COMPRESS(?));";
+	backend->generation = mysql_conn_generation();
 
-	backend->st_read = mysql_stmt_init(backend->db);
-	if (backend->st_read == NULL) {
-		return GIT_ERROR;
+	// prefetching is an optimization, reads go on without it
+	if (backend->prefetch != NULL &&
+	    mysql_prefetch_after_fork(&backend->prefetch) < 0) {
+		giterr_clear();
 	}
 
-	if (mysql_stmt_attr_set
-	    (backend->st_read, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0) {
-		return GIT_ERROR;
+	// and without a journal, writes go to MySQL directly
+	if (journal != NULL &&
+	    open_journal(&backend->journal, backend,
+			 mysql_journal_dir(journal)) < 0) {
+		backend->journal = NULL;
+		giterr_clear();
 	}
+}
 
-	if (mysql_stmt_prepare(backend->st_read, sql_read, strlen(sql_read)) !=
-	    0) {
-		return GIT_ERROR;
-	}
+static int
+read_object_header(size_t * len_p, git_otype * type_p,
+		   mysql_odb_backend * backend, const git_oid * oid)
+{
+	int error;
 
-	backend->st_read_header = mysql_stmt_init(backend->db);
-	if (backend->st_read_header == NULL) {
-		return GIT_ERROR;
+	if (backend->packed) {
+		error = mysql_odb_pack__read_header(len_p, type_p, backend, oid);
+	} else {
+		error = read_unpacked_header(len_p, type_p, backend, oid);
 	}
 
-	if (mysql_stmt_attr_set
-	    (backend->st_read_header, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0)
-	{
-		return GIT_ERROR;
+	if (error == GIT_ENOTFOUND && backend->tier_sample_rate != 0) {
+		error = mysql_odb_tier__read_header(len_p, type_p, backend, oid);
 	}
 
-	if (mysql_stmt_prepare
-	    (backend->st_read_header, sql_read_header, strlen(sql_read)) != 0) {
-		return GIT_ERROR;
+	if (error == GIT_ENOTFOUND && backend->pool != NULL) {
+		error = mysql_odb_pool__read_header(len_p, type_p, backend, oid);
 	}
 
-	backend->st_write = mysql_stmt_init(backend->db);
-	if (backend->st_write == NULL) {
-		return GIT_ERROR;
-	}
+	return error;
+}
 
-	if (mysql_stmt_attr_set
-	    (backend->st_write, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0) {
-		return GIT_ERROR;
+int
+mysql_odb_backend__read_header(size_t * len_p, git_otype * type_p,
+			       git_odb_backend * _backend, const git_oid * oid)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_trace_span span;
+	int error = GIT_ENOTFOUND;
+
+	MYSQL_TRACE_START(&span, "odb.read_header", oid, NULL);
+	check_fork(backend);
+	mysql_gc__check(backend);
+	if (backend->header_index != NULL) {
+		error = mysql_header_index_lookup(len_p, type_p,
+						  backend->header_index, oid);
+	}
+	if (error == GIT_ENOTFOUND && backend->journal != NULL) {
+		error = mysql_journal_read_header(len_p, type_p,
+						  backend->journal, oid);
 	}
+	if (error == GIT_ENOTFOUND && backend->disk_cache != NULL) {
+		error = mysql_disk_cache_read_header(len_p, type_p,
+						     backend->disk_cache, oid);
+	}
+	// only misses of the local caches connect
+	if (error == GIT_ENOTFOUND) {
+		if (mysql_odb__enter(backend) < 0) {
+			error = GIT_ERROR;
+		} else {
+			error = read_object_header(len_p, type_p, backend, oid);
+			mysql_odb__leave(backend);
+		}
 
-	if (mysql_stmt_prepare(backend->st_write, sql_write, strlen(sql_read))
-	    != 0) {
-		return GIT_ERROR;
+		if (error == GIT_OK && backend->header_index != NULL) {
+			mysql_header_index_insert(backend->header_index, oid,
+						  *len_p, *type_p);
+		}
 	}
+	MYSQL_TRACE_FINISH(&span, 0, error == GIT_OK, error);
 
-	return GIT_OK;
+	return error;
+}
+
+static int
+read_object(void **data_p, size_t * len_p, git_otype * type_p,
+	    mysql_odb_backend * backend, const git_oid * oid)
+{
+	int error = GIT_ENOTFOUND;
+
+	if (backend->prefetch == NULL ||
+	    (error = mysql_prefetch_take(data_p, len_p, type_p,
+					 backend->prefetch, &backend->parent,
+					 oid)) == GIT_ENOTFOUND) {
+		if (backend->packed) {
+			error = mysql_odb_pack__read(data_p, len_p, type_p,
+						     backend, oid);
+		} else if ((error = prepare_read(backend)) == GIT_OK &&
+			   (error = prepare_read_header(backend)) == GIT_OK) {
+			error = mysql_odb__read(data_p, len_p, type_p, backend,
+						backend->st_read_header,
+						backend->st_read, oid);
+		}
+	}
+
+	if (backend->tier_sample_rate != 0) {
+		if (error == GIT_OK) {
+			mysql_odb_tier__touch(backend, oid);
+		} else if (error == GIT_ENOTFOUND) {
+			error = mysql_odb_tier__read(data_p, len_p, type_p,
+						     backend, oid);
+		}
+	}
+
+	// alternates-style: the local store first, then the pool
+	if (error == GIT_ENOTFOUND && backend->pool != NULL) {
+		error = mysql_odb_pool__read(data_p, len_p, type_p, backend,
+					     oid);
+	}
+
+	return error;
+}
+
+int
+mysql_odb_backend__read(void **data_p, size_t * len_p, git_otype * type_p,
+			git_odb_backend * _backend, const git_oid * oid)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_trace_span span;
+	int error = GIT_ENOTFOUND;
+
+	MYSQL_TRACE_START(&span, "odb.read", oid, NULL);
+	check_fork(backend);
+	mysql_gc__check(backend);
+	if (backend->disk_cache != NULL) {
+		error = mysql_disk_cache_read(data_p, len_p, type_p,
+					      backend->disk_cache, _backend,
+					      oid);
+	}
+	if (error == GIT_ENOTFOUND && backend->journal != NULL) {
+		error = mysql_journal_read(data_p, len_p, type_p,
+					   backend->journal, _backend, oid);
+	}
+	if (error == GIT_ENOTFOUND) {
+		if (mysql_odb__enter(backend) < 0) {
+			error = GIT_ERROR;
+		} else {
+			error = read_object(data_p, len_p, type_p, backend,
+					    oid);
+			mysql_odb__leave(backend);
+		}
+
+		if (error == GIT_OK && backend->disk_cache != NULL) {
+			mysql_disk_cache_write(backend->disk_cache, oid,
+					       *data_p, *len_p, *type_p);
+		}
+	}
+	// the caller is about to read the entries of this tree
+	if (error == GIT_OK && backend->prefetch != NULL &&
+	    *type_p == GIT_OBJ_TREE) {
+		mysql_prefetch_tree(backend->prefetch, *data_p, *len_p);
+	}
+	MYSQL_TRACE_FINISH(&span, error == GIT_OK ? *len_p : 0,
+			   error == GIT_OK, error);
+
+	return error;
+}
+
+/* keep `length` bytes of a whole object from `offset` */
+static void
+slice_object(void *data, size_t * len_p, size_t offset, size_t length)
+{
+	size_t len = offset < *len_p ? *len_p - offset : 0;
+
+	if (len > length) {
+		len = length;
+	}
+	if (len > 0) {
+		memmove(data, (char *)data + offset, len);
+	}
+	*len_p = len;
+}
+
+int
+git_odb_backend_mysql_read_range(void **data_p, size_t * len_p,
+				 git_otype * type_p, size_t * size_p,
+				 git_odb_backend * _backend,
+				 const git_oid * oid, size_t offset,
+				 size_t length)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_trace_span span;
+	int error = GIT_ENOTFOUND;
+
+	assert(data_p && len_p && type_p && size_p && backend && oid);
+
+	MYSQL_TRACE_START(&span, "odb.read_range", oid, NULL);
+	check_fork(backend);
+	mysql_gc__check(backend);
+
+	// the local copies are whole objects, cut to size
+	if (backend->disk_cache != NULL) {
+		error = mysql_disk_cache_read(data_p, size_p, type_p,
+					      backend->disk_cache, _backend,
+					      oid);
+	}
+	if (error == GIT_ENOTFOUND && backend->journal != NULL) {
+		error = mysql_journal_read(data_p, size_p, type_p,
+					   backend->journal, _backend, oid);
+	}
+	if (error == GIT_OK) {
+		*len_p = *size_p;
+		slice_object(*data_p, len_p, offset, length);
+	} else if (error == GIT_ENOTFOUND) {
+		if (mysql_odb__enter(backend) < 0) {
+			error = GIT_ERROR;
+		} else {
+			if (!backend->packed) {
+				error = mysql_odb_range__read(data_p, len_p,
+							      type_p, size_p,
+							      backend, oid,
+							      offset, length);
+			}
+			// pack entries may be deltas, and the archive and
+			// the pool are rarely read: those are read whole
+			if (error == GIT_ENOTFOUND &&
+			    (error = read_object(data_p, size_p, type_p,
+						 backend, oid)) == GIT_OK) {
+				*len_p = *size_p;
+				slice_object(*data_p, len_p, offset, length);
+			}
+			mysql_odb__leave(backend);
+		}
+	}
+
+	MYSQL_TRACE_FINISH(&span, error == GIT_OK ? *len_p : 0,
+			   error == GIT_OK, error);
+
+	return error;
+}
+
+int mysql_odb_backend__exists(git_odb_backend * _backend, const git_oid * oid)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_trace_span span;
+	size_t len;
+	git_otype type;
+	int found = 0;
+
+	MYSQL_TRACE_START(&span, "odb.exists", oid, NULL);
+	check_fork(backend);
+	mysql_gc__check(backend);
+	if (backend->header_index != NULL &&
+	    mysql_header_index_lookup(&len, &type, backend->header_index,
+				      oid) == GIT_OK) {
+		found = 1;
+	} else if (backend->journal != NULL &&
+		   mysql_journal_read_header(&len, &type, backend->journal,
+					     oid) == GIT_OK) {
+		found = 1;
+	} else if (backend->disk_cache != NULL &&
+		   mysql_disk_cache_read_header(&len, &type,
+						backend->disk_cache,
+						oid) == GIT_OK) {
+		found = 1;
+	}
+
+	// a local hit needs no query
+	if (!found && mysql_odb__enter(backend) < 0) {
+		giterr_clear();
+	} else if (!found) {
+		if (backend->packed) {
+			found = mysql_odb_pack__read_header(&len, &type,
+							    backend,
+							    oid) == GIT_OK;
+		} else {
+			found = object_exists(_backend, oid);
+		}
+
+		if (!found && backend->tier_sample_rate != 0) {
+			found = mysql_odb_tier__read_header(&len, &type,
+							    backend,
+							    oid) == GIT_OK;
+		}
+
+		if (!found && backend->pool != NULL) {
+			found = mysql_odb_pool__exists(backend, oid) == GIT_OK;
+		}
+
+		mysql_odb__leave(backend);
+	}
+
+	// the caller may skip writing an object that is found, so gc must
+	// not take it from under the ref about to use it; that is only a
+	// query while gc runs or has candidates, and a failed one leaves it
+	// to the grace period
+	if (found && backend->gc_active != 0 &&
+	    mysql_gc__touch(backend, oid) < 0) {
+		giterr_clear();
+	}
+
+	MYSQL_TRACE_FINISH(&span, 0, found, 0);
+
+	return found;
+}
+
+/*
+ * Called between mysql_odb__enter() and mysql_odb__leave(); with
+ * `in_transaction` from within the caller's transaction.
+ */
+static int
+store_object(mysql_odb_backend * backend, const git_oid * oid,
+	     const void *data, size_t len, git_otype type, int in_transaction)
+{
+	int error = GIT_PASSTHROUGH;
+
+	if (backend->pool != NULL) {
+		error = mysql_odb_pool__write(backend, oid, data, len, type);
+	}
+	if (error == GIT_PASSTHROUGH) {
+		error = write_counted(backend, oid, data, len, type,
+				      in_transaction);
+	}
+
+	// the graph is an index only, backfill repairs a failed row
+	if (error == GIT_OK && backend->commit_graph &&
+	    type == GIT_OBJ_COMMIT &&
+	    mysql_commit_graph__add(backend, oid, data, len) < 0) {
+		giterr_clear();
+	}
+
+	// and so is the path history, which is left to the backfill; the
+	// queue only lets it find the commit without a scan
+	if (error == GIT_OK && backend->path_history &&
+	    type == GIT_OBJ_COMMIT &&
+	    mysql_path_history__enqueue(backend, oid, 1) < 0) {
+		giterr_clear();
+	}
+
+	return error;
+}
+
+int
+mysql_odb_backend__write(git_odb_backend * _backend, const git_oid * oid,
+			 const void *data, size_t len, git_otype type)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_trace_span span;
+	int error;
+
+	MYSQL_TRACE_START(&span, "odb.write", oid, NULL);
+	check_fork(backend);
+	if (backend->journal != NULL) {
+		error = mysql_journal_append(backend->journal, oid, data, len,
+					     type);
+	} else if ((error = mysql_odb__enter(backend)) == GIT_OK) {
+		error = store_object(backend, oid, data, len, type, 0);
+		mysql_odb__leave(backend);
+	}
+
+	// freshly written objects are usually read back right away
+	if (error == GIT_OK && backend->disk_cache != NULL) {
+		mysql_disk_cache_write(backend->disk_cache, oid, data, len,
+				       type);
+	}
+
+	if (error == GIT_OK && backend->header_index != NULL) {
+		mysql_header_index_insert(backend->header_index, oid, len,
+					  type);
+	}
+	MYSQL_TRACE_FINISH(&span, len, error == GIT_OK, error);
+
+	return error;
+}
+
+/*
+ * Close every statement prepared on the backend's connection. The settings
+ * that tell which ones to prepare again are kept. With `stale`, the
+ * connection is gone already, and nothing is sent over it.
+ */
+static void drop_statements(mysql_odb_backend * backend, int stale)
+{
+	char *pool = backend->pool;
+	unsigned int sample_rate = backend->tier_sample_rate;
+
+	// the reads sampled on a lost connection are dropped, they are a hint
+	if (stale) {
+		backend->tier_access_count = 0;
+	}
+
+	backend->pool = NULL;
+	mysql_odb_pool__free(backend);
+	mysql_odb_tier__free(backend);
+	mysql_stats__free(backend);
+	mysql_odb_pack__free(backend);
+	mysql_commit_graph__free(backend);
+	mysql_odb_range__free(backend);
+	mysql_odb_meta__free(backend);
+	mysql_gc__free(backend);
+
+	if (backend->st_read) {
+		mysql_conn_stmt_close(backend->st_read, backend->epoch);
+	}
+	if (backend->st_read_header) {
+		mysql_conn_stmt_close(backend->st_read_header, backend->epoch);
+	}
+	if (backend->st_write) {
+		mysql_conn_stmt_close(backend->st_write, backend->epoch);
+	}
+
+	backend->st_read = NULL;
+	backend->st_read_header = NULL;
+	backend->st_write = NULL;
+
+	backend->pool = pool;
+	backend->tier_sample_rate = sample_rate;
+}
+
+void mysql_odb_backend__free(git_odb_backend * _backend)
+{
+	mysql_odb_backend *backend;
+	unsigned int epoch;
+
+	assert(_backend);
+	backend = (mysql_odb_backend *) _backend;
+
+	// stores what is still journaled, through a backend of its own
+	mysql_journal_close(backend->journal);
+
+	// a thread that did not survive a fork cannot be joined
+	if (backend->generation == mysql_conn_generation()) {
+		mysql_prefetch_free(backend->prefetch);
+	}
+
+	// other backends may be using the connection
+	if (backend->handle != NULL) {
+		mysql_conn_lock(&epoch, backend->handle);
+		drop_statements(backend, epoch != backend->epoch);
+		mysql_conn_leave(backend->handle);
+		mysql_conn_put(backend->handle);
+	}
+	free(backend->pool);
+	mysql_conn_params_free(&backend->conn);
+
+	mysql_disk_cache_close(backend->disk_cache);
+	mysql_header_index_free(backend->header_index);
+
+	free(backend);
+}
+
+static int create_table(MYSQL * db, int layout)
+{
+	static const char *sql_create =
+	    "CREATE TABLE `" GIT2_ODB_TABLE_NAME "` ("
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `type` tinyint(1) unsigned NOT NULL,"
+	    "  `size` bigint(20) unsigned NOT NULL,"
+	    "  `data` longblob NOT NULL,"
+	    "  PRIMARY KEY (`oid`),"
+	    "  KEY `type` (`type`),"
+	    "  KEY `size` (`size`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	// rows are clustered in the order they are written: a push fills
+	// pages at the end of the table, and a clone reads them back in a
+	// few ranges; the secondary index on `oid` holds the `id` to follow
+	static const char *sql_create_sequential =
+	    "CREATE TABLE `" GIT2_ODB_TABLE_NAME "` ("
+	    "  `id` bigint(20) unsigned NOT NULL AUTO_INCREMENT,"
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `type` tinyint(1) unsigned NOT NULL,"
+	    "  `size` bigint(20) unsigned NOT NULL,"
+	    "  `data` longblob NOT NULL,"
+	    "  PRIMARY KEY (`id`),"
+	    "  UNIQUE KEY `oid` (`oid`),"
+	    "  KEY `type` (`type`),"
+	    "  KEY `size` (`size`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	const char *sql = layout == GIT_ODB_MYSQL_LAYOUT_SEQUENTIAL ?
+	    sql_create_sequential : sql_create;
+
+	if (mysql_real_query(db, sql, strlen(sql)) != 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int init_db(MYSQL * db, int layout)
+{
+	static const char *sql_check =
+	    "SHOW TABLES LIKE '" GIT2_ODB_TABLE_NAME "';";
+
+	MYSQL_RES *res;
+	int error;
+	my_ulonglong num_rows;
+
+	if (mysql_real_query(db, sql_check, strlen(sql_check)) != 0)
+		return GIT_ERROR;
+
+	res = mysql_store_result(db);
+	if (res == NULL)
+		return GIT_ERROR;
+
+	num_rows = mysql_num_rows(res);
+	if (num_rows == 0) {
+		/* the table was not found */
+		error = create_table(db, layout);
+	} else if (num_rows > 0) {
+		/* the table was found */
+		error = GIT_OK;
+	} else {
+		error = GIT_ERROR;
+	}
+
+	mysql_free_result(res);
+	return error;
+}
+
+static int init_db_oid(MYSQL * db)
+{
+	return init_db(db, GIT_ODB_MYSQL_LAYOUT_OID);
+}
+
+static int init_db_sequential(MYSQL * db)
+{
+	return init_db(db, GIT_ODB_MYSQL_LAYOUT_SEQUENTIAL);
+}
+
+int mysql_odb__table_sequential(MYSQL * db)
+{
+	static const char *sql =
+	    "SHOW COLUMNS FROM `" GIT2_ODB_TABLE_NAME "` LIKE 'id';";
+	MYSQL_RES *res;
+	int sequential;
+
+	if (mysql_real_query(db, sql, strlen(sql)) != 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		return -1;
+	}
+
+	sequential = mysql_num_rows(res) > 0;
+	mysql_free_result(res);
+
+	return sequential;
+}
+
+/*
+ * Whether `git2_odb` is clustered by `id`, whoever created it. Asked once
+ * per backend, by the batch reads that order their rows by it.
+ */
+int mysql_odb__sequential(mysql_odb_backend * backend)
+{
+	int sequential;
+
+	if (backend->sequential >= 0) {
+		return backend->sequential;
+	}
+
+	// the reads work either way, ask again next time
+	if ((sequential = mysql_odb__table_sequential(backend->db)) < 0) {
+		return 0;
+	}
+
+	backend->sequential = sequential;
+	return sequential;
+}
+
+static void init_binds(mysql_odb_backend * backend)
+{
+	MYSQL_BIND *bind;
+
+	// both reads take the OID from backend->read_oid
+	bind = &backend->read_params[0];
+	bind->buffer = backend->read_oid;
+	bind->buffer_length = GIT_OID_RAWSZ;
+	bind->length = &bind->buffer_length;
+	bind->buffer_type = MYSQL_TYPE_BLOB;
+
+	// and share the first two result columns; the payload column is
+	// pointed at the caller's buffer for each fetch
+	bind = backend->read_results;
+	bind[0].buffer_type = MYSQL_TYPE_TINY;
+	bind[0].buffer = &backend->read_type;
+	bind[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	bind[1].buffer = &backend->read_size;
+	bind[1].is_unsigned = 1;
+	bind[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
+}
+
+/*
+ * Set up what the features turned on so far need on a new connection: the
+ * first one, or one opened again after a fork.
+ */
+static int init_connection(mysql_odb_backend * backend, int stale)
+{
+	char *pool;
+	int error;
+
+	drop_statements(backend, stale);
+
+	pool = backend->pool;
+	backend->pool = NULL;
+
+	error = mysql_conn_init_table(backend->db, &backend->conn,
+				      GIT2_ODB_TABLE_NAME,
+				      backend->layout ==
+				      GIT_ODB_MYSQL_LAYOUT_SEQUENTIAL ?
+				      init_db_sequential : init_db_oid);
+	if (error == GIT_OK) {
+		error = mysql_gc__init(backend);
+	}
+	if (error == GIT_OK && backend->packed) {
+		error = mysql_odb_pack__init(backend);
+	}
+	if (error == GIT_OK && backend->commit_graph) {
+		error = mysql_commit_graph__init(backend);
+	}
+	if (error == GIT_OK && backend->path_history) {
+		error = mysql_path_history__init(backend);
+	}
+	if (error == GIT_OK && pool != NULL) {
+		error = mysql_odb_pool__init(backend, pool,
+					     backend->pool_policy);
+	}
+	if (error == GIT_OK && backend->tier_sample_rate != 0) {
+		error = mysql_odb_tier__init(backend,
+					     backend->tier_sample_rate);
+	}
+	if (error == GIT_OK) {
+		error = mysql_stats__init(backend);
+	}
+
+	// keep the pool for the next attempt
+	if (backend->pool == NULL) {
+		backend->pool = pool;
+		pool = NULL;
+	}
+	free(pool);
+
+	if (error < 0) {
+		giterr_set_str(GITERR_ODB,
+			       "Error preparing the MySql ODB backend");
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int mysql_odb__enter(mysql_odb_backend * backend)
+{
+	MYSQL *db;
+	unsigned int epoch;
+
+	if (mysql_conn_enter(&db, &epoch, backend->handle) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (epoch != backend->epoch) {
+		int stale = backend->epoch != 0;
+
+		backend->db = db;
+		if (init_connection(backend, stale) < 0) {
+			// prepared again on the next call
+			backend->epoch = 0;
+			mysql_conn_leave(backend->handle);
+			return GIT_ERROR;
+		}
+		backend->epoch = epoch;
+	}
+
+	return GIT_OK;
+}
+
+void mysql_odb__leave(mysql_odb_backend * backend)
+{
+	mysql_conn_leave(backend->handle);
+}
+
+int
+git_odb_backend_mysql(git_odb_backend ** backend_out, const char *mysql_host,
+		      unsigned int mysql_port,
+		      const char *mysql_unix_socket,
+		      const char *mysql_db,
+		      const char *mysql_user, const char *mysql_passwd,
+		      unsigned long mysql_client_flag)
+{
+	mysql_odb_backend *backend;
+
+	backend = calloc(1, sizeof(mysql_odb_backend));
+	if (backend == NULL) {
+		return GITERR_NOMEMORY;
+	}
+
+	git_buf_init(&backend->pack_scratch, 0);
+	init_binds(backend);
+	backend->generation = mysql_conn_generation();
+	backend->sequential = -1;
+	backend->meta = -1;
+	backend->stats_request = -1;
+	backend->gc_active = -1;
+
+	// mysql_pipeline.c sends batches of statements in one query
+	if (mysql_conn_params_init(&backend->conn, mysql_host, mysql_port,
+				   mysql_unix_socket, mysql_db, mysql_user,
+				   mysql_passwd,
+				   mysql_client_flag | CLIENT_MULTI_STATEMENTS) <
+	    0) {
+		goto cleanup;
+	}
+	// the connection is made on first use
+	if (mysql_conn_get(&backend->handle, &backend->conn, 0) < 0) {
+		goto cleanup;
+	}
+
+	backend->parent.read = &mysql_odb_backend__read;
+	backend->parent.read_header = &mysql_odb_backend__read_header;
+	backend->parent.write = &mysql_odb_backend__write;
+	backend->parent.exists = &mysql_odb_backend__exists;
+	backend->parent.free = &mysql_odb_backend__free;
+
+	*backend_out = (git_odb_backend *) backend;
+	return GIT_OK;
+
+ cleanup:
+	mysql_odb_backend__free((git_odb_backend *) backend);
+	return GIT_ERROR;
+}
+
+int git_odb_backend_mysql_set_layout(git_odb_backend * _backend, int layout)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+
+	assert(backend);
+
+	if (backend->epoch != 0) {
+		giterr_set_str(GITERR_ODB,
+			       "The MySql ODB backend is connected already");
+		return GIT_ERROR;
+	}
+
+	backend->layout = layout;
+
+	return GIT_OK;
 }
 
 int
-git_odb_backend_mysql(git_odb_backend ** backend_out, const char *mysql_host,
-		      unsigned int mysql_port,
-		      const char *mysql_unix_socket,
-		      const char *mysql_db,
-		      const char *mysql_user, const char *mysql_passwd,
-		      unsigned long mysql_client_flag)
+git_odb_backend_mysql_set_shared_connection(git_odb_backend * _backend,
+					    int shared)
 {
-	mysql_odb_backend *backend;
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_conn *handle;
+
+	assert(backend);
+
+	if (backend->epoch != 0) {
+		giterr_set_str(GITERR_ODB,
+			       "The MySql ODB backend is connected already");
+		return GIT_ERROR;
+	}
+
+	if (mysql_conn_get(&handle, &backend->conn, shared) < 0) {
+		return GIT_ERROR;
+	}
+
+	mysql_conn_put(backend->handle);
+	backend->handle = handle;
+
+	return GIT_OK;
+}
+
+int git_odb_backend_mysql_connect(git_odb_backend * _backend)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+
+	assert(backend);
+
+	if (mysql_odb__enter(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	mysql_odb__leave(backend);
+	return GIT_OK;
+}
+
+int
+git_odb_backend_mysql_set_disk_cache(git_odb_backend * _backend,
+				     const char *path, size_t max_size)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_disk_cache *cache;
+
+	assert(backend && path);
+
+	if (mysql_disk_cache_open(&cache, path, max_size) < 0) {
+		return GIT_ERROR;
+	}
+
+	mysql_disk_cache_close(backend->disk_cache);
+	backend->disk_cache = cache;
+
+	return GIT_OK;
+}
+
+/*
+ * The setters below only note the setting while the backend is not
+ * connected; mysql_odb__enter() prepares what it needs on the first call.
+ */
+
+int
+git_odb_backend_mysql_set_packed(git_odb_backend * _backend,
+				 size_t segment_size)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	int error = GIT_OK;
+
+	assert(backend);
+
+	if (!backend->packed && backend->epoch != 0 &&
+	    (error = mysql_odb__enter(backend)) == GIT_OK) {
+		error = mysql_odb_pack__init(backend);
+		mysql_odb__leave(backend);
+	}
+
+	if (error < 0) {
+		giterr_set_str(GITERR_ODB,
+			       "Error enabling packed storage for MySql ODB backend");
+		return GIT_ERROR;
+	}
+
+	backend->packed = 1;
+	backend->segment_size =
+	    segment_size > 0 ? segment_size : GIT2_PACK_SEGMENT_SIZE;
+	backend->parent.writepack = &mysql_odb_pack__writepack;
+
+	return GIT_OK;
+}
+
+int
+git_odb_backend_mysql_set_commit_graph(git_odb_backend * _backend,
+				       int enabled)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	int error = GIT_OK;
+
+	assert(backend);
+
+	if (enabled && backend->epoch != 0 &&
+	    (error = mysql_odb__enter(backend)) == GIT_OK) {
+		if (backend->st_graph_write == NULL) {
+			error = mysql_commit_graph__init(backend);
+		}
+		mysql_odb__leave(backend);
+	}
+
+	if (error < 0) {
+		giterr_set_str(GITERR_ODB,
+			       "Error enabling the commit graph for MySql ODB backend");
+		return GIT_ERROR;
+	}
+
+	backend->commit_graph = enabled;
+
+	return GIT_OK;
+}
+
+int
+git_odb_backend_mysql_set_path_history(git_odb_backend * _backend,
+				       int enabled)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	int error = GIT_OK;
+
+	assert(backend);
+
+	// the rows are keyed by generation numbers from the graph
+	if (enabled && !backend->commit_graph) {
+		giterr_set_str(GITERR_ODB,
+			       "The path history needs the commit graph");
+		return GIT_ERROR;
+	}
+
+	if (enabled && backend->epoch != 0 &&
+	    (error = mysql_odb__enter(backend)) == GIT_OK) {
+		error = mysql_path_history__init(backend);
+		mysql_odb__leave(backend);
+	}
+
+	if (error < 0) {
+		giterr_set_str(GITERR_ODB,
+			       "Error enabling the path history for MySql ODB backend");
+		return GIT_ERROR;
+	}
+
+	backend->path_history = enabled;
+
+	return GIT_OK;
+}
+
+int
+git_odb_backend_mysql_set_prefetch(git_odb_backend * _backend,
+				   unsigned int max_depth, size_t max_memory)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_prefetch *prefetch = NULL;
+
+	assert(backend);
+
+	if (max_depth > 0 &&
+	    mysql_prefetch_new(&prefetch, &backend->conn, max_depth,
+			       max_memory) < 0) {
+		return GIT_ERROR;
+	}
+
+	// the old prefetcher must have a thread to join
+	check_fork(backend);
+	mysql_prefetch_free(backend->prefetch);
+	backend->prefetch = prefetch;
+
+	return GIT_OK;
+}
+
+int
+git_odb_backend_mysql_set_header_index(git_odb_backend * _backend,
+				       int enabled)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_header_index *index = NULL;
+	int error = GIT_OK;
+
+	assert(backend);
+
+	// the scan cannot wait for the first call
+	if (enabled) {
+		// a sweep seen later clears what the scan loaded
+		mysql_gc__check(backend);
+		if (mysql_header_index_new(&index) < 0 ||
+		    mysql_odb__enter(backend) < 0) {
+			mysql_header_index_free(index);
+			return GIT_ERROR;
+		}
+
+		// the narrow table is a much shorter scan
+		if (mysql_header_index_load(index, backend->db,
+					    mysql_odb_meta__state(backend) ==
+					    MYSQL_ODB_META_COMPLETE ?
+					    GIT2_ODB_META_TABLE_NAME :
+					    GIT2_ODB_TABLE_NAME) < 0 ||
+		    (backend->packed &&
+		     mysql_header_index_load(index, backend->db,
+					     GIT2_PACK_INDEX_TABLE_NAME) < 0)) {
+			error = GIT_ERROR;
+		}
+		mysql_odb__leave(backend);
+
+		if (error < 0) {
+			mysql_header_index_free(index);
+			return GIT_ERROR;
+		}
+	}
+
+	mysql_header_index_free(backend->header_index);
+	backend->header_index = index;
+
+	return GIT_OK;
+}
+
+int
+git_odb_backend_mysql_set_pool(git_odb_backend * _backend, const char *pool,
+			       int policy)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	int error = GIT_OK;
+
+	assert(backend);
+
+	if (backend->epoch == 0) {
+		free(backend->pool);
+		backend->pool = NULL;
+		backend->pool_policy = policy;
+
+		if (pool != NULL && (backend->pool = strdup(pool)) == NULL) {
+			giterr_set_oom();
+			return GIT_ERROR;
+		}
+
+		return GIT_OK;
+	}
+
+	if (mysql_odb__enter(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	mysql_odb_pool__free(backend);
+
+	if (pool != NULL &&
+	    (error = mysql_odb_pool__init(backend, pool, policy)) < 0) {
+		mysql_odb_pool__free(backend);
+	}
+
+	mysql_odb__leave(backend);
+	return error;
+}
+
+int
+git_odb_backend_mysql_set_tiering(git_odb_backend * _backend,
+				  unsigned int sample_rate)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	int error = GIT_OK;
+
+	assert(backend);
+
+	if (backend->epoch == 0) {
+		backend->tier_sample_rate = sample_rate;
+		return GIT_OK;
+	}
+
+	if (mysql_odb__enter(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	mysql_odb_tier__free(backend);
+
+	if (sample_rate != 0 &&
+	    (error = mysql_odb_tier__init(backend, sample_rate)) < 0) {
+		mysql_odb_tier__free(backend);
+	}
+
+	mysql_odb__leave(backend);
+	return error;
+}
+
+int
+git_odb_backend_mysql_set_statistics(git_odb_backend * _backend, int enabled)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	int error = GIT_OK;
+
+	assert(backend);
+
+	backend->stats_request = enabled != 0;
+
+	// otherwise the first call sets it
+	if (backend->epoch != 0 &&
+	    (error = mysql_odb__enter(backend)) == GIT_OK) {
+		mysql_stats__free(backend);
+		error = mysql_stats__init(backend);
+		mysql_odb__leave(backend);
+	}
+
+	if (error < 0) {
+		giterr_set_str(GITERR_ODB,
+			       "Error setting statistics for MySql ODB backend");
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int
+git_odb_backend_mysql_set_shared_cache(git_odb_backend * _backend,
+				       const char *name, size_t max_size)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_disk_cache *cache;
+
+	assert(backend && name);
+
+	if (mysql_disk_cache_open_shared(&cache, name, max_size) < 0) {
+		return GIT_ERROR;
+	}
+
+	mysql_disk_cache_close(backend->disk_cache);
+	backend->disk_cache = cache;
+
+	return GIT_OK;
+}
+
+/* a batch from the write-behind journal, in one transaction */
+static int
+store_journaled(const mysql_journal_object * objects, size_t count,
+		void *payload)
+{
+	mysql_odb_backend *backend = payload;
+	size_t i;
 	int error;
-	my_bool reconnect;
 
-	backend = calloc(1, sizeof(mysql_odb_backend));
-	if (backend == NULL) {
-		return GITERR_NOMEMORY;
+	if (mysql_odb__enter(backend) < 0) {
+		return GIT_ERROR;
 	}
 
-	backend->db = mysql_init(backend->db);
+	if (mysql_real_query(backend->db, "START TRANSACTION", 17) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(backend->db));
+		mysql_odb__leave(backend);
+		return GIT_ERROR;
+	}
 
-	reconnect = 1;
-	// allow libmysql to reconnect gracefully
-	if (mysql_options(backend->db, MYSQL_OPT_RECONNECT, &reconnect) != 0) {
-		goto cleanup;
+	for (i = 0, error = GIT_OK; i < count && error == GIT_OK; i++) {
+		error = store_object(backend, &objects[i].oid, objects[i].data,
+				     objects[i].len, objects[i].type, 1);
 	}
-	// make the connection
-	if (mysql_real_connect
-	    (backend->db, mysql_host, mysql_user, mysql_passwd, mysql_db,
-	     mysql_port, mysql_unix_socket, mysql_client_flag) != backend->db) {
-		goto cleanup;
+
+	if (error == GIT_OK && mysql_real_query(backend->db, "COMMIT", 6) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(backend->db));
+		error = GIT_ERROR;
 	}
-	// check for and possibly create the database
-	error = init_db(backend->db);
 	if (error < 0) {
-		goto cleanup;
+		mysql_real_query(backend->db, "ROLLBACK", 8);
+	}
+
+	mysql_odb__leave(backend);
+	return error;
+}
+
+static void free_journal_backend(void *payload)
+{
+	git_odb_backend *backend = payload;
+
+	backend->free(backend);
+}
+
+/* the largest object an INSERT of store_object() gets through */
+static int max_object_len(size_t * out, mysql_odb_backend * backend)
+{
+	static const char *sql = "SELECT @@max_allowed_packet;";
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	unsigned long long packet = 0;
+	int error;
+
+	if ((error = mysql_odb__enter(backend)) < 0) {
+		return error;
+	}
+
+	if (mysql_real_query(backend->db, sql, strlen(sql)) != 0 ||
+	    (res = mysql_store_result(backend->db)) == NULL) {
+		giterr_set_str(GITERR_ODB, mysql_error(backend->db));
+		mysql_odb__leave(backend);
+		return GIT_ERROR;
+	}
+
+	if ((row = mysql_fetch_row(res)) != NULL && row[0] != NULL) {
+		packet = strtoull(row[0], NULL, 10);
+	}
+	mysql_free_result(res);
+	mysql_odb__leave(backend);
+
+	// the rest of the statement goes in the same packet
+	*out = packet > 1024 ? (size_t) (packet - 1024) : 0;
+	return GIT_OK;
+}
+
+/*
+ * The journal stores through a backend of its own, on a connection of its
+ * own: a batch holds it for a whole transaction. Its files name the
+ * database, so that no other one replays them.
+ */
+static int open_journal(mysql_journal ** out, mysql_odb_backend * backend,
+			const char *dir)
+{
+	mysql_conn_params *conn = &backend->conn;
+	git_odb_backend *store;
+	git_buf identity = GIT_BUF_INIT;
+	size_t max_len;
+	int error;
+
+	if (max_object_len(&max_len, backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	git_buf_printf(&identity, "%s:%u:%s/%s",
+		       conn->host ? conn->host : "", conn->port,
+		       conn->unix_socket ? conn->unix_socket : "",
+		       conn->db ? conn->db : "");
+	if (git_buf_oom(&identity)) {
+		return GIT_ERROR;
+	}
+
+	if (git_odb_backend_mysql(&store, conn->host, conn->port,
+				  conn->unix_socket, conn->db, conn->user,
+				  conn->passwd, conn->client_flag) < 0) {
+		git_buf_free(&identity);
+		return GIT_ERROR;
 	}
 
-	error = init_statements(backend);
+	// the counters are a setting of the database, it finds them there
+	error = git_odb_backend_mysql_set_layout(store, backend->layout);
+	if (error == GIT_OK) {
+		error = git_odb_backend_mysql_set_commit_graph(store,
+							       backend->commit_graph);
+	}
+	if (error == GIT_OK) {
+		error = git_odb_backend_mysql_set_path_history(store,
+							       backend->path_history);
+	}
+	if (error == GIT_OK && backend->pool != NULL) {
+		error = git_odb_backend_mysql_set_pool(store, backend->pool,
+						       backend->pool_policy);
+	}
 	if (error < 0) {
-		goto cleanup;
+		store->free(store);
+		git_buf_free(&identity);
+		return GIT_ERROR;
 	}
 
-	backend->parent.read = &mysql_odb_backend__read;
-	backend->parent.read_header = &mysql_odb_backend__read_header;
-	backend->parent.write = &mysql_odb_backend__write;
-	backend->parent.exists = &mysql_odb_backend__exists;
-	backend->parent.free = &mysql_odb_backend__free;
+	error = mysql_journal_open(out, dir, git_buf_cstr(&identity), max_len,
+				   store_journaled, free_journal_backend,
+				   store);
+	git_buf_free(&identity);
+	return error;
+}
+
+int
+git_odb_backend_mysql_set_write_behind(git_odb_backend * _backend,
+				       const char *dir)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_journal *journal = NULL;
+
+	assert(backend);
+
+	if (dir != NULL && open_journal(&journal, backend, dir) < 0) {
+		return GIT_ERROR;
+	}
+
+	check_fork(backend);
+	mysql_journal_close(backend->journal);
+	backend->journal = journal;
 
-	*backend_out = (git_odb_backend *) backend;
 	return GIT_OK;
+}
 
- cleanup:
-	mysql_odb_backend__free((git_odb_backend *) backend);
-	return GIT_ERROR;
+int git_odb_backend_mysql_flush(git_odb_backend * _backend)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+
+	assert(backend);
+
+	check_fork(backend);
+	if (backend->journal == NULL) {
+		return GIT_OK;
+	}
+
+	return mysql_journal_flush(backend->journal);
 }
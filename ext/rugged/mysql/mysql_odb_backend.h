@@ -0,0 +1,381 @@
+#ifndef MYSQL_ODB_BACKEND_H
+#define MYSQL_ODB_BACKEND_H
+
+#include <time.h>
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_conn.h"
+#include "mysql_disk_cache.h"
+#include "mysql_header_index.h"
+#include "mysql_journal.h"
+#include "mysql_prefetch.h"
+
+#define GIT2_ODB_TABLE_NAME "git2_odb"
+#define GIT2_PACKS_TABLE_NAME "git2_packs"
+#define GIT2_PACK_INDEX_TABLE_NAME "git2_pack_index"
+#define GIT2_COMMIT_GRAPH_TABLE_NAME "git2_commit_graph"
+#define GIT2_POOL_MEMBERS_TABLE_NAME "git2_pool_members"
+#define GIT2_POOL_REFS_TABLE_NAME "git2_pool_refs"
+#define GIT2_ODB_ARCHIVE_TABLE_NAME "git2_odb_archive"
+#define GIT2_ODB_ACCESS_TABLE_NAME "git2_odb_access"
+#define GIT2_STATS_TABLE_NAME "git2_stats"
+#define GIT2_ODB_META_TABLE_NAME "git2_odb_meta"
+#define GIT2_ODB_META_STATE_TABLE_NAME "git2_odb_meta_state"
+#define GIT2_PATH_HISTORY_TABLE_NAME "git2_path_history"
+#define GIT2_PATH_HISTORY_COMMITS_TABLE_NAME "git2_path_history_commits"
+#define GIT2_PATH_HISTORY_QUEUE_TABLE_NAME "git2_path_history_queue"
+#define GIT2_GC_CANDIDATES_TABLE_NAME "git2_gc_candidates"
+#define GIT2_GC_STATE_TABLE_NAME "git2_gc_state"
+#define GIT2_GC_SWEPT_TABLE_NAME "git2_gc_swept"
+#define GIT2_STORAGE_ENGINE "InnoDB"
+
+#define GIT2_PACK_SEGMENT_SIZE (2 * 1024 * 1024)
+#define GIT2_TIER_ACCESS_BATCH 32
+
+typedef struct {
+	git_odb_backend parent;
+	MYSQL *db;		/* set by mysql_odb__enter() */
+	mysql_conn_params conn;
+	mysql_conn *handle;	/* maybe shared with other backends */
+	unsigned int epoch;	/* of the connection the statements are on */
+
+	/* prepared on first use */
+	MYSQL_STMT *st_read;
+	MYSQL_STMT *st_write;
+	MYSQL_STMT *st_read_header;
+	MYSQL_STMT *st_read_range;	/* see mysql_odb_range.c */
+
+	/* bindings shared by st_read and st_read_header, set up once */
+	MYSQL_BIND read_params[1];
+	MYSQL_BIND read_results[3];
+	unsigned char read_oid[GIT_OID_RAWSZ];
+	signed char read_type;
+	unsigned long long read_size;
+
+	mysql_disk_cache *disk_cache;
+	mysql_prefetch *prefetch;
+	mysql_journal *journal;	/* write-behind, maybe shared */
+	unsigned int generation;	/* mysql_conn_generation() of both */
+	mysql_header_index *header_index;
+
+	int layout;		/* of `git2_odb`, if this backend creates it */
+	int sequential;		/* `git2_odb` is clustered by `id`, -1: unknown */
+
+	/* narrow header table, see mysql_odb_meta.c */
+	int meta;		/* MYSQL_ODB_META_*, -1: unknown */
+	time_t meta_checked;
+	MYSQL_STMT *st_meta_read_header;
+
+	/* packed storage mode, see mysql_odb_pack.c */
+	int packed;
+	size_t segment_size;
+	MYSQL_STMT *st_pack_read;
+	MYSQL_STMT *st_pack_read_header;
+	MYSQL_STMT *st_pack_write;
+	git_buf pack_scratch;
+
+	/* commit-graph table, see mysql_commit_graph.c */
+	int commit_graph;
+	MYSQL_STMT *st_graph_write;
+	MYSQL_STMT *st_graph_update;
+
+	/* path-history index, see mysql_path_history.c */
+	int path_history;
+
+	/* shared object pool, see mysql_odb_pool.c */
+	char *pool;
+	int pool_policy;
+	unsigned int pool_member;
+	MYSQL_STMT *st_pool_read;
+	MYSQL_STMT *st_pool_read_header;
+	MYSQL_STMT *st_pool_write;
+	MYSQL_STMT *st_pool_ref;
+
+	/* hot/cold tiering, see mysql_odb_tier.c */
+	unsigned int tier_sample_rate;	/* 0 when off */
+	unsigned int tier_rng;
+	git_oid tier_access[GIT2_TIER_ACCESS_BATCH];
+	size_t tier_access_count;
+	MYSQL_STMT *st_tier_read;
+	MYSQL_STMT *st_tier_read_header;
+
+	/* unreachable objects found again, see mysql_gc.c */
+	MYSQL_STMT *st_gc_touch;
+	int gc_active;		/* a run or its candidates, -1: unknown */
+	unsigned long long gc_swept;	/* token of the last sweep seen */
+	time_t gc_checked;
+
+	/* object counters, see mysql_stats.c */
+	int stats;		/* the database keeps them */
+	int stats_request;	/* set_statistics() to apply, -1: none */
+	MYSQL_STMT *st_stats_add;
+} mysql_odb_backend;
+
+/* where writes go once a pool is set */
+enum {
+	GIT_ODB_MYSQL_POOL_LOCAL,	/* always to this repository */
+	GIT_ODB_MYSQL_POOL_EXISTING,	/* to the pool if it has the object */
+	GIT_ODB_MYSQL_POOL_ALL,	/* always to the pool */
+};
+
+/* how `git2_odb` is clustered */
+enum {
+	GIT_ODB_MYSQL_LAYOUT_OID,	/* by object id */
+	GIT_ODB_MYSQL_LAYOUT_SEQUENTIAL,	/* by an auto-increment id */
+};
+
+int
+git_odb_backend_mysql(git_odb_backend ** backend_out, const char *mysql_host,
+		      unsigned int mysql_port,
+		      const char *mysql_unix_socket,
+		      const char *mysql_db,
+		      const char *mysql_user, const char *mysql_passwd,
+		      unsigned long mysql_client_flag);
+
+/*
+ * Put a persistent, memory-mapped object cache at `path` in front of MySQL.
+ * The file is shared by every process on the host that opens it.
+ */
+int git_odb_backend_mysql_set_disk_cache(git_odb_backend * backend,
+					 const char *path, size_t max_size);
+
+/*
+ * Prefetch the entries of every tree that is read, `max_depth` levels
+ * deep, holding at most `max_memory` bytes. A depth of 0 turns it off.
+ */
+int git_odb_backend_mysql_set_prefetch(git_odb_backend * backend,
+				       unsigned int max_depth,
+				       size_t max_memory);
+
+/*
+ * Answer read_header and exists from an in-memory index of every object's
+ * type and size, loaded now with one scan and kept up to date on writes.
+ */
+int git_odb_backend_mysql_set_header_index(git_odb_backend * backend,
+					   int enabled);
+
+/*
+ * Store pushed packs as segments of about `segment_size` bytes in
+ * `git2_packs`, indexed by `git2_pack_index`. Loose objects keep working.
+ */
+int git_odb_backend_mysql_set_packed(git_odb_backend * backend,
+				     size_t segment_size);
+
+/*
+ * Keep `git2_commit_graph` up to date as commits are written, so history
+ * queries in mysql_commit_graph.h can use it.
+ */
+int git_odb_backend_mysql_set_commit_graph(git_odb_backend * backend,
+					   int enabled);
+
+/*
+ * Queue commits as they are written for `git2_path_history`, the per-path
+ * history in mysql_path_history.h. Needs the commit graph.
+ */
+int git_odb_backend_mysql_set_path_history(git_odb_backend * backend,
+					   int enabled);
+
+/*
+ * Share objects with other repositories through the database `pool` on the
+ * same server. Objects missing here are read from the pool, and writes go
+ * there as `policy` allows. Pass a NULL pool to stop using it.
+ */
+int git_odb_backend_mysql_set_pool(git_odb_backend * backend,
+				   const char *pool, int policy);
+
+/*
+ * Drop this repository's references into the pool, before the repository
+ * itself is deleted. Its objects stay in the pool until pruned.
+ */
+int git_odb_backend_mysql_leave_pool(git_odb_backend * backend);
+
+/* delete pool objects no repository references any more */
+int git_odb_backend_mysql_prune_pool(size_t * deleted,
+				     git_odb_backend * backend,
+				     size_t batch_size);
+
+/*
+ * Move objects nobody reads to `git2_odb_archive`. One in `sample_rate`
+ * reads is recorded in `git2_odb_access`, and a sampled read of an
+ * archived object moves it back. Pass 0 to turn tiering off.
+ */
+int git_odb_backend_mysql_set_tiering(git_odb_backend * backend,
+				      unsigned int sample_rate);
+
+/*
+ * Keep the number and size of the stored objects of each type in
+ * `git2_stats`, see mysql_stats.h. This is a setting of the database:
+ * every backend that connects to it afterwards keeps the counters, until
+ * one turns them off.
+ */
+int git_odb_backend_mysql_set_statistics(git_odb_backend * backend,
+					 int enabled);
+
+/*
+ * Write objects to a journal in the local directory `dir` and return once
+ * it is on disk; a background thread stores them in MySQL in batched
+ * transactions, and reads look in the journal first. The objects are
+ * stored with the pool, statistics and commit graph settings made so far.
+ * Pass NULL to write to MySQL directly again.
+ */
+int git_odb_backend_mysql_set_write_behind(git_odb_backend * backend,
+					   const char *dir);
+
+/*
+ * Read `length` bytes of an object from `offset` into `data_p`, fewer at
+ * its end, without fetching the rest from MySQL. `size_p` gets the size of
+ * the whole object. The data is freed with free().
+ */
+int git_odb_backend_mysql_read_range(void **data_p, size_t * len_p,
+				     git_otype * type_p, size_t * size_p,
+				     git_odb_backend * backend,
+				     const git_oid * oid, size_t offset,
+				     size_t length);
+
+/* wait until the objects written behind so far are stored in MySQL */
+int git_odb_backend_mysql_flush(git_odb_backend * backend);
+
+/*
+ * Share the connection with the other backends of this process that ask
+ * for one to the same server and database, see mysql_conn_get(). Only
+ * before the backend is first used.
+ */
+int git_odb_backend_mysql_set_shared_connection(git_odb_backend * backend,
+						int shared);
+
+/*
+ * Create `git2_odb`, if it does not exist yet, with rows clustered by
+ * `layout`. GIT_ODB_MYSQL_LAYOUT_SEQUENTIAL keeps objects written together
+ * on the same pages, and batch reads then go in that order. An existing
+ * table is used as it is. Only before the backend is first used.
+ */
+int git_odb_backend_mysql_set_layout(git_odb_backend * backend, int layout);
+
+/*
+ * Connect, and prepare what the enabled features need, if that has not
+ * happened yet or happened before a fork. The backend callbacks do this
+ * themselves. It does not keep the connection locked: code that takes
+ * backend->db directly goes through mysql_odb__enter() instead.
+ */
+int git_odb_backend_mysql_connect(git_odb_backend * backend);
+
+/*
+ * Share an object cache of `max_size` bytes with every process on the host
+ * through the POSIX shared-memory segment `name` ("/name"), in place of a
+ * disk cache.
+ */
+int git_odb_backend_mysql_set_shared_cache(git_odb_backend * backend,
+					   const char *name, size_t max_size);
+
+/*
+ * Connect if needed and lock the connection, for a callback that uses it.
+ * Nothing stays locked on error.
+ */
+int mysql_odb__enter(mysql_odb_backend * backend);
+void mysql_odb__leave(mysql_odb_backend * backend);
+
+/* with the connection entered; 1 if `git2_odb` is clustered by `id` */
+int mysql_odb__sequential(mysql_odb_backend * backend);
+/* the same on a connection of its own, -1 on error */
+int mysql_odb__table_sequential(MYSQL * db);
+
+/* how far the headers of `git2_odb` are in `git2_odb_meta` */
+enum {
+	MYSQL_ODB_META_NONE,	/* not at all */
+	MYSQL_ODB_META_BACKFILL,	/* new objects, older ones being copied */
+	MYSQL_ODB_META_COMPLETE,	/* every object */
+};
+
+int mysql_odb_meta__state(mysql_odb_backend * backend);
+int mysql_odb_meta__read_header(size_t * len_p, git_otype * type_p,
+				mysql_odb_backend * backend,
+				const git_oid * oid);
+void mysql_odb_meta__free(mysql_odb_backend * backend);
+
+int mysql_odb__read_header(size_t * len_p, git_otype * type_p,
+			   mysql_odb_backend * backend, MYSQL_STMT * stmt,
+			   const git_oid * oid);
+int mysql_odb__read(void **data_p, size_t * len_p, git_otype * type_p,
+		    mysql_odb_backend * backend, MYSQL_STMT * header_stmt,
+		    MYSQL_STMT * stmt, const git_oid * oid);
+
+int mysql_odb_range__read(void **data_p, size_t * len_p, git_otype * type_p,
+			  size_t * size_p, mysql_odb_backend * backend,
+			  const git_oid * oid, size_t offset, size_t length);
+void mysql_odb_range__free(mysql_odb_backend * backend);
+
+int mysql_odb_pack__init(mysql_odb_backend * backend);
+void mysql_odb_pack__free(mysql_odb_backend * backend);
+int mysql_odb_pack__read(void **data_p, size_t * len_p, git_otype * type_p,
+			 mysql_odb_backend * backend, const git_oid * oid);
+int mysql_odb_pack__read_header(size_t * len_p, git_otype * type_p,
+				mysql_odb_backend * backend,
+				const git_oid * oid);
+int mysql_odb_pack__unpack(void *out, size_t size, const unsigned char *data,
+			   size_t len, size_t offset);
+int mysql_odb_pack__writepack(git_odb_writepack ** out,
+			      git_odb_backend * backend, git_odb * odb,
+			      git_transfer_progress_callback progress_cb,
+			      void *progress_payload);
+
+int mysql_odb_pool__init(mysql_odb_backend * backend, const char *pool,
+			 int policy);
+void mysql_odb_pool__free(mysql_odb_backend * backend);
+int mysql_odb_pool__read(void **data_p, size_t * len_p, git_otype * type_p,
+			 mysql_odb_backend * backend, const git_oid * oid);
+int mysql_odb_pool__read_header(size_t * len_p, git_otype * type_p,
+				mysql_odb_backend * backend,
+				const git_oid * oid);
+/* GIT_OK if the pool has the object, now referenced by this repository */
+int mysql_odb_pool__exists(mysql_odb_backend * backend, const git_oid * oid);
+/* GIT_PASSTHROUGH when the object belongs in the local store */
+int mysql_odb_pool__write(mysql_odb_backend * backend, const git_oid * oid,
+			  const void *data, size_t len, git_otype type);
+
+int mysql_odb_tier__init(mysql_odb_backend * backend,
+			 unsigned int sample_rate);
+void mysql_odb_tier__free(mysql_odb_backend * backend);
+int mysql_odb_tier__read(void **data_p, size_t * len_p, git_otype * type_p,
+			 mysql_odb_backend * backend, const git_oid * oid);
+int mysql_odb_tier__read_header(size_t * len_p, git_otype * type_p,
+				mysql_odb_backend * backend,
+				const git_oid * oid);
+/* record a read from the hot table, one in tier_sample_rate of them */
+void mysql_odb_tier__touch(mysql_odb_backend * backend, const git_oid * oid);
+
+/* apply stats_request, then look whether the database keeps counters */
+int mysql_stats__init(mysql_odb_backend * backend);
+void mysql_stats__free(mysql_odb_backend * backend);
+/* count one object written to `git2_odb`, in the transaction of its row */
+int mysql_stats__add(mysql_odb_backend * backend, git_otype type, size_t len);
+/*
+ * Add (`sign` > 0) or take away the objects in the rows of `table` that
+ * match `where`, in the transaction that writes or deletes those rows.
+ */
+int mysql_stats__apply_rows(mysql_odb_backend * backend, const char *table,
+			    const git_buf * where, int sign);
+
+int mysql_commit_graph__init(mysql_odb_backend * backend);
+void mysql_commit_graph__free(mysql_odb_backend * backend);
+int mysql_commit_graph__add(mysql_odb_backend * backend, const git_oid * oid,
+			    const void *data, size_t len);
+/* for the commits of `oids`, or for the whole graph if NULL */
+int mysql_commit_graph__fix_generations(mysql_odb_backend * backend,
+					const git_oid * oids, size_t count);
+
+int mysql_gc__init(mysql_odb_backend * backend);
+void mysql_gc__free(mysql_odb_backend * backend);
+/* take an object off the gc candidates, it is in use again */
+int mysql_gc__touch(mysql_odb_backend * backend, const git_oid * oid);
+/* without the connection: see whether gc runs or swept, now and then */
+void mysql_gc__check(mysql_odb_backend * backend);
+
+int mysql_path_history__init(mysql_odb_backend * backend);
+/* leave commits written now to the backfill, in one statement */
+int mysql_path_history__enqueue(mysql_odb_backend * backend,
+				const git_oid * oids, size_t count);
+
+#endif
@@ -0,0 +1,151 @@
+/*
+ * Narrow header table.
+ *
+ * read_header and exists only need an object's type and size, but the
+ * rows of `git2_odb` hold the payload too, so a lookup there pulls pages
+ * of blob data into the buffer pool. `git2_odb_meta` holds the type, the
+ * size, the codec and the location of every object of `git2_odb`, a few
+ * dozen bytes a row, and the lookups go there once it exists. Triggers on
+ * `git2_odb` keep it in step with every writer, and mysql_meta_migrate.c
+ * copies the rows that were there before.
+ *
+ * While that copy runs, a miss in the narrow table is looked up in
+ * `git2_odb` as well. The state is read from `git2_odb_meta_state` and
+ * read again every META_RECHECK seconds until the copy is complete.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+
+#define META_RECHECK 60
+
+static int read_state(MYSQL * db)
+{
+	static const char *sql_check =
+	    "SHOW TABLES LIKE '" GIT2_ODB_META_STATE_TABLE_NAME "';";
+	static const char *sql_state =
+	    "SELECT `done` FROM `" GIT2_ODB_META_STATE_TABLE_NAME
+	    "` WHERE `id` = 1;";
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int state;
+
+	if (mysql_real_query(db, sql_check, strlen(sql_check)) != 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	state = mysql_num_rows(res) > 0 ?
+	    MYSQL_ODB_META_BACKFILL : MYSQL_ODB_META_NONE;
+	mysql_free_result(res);
+
+	if (state == MYSQL_ODB_META_NONE) {
+		return state;
+	}
+
+	if (mysql_real_query(db, sql_state, strlen(sql_state)) != 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	if ((row = mysql_fetch_row(res)) != NULL && row[0] != NULL &&
+	    atoi(row[0]) != 0) {
+		state = MYSQL_ODB_META_COMPLETE;
+	}
+	mysql_free_result(res);
+
+	return state;
+}
+
+/*
+ * With the connection entered; one of MYSQL_ODB_META_*. When the state
+ * cannot be read, the lookups go to `git2_odb` alone, which is always
+ * right, and it is asked again on the next call.
+ */
+int mysql_odb_meta__state(mysql_odb_backend * backend)
+{
+	time_t now;
+	int state;
+
+	if (backend->meta == MYSQL_ODB_META_COMPLETE) {
+		return backend->meta;
+	}
+
+	now = time(NULL);
+	if (backend->meta >= 0 && now - backend->meta_checked < META_RECHECK) {
+		return backend->meta;
+	}
+
+	if ((state = read_state(backend->db)) < 0) {
+		return MYSQL_ODB_META_NONE;
+	}
+
+	backend->meta = state;
+	backend->meta_checked = now;
+
+	return state;
+}
+
+static int prepare_meta(mysql_odb_backend * backend)
+{
+	static const char *sql =
+	    "SELECT `type`, `size` FROM `" GIT2_ODB_META_TABLE_NAME
+	    "` WHERE `oid` = ?;";
+
+	if (backend->st_meta_read_header != NULL) {
+		return GIT_OK;
+	}
+
+	if ((backend->st_meta_read_header = mysql_stmt_init(backend->db)) ==
+	    NULL) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_prepare(backend->st_meta_read_header, sql,
+			       strlen(sql)) != 0 ||
+	    mysql_stmt_bind_param(backend->st_meta_read_header,
+				  backend->read_params) != 0) {
+		giterr_set_str(GITERR_ODB,
+			       mysql_stmt_error(backend->st_meta_read_header));
+		mysql_stmt_close(backend->st_meta_read_header);
+		backend->st_meta_read_header = NULL;
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+/* the header of an object of `git2_odb` from the narrow table */
+int
+mysql_odb_meta__read_header(size_t * len_p, git_otype * type_p,
+			    mysql_odb_backend * backend, const git_oid * oid)
+{
+	assert(len_p && type_p && backend && oid);
+
+	if (prepare_meta(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	return mysql_odb__read_header(len_p, type_p, backend,
+				      backend->st_meta_read_header, oid);
+}
+
+/* the state is read again on a new connection, it may be another server */
+void mysql_odb_meta__free(mysql_odb_backend * backend)
+{
+	if (backend->st_meta_read_header) {
+		mysql_conn_stmt_close(backend->st_meta_read_header,
+				      backend->epoch);
+	}
+
+	backend->st_meta_read_header = NULL;
+	backend->meta = -1;
+}
@@ -0,0 +1,1560 @@
+/*
+ * Packed storage mode.
+ *
+ * Pushed packs are indexed locally and then stored in `git2_packs` as large
+ * segments. Every segment is a self-contained packfile, and `git2_pack_index`
+ * maps each OID to its byte range inside one. A delta of the pushed pack is
+ * kept as it is when its base went to the same segment, as an OFS_DELTA
+ * entry; `chain` is then the distance back to the undeltified entry its
+ * chain starts from, so a single ranged query still returns everything
+ * needed to resolve it. Objects that are written one at a time stay loose
+ * in `git2_odb`; reads look at both.
+ */
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <hash.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+
+#define PACK_INDEX_ROWS_PER_INSERT 500
+
+#define PACK_OBJ_OFS_DELTA 6
+#define PACK_OBJ_REF_DELTA 7
+
+// longer chains and spans are cut by storing the object in full
+#define PACK_MAX_DELTA_DEPTH 16
+#define PACK_MAX_DELTA_SPAN (1024 * 1024)
+
+typedef struct {
+	git_oid oid;
+	git_otype type;
+	size_t size;
+	size_t offset;
+	size_t length;
+	size_t chain;
+} pack_entry;
+
+typedef struct {
+	git_buf data;
+	pack_entry *entries;
+	size_t count;
+	size_t alloc;
+	unsigned int number;
+} pack_segment;
+
+typedef struct {
+	git_odb_writepack parent;
+	git_indexer *indexer;
+	char *dir;
+} mysql_odb_writepack;
+
+typedef struct {
+	git_oid oid;
+	git_otype type;
+	size_t size;
+	size_t offset;		/* of its entry in the pushed pack */
+	size_t end;
+	unsigned int segment;	/* it was stored in, 0 before that */
+	size_t seg_offset;
+	size_t root;		/* seg_offset of the full entry of its chain */
+	unsigned int depth;
+} pack_object;
+
+typedef struct {
+	git_odb *odb;
+	pack_object *objects;
+	size_t count;
+	size_t alloc;
+	const unsigned char *pack;	/* the pushed pack, NULL to store in full */
+	size_t pack_len;
+	const unsigned char *idx;
+	size_t idx_len;
+	pack_object **by_offset;
+} pack_object_list;
+
+typedef struct {
+	int type;
+	size_t size;		/* of the object, or of the delta data */
+	size_t header_len;
+	size_t base;		/* offset of the base of an OFS_DELTA */
+	const unsigned char *base_oid;	/* of a REF_DELTA */
+} pack_entry_header;
+
+static int prepare(MYSQL * db, MYSQL_STMT ** out, const char *sql)
+{
+	my_bool truth = 1;
+
+	*out = mysql_stmt_init(db);
+	if (*out == NULL) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_attr_set(*out, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_prepare(*out, sql, strlen(sql)) != 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int create_tables(MYSQL * db)
+{
+	static const char *sql_check =
+	    "SHOW TABLES LIKE '" GIT2_PACK_INDEX_TABLE_NAME "';";
+
+	static const char *sql_create_packs =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_PACKS_TABLE_NAME "` ("
+	    "  `pack_id` bigint(20) unsigned NOT NULL AUTO_INCREMENT,"
+	    "  `objects` int(10) unsigned NOT NULL,"
+	    "  `data` longblob NOT NULL,"
+	    "  PRIMARY KEY (`pack_id`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	static const char *sql_create_index =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_PACK_INDEX_TABLE_NAME "` ("
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `pack_id` bigint(20) unsigned NOT NULL,"
+	    "  `offset` bigint(20) unsigned NOT NULL,"
+	    "  `length` int(10) unsigned NOT NULL,"
+	    "  `type` tinyint(1) unsigned NOT NULL,"
+	    "  `size` bigint(20) unsigned NOT NULL,"
+	    "  `chain` int(10) unsigned NOT NULL DEFAULT 0,"
+	    "  PRIMARY KEY (`oid`),"
+	    "  KEY `pack` (`pack_id`, `offset`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	static const char *sql_check_chain =
+	    "SHOW COLUMNS FROM `" GIT2_PACK_INDEX_TABLE_NAME "` LIKE 'chain';";
+
+	// tables from before deltas were kept hold only full entries
+	static const char *sql_add_chain =
+	    "ALTER TABLE `" GIT2_PACK_INDEX_TABLE_NAME "` ADD COLUMN"
+	    " `chain` int(10) unsigned NOT NULL DEFAULT 0;";
+
+	MYSQL_RES *res;
+	my_ulonglong num_rows;
+
+	if (mysql_real_query(db, sql_check, strlen(sql_check)) != 0) {
+		return GIT_ERROR;
+	}
+
+	res = mysql_store_result(db);
+	if (res == NULL) {
+		return GIT_ERROR;
+	}
+
+	num_rows = mysql_num_rows(res);
+	mysql_free_result(res);
+
+	if (num_rows > 0) {
+		if (mysql_real_query(db, sql_check_chain,
+				     strlen(sql_check_chain)) != 0 ||
+		    (res = mysql_store_result(db)) == NULL) {
+			return GIT_ERROR;
+		}
+
+		num_rows = mysql_num_rows(res);
+		mysql_free_result(res);
+
+		if (num_rows == 0 &&
+		    mysql_real_query(db, sql_add_chain,
+				     strlen(sql_add_chain)) != 0) {
+			return GIT_ERROR;
+		}
+
+		return GIT_OK;
+	}
+
+	if (mysql_real_query(db, sql_create_packs, strlen(sql_create_packs))
+	    != 0) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_real_query(db, sql_create_index, strlen(sql_create_index))
+	    != 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int mysql_odb_pack__init(mysql_odb_backend * backend)
+{
+	static const char *sql_read =
+	    "SELECT i.`type`, i.`size`,"
+	    " SUBSTRING(p.`data`, i.`offset` - i.`chain` + 1,"
+	    " i.`length` + i.`chain`), i.`chain` + 1 FROM `"
+	    GIT2_PACK_INDEX_TABLE_NAME "` i JOIN `" GIT2_PACKS_TABLE_NAME
+	    "` p ON p.`pack_id` = i.`pack_id` WHERE i.`oid` = ?"
+	    " UNION ALL SELECT `type`, `size`, `data`, 0 FROM `"
+	    GIT2_ODB_TABLE_NAME "` WHERE `oid` = ? LIMIT 1;";
+
+	static const char *sql_read_header =
+	    "SELECT `type`, `size` FROM `" GIT2_PACK_INDEX_TABLE_NAME
+	    "` WHERE `oid` = ? UNION ALL SELECT `type`, `size` FROM `"
+	    GIT2_ODB_TABLE_NAME "` WHERE `oid` = ? LIMIT 1;";
+
+	static const char *sql_write =
+	    "INSERT INTO `" GIT2_PACKS_TABLE_NAME
+	    "` (`objects`, `data`) VALUES (?, ?);";
+
+	if (create_tables(backend->db) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (prepare(backend->db, &backend->st_pack_read, sql_read) < 0 ||
+	    prepare(backend->db, &backend->st_pack_read_header,
+		    sql_read_header) < 0 ||
+	    prepare(backend->db, &backend->st_pack_write, sql_write) < 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+void mysql_odb_pack__free(mysql_odb_backend * backend)
+{
+	if (backend->st_pack_read) {
+		mysql_conn_stmt_close(backend->st_pack_read, backend->epoch);
+	}
+	if (backend->st_pack_read_header) {
+		mysql_conn_stmt_close(backend->st_pack_read_header,
+				      backend->epoch);
+	}
+	if (backend->st_pack_write) {
+		mysql_conn_stmt_close(backend->st_pack_write, backend->epoch);
+	}
+
+	backend->st_pack_read = NULL;
+	backend->st_pack_read_header = NULL;
+	backend->st_pack_write = NULL;
+	git_buf_free(&backend->pack_scratch);
+}
+
+static int inflate_buffer(void *out, size_t out_len, const unsigned char *in,
+			  size_t in_len)
+{
+	z_stream zs;
+	int error;
+
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit(&zs) != Z_OK) {
+		return GIT_ERROR;
+	}
+
+	zs.next_in = (Bytef *) in;
+	zs.avail_in = (uInt) in_len;
+	zs.next_out = (Bytef *) out;
+	zs.avail_out = (uInt) out_len;
+
+	error = inflate(&zs, Z_FINISH);
+	inflateEnd(&zs);
+
+	if (error != Z_STREAM_END || zs.total_out != out_len) {
+		giterr_set_str(GITERR_ZLIB, "Corrupted object in MySql ODB");
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int corrupted(void)
+{
+	giterr_set_str(GITERR_ODB, "Corrupted pack entry in MySql ODB");
+	return GIT_ERROR;
+}
+
+static int
+parse_entry(pack_entry_header * h, const unsigned char *data, size_t len,
+	    size_t offset)
+{
+	const unsigned char *in = data + offset;
+	size_t avail, i = 0, shift = 4, ofs;
+	unsigned char c;
+
+	if (offset >= len) {
+		return corrupted();
+	}
+	avail = len - offset;
+
+	c = in[i++];
+	h->type = (c >> 4) & 7;
+	h->size = c & 15;
+	while (c & 0x80) {
+		if (i >= avail || shift >= sizeof(size_t) * 8) {
+			return corrupted();
+		}
+		c = in[i++];
+		h->size |= (size_t) (c & 0x7f) << shift;
+		shift += 7;
+	}
+
+	h->base = 0;
+	h->base_oid = NULL;
+
+	if (h->type == PACK_OBJ_OFS_DELTA) {
+		if (i >= avail) {
+			return corrupted();
+		}
+		c = in[i++];
+		ofs = c & 0x7f;
+		while (c & 0x80) {
+			if (i >= avail) {
+				return corrupted();
+			}
+			c = in[i++];
+			ofs = ((ofs + 1) << 7) | (c & 0x7f);
+		}
+		if (ofs == 0 || ofs > offset) {
+			return corrupted();
+		}
+		h->base = offset - ofs;
+	} else if (h->type == PACK_OBJ_REF_DELTA) {
+		if (avail - i < GIT_OID_RAWSZ) {
+			return corrupted();
+		}
+		h->base_oid = in + i;
+		i += GIT_OID_RAWSZ;
+	}
+
+	h->header_len = i;
+	return GIT_OK;
+}
+
+static int inflate_entry(void *out, const pack_entry_header * h,
+			 const unsigned char *data, size_t len, size_t offset)
+{
+	if (h->size == 0) {
+		return GIT_OK;
+	}
+
+	return inflate_buffer(out, h->size, data + offset + h->header_len,
+			      len - offset - h->header_len);
+}
+
+static int delta_varint(size_t * out, const unsigned char **p,
+			const unsigned char *end)
+{
+	size_t shift = 0;
+	unsigned char c;
+
+	*out = 0;
+	do {
+		if (*p >= end || shift >= sizeof(size_t) * 8) {
+			return corrupted();
+		}
+		c = *(*p)++;
+		*out |= (size_t) (c & 0x7f) << shift;
+		shift += 7;
+	} while (c & 0x80);
+
+	return GIT_OK;
+}
+
+/* Apply git delta data to `base`, `out` has the size the delta names. */
+static int
+apply_delta(unsigned char *out, size_t out_len, const unsigned char *base,
+	    size_t base_len, const unsigned char *p, const unsigned char *end)
+{
+	size_t pos = 0;
+
+	while (p < end) {
+		unsigned char op = *p++;
+
+		if (op & 0x80) {
+			size_t off = 0, n = 0;
+			int i;
+
+			for (i = 0; i < 4; i++) {
+				if (op & (1 << i)) {
+					if (p >= end) {
+						return corrupted();
+					}
+					off |= (size_t) * p++ << (8 * i);
+				}
+			}
+			for (i = 0; i < 3; i++) {
+				if (op & (0x10 << i)) {
+					if (p >= end) {
+						return corrupted();
+					}
+					n |= (size_t) * p++ << (8 * i);
+				}
+			}
+			if (n == 0) {
+				n = 0x10000;
+			}
+
+			if (off > base_len || n > base_len - off ||
+			    n > out_len - pos) {
+				return corrupted();
+			}
+			memcpy(out + pos, base + off, n);
+			pos += n;
+		} else if (op != 0) {
+			if (op > (size_t) (end - p) || op > out_len - pos) {
+				return corrupted();
+			}
+			memcpy(out + pos, p, op);
+			p += op;
+			pos += op;
+		} else {
+			return corrupted();
+		}
+	}
+
+	return pos == out_len ? GIT_OK : corrupted();
+}
+
+int
+mysql_odb_pack__unpack(void *out, size_t size, const unsigned char *data,
+		       size_t len, size_t offset)
+{
+	size_t chain[PACK_MAX_DELTA_DEPTH];
+	size_t depth = 0, base_len, delta_len, src_len, dst_len;
+	unsigned char *base = NULL, *delta = NULL, *target;
+	const unsigned char *p;
+	pack_entry_header h;
+	int error;
+
+	for (;;) {
+		if (parse_entry(&h, data, len, offset) < 0) {
+			return GIT_ERROR;
+		}
+		if (h.type != PACK_OBJ_OFS_DELTA) {
+			break;
+		}
+		if (depth == PACK_MAX_DELTA_DEPTH) {
+			return corrupted();
+		}
+		chain[depth++] = offset;
+		offset = h.base;
+	}
+
+	if (h.type < GIT_OBJ_COMMIT || h.type > GIT_OBJ_TAG) {
+		return corrupted();
+	}
+
+	if (depth == 0) {
+		return h.size == size ? inflate_entry(out, &h, data, len, offset)
+		    : corrupted();
+	}
+
+	base_len = h.size;
+	if ((base = malloc(base_len + 1)) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+	if ((error = inflate_entry(base, &h, data, len, offset)) < 0) {
+		goto done;
+	}
+
+	// from the base up, every delta applies to the object before it
+	while (depth-- > 0) {
+		if ((error = parse_entry(&h, data, len, chain[depth])) < 0) {
+			goto done;
+		}
+
+		delta_len = h.size;
+		if ((delta = malloc(delta_len + 1)) == NULL) {
+			giterr_set_oom();
+			error = GIT_ERROR;
+			goto done;
+		}
+		if ((error = inflate_entry(delta, &h, data, len,
+					   chain[depth])) < 0) {
+			goto done;
+		}
+
+		p = delta;
+		if ((error = delta_varint(&src_len, &p, delta + delta_len)) < 0 ||
+		    (error = delta_varint(&dst_len, &p, delta + delta_len)) < 0) {
+			goto done;
+		}
+		if (src_len != base_len || (depth == 0 && dst_len != size)) {
+			error = corrupted();
+			goto done;
+		}
+
+		if (depth == 0) {
+			target = out;
+		} else if ((target = malloc(dst_len + 1)) == NULL) {
+			giterr_set_oom();
+			error = GIT_ERROR;
+			goto done;
+		}
+
+		error = apply_delta(target, dst_len, base, base_len, p,
+				    delta + delta_len);
+		free(delta);
+		delta = NULL;
+		free(base);
+		base = NULL;
+
+		if (depth > 0) {
+			base = target;
+			base_len = dst_len;
+		}
+		if (error < 0) {
+			goto done;
+		}
+	}
+
+ done:
+	free(delta);
+	free(base);
+	return error;
+}
+
+/*
+ * Unpack either the pack entry at `chain` - 1 of `in`, or a loose row stored
+ * with MySQL's COMPRESS(), which prefixes the zlib stream with a 4-byte
+ * length.
+ */
+static int decode_object(void *out, size_t size, const unsigned char *in,
+			 size_t in_len, unsigned long long chain)
+{
+	if (chain > 0) {
+		return mysql_odb_pack__unpack(out, size, in, in_len,
+					      (size_t) chain - 1);
+	}
+
+	if (size == 0) {
+		return GIT_OK;
+	}
+
+	if (in_len < 4) {
+		giterr_set_str(GITERR_ODB, "Corrupted object in MySql ODB");
+		return GIT_ERROR;
+	}
+
+	return inflate_buffer(out, size, in + 4, in_len - 4);
+}
+
+static void bind_oid_twice(MYSQL_BIND * bind_buffers, const git_oid * oid)
+{
+	int i;
+
+	memset(bind_buffers, 0, sizeof(MYSQL_BIND) * 2);
+
+	for (i = 0; i < 2; i++) {
+		bind_buffers[i].buffer = (void *)oid->id;
+		bind_buffers[i].buffer_length = 20;
+		bind_buffers[i].length = &bind_buffers[i].buffer_length;
+		bind_buffers[i].buffer_type = MYSQL_TYPE_BLOB;
+	}
+}
+
+int
+mysql_odb_pack__read_header(size_t * len_p, git_otype * type_p,
+			    mysql_odb_backend * backend, const git_oid * oid)
+{
+	MYSQL_STMT *st = backend->st_pack_read_header;
+	MYSQL_BIND bind_buffers[2];
+	MYSQL_BIND result_buffers[2];
+	unsigned char type;
+	unsigned long long size;
+	int error;
+
+	bind_oid_twice(bind_buffers, oid);
+	if (mysql_stmt_bind_param(st, bind_buffers) != 0) {
+		return GIT_ERROR;
+	}
+	if (mysql_stmt_execute(st) != 0) {
+		return GIT_ERROR;
+	}
+	if (mysql_stmt_store_result(st) != 0) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_num_rows(st) == 1) {
+		memset(result_buffers, 0, sizeof(result_buffers));
+
+		result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
+		result_buffers[0].buffer = &type;
+		result_buffers[0].is_unsigned = 1;
+
+		result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
+		result_buffers[1].buffer = &size;
+		result_buffers[1].is_unsigned = 1;
+
+		if (mysql_stmt_bind_result(st, result_buffers) != 0 ||
+		    mysql_stmt_fetch(st) != 0) {
+			mysql_stmt_reset(st);
+			return GIT_ERROR;
+		}
+
+		*type_p = (git_otype) type;
+		*len_p = (size_t) size;
+		error = GIT_OK;
+	} else {
+		error = GIT_ENOTFOUND;
+	}
+
+	mysql_stmt_reset(st);
+	return error;
+}
+
+int
+mysql_odb_pack__read(void **data_p, size_t * len_p, git_otype * type_p,
+		     mysql_odb_backend * backend, const git_oid * oid)
+{
+	MYSQL_STMT *st = backend->st_pack_read;
+	MYSQL_BIND bind_buffers[2];
+	MYSQL_BIND result_buffers[4];
+	unsigned char type;
+	unsigned long long size, chain;
+	unsigned long data_len = 0;
+	int error;
+
+	bind_oid_twice(bind_buffers, oid);
+	if (mysql_stmt_bind_param(st, bind_buffers) != 0) {
+		return GIT_ERROR;
+	}
+	if (mysql_stmt_execute(st) != 0) {
+		return GIT_ERROR;
+	}
+	if (mysql_stmt_store_result(st) != 0) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_num_rows(st) != 1) {
+		mysql_stmt_reset(st);
+		return GIT_ENOTFOUND;
+	}
+
+	memset(result_buffers, 0, sizeof(result_buffers));
+
+	result_buffers[0].buffer_type = MYSQL_TYPE_TINY;
+	result_buffers[0].buffer = &type;
+	result_buffers[0].is_unsigned = 1;
+
+	result_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	result_buffers[1].buffer = &size;
+	result_buffers[1].is_unsigned = 1;
+
+	result_buffers[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
+	result_buffers[2].length = &data_len;
+
+	result_buffers[3].buffer_type = MYSQL_TYPE_LONGLONG;
+	result_buffers[3].buffer = &chain;
+	result_buffers[3].is_unsigned = 1;
+
+	error = GIT_ERROR;
+
+	if (mysql_stmt_bind_result(st, result_buffers) != 0) {
+		goto done;
+	}
+
+	error = mysql_stmt_fetch(st);
+	if (error != 0 && error != MYSQL_DATA_TRUNCATED) {
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	// the stored bytes are only an intermediate, keep them in scratch
+	git_buf_clear(&backend->pack_scratch);
+	if (git_buf_grow(&backend->pack_scratch, data_len + 1) < 0) {
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	if (data_len > 0) {
+		result_buffers[2].buffer = backend->pack_scratch.ptr;
+		result_buffers[2].buffer_length = data_len;
+
+		if (mysql_stmt_fetch_column(st, &result_buffers[2], 2, 0) != 0) {
+			error = GIT_ERROR;
+			goto done;
+		}
+	}
+
+	*data_p = git_odb_backend_malloc(&backend->parent, (size_t) size + 1);
+	if (*data_p == NULL) {
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	error = decode_object(*data_p, (size_t) size,
+			      (unsigned char *)backend->pack_scratch.ptr,
+			      data_len, chain);
+	if (error < 0) {
+		free(*data_p);
+		*data_p = NULL;
+		goto done;
+	}
+
+	*type_p = (git_otype) type;
+	*len_p = (size_t) size;
+
+ done:
+	mysql_stmt_reset(st);
+	return error;
+}
+
+static void pack_segment_clear(pack_segment * seg)
+{
+	git_buf_clear(&seg->data);
+	seg->count = 0;
+	seg->number++;
+}
+
+static void pack_segment_free(pack_segment * seg)
+{
+	git_buf_free(&seg->data);
+	free(seg->entries);
+}
+
+static size_t entry_header(unsigned char *header, int type, size_t size)
+{
+	size_t header_len = 0;
+	unsigned char c;
+
+	c = (unsigned char)((type << 4) | (size & 15));
+	size >>= 4;
+	while (size) {
+		header[header_len++] = c | 0x80;
+		c = size & 0x7f;
+		size >>= 7;
+	}
+	header[header_len++] = c;
+
+	return header_len;
+}
+
+/* Add an entry of up to `reserve` bytes at the end of the segment. */
+static pack_entry *segment_entry(pack_segment * seg, size_t reserve)
+{
+	pack_entry *entry;
+
+	// reserve room for the pack header, it is filled in on flush
+	if (seg->count == 0 && git_buf_put(&seg->data, "PACK\0\0\0\0\0\0\0\0",
+					   12) < 0) {
+		return NULL;
+	}
+
+	if (seg->count == seg->alloc) {
+		size_t alloc = seg->alloc ? seg->alloc * 2 : 256;
+		pack_entry *entries =
+		    realloc(seg->entries, alloc * sizeof(pack_entry));
+
+		if (entries == NULL) {
+			return NULL;
+		}
+		seg->entries = entries;
+		seg->alloc = alloc;
+	}
+
+	if (git_buf_grow(&seg->data, seg->data.size + reserve + 1) < 0) {
+		return NULL;
+	}
+
+	entry = &seg->entries[seg->count];
+	entry->offset = seg->data.size;
+	return entry;
+}
+
+static int
+pack_segment_append(pack_segment * seg, const git_oid * oid,
+		    const void *data, size_t len, git_otype type)
+{
+	unsigned char header[16];
+	size_t header_len;
+	uLongf deflated;
+	pack_entry *entry;
+
+	deflated = compressBound(len);
+	if ((entry = segment_entry(seg, sizeof(header) + deflated)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	header_len = entry_header(header, type, len);
+
+	git_oid_cpy(&entry->oid, oid);
+	entry->type = type;
+	entry->size = len;
+	entry->chain = 0;
+
+	memcpy(seg->data.ptr + seg->data.size, header, header_len);
+	if (compress2((Bytef *) seg->data.ptr + seg->data.size + header_len,
+		      &deflated, data, len, Z_DEFAULT_COMPRESSION) != Z_OK) {
+		giterr_set_str(GITERR_ZLIB, "Failed to deflate pack entry");
+		return GIT_ERROR;
+	}
+
+	seg->data.size += header_len + deflated;
+	seg->data.ptr[seg->data.size] = '\0';
+
+	entry->length = header_len + deflated;
+	seg->count++;
+
+	return GIT_OK;
+}
+
+/*
+ * Append the delta of `obj` as an OFS_DELTA entry against `base`, which is
+ * in this segment. The zlib stream of the pushed pack is copied as it is.
+ */
+static int
+pack_segment_append_delta(pack_segment * seg, const pack_object * obj,
+			  const pack_object * base, const pack_entry_header * h,
+			  const unsigned char *stream, size_t stream_len)
+{
+	unsigned char header[16], ofs_bytes[16];
+	size_t header_len, pos = sizeof(ofs_bytes) - 1, ofs;
+	pack_entry *entry;
+
+	if ((entry = segment_entry(seg, sizeof(header) + sizeof(ofs_bytes) +
+				   stream_len)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	header_len = entry_header(header, PACK_OBJ_OFS_DELTA, h->size);
+
+	ofs = entry->offset - base->seg_offset;
+	ofs_bytes[pos] = ofs & 0x7f;
+	while (ofs >>= 7) {
+		ofs_bytes[--pos] = 0x80 | (--ofs & 0x7f);
+	}
+	memcpy(header + header_len, ofs_bytes + pos, sizeof(ofs_bytes) - pos);
+	header_len += sizeof(ofs_bytes) - pos;
+
+	git_oid_cpy(&entry->oid, &obj->oid);
+	entry->type = obj->type;
+	entry->size = obj->size;
+	entry->chain = entry->offset - base->root;
+
+	memcpy(seg->data.ptr + seg->data.size, header, header_len);
+	memcpy(seg->data.ptr + seg->data.size + header_len, stream, stream_len);
+
+	seg->data.size += header_len + stream_len;
+	seg->data.ptr[seg->data.size] = '\0';
+
+	entry->length = header_len + stream_len;
+	seg->count++;
+
+	return GIT_OK;
+}
+
+static int
+pack_segment_insert_index(MYSQL * db, pack_segment * seg,
+			  my_ulonglong pack_id)
+{
+	git_buf sql = GIT_BUF_INIT;
+	size_t i;
+	int error = GIT_OK;
+
+	for (i = 0; i < seg->count && error == GIT_OK; i++) {
+		pack_entry *entry = &seg->entries[i];
+		char hex[GIT_OID_HEXSZ + 1];
+
+		if (sql.size == 0) {
+			git_buf_puts(&sql, "INSERT IGNORE INTO `"
+				     GIT2_PACK_INDEX_TABLE_NAME "` (`oid`,"
+				     " `pack_id`, `offset`, `length`, `type`,"
+				     " `size`, `chain`) VALUES ");
+		} else {
+			git_buf_putc(&sql, ',');
+		}
+
+		git_oid_tostr(hex, sizeof(hex), &entry->oid);
+		git_buf_printf(&sql, "(x'%s',%llu,%llu,%llu,%d,%llu,%llu)", hex,
+			       (unsigned long long)pack_id,
+			       (unsigned long long)entry->offset,
+			       (unsigned long long)entry->length,
+			       (int)entry->type,
+			       (unsigned long long)entry->size,
+			       (unsigned long long)entry->chain);
+
+		if ((i + 1) % PACK_INDEX_ROWS_PER_INSERT == 0 ||
+		    i + 1 == seg->count) {
+			if (git_buf_oom(&sql) ||
+			    mysql_real_query(db, sql.ptr, sql.size) != 0) {
+				error = GIT_ERROR;
+			}
+			git_buf_clear(&sql);
+		}
+	}
+
+	git_buf_free(&sql);
+	return error;
+}
+
+static int pack_segment_flush(mysql_odb_backend * backend, pack_segment * seg)
+{
+	MYSQL_BIND bind_buffers[2];
+	unsigned long objects;
+	uint32_t be;
+	git_oid trailer;
+	my_ulonglong pack_id;
+
+	if (seg->count == 0) {
+		return GIT_OK;
+	}
+
+	be = htonl(2);
+	memcpy(seg->data.ptr + 4, &be, 4);
+	be = htonl((uint32_t) seg->count);
+	memcpy(seg->data.ptr + 8, &be, 4);
+
+	if (git_hash_buf(&trailer, seg->data.ptr, seg->data.size) < 0 ||
+	    git_buf_put(&seg->data, (const char *)trailer.id, GIT_OID_RAWSZ) <
+	    0) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_real_query(backend->db, "START TRANSACTION", 17) != 0) {
+		return GIT_ERROR;
+	}
+
+	objects = (unsigned long)seg->count;
+
+	memset(bind_buffers, 0, sizeof(bind_buffers));
+
+	bind_buffers[0].buffer = &objects;
+	bind_buffers[0].buffer_type = MYSQL_TYPE_LONG;
+	bind_buffers[0].is_unsigned = 1;
+
+	bind_buffers[1].buffer = seg->data.ptr;
+	bind_buffers[1].buffer_length = seg->data.size;
+	bind_buffers[1].length = &bind_buffers[1].buffer_length;
+	bind_buffers[1].buffer_type = MYSQL_TYPE_BLOB;
+
+	if (mysql_stmt_bind_param(backend->st_pack_write, bind_buffers) != 0 ||
+	    mysql_stmt_execute(backend->st_pack_write) != 0) {
+		goto rollback;
+	}
+
+	pack_id = mysql_stmt_insert_id(backend->st_pack_write);
+	mysql_stmt_reset(backend->st_pack_write);
+
+	if (pack_segment_insert_index(backend->db, seg, pack_id) < 0) {
+		goto rollback;
+	}
+
+	// objects the index had already keep their old pack_id
+	if (backend->stats) {
+		git_buf where = GIT_BUF_INIT;
+		int error;
+
+		git_buf_printf(&where, "`pack_id` = %llu",
+			       (unsigned long long)pack_id);
+		error = mysql_stats__apply_rows(backend,
+						"`" GIT2_PACK_INDEX_TABLE_NAME "`",
+						&where, 1);
+		git_buf_free(&where);
+		if (error < 0) {
+			goto rollback;
+		}
+	}
+
+	if (mysql_real_query(backend->db, "COMMIT", 6) != 0) {
+		goto rollback;
+	}
+
+	if (backend->header_index != NULL) {
+		size_t i;
+
+		for (i = 0; i < seg->count; i++) {
+			mysql_header_index_insert(backend->header_index,
+						  &seg->entries[i].oid,
+						  seg->entries[i].size,
+						  seg->entries[i].type);
+		}
+	}
+
+	pack_segment_clear(seg);
+	return GIT_OK;
+
+ rollback:
+	mysql_real_query(backend->db, "ROLLBACK", 8);
+	giterr_set_str(GITERR_ODB, "Error writing pack to MySql ODB backend");
+	return GIT_ERROR;
+}
+
+static int object_rank(git_otype type)
+{
+	switch (type) {
+	case GIT_OBJ_COMMIT:
+		return 0;
+	case GIT_OBJ_TAG:
+		return 1;
+	case GIT_OBJ_TREE:
+		return 2;
+	default:
+		return 3;
+	}
+}
+
+/* by type, then in the order of the pushed pack, which has bases first */
+static int pack_object_cmp(const void *a, const void *b)
+{
+	const pack_object *oa = a, *ob = b;
+	int diff = object_rank(oa->type) - object_rank(ob->type);
+
+	if (diff == 0 && oa->offset != ob->offset) {
+		diff = oa->offset < ob->offset ? -1 : 1;
+	}
+
+	return diff ? diff : git_oid_cmp(&oa->oid, &ob->oid);
+}
+
+static int by_offset_cmp(const void *a, const void *b)
+{
+	const pack_object *oa = *(pack_object * const *)a;
+	const pack_object *ob = *(pack_object * const *)b;
+
+	return oa->offset < ob->offset ? -1 : oa->offset > ob->offset;
+}
+
+static int collect_object(const git_oid * oid, void *payload)
+{
+	pack_object_list *list = payload;
+	size_t len;
+
+	if (list->count == list->alloc) {
+		size_t alloc = list->alloc ? list->alloc * 2 : 1024;
+		pack_object *objects =
+		    realloc(list->objects, alloc * sizeof(pack_object));
+
+		if (objects == NULL) {
+			return GIT_ERROR;
+		}
+		list->objects = objects;
+		list->alloc = alloc;
+	}
+
+	memset(&list->objects[list->count], 0, sizeof(pack_object));
+	git_oid_cpy(&list->objects[list->count].oid, oid);
+	if (git_odb_read_header(&len, &list->objects[list->count].type,
+				list->odb, oid) < 0) {
+		return GIT_ERROR;
+	}
+	list->objects[list->count].size = len;
+	list->count++;
+
+	return GIT_OK;
+}
+
+/* only for the commits of the pack, which come first in the list */
+static int fix_generations(mysql_odb_backend * backend,
+			   const pack_object_list * list)
+{
+	git_oid *oids;
+	size_t count;
+	int error;
+
+	count = 0;
+	while (count < list->count &&
+	       list->objects[count].type == GIT_OBJ_COMMIT) {
+		count++;
+	}
+
+	if (count == 0) {
+		return GIT_OK;
+	}
+
+	if ((oids = malloc(count * sizeof(git_oid))) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	for (count = 0; count < list->count &&
+	     list->objects[count].type == GIT_OBJ_COMMIT; count++) {
+		git_oid_cpy(&oids[count], &list->objects[count].oid);
+	}
+
+	error = mysql_commit_graph__fix_generations(backend, oids, count);
+	free(oids);
+	return error;
+}
+
+static const unsigned char *map_file(size_t * len, const char *path)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY)) < 0) {
+		return NULL;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	*len = (size_t) st.st_size;
+	return map;
+}
+
+static uint32_t get_be32(const unsigned char *p)
+{
+	return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+	    ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+/* The offset of `oid` in the pushed pack, from its version 2 index. */
+static int idx_lookup(size_t * out, const pack_object_list * list,
+		      const unsigned char *oid)
+{
+	const unsigned char *fanout = list->idx + 8;
+	const unsigned char *oids = fanout + 256 * 4;
+	uint32_t count = get_be32(fanout + 255 * 4);
+	const unsigned char *offsets = oids + (size_t) count * (GIT_OID_RAWSZ + 4);
+	uint32_t lo = oid[0] ? get_be32(fanout + (oid[0] - 1) * 4) : 0;
+	uint32_t hi = get_be32(fanout + oid[0] * 4);
+	uint32_t mid, off;
+	const unsigned char *large;
+	int cmp;
+
+	if (hi > count) {
+		return GIT_ERROR;
+	}
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = memcmp(oid, oids + (size_t) mid * GIT_OID_RAWSZ,
+			     GIT_OID_RAWSZ);
+
+		if (cmp < 0) {
+			hi = mid;
+		} else if (cmp > 0) {
+			lo = mid + 1;
+		} else {
+			off = get_be32(offsets + (size_t) mid * 4);
+			if (!(off & 0x80000000)) {
+				*out = off;
+				return GIT_OK;
+			}
+
+			large = offsets + (size_t) count * 4 +
+			    (size_t) (off & 0x7fffffff) * 8;
+			if (large + 8 > list->idx + list->idx_len - 40) {
+				return GIT_ERROR;
+			}
+			*out = (size_t) (((uint64_t) get_be32(large) << 32) |
+					 get_be32(large + 4));
+			return GIT_OK;
+		}
+	}
+
+	return GIT_ENOTFOUND;
+}
+
+static void unmap_pack(pack_object_list * list)
+{
+	if (list->pack != NULL) {
+		munmap((void *)list->pack, list->pack_len);
+	}
+	if (list->idx != NULL) {
+		munmap((void *)list->idx, list->idx_len);
+	}
+	free(list->by_offset);
+
+	list->pack = NULL;
+	list->idx = NULL;
+	list->by_offset = NULL;
+}
+
+/*
+ * Map the pushed pack and its index and find where every object is. When
+ * that fails, the objects are stored in full.
+ */
+static void map_pack(pack_object_list * list, const char *idx_path)
+{
+	git_buf pack_path = GIT_BUF_INIT;
+	size_t i, count;
+
+	list->idx = map_file(&list->idx_len, idx_path);
+	if (list->idx == NULL || list->idx_len < 8 + 256 * 4 + 40 ||
+	    memcmp(list->idx, "\377tOc", 4) != 0 || get_be32(list->idx + 4) != 2) {
+		goto fail;
+	}
+
+	count = get_be32(list->idx + 8 + 255 * 4);
+	if (count != list->count ||
+	    list->idx_len < 8 + 256 * 4 + count * (GIT_OID_RAWSZ + 8) + 40) {
+		goto fail;
+	}
+
+	if (git_buf_put(&pack_path, idx_path, strlen(idx_path) - 4) < 0 ||
+	    git_buf_puts(&pack_path, ".pack") < 0) {
+		goto fail;
+	}
+	list->pack = map_file(&list->pack_len, pack_path.ptr);
+	if (list->pack == NULL || list->pack_len < 12 + GIT_OID_RAWSZ) {
+		goto fail;
+	}
+
+	for (i = 0; i < list->count; i++) {
+		if (idx_lookup(&list->objects[i].offset, list,
+			       list->objects[i].oid.id) < 0 ||
+		    list->objects[i].offset < 12 ||
+		    list->objects[i].offset >= list->pack_len - GIT_OID_RAWSZ) {
+			goto fail;
+		}
+	}
+
+	git_buf_free(&pack_path);
+	return;
+
+ fail:
+	git_buf_free(&pack_path);
+	unmap_pack(list);
+	for (i = 0; i < list->count; i++) {
+		list->objects[i].offset = 0;
+	}
+	giterr_clear();
+}
+
+/* Once the list is in its final order, index it by pack offset. */
+static void index_pack(pack_object_list * list)
+{
+	size_t i;
+
+	if (list->pack == NULL) {
+		return;
+	}
+
+	list->by_offset = malloc(list->count * sizeof(pack_object *) + 1);
+	if (list->by_offset == NULL) {
+		unmap_pack(list);
+		return;
+	}
+
+	for (i = 0; i < list->count; i++) {
+		list->by_offset[i] = &list->objects[i];
+	}
+	qsort(list->by_offset, list->count, sizeof(pack_object *),
+	      by_offset_cmp);
+
+	for (i = 0; i < list->count; i++) {
+		list->by_offset[i]->end = i + 1 < list->count ?
+		    list->by_offset[i + 1]->offset :
+		    list->pack_len - GIT_OID_RAWSZ;
+	}
+}
+
+static pack_object *find_offset(const pack_object_list * list, size_t offset)
+{
+	pack_object key, *keyp = &key, **found;
+
+	key.offset = offset;
+	found = bsearch(&keyp, list->by_offset, list->count,
+			sizeof(pack_object *), by_offset_cmp);
+
+	return found ? *found : NULL;
+}
+
+static int enqueue_commits(mysql_odb_backend * backend,
+			   const pack_object_list * list)
+{
+	git_oid *oids;
+	size_t count;
+	int error;
+
+	count = 0;
+	while (count < list->count &&
+	       list->objects[count].type == GIT_OBJ_COMMIT) {
+		count++;
+	}
+
+	if (count == 0) {
+		return GIT_OK;
+	}
+
+	if ((oids = malloc(count * sizeof(git_oid))) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	for (count = 0; count < list->count &&
+	     list->objects[count].type == GIT_OBJ_COMMIT; count++) {
+		git_oid_cpy(&oids[count], &list->objects[count].oid);
+	}
+
+	error = mysql_path_history__enqueue(backend, oids, count);
+	free(oids);
+	return error;
+}
+
+/*
+ * The base to keep `obj` as a delta against, or NULL to store it in full.
+ * It must already be in the current segment, within the depth and span
+ * that reads resolve.
+ */
+static pack_object *delta_base(pack_object_list * list, const pack_object * obj,
+			       const pack_segment * seg, pack_entry_header * h)
+{
+	pack_object *base;
+	size_t offset;
+
+	if (list->pack == NULL ||
+	    parse_entry(h, list->pack, obj->end, obj->offset) < 0) {
+		giterr_clear();
+		return NULL;
+	}
+
+	if (h->type == PACK_OBJ_OFS_DELTA) {
+		offset = h->base;
+	} else if (h->type != PACK_OBJ_REF_DELTA ||
+		   idx_lookup(&offset, list, h->base_oid) < 0) {
+		return NULL;
+	}
+
+	base = find_offset(list, offset);
+	if (base == NULL || base->segment != seg->number ||
+	    base->depth + 1 > PACK_MAX_DELTA_DEPTH ||
+	    seg->data.size - base->root > PACK_MAX_DELTA_SPAN) {
+		return NULL;
+	}
+
+	return base;
+}
+
+/*
+ * Store every object of a freshly indexed pack into segments. Objects are
+ * grouped commits, tags, trees, blobs so history walks stay within as few
+ * segments as possible, and a delta is copied as it is when its base is
+ * already in the segment. Anything else is inflated and stored in full.
+ */
+static int store_pack(mysql_odb_backend * backend, const char *idx_path)
+{
+	git_odb_backend *pack_backend;
+	pack_object_list list;
+	pack_segment seg;
+	size_t i;
+	int error;
+
+	memset(&list, 0, sizeof(list));
+	memset(&seg, 0, sizeof(seg));
+	git_buf_init(&seg.data, 0);
+	seg.number = 1;
+
+	if ((error = git_odb_new(&list.odb)) < 0) {
+		return error;
+	}
+
+	if ((error = git_odb_backend_one_pack(&pack_backend, idx_path)) < 0 ||
+	    (error = git_odb_add_backend(list.odb, pack_backend, 1)) < 0 ||
+	    (error = git_odb_foreach(list.odb, collect_object, &list)) < 0) {
+		goto done;
+	}
+
+	map_pack(&list, idx_path);
+	qsort(list.objects, list.count, sizeof(pack_object), pack_object_cmp);
+	index_pack(&list);
+
+	for (i = 0; i < list.count && error == GIT_OK; i++) {
+		pack_object *obj = &list.objects[i], *base;
+		git_odb_object *full = NULL;
+		pack_entry_header h;
+		pack_entry *entry;
+
+		base = delta_base(&list, obj, &seg, &h);
+
+		if (base == NULL || (backend->commit_graph &&
+				     obj->type == GIT_OBJ_COMMIT)) {
+			if ((error = git_odb_read(&full, list.odb,
+						  &obj->oid)) < 0) {
+				break;
+			}
+		}
+
+		if (base != NULL) {
+			const unsigned char *stream =
+			    list.pack + obj->offset + h.header_len;
+
+			error = pack_segment_append_delta(&seg, obj, base, &h,
+							  stream,
+							  obj->end -
+							  obj->offset -
+							  h.header_len);
+		} else {
+			error = pack_segment_append(&seg, &obj->oid,
+						    git_odb_object_data(full),
+						    git_odb_object_size(full),
+						    git_odb_object_type(full));
+		}
+
+		if (error == GIT_OK) {
+			entry = &seg.entries[seg.count - 1];
+			obj->segment = seg.number;
+			obj->seg_offset = entry->offset;
+			obj->root = entry->offset - entry->chain;
+			obj->depth = base != NULL ? base->depth + 1 : 0;
+		}
+
+		if (error == GIT_OK && full != NULL && backend->commit_graph &&
+		    obj->type == GIT_OBJ_COMMIT &&
+		    mysql_commit_graph__add(backend, &obj->oid,
+					    git_odb_object_data(full),
+					    git_odb_object_size(full)) < 0) {
+			giterr_clear();
+		}
+		git_odb_object_free(full);
+
+		if (error == GIT_OK && seg.data.size >= backend->segment_size) {
+			error = pack_segment_flush(backend, &seg);
+		}
+	}
+
+	if (error == GIT_OK) {
+		error = pack_segment_flush(backend, &seg);
+	}
+
+	// pack order is not topological, most generations are known only now
+	if (error == GIT_OK && backend->commit_graph) {
+		error = fix_generations(backend, &list);
+	}
+
+	// the commits come first in the list, the backfill indexes them
+	if (error == GIT_OK && backend->path_history &&
+	    enqueue_commits(backend, &list) < 0) {
+		giterr_clear();
+	}
+
+ done:
+	unmap_pack(&list);
+	pack_segment_free(&seg);
+	free(list.objects);
+	git_odb_free(list.odb);
+	return error;
+}
+
+static int
+writepack__append(git_odb_writepack * _writepack, const void *data,
+		  size_t size, git_transfer_progress * stats)
+{
+	mysql_odb_writepack *writepack = (mysql_odb_writepack *) _writepack;
+
+	return git_indexer_append(writepack->indexer, data, size, stats);
+}
+
+static int
+writepack__commit(git_odb_writepack * _writepack,
+		  git_transfer_progress * stats)
+{
+	mysql_odb_writepack *writepack = (mysql_odb_writepack *) _writepack;
+	mysql_odb_backend *backend;
+	git_buf idx_path = GIT_BUF_INIT;
+	char hex[GIT_OID_HEXSZ + 1];
+	int error;
+
+	if ((error = git_indexer_commit(writepack->indexer, stats)) < 0) {
+		return error;
+	}
+
+	git_oid_tostr(hex, sizeof(hex), git_indexer_hash(writepack->indexer));
+	if (git_buf_printf(&idx_path, "%s/pack-%s.idx", writepack->dir, hex) <
+	    0) {
+		return GIT_ERROR;
+	}
+
+	// the connection is needed only now, the indexer reads through
+	// the callbacks
+	backend = (mysql_odb_backend *) _writepack->backend;
+	if ((error = mysql_odb__enter(backend)) == GIT_OK) {
+		error = store_pack(backend, idx_path.ptr);
+		mysql_odb__leave(backend);
+	}
+
+	git_buf_free(&idx_path);
+	return error;
+}
+
+static void writepack__free(git_odb_writepack * _writepack)
+{
+	mysql_odb_writepack *writepack = (mysql_odb_writepack *) _writepack;
+	DIR *dir;
+	struct dirent *entry;
+
+	git_indexer_free(writepack->indexer);
+
+	if (writepack->dir != NULL && (dir = opendir(writepack->dir)) != NULL) {
+		while ((entry = readdir(dir)) != NULL) {
+			git_buf path = GIT_BUF_INIT;
+
+			if (entry->d_name[0] == '.') {
+				continue;
+			}
+			if (git_buf_printf(&path, "%s/%s", writepack->dir,
+					   entry->d_name) == 0) {
+				unlink(path.ptr);
+			}
+			git_buf_free(&path);
+		}
+		closedir(dir);
+		rmdir(writepack->dir);
+	}
+
+	free(writepack->dir);
+	free(writepack);
+}
+
+int
+mysql_odb_pack__writepack(git_odb_writepack ** out,
+			  git_odb_backend * _backend, git_odb * odb,
+			  git_transfer_progress_callback progress_cb,
+			  void *progress_payload)
+{
+	mysql_odb_writepack *writepack;
+	const char *tmp = getenv("TMPDIR");
+	git_buf dir = GIT_BUF_INIT;
+
+	assert(out && _backend);
+
+	writepack = calloc(1, sizeof(mysql_odb_writepack));
+	GITERR_CHECK_ALLOC(writepack);
+
+	writepack->parent.backend = _backend;
+	writepack->parent.append = writepack__append;
+	writepack->parent.commit = writepack__commit;
+	writepack->parent.free = writepack__free;
+
+	if (git_buf_printf(&dir, "%s/rugged-mysql-pack-XXXXXX",
+			   tmp ? tmp : "/tmp") < 0 || mkdtemp(dir.ptr) == NULL) {
+		giterr_set_str(GITERR_OS, "Failed to create pack directory");
+		git_buf_free(&dir);
+		writepack__free((git_odb_writepack *) writepack);
+		return GIT_ERROR;
+	}
+	writepack->dir = git_buf_detach(&dir);
+
+	if (git_indexer_new(&writepack->indexer, writepack->dir, 0, odb,
+			    progress_cb, progress_payload) < 0) {
+		writepack__free((git_odb_writepack *) writepack);
+		return GIT_ERROR;
+	}
+
+	*out = (git_odb_writepack *) writepack;
+	return GIT_OK;
+}
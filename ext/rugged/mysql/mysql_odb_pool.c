@@ -0,0 +1,557 @@
+/*
+ * Shared object pool.
+ *
+ * Forks of one repository store mostly the same objects. Each of them can
+ * point at a pool database on the same server, which works like git's
+ * alternates: reads look in the repository's own tables first and then in
+ * `<pool>`.`git2_odb`. Writes go to the pool as the policy allows, and
+ * `INSERT IGNORE` keeps a single copy of every object there.
+ *
+ * Every repository is a row in `git2_pool_members`. `git2_pool_refs` holds
+ * one (oid, member) row for each pool object a repository wrote or found
+ * with exists, and gc adds the ones it reaches from the repository's refs,
+ * so an object can go once no member references it. A writer adds its
+ * reference before it looks the object up, and a prune deletes only
+ * objects that have no references, so an object that is in use is never
+ * pruned.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+
+#define POOL_NAME_MAX 64
+#define POOL_LEAVE_BATCH 10000
+
+static int valid_name(const char *name)
+{
+	size_t len = strlen(name), i;
+
+	if (len == 0 || len > POOL_NAME_MAX) {
+		return 0;
+	}
+
+	// plain identifiers only, the name is spliced into every statement
+	for (i = 0; i < len; i++) {
+		char c = name[i];
+
+		if (!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+		      (c >= '0' && c <= '9') || c == '_' || c == '$')) {
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int run_buf(MYSQL * db, git_buf * sql)
+{
+	if (git_buf_oom(sql)) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_real_query(db, sql->ptr, sql->size) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int prepare(MYSQL * db, MYSQL_STMT ** out, git_buf * sql)
+{
+	my_bool truth = 1;
+
+	if (git_buf_oom(sql)) {
+		return GIT_ERROR;
+	}
+
+	*out = mysql_stmt_init(db);
+	if (*out == NULL) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_attr_set(*out, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0
+	    || mysql_stmt_prepare(*out, sql->ptr, sql->size) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_stmt_error(*out));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int create_tables(MYSQL * db, const char *pool)
+{
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	// may be refused to a user who can still use an existing pool
+	git_buf_printf(&sql, "CREATE DATABASE IF NOT EXISTS `%s`", pool);
+	if (!git_buf_oom(&sql)) {
+		mysql_real_query(db, sql.ptr, sql.size);
+	}
+
+	git_buf_clear(&sql);
+	git_buf_printf(&sql, "CREATE TABLE IF NOT EXISTS `%s`.`"
+		       GIT2_ODB_TABLE_NAME "` ("
+		       "  `oid` binary(20) NOT NULL DEFAULT '',"
+		       "  `type` tinyint(1) unsigned NOT NULL,"
+		       "  `size` bigint(20) unsigned NOT NULL,"
+		       "  `data` longblob NOT NULL,"
+		       "  PRIMARY KEY (`oid`)"
+		       ") ENGINE=" GIT2_STORAGE_ENGINE
+		       " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;", pool);
+	if ((error = run_buf(db, &sql)) < 0) {
+		goto done;
+	}
+
+	git_buf_clear(&sql);
+	git_buf_printf(&sql, "CREATE TABLE IF NOT EXISTS `%s`.`"
+		       GIT2_POOL_MEMBERS_TABLE_NAME "` ("
+		       "  `id` int(10) unsigned NOT NULL AUTO_INCREMENT,"
+		       "  `name` varchar(255) NOT NULL,"
+		       "  PRIMARY KEY (`id`),"
+		       "  UNIQUE KEY `name` (`name`)"
+		       ") ENGINE=" GIT2_STORAGE_ENGINE
+		       " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;", pool);
+	if ((error = run_buf(db, &sql)) < 0) {
+		goto done;
+	}
+
+	git_buf_clear(&sql);
+	git_buf_printf(&sql, "CREATE TABLE IF NOT EXISTS `%s`.`"
+		       GIT2_POOL_REFS_TABLE_NAME "` ("
+		       "  `oid` binary(20) NOT NULL DEFAULT '',"
+		       "  `member` int(10) unsigned NOT NULL,"
+		       "  PRIMARY KEY (`oid`, `member`),"
+		       "  KEY `member` (`member`, `oid`)"
+		       ") ENGINE=" GIT2_STORAGE_ENGINE
+		       " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;", pool);
+	error = run_buf(db, &sql);
+
+ done:
+	git_buf_free(&sql);
+	return error;
+}
+
+/* the member id of this repository, named after its database */
+static int register_member(mysql_odb_backend * backend)
+{
+	const char *name = backend->conn.db;
+	git_buf sql = GIT_BUF_INIT;
+	char *escaped;
+	int error;
+
+	if (name == NULL) {
+		giterr_set_str(GITERR_ODB,
+			       "A database name is needed to join a pool");
+		return GIT_ERROR;
+	}
+
+	if ((escaped = malloc(strlen(name) * 2 + 1)) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+	mysql_real_escape_string(backend->db, escaped, name, strlen(name));
+
+	git_buf_printf(&sql, "INSERT INTO `%s`.`" GIT2_POOL_MEMBERS_TABLE_NAME
+		       "` (`name`) VALUES ('%s')"
+		       " ON DUPLICATE KEY UPDATE `id` = LAST_INSERT_ID(`id`)",
+		       backend->pool, escaped);
+
+	if ((error = run_buf(backend->db, &sql)) == GIT_OK) {
+		backend->pool_member =
+		    (unsigned int)mysql_insert_id(backend->db);
+	}
+
+	free(escaped);
+	git_buf_free(&sql);
+	return error;
+}
+
+static int init_statements(mysql_odb_backend * backend)
+{
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	git_buf_printf(&sql, "SELECT `type`, `size`, UNCOMPRESS(`data`) FROM `%s`.`"
+		       GIT2_ODB_TABLE_NAME "` WHERE `oid` = ?;", backend->pool);
+	if ((error = prepare(backend->db, &backend->st_pool_read, &sql)) < 0) {
+		goto done;
+	}
+
+	git_buf_clear(&sql);
+	git_buf_printf(&sql, "SELECT `type`, `size` FROM `%s`.`"
+		       GIT2_ODB_TABLE_NAME "` WHERE `oid` = ?;", backend->pool);
+	if ((error = prepare(backend->db, &backend->st_pool_read_header,
+			     &sql)) < 0) {
+		goto done;
+	}
+
+	git_buf_clear(&sql);
+	git_buf_printf(&sql, "INSERT IGNORE INTO `%s`.`" GIT2_ODB_TABLE_NAME
+		       "` (`oid`, `type`, `size`, `data`)"
+		       " VALUES (?, ?, ?, COMPRESS(?));", backend->pool);
+	if ((error = prepare(backend->db, &backend->st_pool_write, &sql)) < 0) {
+		goto done;
+	}
+
+	git_buf_clear(&sql);
+	git_buf_printf(&sql, "INSERT IGNORE INTO `%s`.`"
+		       GIT2_POOL_REFS_TABLE_NAME
+		       "` (`oid`, `member`) VALUES (?, %u);", backend->pool,
+		       backend->pool_member);
+	if ((error = prepare(backend->db, &backend->st_pool_ref, &sql)) < 0) {
+		goto done;
+	}
+
+	// the reads and the reference take the OID from backend->read_oid,
+	// like the local reads
+	if (mysql_stmt_bind_param(backend->st_pool_read,
+				  backend->read_params) != 0 ||
+	    mysql_stmt_bind_param(backend->st_pool_read_header,
+				  backend->read_params) != 0 ||
+	    mysql_stmt_bind_param(backend->st_pool_ref,
+				  backend->read_params) != 0) {
+		error = GIT_ERROR;
+	}
+
+ done:
+	git_buf_free(&sql);
+	return error;
+}
+
+int
+mysql_odb_pool__init(mysql_odb_backend * backend, const char *pool,
+		     int policy)
+{
+	if (!valid_name(pool)) {
+		giterr_set_str(GITERR_INVALID, "Invalid pool database name");
+		return GIT_ERROR;
+	}
+
+	if ((backend->pool = strdup(pool)) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+	backend->pool_policy = policy;
+
+	if (create_tables(backend->db, pool) < 0 ||
+	    register_member(backend) < 0 || init_statements(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+void mysql_odb_pool__free(mysql_odb_backend * backend)
+{
+	if (backend->st_pool_read) {
+		mysql_conn_stmt_close(backend->st_pool_read, backend->epoch);
+	}
+	if (backend->st_pool_read_header) {
+		mysql_conn_stmt_close(backend->st_pool_read_header,
+				      backend->epoch);
+	}
+	if (backend->st_pool_write) {
+		mysql_conn_stmt_close(backend->st_pool_write, backend->epoch);
+	}
+	if (backend->st_pool_ref) {
+		mysql_conn_stmt_close(backend->st_pool_ref, backend->epoch);
+	}
+
+	free(backend->pool);
+
+	backend->pool = NULL;
+	backend->st_pool_read = NULL;
+	backend->st_pool_read_header = NULL;
+	backend->st_pool_write = NULL;
+	backend->st_pool_ref = NULL;
+}
+
+int
+mysql_odb_pool__read(void **data_p, size_t * len_p, git_otype * type_p,
+		     mysql_odb_backend * backend, const git_oid * oid)
+{
+	return mysql_odb__read(data_p, len_p, type_p, backend,
+			       backend->st_pool_read_header,
+			       backend->st_pool_read, oid);
+}
+
+int
+mysql_odb_pool__read_header(size_t * len_p, git_otype * type_p,
+			    mysql_odb_backend * backend, const git_oid * oid)
+{
+	return mysql_odb__read_header(len_p, type_p, backend,
+				      backend->st_pool_read_header, oid);
+}
+
+static int add_ref(mysql_odb_backend * backend, const git_oid * oid)
+{
+	MYSQL_STMT *st = backend->st_pool_ref;
+
+	memcpy(backend->read_oid, oid->id, GIT_OID_RAWSZ);
+
+	if (mysql_stmt_execute(st) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_stmt_error(st));
+		mysql_stmt_reset(st);
+		return GIT_ERROR;
+	}
+
+	mysql_stmt_reset(st);
+	return GIT_OK;
+}
+
+static int drop_ref(mysql_odb_backend * backend, const git_oid * oid)
+{
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	git_buf_printf(&sql, "DELETE FROM `%s`.`" GIT2_POOL_REFS_TABLE_NAME
+		       "` WHERE `member` = %u AND `oid` = ", backend->pool,
+		       backend->pool_member);
+	mysql_buf_put_oid(&sql, oid);
+
+	error = run_buf(backend->db, &sql);
+	git_buf_free(&sql);
+	return error;
+}
+
+static int
+insert_object(mysql_odb_backend * backend, const git_oid * oid,
+	      const void *data, size_t len, git_otype type)
+{
+	MYSQL_STMT *st = backend->st_pool_write;
+	MYSQL_BIND bind_buffers[4];
+	unsigned long long size = len;
+	signed char type_value = (signed char)type;
+
+	memset(bind_buffers, 0, sizeof(bind_buffers));
+
+	bind_buffers[0].buffer = (void *)oid->id;
+	bind_buffers[0].buffer_length = GIT_OID_RAWSZ;
+	bind_buffers[0].length = &bind_buffers[0].buffer_length;
+	bind_buffers[0].buffer_type = MYSQL_TYPE_BLOB;
+
+	bind_buffers[1].buffer = &type_value;
+	bind_buffers[1].buffer_type = MYSQL_TYPE_TINY;
+
+	bind_buffers[2].buffer = &size;
+	bind_buffers[2].buffer_type = MYSQL_TYPE_LONGLONG;
+	bind_buffers[2].is_unsigned = 1;
+
+	bind_buffers[3].buffer = (void *)data;
+	bind_buffers[3].buffer_length = len;
+	bind_buffers[3].length = &bind_buffers[3].buffer_length;
+	bind_buffers[3].buffer_type = MYSQL_TYPE_BLOB;
+
+	if (mysql_stmt_bind_param(st, bind_buffers) != 0 ||
+	    mysql_stmt_execute(st) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_stmt_error(st));
+		mysql_stmt_reset(st);
+		return GIT_ERROR;
+	}
+
+	mysql_stmt_reset(st);
+	return GIT_OK;
+}
+
+int
+mysql_odb_pool__write(mysql_odb_backend * backend, const git_oid * oid,
+		      const void *data, size_t len, git_otype type)
+{
+	size_t found_len;
+	git_otype found_type;
+	int error;
+
+	if (backend->pool_policy == GIT_ODB_MYSQL_POOL_LOCAL) {
+		return GIT_PASSTHROUGH;
+	}
+
+	// objects only this repository has stay private under EXISTING
+	if (backend->pool_policy == GIT_ODB_MYSQL_POOL_EXISTING &&
+	    (error = mysql_odb_pool__read_header(&found_len, &found_type,
+						 backend, oid)) < 0) {
+		return error == GIT_ENOTFOUND ? GIT_PASSTHROUGH : error;
+	}
+
+	// the reference first: from then on a prune keeps the object, so
+	// if it is still there now, it stays
+	if ((error = add_ref(backend, oid)) < 0) {
+		return error;
+	}
+
+	error = mysql_odb_pool__read_header(&found_len, &found_type, backend,
+					    oid);
+	if (error != GIT_ENOTFOUND) {
+		return error;
+	}
+
+	if (backend->pool_policy == GIT_ODB_MYSQL_POOL_EXISTING) {
+		// pruned in between
+		drop_ref(backend, oid);
+		return GIT_PASSTHROUGH;
+	}
+
+	return insert_object(backend, oid, data, len, type);
+}
+
+/*
+ * Whether the pool has `oid`, for a caller that may go on to use it without
+ * writing it, like a push that does not send it: the repository then
+ * references the object, as if it had written it.
+ */
+int mysql_odb_pool__exists(mysql_odb_backend * backend, const git_oid * oid)
+{
+	size_t found_len;
+	git_otype found_type;
+	int error;
+
+	if ((error = mysql_odb_pool__read_header(&found_len, &found_type,
+						 backend, oid)) < 0) {
+		return error;
+	}
+
+	// a prune may have taken it before the reference went in
+	if ((error = add_ref(backend, oid)) < 0 ||
+	    (error = mysql_odb_pool__read_header(&found_len, &found_type,
+						 backend,
+						 oid)) != GIT_ENOTFOUND) {
+		return error;
+	}
+
+	drop_ref(backend, oid);
+	return GIT_ENOTFOUND;
+}
+
+int git_odb_backend_mysql_leave_pool(git_odb_backend * _backend)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	assert(backend);
+
+	if (mysql_odb__enter(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (backend->pool == NULL) {
+		mysql_odb__leave(backend);
+		return GIT_OK;
+	}
+
+	git_buf_printf(&sql, "DELETE FROM `%s`.`" GIT2_POOL_REFS_TABLE_NAME
+		       "` WHERE `member` = %u LIMIT %d", backend->pool,
+		       backend->pool_member, POOL_LEAVE_BATCH);
+
+	// in batches, to keep the transactions small
+	do {
+		error = run_buf(backend->db, &sql);
+	} while (error == GIT_OK && mysql_affected_rows(backend->db) > 0);
+
+	git_buf_free(&sql);
+
+	if (error == GIT_OK) {
+		mysql_odb_pool__free(backend);
+	}
+
+	mysql_odb__leave(backend);
+	return error;
+}
+
+int
+git_odb_backend_mysql_prune_pool(size_t * deleted, git_odb_backend * _backend,
+				 size_t batch_size)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	git_buf sql = GIT_BUF_INIT, oids = GIT_BUF_INIT;
+	git_oid last;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error = GIT_OK;
+
+	assert(deleted && backend);
+
+	*deleted = 0;
+	memset(&last, 0, sizeof(last));
+
+	if (mysql_odb__enter(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (backend->pool == NULL) {
+		giterr_set_str(GITERR_ODB, "The MySql ODB backend has no pool");
+		mysql_odb__leave(backend);
+		return GIT_ERROR;
+	}
+
+	if (batch_size == 0) {
+		batch_size = 500;
+	}
+
+	for (;;) {
+		git_buf_clear(&sql);
+		git_buf_clear(&oids);
+
+		git_buf_printf(&sql, "SELECT o.`oid` FROM `%s`.`"
+			       GIT2_ODB_TABLE_NAME "` o LEFT JOIN `%s`.`"
+			       GIT2_POOL_REFS_TABLE_NAME "` r"
+			       " ON r.`oid` = o.`oid` WHERE r.`oid` IS NULL"
+			       " AND o.`oid` > ", backend->pool,
+			       backend->pool);
+		mysql_buf_put_oid(&sql, &last);
+		git_buf_printf(&sql, " ORDER BY o.`oid` LIMIT %llu",
+			       (unsigned long long)batch_size);
+
+		if ((error = run_buf(backend->db, &sql)) < 0) {
+			break;
+		}
+		if ((res = mysql_store_result(backend->db)) == NULL) {
+			error = GIT_ERROR;
+			break;
+		}
+
+		while ((row = mysql_fetch_row(res)) != NULL) {
+			if (mysql_fetch_lengths(res)[0] != GIT_OID_RAWSZ) {
+				continue;
+			}
+			git_oid_fromraw(&last, (const unsigned char *)row[0]);
+			git_buf_putc(&oids, oids.size ? ',' : '(');
+			mysql_buf_put_oid(&oids, &last);
+		}
+		mysql_free_result(res);
+
+		if (oids.size == 0) {
+			break;
+		}
+		git_buf_putc(&oids, ')');
+
+		// the join again: a reference may have come in meanwhile
+		git_buf_clear(&sql);
+		git_buf_printf(&sql, "DELETE o FROM `%s`.`" GIT2_ODB_TABLE_NAME
+			       "` o LEFT JOIN `%s`.`"
+			       GIT2_POOL_REFS_TABLE_NAME "` r"
+			       " ON r.`oid` = o.`oid` WHERE r.`oid` IS NULL"
+			       " AND o.`oid` IN ", backend->pool,
+			       backend->pool);
+		git_buf_put(&sql, oids.ptr, oids.size);
+
+		if ((error = run_buf(backend->db, &sql)) < 0) {
+			break;
+		}
+		*deleted += (size_t) mysql_affected_rows(backend->db);
+	}
+
+	mysql_odb__leave(backend);
+	git_buf_free(&sql);
+	git_buf_free(&oids);
+	return error;
+}
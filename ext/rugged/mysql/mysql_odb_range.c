@@ -0,0 +1,286 @@
+/*
+ * Range reads.
+ *
+ * A preview or a binary check needs the first few KB of a blob, but a full
+ * read transfers and inflates all of it. Rows of `git2_odb` hold the output
+ * of COMPRESS(): the length in four bytes, then a zlib stream. The stream
+ * is fetched here in growing windows with SUBSTRING(), and inflated as it
+ * arrives until the requested range is complete, so the rest of the row
+ * never leaves the server.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <zlib.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+
+// compressed bytes asked for first, on top of half the range end
+#define RANGE_FIRST_WINDOW 4096
+#define RANGE_MAX_WINDOW (1024 * 1024)
+
+static int prepare_range(mysql_odb_backend * backend)
+{
+	static const char *sql =
+	    "SELECT `type`, `size`, SUBSTRING(`data`, ?, ?) FROM `"
+	    GIT2_ODB_TABLE_NAME "` WHERE `oid` = ?;";
+
+	if (backend->st_read_range != NULL) {
+		return GIT_OK;
+	}
+
+	if ((backend->st_read_range = mysql_stmt_init(backend->db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_prepare(backend->st_read_range, sql, strlen(sql)) != 0) {
+		giterr_set_str(GITERR_ODB,
+			       mysql_stmt_error(backend->st_read_range));
+		mysql_stmt_close(backend->st_read_range);
+		backend->st_read_range = NULL;
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+/* fetch `want` bytes of the row's data from `pos` (1-based) into `buf` */
+static int
+fetch_window(unsigned long *got, git_otype * type_p, size_t * size_p,
+	     mysql_odb_backend * backend, const git_oid * oid,
+	     unsigned long long pos, unsigned long want, unsigned char *buf)
+{
+	unsigned long long count = want;
+	MYSQL_STMT *stmt = backend->st_read_range;
+	MYSQL_BIND params[3], results[3];
+	unsigned long long size;
+	signed char type;
+	int error = GIT_OK, status;
+
+	memset(params, 0, sizeof(params));
+	memset(results, 0, sizeof(results));
+
+	params[0].buffer_type = MYSQL_TYPE_LONGLONG;
+	params[0].buffer = &pos;
+	params[0].is_unsigned = 1;
+	params[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	params[1].buffer = &count;
+	params[1].is_unsigned = 1;
+	params[2].buffer_type = MYSQL_TYPE_BLOB;
+	params[2].buffer = (void *)oid->id;
+	params[2].buffer_length = GIT_OID_RAWSZ;
+
+	results[0].buffer_type = MYSQL_TYPE_TINY;
+	results[0].buffer = &type;
+	results[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	results[1].buffer = &size;
+	results[1].is_unsigned = 1;
+	results[2].buffer_type = MYSQL_TYPE_LONG_BLOB;
+	results[2].buffer = buf;
+	results[2].buffer_length = want;
+	results[2].length = got;
+
+	if (mysql_stmt_bind_param(stmt, params) != 0 ||
+	    mysql_stmt_execute(stmt) != 0 ||
+	    mysql_stmt_bind_result(stmt, results) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_stmt_error(stmt));
+		mysql_stmt_reset(stmt);
+		return GIT_ERROR;
+	}
+
+	status = mysql_stmt_fetch(stmt);
+	if (status == MYSQL_NO_DATA) {
+		error = GIT_ENOTFOUND;
+	} else if (status != 0 || *got > want) {
+		giterr_set_str(GITERR_ODB, "Error reading object from MySql");
+		error = GIT_ERROR;
+	} else {
+		*type_p = (git_otype) type;
+		*size_p = (size_t) size;
+	}
+
+	mysql_stmt_free_result(stmt);
+	mysql_stmt_reset(stmt);
+
+	return error;
+}
+
+static int corrupted(void)
+{
+	giterr_set_str(GITERR_ODB, "Corrupted object in MySql ODB");
+	return GIT_ERROR;
+}
+
+/*
+ * Inflate what `zs` holds into its output, dropping the first `*skip`
+ * bytes. Returns 1 once the output is full, 0 when more input is needed.
+ */
+static int inflate_window(z_stream * zs, size_t * skip)
+{
+	unsigned char sink[16384];
+	unsigned char *out = zs->next_out;
+	uInt avail = zs->avail_out;
+	int status;
+
+	while (zs->avail_in > 0) {
+		if (*skip > 0) {
+			zs->next_out = sink;
+			zs->avail_out = *skip < sizeof(sink) ?
+			    (uInt) * skip : sizeof(sink);
+		} else {
+			zs->next_out = out;
+			zs->avail_out = avail;
+		}
+
+		status = inflate(zs, Z_NO_FLUSH);
+		if (status != Z_OK && status != Z_STREAM_END &&
+		    status != Z_BUF_ERROR) {
+			return corrupted();
+		}
+
+		if (*skip > 0) {
+			*skip -= (size_t) (zs->next_out - sink);
+		} else {
+			out = zs->next_out;
+			avail = zs->avail_out;
+			if (avail == 0) {
+				return 1;
+			}
+		}
+
+		if (status == Z_STREAM_END) {
+			return corrupted();
+		}
+	}
+
+	zs->next_out = out;
+	zs->avail_out = avail;
+	return 0;
+}
+
+/*
+ * Read `length` bytes of the object at `offset`, or less at its end. Sets
+ * the object's type and full size too. GIT_ENOTFOUND if the object is not
+ * in `git2_odb`.
+ */
+int
+mysql_odb_range__read(void **data_p, size_t * len_p, git_otype * type_p,
+		      size_t * size_p, mysql_odb_backend * backend,
+		      const git_oid * oid, size_t offset, size_t length)
+{
+	unsigned char *window = NULL, *out = NULL;
+	unsigned long want, got;
+	unsigned long long pos = 1;
+	size_t skip = offset, end;
+	z_stream zs;
+	int error, done = 0, started = 0;
+
+	assert(data_p && len_p && type_p && size_p && backend && oid);
+
+	if (prepare_range(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	end = offset + length < offset ? (size_t) - 1 : offset + length;
+	want = end / 2 + RANGE_FIRST_WINDOW;
+	if (want > RANGE_MAX_WINDOW) {
+		want = RANGE_MAX_WINDOW;
+	}
+
+	memset(&zs, 0, sizeof(zs));
+
+	while (!done) {
+		unsigned char *grown = realloc(window, want);
+
+		if (grown == NULL) {
+			giterr_set_oom();
+			error = GIT_ERROR;
+			break;
+		}
+		window = grown;
+
+		error = fetch_window(&got, type_p, size_p, backend, oid, pos,
+				     want, window);
+		if (error < 0) {
+			break;
+		}
+
+		if (!started) {
+			size_t size = *size_p;
+
+			*len_p = offset < size ? size - offset : 0;
+			if (*len_p > length) {
+				*len_p = length;
+			}
+
+			if ((out = git_odb_backend_malloc(&backend->parent,
+							  *len_p ? *len_p :
+							  1)) == NULL) {
+				error = GIT_ERROR;
+				break;
+			}
+
+			// nothing to inflate for an empty range
+			if (*len_p == 0) {
+				break;
+			}
+
+			// past the length COMPRESS() puts in front
+			if (got <= 4 || inflateInit(&zs) != Z_OK) {
+				error = corrupted();
+				break;
+			}
+			started = 1;
+
+			zs.next_in = window + 4;
+			zs.avail_in = (uInt) (got - 4);
+			zs.next_out = out;
+			zs.avail_out = (uInt) * len_p;
+		} else {
+			zs.next_in = window;
+			zs.avail_in = (uInt) got;
+		}
+
+		if ((error = inflate_window(&zs, &skip)) < 0) {
+			break;
+		}
+		done = error;
+		error = GIT_OK;
+
+		// the row ended before the range did
+		if (!done && got < want) {
+			error = corrupted();
+			break;
+		}
+
+		pos += got;
+		want = want * 2 > RANGE_MAX_WINDOW ? RANGE_MAX_WINDOW : want * 2;
+	}
+
+	if (started) {
+		inflateEnd(&zs);
+	}
+	free(window);
+
+	if (error < 0) {
+		free(out);
+		return error;
+	}
+
+	*data_p = out;
+	return GIT_OK;
+}
+
+void mysql_odb_range__free(mysql_odb_backend * backend)
+{
+	if (backend->st_read_range) {
+		mysql_conn_stmt_close(backend->st_read_range, backend->epoch);
+	}
+
+	backend->st_read_range = NULL;
+}
@@ -0,0 +1,270 @@
+/*
+ * Hot/cold tiering.
+ *
+ * Most of `git2_odb` is old history that nobody reads, but it still shares
+ * buffer pool pages with the objects that are read all the time. With
+ * tiering, the archiver (mysql_tier.c) moves objects that have not been
+ * read for a while to `git2_odb_archive`. That table has compressed pages
+ * and stays on disk, so the hot table can fit in memory.
+ *
+ * Reads are not logged one by one. One read in `tier_sample_rate` from the
+ * hot table is noted here and written to `git2_odb_access` in batches. An
+ * object read often is noted soon enough, and one read rarely costs one
+ * more lookup in the archive. A sampled read of an archived object moves it
+ * back. Each move copies the row before it deletes the source row, and only
+ * deletes it when the copy is there, so a reader always finds the object in
+ * one of the tables.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+
+static int run_buf(MYSQL * db, git_buf * sql)
+{
+	if (git_buf_oom(sql)) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_real_query(db, sql->ptr, sql->size) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int run_query(MYSQL * db, const char *sql)
+{
+	if (mysql_real_query(db, sql, strlen(sql)) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int prepare(MYSQL * db, MYSQL_STMT ** out, const char *sql)
+{
+	my_bool truth = 1;
+
+	*out = mysql_stmt_init(db);
+	if (*out == NULL) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_attr_set(*out, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0
+	    || mysql_stmt_prepare(*out, sql, strlen(sql)) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_stmt_error(*out));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int create_tables(MYSQL * db)
+{
+	// the data is COMPRESS()ed already, the compressed pages mostly
+	// pack the rows tighter than the hot table does
+	static const char *sql_archive =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_ODB_ARCHIVE_TABLE_NAME "` ("
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `type` tinyint(1) unsigned NOT NULL,"
+	    "  `size` bigint(20) unsigned NOT NULL,"
+	    "  `data` longblob NOT NULL,"
+	    "  PRIMARY KEY (`oid`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " ROW_FORMAT=COMPRESSED KEY_BLOCK_SIZE=8"
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	static const char *sql_access =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_ODB_ACCESS_TABLE_NAME "` ("
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `last_access` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP,"
+	    "  PRIMARY KEY (`oid`),"
+	    "  KEY `last_access` (`last_access`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	if (run_query(db, sql_archive) < 0 || run_query(db, sql_access) < 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int mysql_odb_tier__init(mysql_odb_backend * backend, unsigned int sample_rate)
+{
+	static const char *sql_read =
+	    "SELECT `type`, `size`, UNCOMPRESS(`data`) FROM `"
+	    GIT2_ODB_ARCHIVE_TABLE_NAME "` WHERE `oid` = ?;";
+	static const char *sql_read_header =
+	    "SELECT `type`, `size` FROM `" GIT2_ODB_ARCHIVE_TABLE_NAME
+	    "` WHERE `oid` = ?;";
+
+	if (create_tables(backend->db) < 0 ||
+	    prepare(backend->db, &backend->st_tier_read, sql_read) < 0 ||
+	    prepare(backend->db, &backend->st_tier_read_header,
+		    sql_read_header) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_bind_param(backend->st_tier_read,
+				  backend->read_params) != 0 ||
+	    mysql_stmt_bind_param(backend->st_tier_read_header,
+				  backend->read_params) != 0) {
+		return GIT_ERROR;
+	}
+
+	backend->tier_sample_rate = sample_rate;
+	backend->tier_rng = (unsigned int)time(NULL) ^
+	    (unsigned int)(size_t) backend;
+	if (backend->tier_rng == 0) {
+		backend->tier_rng = 1;
+	}
+
+	return GIT_OK;
+}
+
+/* write the noted reads; access times are a hint, so failures are dropped */
+static void flush_access(mysql_odb_backend * backend)
+{
+	git_buf sql = GIT_BUF_INIT;
+	size_t i;
+
+	if (backend->tier_access_count == 0) {
+		return;
+	}
+
+	git_buf_puts(&sql, "INSERT INTO `" GIT2_ODB_ACCESS_TABLE_NAME
+		     "` (`oid`) VALUES ");
+	for (i = 0; i < backend->tier_access_count; i++) {
+		git_buf_puts(&sql, i ? ",(" : "(");
+		mysql_buf_put_oid(&sql, &backend->tier_access[i]);
+		git_buf_putc(&sql, ')');
+	}
+	git_buf_puts(&sql, " ON DUPLICATE KEY UPDATE"
+		     " `last_access` = CURRENT_TIMESTAMP");
+
+	if (run_buf(backend->db, &sql) < 0) {
+		giterr_clear();
+	}
+
+	backend->tier_access_count = 0;
+	git_buf_free(&sql);
+}
+
+void mysql_odb_tier__free(mysql_odb_backend * backend)
+{
+	if (backend->tier_sample_rate != 0) {
+		flush_access(backend);
+	}
+
+	if (backend->st_tier_read) {
+		mysql_conn_stmt_close(backend->st_tier_read, backend->epoch);
+	}
+	if (backend->st_tier_read_header) {
+		mysql_conn_stmt_close(backend->st_tier_read_header,
+				      backend->epoch);
+	}
+
+	backend->tier_sample_rate = 0;
+	backend->tier_access_count = 0;
+	backend->st_tier_read = NULL;
+	backend->st_tier_read_header = NULL;
+}
+
+static int sampled(mysql_odb_backend * backend)
+{
+	unsigned int x = backend->tier_rng;
+
+	// xorshift32, a counter would line up with regular access patterns
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	backend->tier_rng = x;
+
+	return x % backend->tier_sample_rate == 0;
+}
+
+static void note_access(mysql_odb_backend * backend, const git_oid * oid)
+{
+	git_oid_cpy(&backend->tier_access[backend->tier_access_count++], oid);
+
+	if (backend->tier_access_count == GIT2_TIER_ACCESS_BATCH) {
+		flush_access(backend);
+	}
+}
+
+void mysql_odb_tier__touch(mysql_odb_backend * backend, const git_oid * oid)
+{
+	if (backend->tier_sample_rate != 0 && sampled(backend)) {
+		note_access(backend, oid);
+	}
+}
+
+/* copy an archived object back to the hot table, then drop the archive row */
+static int promote(mysql_odb_backend * backend, const git_oid * oid)
+{
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	git_buf_puts(&sql, "INSERT IGNORE INTO `" GIT2_ODB_TABLE_NAME
+		     "` (`oid`, `type`, `size`, `data`)"
+		     " SELECT `oid`, `type`, `size`, `data` FROM `"
+		     GIT2_ODB_ARCHIVE_TABLE_NAME "` WHERE `oid` = ");
+	mysql_buf_put_oid(&sql, oid);
+	if ((error = run_buf(backend->db, &sql)) < 0) {
+		goto done;
+	}
+
+	git_buf_clear(&sql);
+	git_buf_puts(&sql, "DELETE a FROM `" GIT2_ODB_ARCHIVE_TABLE_NAME
+		     "` a JOIN `" GIT2_ODB_TABLE_NAME
+		     "` o ON o.`oid` = a.`oid` WHERE a.`oid` = ");
+	mysql_buf_put_oid(&sql, oid);
+	error = run_buf(backend->db, &sql);
+
+ done:
+	git_buf_free(&sql);
+	return error;
+}
+
+int
+mysql_odb_tier__read(void **data_p, size_t * len_p, git_otype * type_p,
+		     mysql_odb_backend * backend, const git_oid * oid)
+{
+	int error;
+
+	error = mysql_odb__read(data_p, len_p, type_p, backend,
+				backend->st_tier_read_header,
+				backend->st_tier_read, oid);
+
+	// the object is read already, a failed move only leaves it cold
+	if (error == GIT_OK && sampled(backend)) {
+		if (promote(backend, oid) < 0) {
+			giterr_clear();
+		} else {
+			note_access(backend, oid);
+			flush_access(backend);
+		}
+	}
+
+	return error;
+}
+
+int
+mysql_odb_tier__read_header(size_t * len_p, git_otype * type_p,
+			    mysql_odb_backend * backend, const git_oid * oid)
+{
+	return mysql_odb__read_header(len_p, type_p, backend,
+				      backend->st_tier_read_header, oid);
+}
@@ -0,0 +1,919 @@
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_commit_graph.h"
+#include "mysql_object_parse.h"
+#include "mysql_path_history.h"
+
+#define HISTORY_BATCH 256
+#define HISTORY_INSERT_ROWS 500
+
+#define MODE_TYPE(mode) ((mode) & 0170000)
+#define MODE_TREE 0040000
+#define MODE_GITLINK 0160000
+
+typedef struct {
+	const char *name;	/* in the tree's data, not NUL-terminated */
+	size_t name_len;
+	git_oid oid;
+	unsigned int mode;
+} tree_entry;
+
+typedef struct {
+	void *data;
+	tree_entry *entries;
+	size_t count;
+	size_t alloc;
+} tree_list;
+
+typedef struct {
+	git_oid path_hash;
+	git_oid blob;
+} path_change;
+
+typedef struct {
+	mysql_odb_backend *backend;
+	git_buf path;
+	path_change *changes;
+	size_t count;
+	size_t alloc;
+} path_diff;
+
+typedef struct {
+	mysql_path_history_entry *entries;	/* by commit */
+	size_t count;
+	size_t limit;
+	size_t visited;
+	mysql_path_history_cb cb;
+	void *payload;
+} log_walk;
+
+static int run_buf(MYSQL * db, git_buf * sql)
+{
+	if (git_buf_oom(sql)) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_real_query(db, sql->ptr, sql->size) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int mysql_path_history__init(mysql_odb_backend * backend)
+{
+	// the primary key is the lookup: one path, newest first
+	static const char *sql_history =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_PATH_HISTORY_TABLE_NAME "` ("
+	    "  `path_hash` binary(20) NOT NULL,"
+	    "  `generation` int(10) unsigned NOT NULL,"
+	    "  `commit_oid` binary(20) NOT NULL,"
+	    "  `blob_oid` binary(20) NOT NULL,"
+	    "  PRIMARY KEY (`path_hash`, `generation`, `commit_oid`),"
+	    "  KEY `commit_oid` (`commit_oid`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	// commits that are done, a commit may change no path at all
+	static const char *sql_commits =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_PATH_HISTORY_COMMITS_TABLE_NAME
+	    "` ("
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  PRIMARY KEY (`oid`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	// commits written since the last backfill
+	static const char *sql_queue =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_PATH_HISTORY_QUEUE_TABLE_NAME
+	    "` ("
+	    "  `oid` binary(20) NOT NULL DEFAULT '',"
+	    "  PRIMARY KEY (`oid`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	if (mysql_real_query(backend->db, sql_history,
+			     strlen(sql_history)) != 0 ||
+	    mysql_real_query(backend->db, sql_commits,
+			     strlen(sql_commits)) != 0 ||
+	    mysql_real_query(backend->db, sql_queue,
+			     strlen(sql_queue)) != 0) {
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int
+mysql_path_history__enqueue(mysql_odb_backend * backend, const git_oid * oids,
+			    size_t count)
+{
+	git_buf sql = GIT_BUF_INIT;
+	size_t i;
+	int error = GIT_OK;
+
+	for (i = 0; i < count && error == GIT_OK; i++) {
+		if (i % HISTORY_INSERT_ROWS == 0) {
+			git_buf_clear(&sql);
+			git_buf_puts(&sql, "INSERT IGNORE INTO `"
+				     GIT2_PATH_HISTORY_QUEUE_TABLE_NAME
+				     "` (`oid`) VALUES (");
+		} else {
+			git_buf_puts(&sql, ",(");
+		}
+
+		mysql_buf_put_oid(&sql, &oids[i]);
+		git_buf_putc(&sql, ')');
+
+		if ((i + 1) % HISTORY_INSERT_ROWS == 0 || i + 1 == count) {
+			error = run_buf(backend->db, &sql);
+		}
+	}
+
+	git_buf_free(&sql);
+	return error;
+}
+
+static int
+collect_entry(const char *name, size_t name_len, const git_oid * oid,
+	      unsigned int mode, void *payload)
+{
+	tree_list *list = payload;
+	tree_entry *entry;
+
+	if (list->count == list->alloc) {
+		size_t alloc = list->alloc ? list->alloc * 2 : 32;
+		tree_entry *entries = realloc(list->entries,
+					      alloc * sizeof(tree_entry));
+
+		if (entries == NULL) {
+			giterr_set_oom();
+			return GIT_ERROR;
+		}
+
+		list->entries = entries;
+		list->alloc = alloc;
+	}
+
+	entry = &list->entries[list->count++];
+	entry->name = name;
+	entry->name_len = name_len;
+	entry->mode = mode;
+	git_oid_cpy(&entry->oid, oid);
+
+	return 0;
+}
+
+/* a NULL `oid` is the empty tree */
+static int
+load_tree(tree_list * list, mysql_odb_backend * backend, const git_oid * oid)
+{
+	git_odb_backend *odb = &backend->parent;
+	size_t len;
+	git_otype type;
+	int error;
+
+	memset(list, 0, sizeof(*list));
+
+	if (oid == NULL) {
+		return GIT_OK;
+	}
+
+	if ((error = odb->read(&list->data, &len, &type, odb, oid)) < 0) {
+		list->data = NULL;
+		return error;
+	}
+
+	if (type != GIT_OBJ_TREE) {
+		giterr_set_str(GITERR_ODB, "Expected a tree in the MySql ODB");
+		return GIT_ERROR;
+	}
+
+	return mysql_parse_tree_named(list->data, len, collect_entry, list);
+}
+
+static void tree_free(tree_list * list)
+{
+	free(list->entries);
+	free(list->data);
+}
+
+/* git's tree order: a tree sorts as if its name ended with a slash */
+static int entry_cmp(const tree_entry * a, const tree_entry * b)
+{
+	size_t len = a->name_len < b->name_len ? a->name_len : b->name_len;
+	unsigned char ca, cb;
+	int cmp;
+
+	if ((cmp = memcmp(a->name, b->name, len)) != 0) {
+		return cmp;
+	}
+
+	ca = a->name_len > len ? (unsigned char)a->name[len] :
+	    MODE_TYPE(a->mode) == MODE_TREE ? '/' : '\0';
+	cb = b->name_len > len ? (unsigned char)b->name[len] :
+	    MODE_TYPE(b->mode) == MODE_TREE ? '/' : '\0';
+
+	return (int)ca - (int)cb;
+}
+
+static void diff_init(path_diff * diff, mysql_odb_backend * backend)
+{
+	memset(diff, 0, sizeof(*diff));
+	diff->backend = backend;
+	git_buf_init(&diff->path, 0);
+}
+
+static void diff_free(path_diff * diff)
+{
+	git_buf_free(&diff->path);
+	free(diff->changes);
+}
+
+/* the path in diff->path now holds `blob`, NULL once it is deleted */
+static int add_change(path_diff * diff, const git_oid * blob)
+{
+	path_change *change;
+
+	if (git_buf_oom(&diff->path)) {
+		return GIT_ERROR;
+	}
+
+	if (diff->count == diff->alloc) {
+		size_t alloc = diff->alloc ? diff->alloc * 2 : 64;
+		path_change *changes = realloc(diff->changes,
+					       alloc * sizeof(path_change));
+
+		if (changes == NULL) {
+			giterr_set_oom();
+			return GIT_ERROR;
+		}
+
+		diff->changes = changes;
+		diff->alloc = alloc;
+	}
+
+	change = &diff->changes[diff->count];
+	if (git_odb_hash(&change->path_hash, diff->path.ptr, diff->path.size,
+			 GIT_OBJ_BLOB) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (blob != NULL) {
+		git_oid_cpy(&change->blob, blob);
+	} else {
+		memset(&change->blob, 0, sizeof(git_oid));
+	}
+	diff->count++;
+
+	return GIT_OK;
+}
+
+static int diff_trees(path_diff * diff, const git_oid * old_tree,
+		      const git_oid * new_tree);
+
+static int
+diff_entry(path_diff * diff, const tree_entry * old_entry,
+	   const tree_entry * new_entry)
+{
+	const tree_entry *entry;
+	size_t len = diff->path.size;
+	int error;
+
+	// a submodule's history is in its own repository
+	if (old_entry != NULL && MODE_TYPE(old_entry->mode) == MODE_GITLINK) {
+		old_entry = NULL;
+	}
+	if (new_entry != NULL && MODE_TYPE(new_entry->mode) == MODE_GITLINK) {
+		new_entry = NULL;
+	}
+
+	if (old_entry == NULL && new_entry == NULL) {
+		return GIT_OK;
+	}
+
+	// unchanged subtrees are never read
+	if (old_entry != NULL && new_entry != NULL &&
+	    old_entry->mode == new_entry->mode &&
+	    git_oid_equal(&old_entry->oid, &new_entry->oid)) {
+		return GIT_OK;
+	}
+
+	entry = new_entry != NULL ? new_entry : old_entry;
+
+	if (len > 0) {
+		git_buf_putc(&diff->path, '/');
+	}
+	git_buf_put(&diff->path, entry->name, entry->name_len);
+
+	if (MODE_TYPE(entry->mode) == MODE_TREE) {
+		error = diff_trees(diff, old_entry ? &old_entry->oid : NULL,
+				   new_entry ? &new_entry->oid : NULL);
+	} else {
+		error = add_change(diff, new_entry ? &new_entry->oid : NULL);
+	}
+
+	git_buf_truncate(&diff->path, len);
+	return error;
+}
+
+/* both trees are in tree order, walk them side by side */
+static int
+diff_trees(path_diff * diff, const git_oid * old_tree,
+	   const git_oid * new_tree)
+{
+	tree_list old_list, new_list;
+	size_t i = 0, j = 0;
+	int error;
+
+	if ((error = load_tree(&old_list, diff->backend, old_tree)) < 0) {
+		tree_free(&old_list);
+		return error;
+	}
+
+	if ((error = load_tree(&new_list, diff->backend, new_tree)) < 0) {
+		tree_free(&old_list);
+		tree_free(&new_list);
+		return error;
+	}
+
+	while (error == GIT_OK &&
+	       (i < old_list.count || j < new_list.count)) {
+		int cmp;
+
+		if (i == old_list.count) {
+			cmp = 1;
+		} else if (j == new_list.count) {
+			cmp = -1;
+		} else {
+			cmp = entry_cmp(&old_list.entries[i],
+					&new_list.entries[j]);
+		}
+
+		if (cmp < 0) {
+			error = diff_entry(diff, &old_list.entries[i++], NULL);
+		} else if (cmp > 0) {
+			error = diff_entry(diff, NULL, &new_list.entries[j++]);
+		} else {
+			error = diff_entry(diff, &old_list.entries[i++],
+					   &new_list.entries[j++]);
+		}
+	}
+
+	tree_free(&old_list);
+	tree_free(&new_list);
+	return error;
+}
+
+static int change_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp(&((const path_change *)a)->path_hash,
+			   &((const path_change *)b)->path_hash);
+}
+
+/* keep the changes of `diff` that `other` has too */
+static void keep_common(path_diff * diff, path_diff * other)
+{
+	size_t i, kept = 0;
+
+	if (other->count > 0) {
+		qsort(other->changes, other->count, sizeof(path_change),
+		      change_cmp);
+
+		for (i = 0; i < diff->count; i++) {
+			if (bsearch(&diff->changes[i], other->changes,
+				    other->count, sizeof(path_change),
+				    change_cmp) != NULL) {
+				diff->changes[kept++] = diff->changes[i];
+			}
+		}
+	}
+
+	diff->count = kept;
+}
+
+/*
+ * The generation of the commit, and the root trees of its parents, from
+ * the commit graph. The generation is 0 while it is unknown.
+ */
+static int
+load_graph(uint32_t * generation, git_oid * trees,
+	   mysql_odb_backend * backend, const git_oid * oid,
+	   const mysql_commit_info * info)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	git_oid parent, found;
+	size_t i;
+	int error;
+
+	*generation = 0;
+
+	git_buf_puts(&sql, "SELECT `oid`, `generation`, `tree` FROM `"
+		     GIT2_COMMIT_GRAPH_TABLE_NAME "` WHERE `oid` IN (");
+	mysql_buf_put_oid(&sql, oid);
+	for (i = 0; i < info->parent_count; i++) {
+		git_oid_fromraw(&parent, (const unsigned char *)
+				info->parents.ptr + i * GIT_OID_RAWSZ);
+		git_buf_putc(&sql, ',');
+		mysql_buf_put_oid(&sql, &parent);
+	}
+	git_buf_putc(&sql, ')');
+
+	error = run_buf(backend->db, &sql);
+	git_buf_free(&sql);
+
+	if (error < 0 || (res = mysql_store_result(backend->db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		unsigned long *lengths = mysql_fetch_lengths(res);
+
+		if (lengths[0] != GIT_OID_RAWSZ || lengths[2] != GIT_OID_RAWSZ) {
+			continue;
+		}
+
+		git_oid_fromraw(&found, (const unsigned char *)row[0]);
+		if (git_oid_equal(&found, oid)) {
+			*generation = (uint32_t) strtoul(row[1], NULL, 10);
+			continue;
+		}
+
+		for (i = 0; i < info->parent_count; i++) {
+			git_oid_fromraw(&parent, (const unsigned char *)
+					info->parents.ptr + i * GIT_OID_RAWSZ);
+			if (git_oid_equal(&found, &parent)) {
+				git_oid_fromraw(&trees[i],
+						(const unsigned char *)row[2]);
+			}
+		}
+	}
+	mysql_free_result(res);
+
+	for (i = 0; i < info->parent_count; i++) {
+		if (git_oid_iszero(&trees[i])) {
+			*generation = 0;
+		}
+	}
+
+	return GIT_OK;
+}
+
+static int
+write_rows(mysql_odb_backend * backend, const git_oid * oid,
+	   uint32_t generation, const path_diff * diff)
+{
+	git_buf sql = GIT_BUF_INIT;
+	size_t i;
+	int error = GIT_OK;
+
+	for (i = 0; i < diff->count && error == GIT_OK; i++) {
+		if (i % HISTORY_INSERT_ROWS == 0) {
+			git_buf_clear(&sql);
+			git_buf_puts(&sql, "INSERT IGNORE INTO `"
+				     GIT2_PATH_HISTORY_TABLE_NAME "` VALUES (");
+		} else {
+			git_buf_puts(&sql, ",(");
+		}
+
+		mysql_buf_put_oid(&sql, &diff->changes[i].path_hash);
+		git_buf_printf(&sql, ",%u,", (unsigned int)generation);
+		mysql_buf_put_oid(&sql, oid);
+		git_buf_putc(&sql, ',');
+		mysql_buf_put_oid(&sql, &diff->changes[i].blob);
+		git_buf_putc(&sql, ')');
+
+		if ((i + 1) % HISTORY_INSERT_ROWS == 0 || i + 1 == diff->count) {
+			error = run_buf(backend->db, &sql);
+		}
+	}
+
+	// last, so a commit cut off halfway is indexed again
+	if (error == GIT_OK) {
+		git_buf_clear(&sql);
+		git_buf_puts(&sql, "INSERT IGNORE INTO `"
+			     GIT2_PATH_HISTORY_COMMITS_TABLE_NAME
+			     "` (`oid`) VALUES (");
+		mysql_buf_put_oid(&sql, oid);
+		git_buf_putc(&sql, ')');
+		error = run_buf(backend->db, &sql);
+	}
+
+	git_buf_free(&sql);
+	return error;
+}
+
+/*
+ * Index one commit. GIT_PASSTHROUGH without doing anything while its
+ * generation is unknown; GIT_ENOTFOUND when one of its trees is not
+ * stored yet.
+ */
+static int
+index_commit(mysql_odb_backend * backend, const git_oid * oid,
+	     const void *data, size_t len)
+{
+	mysql_commit_info info;
+	path_diff diff, other;
+	git_oid *trees = NULL;
+	uint32_t generation;
+	size_t i;
+	int error;
+
+	mysql_commit_info_init(&info);
+	diff_init(&diff, backend);
+	diff_init(&other, backend);
+
+	if ((error = mysql_parse_commit(&info, data, len)) < 0) {
+		goto done;
+	}
+
+	if ((trees = calloc(info.parent_count ? info.parent_count : 1,
+			    sizeof(git_oid))) == NULL) {
+		giterr_set_oom();
+		error = GIT_ERROR;
+		goto done;
+	}
+
+	if ((error = load_graph(&generation, trees, backend, oid, &info)) < 0) {
+		goto done;
+	}
+	if (generation == 0) {
+		error = GIT_PASSTHROUGH;
+		goto done;
+	}
+
+	// against the first parent, or every path of a root commit
+	if ((error = diff_trees(&diff, info.parent_count ? &trees[0] : NULL,
+				&info.tree)) < 0) {
+		goto done;
+	}
+
+	// a merge changes what differs from every parent
+	for (i = 1; i < info.parent_count && diff.count > 0; i++) {
+		other.count = 0;
+		if ((error = diff_trees(&other, &trees[i], &info.tree)) < 0) {
+			goto done;
+		}
+		keep_common(&diff, &other);
+	}
+
+	error = write_rows(backend, oid, generation, &diff);
+
+ done:
+	free(trees);
+	diff_free(&other);
+	diff_free(&diff);
+	mysql_commit_info_free(&info);
+	return error;
+}
+
+static int collect_pending(git_oid * oids, size_t * count, MYSQL * db,
+			   const git_oid * cursor)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error;
+
+	git_buf_puts(&sql, "SELECT g.`oid` FROM `" GIT2_COMMIT_GRAPH_TABLE_NAME
+		     "` g LEFT JOIN `" GIT2_PATH_HISTORY_COMMITS_TABLE_NAME
+		     "` c ON c.`oid` = g.`oid` WHERE c.`oid` IS NULL"
+		     " AND g.`generation` > 0 AND g.`oid` > ");
+	mysql_buf_put_oid(&sql, cursor);
+	git_buf_printf(&sql, " ORDER BY g.`oid` LIMIT %d", HISTORY_BATCH);
+
+	*count = 0;
+
+	error = run_buf(db, &sql);
+	git_buf_free(&sql);
+
+	if (error < 0 || (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		if (mysql_fetch_lengths(res)[0] == GIT_OID_RAWSZ) {
+			git_oid_fromraw(&oids[(*count)++],
+					(const unsigned char *)row[0]);
+		}
+	}
+
+	mysql_free_result(res);
+	return GIT_OK;
+}
+
+static int collect_queued(git_oid * oids, size_t * count, MYSQL * db)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error;
+
+	git_buf_printf(&sql, "SELECT `oid` FROM `"
+		       GIT2_PATH_HISTORY_QUEUE_TABLE_NAME
+		       "` ORDER BY `oid` LIMIT %d", HISTORY_BATCH);
+
+	*count = 0;
+
+	error = run_buf(db, &sql);
+	git_buf_free(&sql);
+
+	if (error < 0 || (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		if (mysql_fetch_lengths(res)[0] == GIT_OID_RAWSZ) {
+			git_oid_fromraw(&oids[(*count)++],
+					(const unsigned char *)row[0]);
+		}
+	}
+
+	mysql_free_result(res);
+	return GIT_OK;
+}
+
+static int dequeue(MYSQL * db, const git_oid * oids, size_t count)
+{
+	git_buf sql = GIT_BUF_INIT;
+	size_t i;
+	int error;
+
+	if (count == 0) {
+		return GIT_OK;
+	}
+
+	git_buf_puts(&sql, "DELETE FROM `" GIT2_PATH_HISTORY_QUEUE_TABLE_NAME
+		     "` WHERE `oid` IN (");
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			git_buf_putc(&sql, ',');
+		}
+		mysql_buf_put_oid(&sql, &oids[i]);
+	}
+	git_buf_putc(&sql, ')');
+
+	error = run_buf(db, &sql);
+	git_buf_free(&sql);
+	return error;
+}
+
+/*
+ * Index the commits of `oids` until `limit` are added; `visited` is how
+ * many of them were looked at.
+ */
+static int
+index_commits(size_t * added, size_t * visited, mysql_odb_backend * backend,
+	      const git_oid * oids, size_t count, size_t limit)
+{
+	git_odb_backend *_backend = &backend->parent;
+	size_t i;
+	int error = GIT_OK;
+
+	for (i = 0; i < count && error == GIT_OK; i++) {
+		void *data;
+		size_t len;
+		git_otype type;
+
+		if (limit > 0 && *added >= limit) {
+			break;
+		}
+
+		error = _backend->read(&data, &len, &type, _backend, &oids[i]);
+		if (error == GIT_OK) {
+			error = index_commit(backend, &oids[i], data, len);
+			free(data);
+		}
+
+		// a commit or tree that is not stored is passed over, and so
+		// is one without a generation, it is not added
+		if (error == GIT_ENOTFOUND || error == GIT_PASSTHROUGH) {
+			giterr_clear();
+			error = GIT_OK;
+		} else if (error == GIT_OK) {
+			(*added)++;
+		}
+	}
+
+	*visited = i;
+	return error;
+}
+
+/* with the connection entered */
+static int backfill(size_t * added, mysql_odb_backend * backend, size_t limit)
+{
+	git_oid *oids, cursor;
+	size_t count, visited;
+	int error = GIT_OK;
+
+	if (!backend->path_history) {
+		giterr_set_str(GITERR_ODB, "The path history is not enabled");
+		return GIT_ERROR;
+	}
+
+	if ((oids = malloc(HISTORY_BATCH * sizeof(git_oid))) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	// the commits written since the last run first; one that cannot be
+	// indexed yet leaves the queue and is found by the scan later on
+	do {
+		if ((error = collect_queued(oids, &count, backend->db)) < 0 ||
+		    (error = index_commits(added, &visited, backend, oids,
+					   count, limit)) < 0) {
+			break;
+		}
+		error = dequeue(backend->db, oids, visited);
+	} while (error == GIT_OK && count == HISTORY_BATCH &&
+		 visited == count);
+
+	memset(&cursor, 0, sizeof(cursor));
+
+	while (error == GIT_OK && (limit == 0 || *added < limit)) {
+		if ((error = collect_pending(oids, &count, backend->db,
+					     &cursor)) < 0 ||
+		    (error = index_commits(added, &visited, backend, oids,
+					   count, limit)) < 0) {
+			break;
+		}
+
+		if (count < HISTORY_BATCH) {
+			break;
+		}
+		git_oid_cpy(&cursor, &oids[count - 1]);
+	}
+
+	free(oids);
+	return error;
+}
+
+int
+mysql_path_history_backfill(size_t * added, git_odb_backend * _backend,
+			    size_t limit)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	int error;
+
+	assert(added && backend);
+
+	*added = 0;
+
+	if ((error = mysql_odb__enter(backend)) == GIT_OK) {
+		error = backfill(added, backend, limit);
+		mysql_odb__leave(backend);
+	}
+
+	return error;
+}
+
+/* the rows of one path, newest first */
+static int
+load_entries(mysql_path_history_entry ** out, size_t * count, MYSQL * db,
+	     const git_oid * path_hash, size_t limit)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	mysql_path_history_entry *entries;
+	int error;
+
+	*out = NULL;
+	*count = 0;
+
+	git_buf_puts(&sql, "SELECT `generation`, `commit_oid`, `blob_oid`"
+		     " FROM `" GIT2_PATH_HISTORY_TABLE_NAME
+		     "` WHERE `path_hash` = ");
+	mysql_buf_put_oid(&sql, path_hash);
+	git_buf_puts(&sql, " ORDER BY `generation` DESC, `commit_oid` DESC");
+	if (limit > 0) {
+		git_buf_printf(&sql, " LIMIT %llu", (unsigned long long)limit);
+	}
+
+	error = run_buf(db, &sql);
+	git_buf_free(&sql);
+
+	if (error < 0 || (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	entries = malloc((mysql_num_rows(res) + 1) *
+			 sizeof(mysql_path_history_entry));
+	if (entries == NULL) {
+		mysql_free_result(res);
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		unsigned long *lengths = mysql_fetch_lengths(res);
+		mysql_path_history_entry *entry = &entries[*count];
+
+		if (lengths[1] != GIT_OID_RAWSZ || lengths[2] != GIT_OID_RAWSZ) {
+			continue;
+		}
+
+		entry->generation = (uint32_t) strtoul(row[0], NULL, 10);
+		git_oid_fromraw(&entry->commit, (const unsigned char *)row[1]);
+		git_oid_fromraw(&entry->blob, (const unsigned char *)row[2]);
+		(*count)++;
+	}
+
+	mysql_free_result(res);
+	*out = entries;
+	return GIT_OK;
+}
+
+static int entry_commit_cmp(const void *a, const void *b)
+{
+	return git_oid_cmp(&((const mysql_path_history_entry *)a)->commit,
+			   &((const mysql_path_history_entry *)b)->commit);
+}
+
+static int log_visit(const mysql_commit_graph_entry * commit, void *payload)
+{
+	log_walk *walk = payload;
+	mysql_path_history_entry key, *entry;
+	int error;
+
+	git_oid_cpy(&key.commit, &commit->oid);
+	entry = bsearch(&key, walk->entries, walk->count,
+			sizeof(mysql_path_history_entry), entry_commit_cmp);
+	if (entry == NULL) {
+		return 0;
+	}
+
+	if ((error = walk->cb(entry, walk->payload)) != 0) {
+		return error;
+	}
+
+	return ++walk->visited == walk->limit ? GIT_ITEROVER : 0;
+}
+
+int
+mysql_path_history_log(git_odb_backend * _backend, const char *path,
+		       const git_oid * tip, size_t limit,
+		       mysql_path_history_cb cb, void *payload)
+{
+	mysql_odb_backend *backend = (mysql_odb_backend *) _backend;
+	mysql_path_history_entry *entries;
+	git_oid path_hash;
+	log_walk walk;
+	uint32_t oldest;
+	size_t i, count;
+	int error;
+
+	assert(backend && path && cb);
+
+	if (git_odb_hash(&path_hash, path, strlen(path), GIT_OBJ_BLOB) < 0 ||
+	    mysql_odb__enter(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	// the ancestors of the tip may be further down than `limit` rows;
+	// `cb` runs with the connection left, as does the walk's
+	error = load_entries(&entries, &count, backend->db, &path_hash,
+			     tip ? 0 : limit);
+	mysql_odb__leave(backend);
+	if (error < 0) {
+		return error;
+	}
+
+	if (tip == NULL || count == 0) {
+		for (i = 0, error = GIT_OK; i < count && error == GIT_OK; i++) {
+			error = cb(&entries[i], payload);
+		}
+		free(entries);
+		return error;
+	}
+
+	oldest = entries[count - 1].generation;
+	qsort(entries, count, sizeof(mysql_path_history_entry),
+	      entry_commit_cmp);
+
+	memset(&walk, 0, sizeof(walk));
+	walk.entries = entries;
+	walk.count = count;
+	walk.limit = limit;
+	walk.cb = cb;
+	walk.payload = payload;
+
+	// the walk reads narrow graph rows only, and stops at the oldest
+	// change of the path
+	error = mysql_commit_graph_walk(_backend, tip, 1, oldest, 0, log_visit,
+					&walk);
+
+	free(entries);
+	return error;
+}
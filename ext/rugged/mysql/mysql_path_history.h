@@ -0,0 +1,54 @@
+#ifndef MYSQL_PATH_HISTORY_H
+#define MYSQL_PATH_HISTORY_H
+
+#include <stdint.h>
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+/*
+ * Path-history index.
+ *
+ * `git2_path_history` keeps one row for every path a commit changes: the
+ * hash of the path, the generation number of the commit from the commit
+ * graph, the commit, and the blob at the path after it. The history of a
+ * file is then one range scan of the primary key, newest first, where
+ * `git log -- path` diffs the trees of every commit. Writing a commit only
+ * adds it to `git2_path_history_queue`; mysql_path_history_backfill()
+ * indexes the queued commits first and then any other that has a
+ * generation but no rows, so it should run regularly.
+ *
+ * A commit changes a path when the path differs from the one in each of
+ * its parents, which for a merge is how `git log` simplifies history by
+ * default. The path is hashed as the contents of a blob, like `git
+ * hash-object --stdin` does.
+ */
+
+typedef struct {
+	git_oid commit;
+	git_oid blob;		/* zero where the commit deleted the path */
+	uint32_t generation;
+} mysql_path_history_entry;
+
+typedef int (*mysql_path_history_cb) (const mysql_path_history_entry *
+				      entry, void *payload);
+
+/*
+ * Index up to `limit` commits (0 for all): the queued ones, then those of
+ * the commit graph that have a generation number but no rows yet. Commits
+ * whose trees are missing are passed over.
+ */
+int mysql_path_history_backfill(size_t * added, git_odb_backend * backend,
+				size_t limit);
+
+/*
+ * Visit the commits that changed `path`, relative to the root of the tree
+ * and without a leading slash, newest generation first. With a `tip`,
+ * only its ancestors are visited, found with a walk of the commit graph
+ * down to the oldest change. Stops after `limit` commits (0 for no limit)
+ * or when `cb` returns non-zero.
+ */
+int mysql_path_history_log(git_odb_backend * backend, const char *path,
+			   const git_oid * tip, size_t limit,
+			   mysql_path_history_cb cb, void *payload);
+
+#endif
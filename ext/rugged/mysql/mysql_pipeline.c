@@ -0,0 +1,400 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_pipeline.h"
+
+/* requests per round trip */
+#define PIPELINE_DEPTH 64
+
+typedef struct {
+	git_oid oid;
+	int header_only;
+} pipeline_request;
+
+struct mysql_pipeline {
+	mysql_odb_backend *backend;
+	pipeline_request *requests;
+	size_t count;
+	size_t alloc;
+};
+
+int mysql_pipeline_new(mysql_pipeline ** out, git_odb_backend * backend)
+{
+	mysql_pipeline *pipeline;
+
+	*out = NULL;
+
+	if ((pipeline = calloc(1, sizeof(mysql_pipeline))) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	pipeline->backend = (mysql_odb_backend *) backend;
+
+	*out = pipeline;
+	return GIT_OK;
+}
+
+void mysql_pipeline_free(mysql_pipeline * pipeline)
+{
+	if (pipeline == NULL) {
+		return;
+	}
+
+	free(pipeline->requests);
+	free(pipeline);
+}
+
+static int queue(mysql_pipeline * pipeline, const git_oid * oid,
+		 int header_only)
+{
+	if (pipeline->count == pipeline->alloc) {
+		size_t alloc = pipeline->alloc ? pipeline->alloc * 2 : 64;
+		pipeline_request *requests = realloc(pipeline->requests,
+						     alloc *
+						     sizeof(pipeline_request));
+
+		if (requests == NULL) {
+			giterr_set_oom();
+			return GIT_ERROR;
+		}
+		pipeline->requests = requests;
+		pipeline->alloc = alloc;
+	}
+
+	git_oid_cpy(&pipeline->requests[pipeline->count].oid, oid);
+	pipeline->requests[pipeline->count].header_only = header_only;
+	pipeline->count++;
+
+	return GIT_OK;
+}
+
+int mysql_pipeline_read(mysql_pipeline * pipeline, const git_oid * oid)
+{
+	return queue(pipeline, oid, 0);
+}
+
+int mysql_pipeline_read_header(mysql_pipeline * pipeline, const git_oid * oid)
+{
+	return queue(pipeline, oid, 1);
+}
+
+/*
+ * answer a request without MySQL when a local cache or the write-behind
+ * journal has it, in the order of mysql_odb_backend__read()
+ */
+static int resolve_local(void **data_p, size_t * len_p, git_otype * type_p,
+			 mysql_odb_backend * backend,
+			 const pipeline_request * request)
+{
+	int error = GIT_ENOTFOUND;
+
+	if (request->header_only) {
+		if (backend->header_index != NULL) {
+			error = mysql_header_index_lookup(len_p, type_p,
+							  backend->header_index,
+							  &request->oid);
+		}
+		if (error == GIT_ENOTFOUND && backend->journal != NULL) {
+			error = mysql_journal_read_header(len_p, type_p,
+							  backend->journal,
+							  &request->oid);
+		}
+		if (error == GIT_ENOTFOUND && backend->disk_cache != NULL) {
+			error = mysql_disk_cache_read_header(len_p, type_p,
+							     backend->disk_cache,
+							     &request->oid);
+		}
+		return error;
+	}
+
+	if (backend->disk_cache != NULL) {
+		error = mysql_disk_cache_read(data_p, len_p, type_p,
+					      backend->disk_cache,
+					      (git_odb_backend *) backend,
+					      &request->oid);
+	}
+	if (error == GIT_ENOTFOUND && backend->journal != NULL) {
+		error = mysql_journal_read(data_p, len_p, type_p,
+					   backend->journal,
+					   (git_odb_backend *) backend,
+					   &request->oid);
+	}
+
+	return error;
+}
+
+/* the one-at-a-time path, for packed objects and failed batches */
+static int resolve_single(void **data_p, size_t * len_p, git_otype * type_p,
+			  mysql_odb_backend * backend,
+			  const pipeline_request * request)
+{
+	git_odb_backend *parent = &backend->parent;
+
+	return request->header_only ?
+	    parent->read_header(len_p, type_p, parent, &request->oid) :
+	    parent->read(data_p, len_p, type_p, parent, &request->oid);
+}
+
+typedef struct {
+	int error;
+	int sent;		/* asked of MySQL, GIT_ERROR until answered */
+	void *data;
+	size_t len;
+	git_otype type;
+} pipeline_result;
+
+/*
+ * One statement for the requests of a kind: their rows by `oid`, in
+ * insertion order when the table is clustered by it. 0 if there are none.
+ */
+static int
+put_select(git_buf * sql, mysql_pipeline * pipeline,
+	   const pipeline_result * results, size_t start, size_t end,
+	   int header_only, int sequential)
+{
+	size_t i, n = 0;
+
+	for (i = start; i < end; i++) {
+		if (!results[i - start].sent ||
+		    pipeline->requests[i].header_only != header_only) {
+			continue;
+		}
+
+		if (n++ > 0) {
+			git_buf_putc(sql, ',');
+		} else {
+			git_buf_printf(sql, "%sSELECT `oid`, `type`, `size`%s"
+				       " FROM `" GIT2_ODB_TABLE_NAME
+				       "` WHERE `oid` IN (",
+				       sql->size ? ";" : "",
+				       header_only ? "" :
+				       ", UNCOMPRESS(`data`)");
+		}
+		mysql_buf_put_oid(sql, &pipeline->requests[i].oid);
+	}
+
+	if (n > 0) {
+		git_buf_putc(sql, ')');
+		if (sequential) {
+			git_buf_puts(sql, " ORDER BY `id`");
+		}
+	}
+
+	return n > 0;
+}
+
+static int
+read_row(pipeline_result * result, mysql_odb_backend * backend,
+	 MYSQL_ROW row, unsigned long *lengths, int header_only)
+{
+	result->type = (git_otype) atoi(row[1]);
+	result->len = (size_t) strtoull(row[2], NULL, 10);
+
+	if (header_only) {
+		return GIT_OK;
+	}
+
+	if (row[3] == NULL ||
+	    (result->data = git_odb_backend_malloc(&backend->parent,
+						   lengths[3] ? lengths[3] :
+						   1)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	memcpy(result->data, row[3], lengths[3]);
+	result->len = lengths[3];
+	return GIT_OK;
+}
+
+/* answer the requests of a kind from the result of their statement */
+static void
+read_results(pipeline_result * results, mysql_pipeline * pipeline,
+	     size_t start, size_t end, int header_only)
+{
+	mysql_odb_backend *backend = pipeline->backend;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	size_t i;
+
+	if ((res = mysql_store_result(backend->db)) == NULL) {
+		return;
+	}
+
+	for (i = start; i < end; i++) {
+		if (results[i - start].sent &&
+		    pipeline->requests[i].header_only == header_only) {
+			results[i - start].error = GIT_ENOTFOUND;
+		}
+	}
+
+	// a batch is small, and the same OID may be asked for twice
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		unsigned long *lengths = mysql_fetch_lengths(res);
+		git_oid oid;
+
+		if (lengths[0] != GIT_OID_RAWSZ) {
+			continue;
+		}
+		git_oid_fromraw(&oid, (const unsigned char *)row[0]);
+
+		for (i = start; i < end; i++) {
+			pipeline_result *result = &results[i - start];
+
+			if (result->sent && result->error == GIT_ENOTFOUND &&
+			    pipeline->requests[i].header_only == header_only &&
+			    git_oid_equal(&pipeline->requests[i].oid, &oid)) {
+				result->error = read_row(result, backend, row,
+							 lengths, header_only);
+			}
+		}
+	}
+
+	mysql_free_result(res);
+}
+
+static int flush_batch(mysql_pipeline * pipeline, size_t start, size_t end,
+		       mysql_pipeline_cb cb, void *payload)
+{
+	mysql_odb_backend *backend = pipeline->backend;
+	pipeline_result results[PIPELINE_DEPTH];
+	git_buf sql = GIT_BUF_INIT;
+	size_t i, sent = 0;
+	int entered, pending, sequential, headers = 0, reads = 0;
+	int error = GIT_OK;
+
+	memset(results, 0, sizeof(results));
+
+	for (i = start; i < end; i++) {
+		const pipeline_request *request = &pipeline->requests[i];
+		pipeline_result *result = &results[i - start];
+
+		result->error = resolve_local(&result->data, &result->len,
+					      &result->type, backend, request);
+		if (result->error == GIT_OK) {
+			continue;
+		}
+		// until its result is read
+		result->error = GIT_ERROR;
+		result->sent = 1;
+		sent++;
+	}
+
+	// one statement for the headers, one for the objects, sent at once;
+	// the connection stays entered until they are read, but not
+	// around `cb`
+	entered = sent > 0 && mysql_odb__enter(backend) == GIT_OK;
+	if (entered) {
+		sequential = mysql_odb__sequential(backend);
+		headers = put_select(&sql, pipeline, results, start, end, 1,
+				     sequential);
+		reads = put_select(&sql, pipeline, results, start, end, 0,
+				   sequential);
+	}
+	pending = entered && !git_buf_oom(&sql) &&
+	    mysql_real_query(backend->db, sql.ptr, sql.size) == 0;
+	git_buf_free(&sql);
+
+	if (pending && headers) {
+		read_results(results, pipeline, start, end, 1);
+		pending = reads && mysql_next_result(backend->db) == 0;
+	}
+	if (pending && reads) {
+		read_results(results, pipeline, start, end, 0);
+	}
+
+	// drain what is left so the connection can be used again
+	while (entered && mysql_more_results(backend->db) &&
+	       mysql_next_result(backend->db) == 0) {
+		MYSQL_RES *res = mysql_store_result(backend->db);
+
+		if (res != NULL) {
+			mysql_free_result(res);
+		}
+	}
+
+	for (i = start; i < end; i++) {
+		const pipeline_request *request = &pipeline->requests[i];
+		pipeline_result *result = &results[i - start];
+
+		if (!result->sent || result->error != GIT_OK) {
+			continue;
+		}
+
+		if (backend->header_index != NULL) {
+			mysql_header_index_insert(backend->header_index,
+						  &request->oid, result->len,
+						  result->type);
+		}
+
+		if (!request->header_only && backend->disk_cache != NULL) {
+			mysql_disk_cache_write(backend->disk_cache,
+					       &request->oid, result->data,
+					       result->len, result->type);
+		}
+	}
+
+	// a failed statement ends the batch; what it left unanswered, and
+	// whatever is not loose, goes through the single-object path
+	for (i = start; i < end; i++) {
+		pipeline_result *result = &results[i - start];
+
+		if (result->error == GIT_ERROR ||
+		    (result->error == GIT_ENOTFOUND &&
+		     (backend->packed || backend->pool != NULL ||
+		      backend->tier_sample_rate != 0))) {
+			result->error = resolve_single(&result->data,
+						       &result->len,
+						       &result->type, backend,
+						       &pipeline->requests[i]);
+		}
+	}
+
+	if (entered) {
+		mysql_odb__leave(backend);
+	}
+
+	for (i = start; i < end; i++) {
+		pipeline_result *result = &results[i - start];
+
+		if (error == GIT_OK &&
+		    cb(i, &pipeline->requests[i].oid, result->error,
+		       result->data, result->len, result->type, payload) != 0) {
+			error = GIT_EUSER;
+		} else if (error != GIT_OK) {
+			free(result->data);
+		}
+	}
+
+	return error;
+}
+
+int
+mysql_pipeline_flush(mysql_pipeline * pipeline, mysql_pipeline_cb cb,
+		     void *payload)
+{
+	size_t start, end;
+	int error = GIT_OK;
+
+	// local hits are only as good as the last sweep seen
+	mysql_gc__check(pipeline->backend);
+
+	for (start = 0; start < pipeline->count && error == GIT_OK;
+	     start = end) {
+		end = start + PIPELINE_DEPTH;
+		if (end > pipeline->count) {
+			end = pipeline->count;
+		}
+
+		error = flush_batch(pipeline, start, end, cb, payload);
+	}
+
+	pipeline->count = 0;
+	return error;
+}
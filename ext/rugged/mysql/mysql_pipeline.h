@@ -0,0 +1,41 @@
+#ifndef MYSQL_PIPELINE_H
+#define MYSQL_PIPELINE_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+/*
+ * Pipelined object reads over the backend's own connection.
+ *
+ * Reads and header lookups are queued, then sent in batches: one
+ * `oid IN (...)` statement for the headers and one for the objects of a
+ * batch, as a single multi-statement query, in row id order when the
+ * table is sequential. The rows are matched to the queued requests by OID.
+ * Independent lookups thus cost one round trip per batch instead of one
+ * each.
+ */
+
+typedef struct mysql_pipeline mysql_pipeline;
+
+/*
+ * Called once per request, in the order they were queued. `error` is
+ * GIT_OK, GIT_ENOTFOUND or GIT_ERROR. For full reads `data` comes from
+ * git_odb_backend_malloc() and belongs to the callback; header lookups
+ * get NULL. A non-zero return stops the flush.
+ */
+typedef int (*mysql_pipeline_cb) (size_t i, const git_oid * oid, int error,
+				  void *data, size_t len, git_otype type,
+				  void *payload);
+
+int mysql_pipeline_new(mysql_pipeline ** out, git_odb_backend * backend);
+void mysql_pipeline_free(mysql_pipeline * pipeline);
+
+int mysql_pipeline_read(mysql_pipeline * pipeline, const git_oid * oid);
+int mysql_pipeline_read_header(mysql_pipeline * pipeline,
+			       const git_oid * oid);
+
+/* run everything queued and empty the queue */
+int mysql_pipeline_flush(mysql_pipeline * pipeline, mysql_pipeline_cb cb,
+			 void *payload);
+
+#endif
@@ -0,0 +1,499 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_object_parse.h"
+#include "mysql_prefetch.h"
+
+#define PREFETCH_BUCKETS 4096
+#define PREFETCH_MAX_ENTRIES 16384
+#define PREFETCH_BATCH 256
+#define PREFETCH_CANCEL_MISSES 64
+
+#define GITLINK_MODE 0160000
+
+enum {
+	PF_QUEUED,
+	PF_FETCHING,
+	PF_READY,
+};
+
+typedef struct pf_entry {
+	git_oid oid;
+	int state;
+	int orphan;		/* taken off the map while still queued */
+	unsigned int depth;
+	git_otype type;
+	size_t len;
+	void *data;
+	struct pf_entry *bucket_next;
+	struct pf_entry *queue_next;
+} pf_entry;
+
+struct mysql_prefetch {
+	mysql_conn_params params;
+	unsigned int max_depth;
+	size_t max_memory;
+
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t work;	/* the queue is not empty, or shutdown */
+	pthread_cond_t done;	/* a batch finished */
+	int shutdown;
+	int failed;
+
+	pf_entry *buckets[PREFETCH_BUCKETS];
+	size_t entries;
+	size_t memory;
+	pf_entry *queue_head;
+	pf_entry *queue_tail;
+	size_t misses;
+};
+
+static pf_entry **bucket_of(mysql_prefetch * pf, const git_oid * oid)
+{
+	size_t hash;
+
+	memcpy(&hash, oid->id, sizeof(hash));
+	return &pf->buckets[hash % PREFETCH_BUCKETS];
+}
+
+static pf_entry *entry_find(mysql_prefetch * pf, const git_oid * oid)
+{
+	pf_entry *entry;
+
+	for (entry = *bucket_of(pf, oid); entry != NULL;
+	     entry = entry->bucket_next) {
+		if (git_oid_equal(&entry->oid, oid)) {
+			return entry;
+		}
+	}
+
+	return NULL;
+}
+
+static void entry_unlink(mysql_prefetch * pf, pf_entry * entry)
+{
+	pf_entry **link;
+
+	for (link = bucket_of(pf, &entry->oid); *link != NULL;
+	     link = &(*link)->bucket_next) {
+		if (*link == entry) {
+			*link = entry->bucket_next;
+			pf->entries--;
+			return;
+		}
+	}
+}
+
+static void entry_free(mysql_prefetch * pf, pf_entry * entry)
+{
+	if (entry->state == PF_READY) {
+		pf->memory -= entry->len;
+	}
+	free(entry->data);
+	free(entry);
+}
+
+typedef struct {
+	mysql_prefetch *pf;
+	unsigned int depth;
+} enqueue_payload;
+
+static int enqueue_entry(const git_oid * oid, unsigned int mode, void *payload)
+{
+	enqueue_payload *p = payload;
+	mysql_prefetch *pf = p->pf;
+	pf_entry **bucket, *entry;
+
+	// submodule commits live in another repository
+	if ((mode & 0170000) == GITLINK_MODE) {
+		return 0;
+	}
+
+	if (pf->entries >= PREFETCH_MAX_ENTRIES) {
+		return 1;
+	}
+
+	if (entry_find(pf, oid) != NULL) {
+		return 0;
+	}
+
+	if ((entry = calloc(1, sizeof(pf_entry))) == NULL) {
+		return 1;
+	}
+
+	git_oid_cpy(&entry->oid, oid);
+	entry->state = PF_QUEUED;
+	entry->depth = p->depth;
+
+	bucket = bucket_of(pf, oid);
+	entry->bucket_next = *bucket;
+	*bucket = entry;
+	pf->entries++;
+
+	if (pf->queue_tail != NULL) {
+		pf->queue_tail->queue_next = entry;
+	} else {
+		pf->queue_head = entry;
+	}
+	pf->queue_tail = entry;
+
+	return 0;
+}
+
+/* called with the lock held */
+static void enqueue_tree(mysql_prefetch * pf, const void *data, size_t len,
+			 unsigned int depth)
+{
+	enqueue_payload payload;
+
+	payload.pf = pf;
+	payload.depth = depth;
+
+	mysql_parse_tree(data, len, enqueue_entry, &payload);
+	giterr_clear();
+
+	if (pf->queue_head != NULL) {
+		pthread_cond_signal(&pf->work);
+	}
+}
+
+/*
+ * Load one batch; rows are published as they stream in. In a table
+ * clustered by insertion order they are read in that order.
+ */
+static void
+fetch_batch(mysql_prefetch * pf, MYSQL * db, int sequential,
+	    const git_oid * oids, size_t count)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res = NULL;
+	MYSQL_ROW row;
+	size_t i;
+
+	git_buf_puts(&sql, "SELECT `oid`, `type`, `size`, UNCOMPRESS(`data`)"
+		     " FROM `" GIT2_ODB_TABLE_NAME "` WHERE `oid` IN (");
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			git_buf_putc(&sql, ',');
+		}
+		mysql_buf_put_oid(&sql, &oids[i]);
+	}
+	git_buf_putc(&sql, ')');
+	if (sequential) {
+		git_buf_puts(&sql, " ORDER BY `id`");
+	}
+
+	if (!git_buf_oom(&sql) &&
+	    mysql_real_query(db, sql.ptr, sql.size) == 0) {
+		res = mysql_use_result(db);
+	}
+	git_buf_free(&sql);
+
+	while (res != NULL && (row = mysql_fetch_row(res)) != NULL) {
+		unsigned long *lengths = mysql_fetch_lengths(res);
+		pf_entry *entry;
+		git_oid oid;
+		void *data;
+
+		if (lengths[0] != GIT_OID_RAWSZ || row[3] == NULL) {
+			continue;
+		}
+		git_oid_fromraw(&oid, (const unsigned char *)row[0]);
+
+		pthread_mutex_lock(&pf->lock);
+
+		entry = entry_find(pf, &oid);
+		if (entry == NULL || entry->state != PF_FETCHING ||
+		    pf->memory + lengths[3] > pf->max_memory ||
+		    (data = malloc(lengths[3] ? lengths[3] : 1)) == NULL) {
+			pthread_mutex_unlock(&pf->lock);
+			continue;
+		}
+
+		memcpy(data, row[3], lengths[3]);
+		entry->data = data;
+		entry->len = lengths[3];
+		entry->type = (git_otype) atoi(row[1]);
+		entry->state = PF_READY;
+		pf->memory += entry->len;
+
+		if (entry->type == GIT_OBJ_TREE && entry->depth < pf->max_depth) {
+			enqueue_tree(pf, entry->data, entry->len,
+				     entry->depth + 1);
+		}
+
+		pthread_cond_broadcast(&pf->done);
+		pthread_mutex_unlock(&pf->lock);
+	}
+
+	if (res != NULL) {
+		mysql_free_result(res);
+	}
+}
+
+static void *prefetch_thread(void *payload)
+{
+	mysql_prefetch *pf = payload;
+	git_oid oids[PREFETCH_BATCH];
+	MYSQL *db = NULL;
+	size_t count, i;
+	int sequential;
+
+	mysql_thread_init();
+
+	if (mysql_conn_open(&db, &pf->params) < 0) {
+		pthread_mutex_lock(&pf->lock);
+		pf->failed = 1;
+		pthread_mutex_unlock(&pf->lock);
+		goto done;
+	}
+
+	// the batches are read by `oid` either way
+	if ((sequential = mysql_odb__table_sequential(db)) < 0) {
+		sequential = 0;
+	}
+
+	pthread_mutex_lock(&pf->lock);
+
+	while (!pf->shutdown) {
+		if (pf->queue_head == NULL) {
+			pthread_cond_wait(&pf->work, &pf->lock);
+			continue;
+		}
+
+		for (count = 0; count < PREFETCH_BATCH && pf->queue_head;) {
+			pf_entry *entry = pf->queue_head;
+
+			pf->queue_head = entry->queue_next;
+			entry->queue_next = NULL;
+
+			if (entry->orphan) {
+				entry_free(pf, entry);
+				continue;
+			}
+
+			entry->state = PF_FETCHING;
+			git_oid_cpy(&oids[count++], &entry->oid);
+		}
+		if (pf->queue_head == NULL) {
+			pf->queue_tail = NULL;
+		}
+
+		if (count == 0) {
+			continue;
+		}
+
+		pthread_mutex_unlock(&pf->lock);
+		fetch_batch(pf, db, sequential, oids, count);
+		pthread_mutex_lock(&pf->lock);
+
+		// published entries may be taken already, look them up again;
+		// whatever did not arrive is left to the foreground
+		for (i = 0; i < count; i++) {
+			pf_entry *entry = entry_find(pf, &oids[i]);
+
+			if (entry != NULL && entry->state == PF_FETCHING) {
+				entry_unlink(pf, entry);
+				entry_free(pf, entry);
+			}
+		}
+
+		pthread_cond_broadcast(&pf->done);
+	}
+
+	pthread_mutex_unlock(&pf->lock);
+	mysql_close(db);
+
+ done:
+	mysql_thread_end();
+	return NULL;
+}
+
+/* called with the lock held; in-flight entries belong to the worker */
+static void drop_pending(mysql_prefetch * pf)
+{
+	pf_entry *entry;
+	size_t i;
+
+	for (entry = pf->queue_head; entry != NULL; entry = entry->queue_next) {
+		if (!entry->orphan) {
+			entry_unlink(pf, entry);
+			entry->orphan = 1;
+		}
+	}
+
+	for (i = 0; i < PREFETCH_BUCKETS; i++) {
+		pf_entry **link = &pf->buckets[i];
+
+		while (*link != NULL) {
+			pf_entry *entry = *link;
+
+			if (entry->state == PF_READY) {
+				*link = entry->bucket_next;
+				pf->entries--;
+				entry_free(pf, entry);
+			} else {
+				link = &entry->bucket_next;
+			}
+		}
+	}
+
+	pf->misses = 0;
+}
+
+int
+mysql_prefetch_new(mysql_prefetch ** out, const mysql_conn_params * params,
+		   unsigned int max_depth, size_t max_memory)
+{
+	mysql_prefetch *pf;
+
+	*out = NULL;
+
+	if ((pf = calloc(1, sizeof(mysql_prefetch))) == NULL) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_conn_params_init(&pf->params, params->host, params->port,
+				   params->unix_socket, params->db,
+				   params->user, params->passwd,
+				   params->client_flag) < 0) {
+		free(pf);
+		return GIT_ERROR;
+	}
+
+	pf->max_depth = max_depth;
+	pf->max_memory = max_memory;
+
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->work, NULL);
+	pthread_cond_init(&pf->done, NULL);
+
+	if (pthread_create(&pf->thread, NULL, prefetch_thread, pf) != 0) {
+		pthread_cond_destroy(&pf->done);
+		pthread_cond_destroy(&pf->work);
+		pthread_mutex_destroy(&pf->lock);
+		mysql_conn_params_free(&pf->params);
+		free(pf);
+		giterr_set_str(GITERR_OS, "Failed to start the prefetch thread");
+		return GIT_ERROR;
+	}
+
+	*out = pf;
+	return GIT_OK;
+}
+
+void mysql_prefetch_free(mysql_prefetch * pf)
+{
+	pf_entry *entry;
+	size_t i;
+
+	if (pf == NULL) {
+		return;
+	}
+
+	pthread_mutex_lock(&pf->lock);
+	pf->shutdown = 1;
+	pthread_cond_signal(&pf->work);
+	pthread_mutex_unlock(&pf->lock);
+
+	pthread_join(pf->thread, NULL);
+
+	while ((entry = pf->queue_head) != NULL) {
+		pf->queue_head = entry->queue_next;
+		if (entry->orphan) {
+			entry_free(pf, entry);
+		}
+	}
+
+	for (i = 0; i < PREFETCH_BUCKETS; i++) {
+		while ((entry = pf->buckets[i]) != NULL) {
+			pf->buckets[i] = entry->bucket_next;
+			entry_free(pf, entry);
+		}
+	}
+
+	pthread_cond_destroy(&pf->done);
+	pthread_cond_destroy(&pf->work);
+	pthread_mutex_destroy(&pf->lock);
+	mysql_conn_params_free(&pf->params);
+	free(pf);
+}
+
+void mysql_prefetch_tree(mysql_prefetch * pf, const void *data, size_t len)
+{
+	pthread_mutex_lock(&pf->lock);
+	if (!pf->failed && pf->max_depth > 0) {
+		enqueue_tree(pf, data, len, 1);
+	}
+	pthread_mutex_unlock(&pf->lock);
+}
+
+int
+mysql_prefetch_take(void **data_p, size_t * len_p, git_otype * type_p,
+		    mysql_prefetch * pf, git_odb_backend * backend,
+		    const git_oid * oid)
+{
+	pf_entry *entry;
+	int error = GIT_ENOTFOUND;
+
+	pthread_mutex_lock(&pf->lock);
+
+	while ((entry = entry_find(pf, oid)) != NULL &&
+	       entry->state == PF_FETCHING) {
+		pthread_cond_wait(&pf->done, &pf->lock);
+	}
+
+	if (entry == NULL) {
+		if (++pf->misses >= PREFETCH_CANCEL_MISSES && pf->entries > 0) {
+			drop_pending(pf);
+		}
+	} else if (entry->state == PF_QUEUED) {
+		// not worth waiting behind the rest of the queue
+		entry_unlink(pf, entry);
+		entry->orphan = 1;
+	} else {
+		entry_unlink(pf, entry);
+		pf->misses = 0;
+
+		*data_p = git_odb_backend_malloc(backend, entry->len);
+		if (*data_p != NULL) {
+			memcpy(*data_p, entry->data, entry->len);
+			*len_p = entry->len;
+			*type_p = entry->type;
+			error = GIT_OK;
+		}
+
+		entry_free(pf, entry);
+	}
+
+	pthread_mutex_unlock(&pf->lock);
+	return error;
+}
+
+void mysql_prefetch_cancel(mysql_prefetch * pf)
+{
+	pthread_mutex_lock(&pf->lock);
+	drop_pending(pf);
+	pthread_mutex_unlock(&pf->lock);
+}
+
+int mysql_prefetch_after_fork(mysql_prefetch ** prefetch)
+{
+	mysql_prefetch *old = *prefetch;
+
+	*prefetch = NULL;
+
+	// set up once by mysql_prefetch_new(), safe to read without the lock;
+	// the old entries are leaked, and so is the thread's connection,
+	// which the child cannot reach
+	return mysql_prefetch_new(prefetch, &old->params, old->max_depth,
+				  old->max_memory);
+}
@@ -0,0 +1,48 @@
+#ifndef MYSQL_PREFETCH_H
+#define MYSQL_PREFETCH_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+#include "mysql_conn.h"
+
+/*
+ * Background tree prefetcher.
+ *
+ * Whoever reads a tree usually reads all of its entries next. Handing the
+ * tree to mysql_prefetch_tree() queues its entries for a worker thread,
+ * which loads them on its own connection in batched queries, and expands
+ * subtrees down to `max_depth` levels. Loaded objects are held in memory
+ * (at most `max_memory` bytes) until mysql_prefetch_take() hands them out.
+ */
+
+typedef struct mysql_prefetch mysql_prefetch;
+
+int mysql_prefetch_new(mysql_prefetch ** out,
+		       const mysql_conn_params * params,
+		       unsigned int max_depth, size_t max_memory);
+void mysql_prefetch_free(mysql_prefetch * prefetch);
+
+void mysql_prefetch_tree(mysql_prefetch * prefetch, const void *data,
+			 size_t len);
+
+/*
+ * Hand out a prefetched object, waiting if its batch is in flight.
+ * Returns GIT_ENOTFOUND if the object is not in the prefetcher; after a
+ * run of such misses the pending work is considered stale and dropped.
+ */
+int mysql_prefetch_take(void **data_p, size_t * len_p, git_otype * type_p,
+			mysql_prefetch * prefetch, git_odb_backend * backend,
+			const git_oid * oid);
+
+/* drop everything queued or loaded but not taken yet */
+void mysql_prefetch_cancel(mysql_prefetch * prefetch);
+
+/*
+ * In the child of a fork, replace `*prefetch` with a new prefetcher and
+ * worker thread. The old one is left alone: its thread did not survive the
+ * fork and its lock may still look held.
+ */
+int mysql_prefetch_after_fork(mysql_prefetch ** prefetch);
+
+#endif
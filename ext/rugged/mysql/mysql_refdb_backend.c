@@ -2,6 +2,7 @@
 #include <string.h>
 
 #include <git2.h>
+#include <git2/sys/odb_backend.h>
 #include <git2/sys/refdb_backend.h>
 #include <git2/sys/refs.h>
 #include <git2/sys/reflog.h>
@@ -15,19 +16,89 @@
 
 #include <mysql.h>
 
+#include "mysql_conn.h"
+#include "mysql_trace.h"
+#include "mysql_object_parse.h"
+#include "mysql_refdb_backend.h"
+
 #define GIT2_REFDB_TABLE_NAME "git2_refdb"
+#define GIT2_REFDB_SNAPSHOT_TABLE_NAME "git2_refdb_snapshot"
+#define GIT2_REFDB_DELTA_TABLE_NAME "git2_refdb_delta"
+#define REFDB_DELTA_INSERT_TRIGGER "git2_refdb_delta_insert"
+#define REFDB_DELTA_UPDATE_TRIGGER "git2_refdb_delta_update"
+#define REFDB_DELTA_DELETE_TRIGGER "git2_refdb_delta_delete"
+#define REFDB_DELTA_DELETE_BATCH 1000
 #define GIT_SYMREF "ref: "
+#define PEEL_MAX_DEPTH 32
+#define SYMREF_MAX_DEPTH 5
 #define GIT2_STORAGE_ENGINE "InnoDB"
 
 typedef struct mysql_refdb_backend {
 	git_refdb_backend parent;
-	MYSQL *db;
+	MYSQL *db;		/* set by refdb_enter() */
+	mysql_conn_params conn;
+	mysql_conn *handle;	/* maybe shared with other backends */
+	unsigned int epoch;	/* of the connection the statements are on */
+
+	/* prepared on first use */
 	MYSQL_STMT *st_read;
 	MYSQL_STMT *st_read_all;
 	MYSQL_STMT *st_write;
 	MYSQL_STMT *st_delete;
+	int snapshot;		/* the database may keep a snapshot */
+	int snapshot_request;	/* set_snapshot() to apply, -1: none */
+	git_odb_backend *odb;	/* peels tags as refs are written */
 } mysql_refdb_backend;
 
+static const char *sql_read =
+    "SELECT ref FROM '" GIT2_REFDB_TABLE_NAME "' WHERE refname = ?;";
+
+static const char *sql_read_all =
+    "SELECT refname FROM '" GIT2_REFDB_TABLE_NAME "';";
+
+static const char *sql_write =
+    "INSERT OR IGNORE INTO '" GIT2_REFDB_TABLE_NAME
+    "' (refname, ref, peeled) VALUES (?, ?, ?);";
+
+static const char *sql_delete =
+    "DELETE FROM '" GIT2_REFDB_TABLE_NAME "' WHERE refname = ?;";
+
+/*
+ * Snapshot mode.
+ *
+ * With hundreds of thousands of refs, even one query returning a row per
+ * ref is slow, and listing them with a lookup each is far slower. In
+ * snapshot mode `git2_refdb_snapshot` holds one compressed, sorted
+ * packed-refs style blob of "<refname> <ref>" lines, and triggers on
+ * `git2_refdb` append every change to `git2_refdb_delta` in the
+ * transaction that makes it, whichever process that is. A full listing
+ * reads the blob and the deltas still in the table, and merges them.
+ * compress() folds the deltas into a new blob and deletes exactly the
+ * ones it folded, in one transaction. Point lookups still use
+ * `git2_refdb`.
+ *
+ * The mode is a setting of the database: the triggers and the blob are
+ * there, or neither is.
+ */
+
+typedef struct {
+	const char *name;
+	const char *value;	/* NULL for a deleted ref */
+	unsigned long long seq;
+} snapshot_entry;
+
+typedef struct {
+	git_buf data;		/* the blob, split in place */
+	git_pool pool;		/* entries and delta strings */
+	git_vector base;	/* refs of the blob, sorted by name */
+	git_vector deltas;	/* sorted by name, then seq */
+	unsigned long long seq;	/* last delta in the blob */
+	unsigned long long last;	/* last delta read */
+} snapshot_state;
+
+typedef int (*snapshot_cb) (const char *name, const char *value,
+			    void *payload);
+
 static int ref_error_notfound(const char *name)
 {
 	giterr_set(GITERR_REFERENCE, "Reference not found: %s", name);
@@ -79,9 +150,99 @@ static int parse_oid(git_oid * oid, const char *filename, git_buf * ref_content)
 	return -1;
 }
 
+static int init_db(MYSQL * db);
+static int apply_snapshot(mysql_refdb_backend * backend);
+
 static int
-mysql_refdb_backend__exists(int *exists,
-			    git_refdb_backend * _backend, const char *ref_name)
+prepare(mysql_refdb_backend * backend, MYSQL_STMT ** stmt, const char *sql)
+{
+	my_bool truth = 1;
+
+	if (*stmt != NULL) {
+		return GIT_OK;
+	}
+
+	if ((*stmt = mysql_stmt_init(backend->db)) == NULL ||
+	    mysql_stmt_attr_set(*stmt, STMT_ATTR_UPDATE_MAX_LENGTH,
+				&truth) != 0 ||
+	    mysql_stmt_prepare(*stmt, sql, strlen(sql)) != 0) {
+		if (*stmt != NULL) {
+			mysql_stmt_close(*stmt);
+			*stmt = NULL;
+		}
+		giterr_set(GITERR_REFERENCE,
+			   "Error creating prepared statement for MySql RefDB backend");
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static void close_statements(mysql_refdb_backend * backend)
+{
+	if (backend->st_read) {
+		mysql_conn_stmt_close(backend->st_read, backend->epoch);
+	}
+	if (backend->st_read_all) {
+		mysql_conn_stmt_close(backend->st_read_all, backend->epoch);
+	}
+	if (backend->st_write) {
+		mysql_conn_stmt_close(backend->st_write, backend->epoch);
+	}
+	if (backend->st_delete) {
+		mysql_conn_stmt_close(backend->st_delete, backend->epoch);
+	}
+
+	backend->st_read = NULL;
+	backend->st_read_all = NULL;
+	backend->st_write = NULL;
+	backend->st_delete = NULL;
+}
+
+/*
+ * Connect on first use and lock the connection, which may be shared with
+ * other backends. On a new connection, the first one or one opened again
+ * after a fork, the statements of the old one are stale and are dropped.
+ * Nothing stays locked on error.
+ */
+static int refdb_enter(git_refdb_backend * _backend)
+{
+	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+	unsigned int epoch;
+	MYSQL *db;
+
+	if (mysql_conn_enter(&db, &epoch, backend->handle) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (epoch != backend->epoch) {
+		close_statements(backend);
+		backend->db = db;
+
+		if (mysql_conn_init_table(db, &backend->conn,
+					  GIT2_REFDB_TABLE_NAME, init_db) < 0 ||
+		    apply_snapshot(backend) < 0) {
+			backend->epoch = 0;
+			mysql_conn_leave(backend->handle);
+			return GIT_ERROR;
+		}
+
+		backend->epoch = epoch;
+	}
+
+	return GIT_OK;
+}
+
+static void refdb_leave(git_refdb_backend * _backend)
+{
+	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+
+	mysql_conn_leave(backend->handle);
+}
+
+static int
+refdb_exists(int *exists,
+	     git_refdb_backend * _backend, const char *ref_name)
 {
 	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
 	MYSQL_BIND bind_buffers[1];
@@ -91,6 +252,10 @@ mysql_refdb_backend__exists(int *exists,
 
 	*exists = 0;
 
+	if (prepare(backend, &backend->st_read, sql_read) < 0) {
+		return GIT_ERROR;
+	}
+
 	bind_buffers[0].buffer = (void *)ref_name;
 	bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
 	if (mysql_stmt_bind_param(backend->st_read, bind_buffers) != 0) {
@@ -112,17 +277,70 @@ mysql_refdb_backend__exists(int *exists,
 	return 0;
 }
 
+static int
+mysql_refdb_backend__exists(int *exists,
+			    git_refdb_backend * _backend, const char *ref_name)
+{
+	mysql_trace_span span;
+	int error;
+
+	MYSQL_TRACE_START(&span, "refdb.exists", NULL, ref_name);
+	if ((error = refdb_enter(_backend)) == GIT_OK) {
+		error = refdb_exists(exists, _backend, ref_name);
+		refdb_leave(_backend);
+	} else {
+		*exists = 0;
+	}
+	MYSQL_TRACE_FINISH(&span, 0, *exists, error);
+
+	return error;
+}
+
+/* build the reference `ref_name` from its stored `ref` column */
+static int
+ref_from_value(git_reference ** out, const char *ref_name, const char *raw_ref)
+{
+	git_buf ref_buf = GIT_BUF_INIT;
+	int error = 0;
+
+	git_buf_set(&ref_buf, raw_ref, strlen(raw_ref));
+
+	if (git__prefixcmp(git_buf_cstr(&ref_buf), GIT_SYMREF) == 0) {
+		const char *target;
+
+		git_buf_rtrim(&ref_buf);
+
+		if (!(target = parse_symbolic(&ref_buf))) {
+			error = -1;
+		} else if (out != NULL) {
+			*out = git_reference__alloc_symbolic(ref_name, target);
+		}
+	} else {
+		git_oid oid;
+
+		if (!(error = parse_oid(&oid, ref_name, &ref_buf))
+		    && out != NULL)
+			*out = git_reference__alloc(ref_name, &oid, NULL);
+	}
+
+	git_buf_free(&ref_buf);
+	return error;
+}
+
 static int
 loose_lookup(git_reference ** out,
 	     mysql_refdb_backend * backend, const char *ref_name)
 {
-	git_buf ref_buf = GIT_BUF_INIT;
 	MYSQL_BIND bind_buffers[1];
 	MYSQL_ROW row;
 	int error = GIT_ERROR;
 
 	assert(backend);
 
+	if (prepare(backend, &backend->st_read, sql_read) < 0) {
+		return GIT_ERROR;
+	}
+
 	bind_buffers[0].buffer = (void *)ref_name;
 	bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
 
@@ -137,42 +355,17 @@ loose_lookup(git_reference ** out,
 		return ref_error_notfound(ref_name);
 	}
 	if ((row = mysql_fetch_row(backend->st_read))) {
-		char *raw_ref = row[0];
-
-		git_buf_set(&ref_buf, raw_ref, strlen(raw_ref));
-
-		if (git__prefixcmp(git_buf_cstr(&ref_buf), GIT_SYMREF) == 0) {
-			const char *target;
-
-			git_buf_rtrim(&ref_buf);
-
-			if (!(target = parse_symbolic(&ref_buf))) {
-				error = -1;
-			} else if (out != NULL) {
-				*out =
-				    git_reference__alloc_symbolic(ref_name,
-								  target);
-			}
-		} else {
-			git_oid oid;
-
-			if (!(error = parse_oid(&oid, ref_name, &ref_buf))
-			    && out != NULL)
-				*out =
-				    git_reference__alloc(ref_name, &oid, NULL);
-		}
-
+		error = ref_from_value(out, ref_name, row[0]);
 	}
 
-	git_buf_free(&ref_buf);
 	mysql_stmt_reset(backend->st_read);
 
 	return error;
 }
 
 static int
-mysql_refdb_backend__lookup(git_reference ** out,
-			    git_refdb_backend * _backend, const char *ref_name)
+refdb_lookup(git_reference ** out,
+	     git_refdb_backend * _backend, const char *ref_name)
 {
 	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
 	int error;
@@ -186,152 +379,941 @@ mysql_refdb_backend__lookup(git_reference ** out,
 	return error;
 }
 
-typedef struct {
-	git_reference_iterator parent;
-
-	char *glob;
+static int
+mysql_refdb_backend__lookup(git_reference ** out,
+			    git_refdb_backend * _backend, const char *ref_name)
+{
+	mysql_trace_span span;
+	int error;
 
-	git_pool pool;
-	git_vector loose;
+	MYSQL_TRACE_START(&span, "refdb.lookup", NULL, ref_name);
+	if ((error = refdb_enter(_backend)) == GIT_OK) {
+		error = refdb_lookup(out, _backend, ref_name);
+		refdb_leave(_backend);
+	}
+	MYSQL_TRACE_FINISH(&span, 0, error == 0, error);
 
-	size_t loose_pos;
-} mysql_refdb_iter;
+	return error;
+}
 
-static void mysql_refdb_backend__iterator_free(git_reference_iterator * _iter)
+static int run_query(MYSQL * db, const char *sql, size_t len)
 {
-	mysql_refdb_iter *iter = (mysql_refdb_iter *) _iter;
+	if (mysql_real_query(db, sql, len) != 0) {
+		giterr_set_str(GITERR_REFERENCE, mysql_error(db));
+		return GIT_ERROR;
+	}
 
-	git_vector_free(&iter->loose);
-	git_pool_clear(&iter->pool);
-	git__free(iter);
+	return GIT_OK;
 }
 
-static int
-iter_load_loose_paths(mysql_refdb_backend * backend, mysql_refdb_iter * iter)
+static int run_buf(MYSQL * db, git_buf * sql)
 {
-	int error = GIT_ERROR;
-	MYSQL_ROW row;
-
-	if (mysql_stmt_execute(backend->st_read_all) != 0) {
+	if (git_buf_oom(sql)) {
 		return GIT_ERROR;
 	}
-	if (mysql_stmt_store_result(backend->st_read_all) != 0) {
-		return GIT_ERROR;
+
+	return run_query(db, sql->ptr, sql->size);
+}
+
+static void put_string(git_buf * sql, MYSQL * db, const char *str)
+{
+	size_t len = strlen(str);
+
+	if (git_buf_grow(sql, sql->size + len * 2 + 3) < 0) {
+		return;
 	}
 
-	while ((row = mysql_fetch_row(backend->st_read_all))) {
-		char *ref_dup;
-		char *ref_name = row[0];
+	sql->ptr[sql->size++] = '\'';
+	sql->size += mysql_real_escape_string(db, sql->ptr + sql->size, str,
+					      len);
+	sql->ptr[sql->size++] = '\'';
+	sql->ptr[sql->size] = '\0';
+}
 
-		if (git__suffixcmp(ref_name, ".lock") == 0 ||
-		    (iter->glob && p_fnmatch(iter->glob, ref_name, 0) != 0))
-			continue;
+static int snapshot_entry_cmp(const void *a, const void *b)
+{
+	const snapshot_entry *x = a, *y = b;
+	int cmp = strcmp(x->name, y->name);
 
-		ref_dup = git_pool_strdup(&iter->pool, ref_name);
-		if (!ref_dup)
-			error = -1;
-		else
-			error = git_vector_insert(&iter->loose, ref_dup);
+	if (cmp != 0) {
+		return cmp;
 	}
 
-	mysql_stmt_reset(backend->st_read_all);
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
 
-	return error;
+static void snapshot_free(snapshot_state * state)
+{
+	git_vector_free(&state->base);
+	git_vector_free(&state->deltas);
+	git_pool_clear(&state->pool);
+	git_buf_free(&state->data);
 }
 
-static int
-mysql_refdb_backend__iterator_next(git_reference ** out,
-				   git_reference_iterator * _iter)
+static int snapshot_init(snapshot_state * state)
 {
-	int error = GIT_ITEROVER;
-	mysql_refdb_iter *iter = (mysql_refdb_iter *) _iter;
-	mysql_refdb_backend *backend =
-	    (mysql_refdb_backend *) iter->parent.db->backend;
+	memset(state, 0, sizeof(*state));
+	git_buf_init(&state->data, 0);
 
-	while (iter->loose_pos < iter->loose.length) {
-		const char *path =
-		    git_vector_get(&iter->loose, iter->loose_pos++);
+	if (git_pool_init(&state->pool, 1, 0) < 0 ||
+	    git_vector_init(&state->base, 1024, snapshot_entry_cmp) < 0 ||
+	    git_vector_init(&state->deltas, 64, snapshot_entry_cmp) < 0) {
+		snapshot_free(state);
+		return GIT_ERROR;
+	}
 
-		if (loose_lookup(out, backend, path) == 0)
-			return 0;
+	return GIT_OK;
+}
 
-		giterr_clear();
+static snapshot_entry *snapshot_entry_new(snapshot_state * state)
+{
+	snapshot_entry *entry =
+	    git_pool_malloc(&state->pool, sizeof(snapshot_entry));
+
+	if (entry == NULL) {
+		giterr_set_oom();
 	}
 
-	return error;
+	return entry;
 }
 
-static int
-mysql_refdb_backend__iterator_next_name(const char **out,
-					git_reference_iterator * _iter)
+/* split the blob into entries; its lines are sorted already */
+static int snapshot_parse(snapshot_state * state)
 {
-	int error = GIT_ITEROVER;
-	mysql_refdb_iter *iter = (mysql_refdb_iter *) _iter;
-	mysql_refdb_backend *backend =
-	    (mysql_refdb_backend *) iter->parent.db->backend;
+	char *line = state->data.ptr, *end = line + state->data.size;
 
-	while (iter->loose_pos < iter->loose.length) {
-		const char *path =
-		    git_vector_get(&iter->loose, iter->loose_pos++);
+	while (line < end) {
+		char *eol = memchr(line, '\n', end - line);
+		char *sep = memchr(line, ' ', (eol ? eol : end) - line);
+		snapshot_entry *entry;
 
-		if (loose_lookup(NULL, backend, path) == 0) {
-			*out = path;
-			return 0;
+		if (eol == NULL || sep == NULL) {
+			giterr_set(GITERR_REFERENCE, "Corrupted ref snapshot");
+			return GIT_ERROR;
 		}
+		*sep = '\0';
+		*eol = '\0';
 
-		giterr_clear();
+		if ((entry = snapshot_entry_new(state)) == NULL) {
+			return GIT_ERROR;
+		}
+		entry->name = line;
+		entry->value = sep + 1;
+		entry->seq = 0;
+
+		if (git_vector_insert(&state->base, entry) < 0) {
+			return GIT_ERROR;
+		}
+
+		line = eol + 1;
 	}
 
-	return error;
+	return GIT_OK;
 }
 
+/*
+ * Read the blob and every delta not folded into it, GIT_ENOTFOUND when
+ * the database keeps no snapshot. The caller runs this in one
+ * transaction; with `for_update` the snapshot row stays locked until it
+ * ends, which keeps two compressions apart.
+ */
 static int
-mysql_refdb_backend__iterator(git_reference_iterator ** out,
-			      git_refdb_backend * _backend, const char *glob)
+snapshot_load(snapshot_state * state, mysql_refdb_backend * backend,
+	      int for_update)
 {
-	mysql_refdb_iter *iter;
-	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+	MYSQL *db = backend->db;
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int found = 0, error;
 
-	assert(backend);
+	git_buf_puts(&sql, "SELECT `seq`, UNCOMPRESS(`data`) FROM `"
+		     GIT2_REFDB_SNAPSHOT_TABLE_NAME "` WHERE `id` = 1");
+	if (for_update) {
+		git_buf_puts(&sql, " FOR UPDATE");
+	}
 
-	iter = git__calloc(1, sizeof(mysql_refdb_iter));
-	GITERR_CHECK_ALLOC(iter);
+	if ((error = run_buf(db, &sql)) < 0) {
+		goto done;
+	}
+	if ((res = mysql_store_result(db)) == NULL) {
+		error = GIT_ERROR;
+		goto done;
+	}
+	if ((row = mysql_fetch_row(res)) != NULL) {
+		found = 1;
+		state->seq = strtoull(row[0], NULL, 10);
+		if (row[1] != NULL) {
+			git_buf_set(&state->data, row[1],
+				    mysql_fetch_lengths(res)[1]);
+		}
+	}
+	mysql_free_result(res);
 
-	if (git_pool_init(&iter->pool, 1, 0) < 0 ||
-	    git_vector_init(&iter->loose, 8, NULL) < 0)
-		goto fail;
+	if (!found) {
+		error = GIT_ENOTFOUND;
+		goto done;
+	}
 
-	if (glob != NULL &&
-	    (iter->glob = git_pool_strdup(&iter->pool, glob)) == NULL)
-		goto fail;
+	state->last = state->seq;
+	if (git_buf_oom(&state->data) ||
+	    (error = snapshot_parse(state)) < 0) {
+		error = GIT_ERROR;
+		goto done;
+	}
 
-	iter->parent.next = mysql_refdb_backend__iterator_next;
-	iter->parent.next_name = mysql_refdb_backend__iterator_next_name;
-	iter->parent.free = mysql_refdb_backend__iterator_free;
+	// `seq` is taken when a change is made, not when it commits, so a
+	// delta below the blob's may have come in after it; only the deltas
+	// folded into a blob are deleted, and the rest all apply
+	git_buf_clear(&sql);
+	git_buf_puts(&sql, "SELECT `seq`, `refname`, `ref` FROM `"
+		     GIT2_REFDB_DELTA_TABLE_NAME "` ORDER BY `seq`");
+	if ((error = run_buf(db, &sql)) < 0) {
+		goto done;
+	}
+	if ((res = mysql_store_result(db)) == NULL) {
+		error = GIT_ERROR;
+		goto done;
+	}
 
-	if (iter_load_loose_paths(backend, iter) < 0)
-		goto fail;
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		snapshot_entry *entry = snapshot_entry_new(state);
 
-	*out = (git_reference_iterator *) iter;
-	return 0;
+		if (entry == NULL ||
+		    (entry->name = git_pool_strdup(&state->pool, row[1])) == NULL
+		    || (row[2] != NULL &&
+			(entry->value =
+			 git_pool_strdup(&state->pool, row[2])) == NULL)) {
+			error = GIT_ERROR;
+			break;
+		}
+		if (row[2] == NULL) {
+			entry->value = NULL;
+		}
+		entry->seq = strtoull(row[0], NULL, 10);
+		if (entry->seq > state->last) {
+			state->last = entry->seq;
+		}
 
- fail:
-	mysql_refdb_backend__iterator_free((git_reference_iterator *) iter);
-	return -1;
+		if ((error = git_vector_insert(&state->deltas, entry)) < 0) {
+			break;
+		}
+	}
+	mysql_free_result(res);
+
+	git_vector_sort(&state->deltas);
+
+ done:
+	git_buf_free(&sql);
+	return error;
 }
 
+/* call `cb` for every live ref, in name order, the last delta winning */
 static int
-reference_path_available(mysql_refdb_backend * backend,
-			 const char *new_ref, const char *old_ref, int force)
+snapshot_merge(snapshot_state * state, snapshot_cb cb, void *payload)
 {
-	if (!force) {
-		int exists;
+	size_t i = 0, j = 0;
+	int error = 0;
+
+	while (error == 0 &&
+	       (i < state->base.length || j < state->deltas.length)) {
+		snapshot_entry *base = git_vector_get(&state->base, i);
+		snapshot_entry *delta = git_vector_get(&state->deltas, j);
+		int cmp;
+
+		if (base == NULL) {
+			cmp = 1;
+		} else if (delta == NULL) {
+			cmp = -1;
+		} else {
+			cmp = strcmp(base->name, delta->name);
+		}
 
-		if (mysql_refdb_backend__exists
-		    (&exists, (git_refdb_backend *) backend, new_ref) < 0)
-			return -1;
+		if (cmp < 0) {
+			error = cb(base->name, base->value, payload);
+			i++;
+			continue;
+		}
 
-		if (exists) {
+		// a delta replaces the blob's line; of several, the last
+		while (j + 1 < state->deltas.length &&
+		       strcmp(((snapshot_entry *)
+			       git_vector_get(&state->deltas, j + 1))->name,
+			      delta->name) == 0) {
+			delta = git_vector_get(&state->deltas, ++j);
+		}
+		j++;
+		if (cmp == 0) {
+			i++;
+		}
+
+		if (delta->value != NULL) {
+			error = cb(delta->name, delta->value, payload);
+		}
+	}
+
+	return error;
+}
+
+static int snapshot_write_line(const char *name, const char *value,
+			       void *payload)
+{
+	git_buf *out = payload;
+
+	git_buf_printf(out, "%s %s\n", name, value);
+	return git_buf_oom(out) ? GIT_ERROR : 0;
+}
+
+/* replace the blob with `data`, made from the deltas up to `seq` */
+static int
+snapshot_store(mysql_refdb_backend * backend, git_buf * data,
+	       unsigned long long seq)
+{
+	MYSQL_STMT *st;
+	MYSQL_BIND bind_buffers[2];
+	git_buf sql = GIT_BUF_INIT;
+	int error = GIT_ERROR;
+
+	git_buf_puts(&sql, "INSERT INTO `" GIT2_REFDB_SNAPSHOT_TABLE_NAME
+		     "` (`id`, `seq`, `data`) VALUES (1, ?, COMPRESS(?))"
+		     " ON DUPLICATE KEY UPDATE `seq` = VALUES(`seq`),"
+		     " `data` = VALUES(`data`)");
+	if (git_buf_oom(&sql) || (st = mysql_stmt_init(backend->db)) == NULL) {
+		git_buf_free(&sql);
+		return GIT_ERROR;
+	}
+
+	memset(bind_buffers, 0, sizeof(bind_buffers));
+	bind_buffers[0].buffer = &seq;
+	bind_buffers[0].buffer_type = MYSQL_TYPE_LONGLONG;
+	bind_buffers[0].is_unsigned = 1;
+	bind_buffers[1].buffer = data->ptr ? data->ptr : "";
+	bind_buffers[1].buffer_length = data->size;
+	bind_buffers[1].length = &bind_buffers[1].buffer_length;
+	bind_buffers[1].buffer_type = MYSQL_TYPE_LONG_BLOB;
+
+	if (mysql_stmt_prepare(st, sql.ptr, sql.size) != 0 ||
+	    mysql_stmt_bind_param(st, bind_buffers) != 0 ||
+	    mysql_stmt_execute(st) != 0) {
+		giterr_set_str(GITERR_REFERENCE, mysql_stmt_error(st));
+	} else {
+		error = GIT_OK;
+	}
+
+	mysql_stmt_close(st);
+	git_buf_free(&sql);
+	return error;
+}
+
+/* delete the deltas of `deltas`, which the new blob holds */
+static int
+snapshot_delete_deltas(mysql_refdb_backend * backend, git_vector * deltas)
+{
+	git_buf sql = GIT_BUF_INIT;
+	snapshot_entry *entry;
+	size_t i;
+	int error = GIT_OK;
+
+	git_vector_foreach(deltas, i, entry) {
+		git_buf_puts(&sql, sql.size ? "," :
+			     "DELETE FROM `" GIT2_REFDB_DELTA_TABLE_NAME
+			     "` WHERE `seq` IN (");
+		git_buf_printf(&sql, "%llu", entry->seq);
+
+		if ((i + 1) % REFDB_DELTA_DELETE_BATCH == 0 ||
+		    i + 1 == deltas->length) {
+			git_buf_putc(&sql, ')');
+			if ((error = run_buf(backend->db, &sql)) < 0) {
+				break;
+			}
+			git_buf_clear(&sql);
+		}
+	}
+
+	git_buf_free(&sql);
+	return error;
+}
+
+/* fold every delta into a new blob */
+static int snapshot_compress(mysql_refdb_backend * backend)
+{
+	static const char *sql_begin = "START TRANSACTION";
+	snapshot_state state;
+	git_buf data = GIT_BUF_INIT;
+	int error;
+
+	if ((error = snapshot_init(&state)) < 0) {
+		return error;
+	}
+
+	if ((error = run_query(backend->db, sql_begin, strlen(sql_begin))) <
+	    0) {
+		snapshot_free(&state);
+		return error;
+	}
+
+	// turned off in the meantime, there is nothing to fold into
+	if ((error = snapshot_load(&state, backend, 1)) == GIT_ENOTFOUND) {
+		error = GIT_OK;
+		goto done;
+	}
+	if (error < 0 || state.deltas.length == 0) {
+		goto done;
+	}
+
+	if ((error = snapshot_merge(&state, snapshot_write_line, &data)) < 0 ||
+	    (error = snapshot_store(backend, &data, state.last)) < 0) {
+		goto done;
+	}
+
+	error = snapshot_delete_deltas(backend, &state.deltas);
+
+ done:
+	if (error == GIT_OK) {
+		error = run_query(backend->db, "COMMIT", 6);
+	} else {
+		mysql_real_query(backend->db, "ROLLBACK", 8);
+	}
+
+	git_buf_free(&data);
+	snapshot_free(&state);
+	return error;
+}
+
+/*
+ * A first blob, from `git2_refdb` as it is. The refs and the deltas are
+ * read in one consistent view: the deltas in it are in the refs, and are
+ * deleted with the new blob, and those after it are applied on top.
+ */
+static int snapshot_create(mysql_refdb_backend * backend)
+{
+	static const char *sql_begin = "START TRANSACTION";
+	static const char *sql_lock =
+	    "SELECT `id` FROM `" GIT2_REFDB_SNAPSHOT_TABLE_NAME
+	    "` WHERE `id` = 1 FOR UPDATE";
+	static const char *sql_seqs =
+	    "SELECT `seq` FROM `" GIT2_REFDB_DELTA_TABLE_NAME "`";
+	static const char *sql_refs =
+	    "SELECT `refname`, `ref` FROM `" GIT2_REFDB_TABLE_NAME
+	    "` ORDER BY `refname`";
+	snapshot_state state;
+	snapshot_entry *entry;
+	git_buf data = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error;
+
+	if ((error = snapshot_init(&state)) < 0) {
+		return error;
+	}
+
+	// the lock keeps a compression out until the blob is replaced
+	if ((error = run_query(backend->db, sql_begin, strlen(sql_begin))) <
+	    0) {
+		snapshot_free(&state);
+		return error;
+	}
+	if ((error = run_query(backend->db, sql_lock, strlen(sql_lock))) < 0 ||
+	    (res = mysql_store_result(backend->db)) == NULL) {
+		error = GIT_ERROR;
+		goto done;
+	}
+	mysql_free_result(res);
+
+	if ((error = run_query(backend->db, sql_seqs, strlen(sql_seqs))) < 0 ||
+	    (res = mysql_store_result(backend->db)) == NULL) {
+		error = GIT_ERROR;
+		goto done;
+	}
+	while (error == 0 && (row = mysql_fetch_row(res)) != NULL) {
+		if ((entry = snapshot_entry_new(&state)) == NULL ||
+		    git_vector_insert(&state.deltas, entry) < 0) {
+			error = GIT_ERROR;
+			break;
+		}
+		entry->seq = strtoull(row[0], NULL, 10);
+		if (entry->seq > state.last) {
+			state.last = entry->seq;
+		}
+	}
+	mysql_free_result(res);
+	if (error < 0) {
+		goto done;
+	}
+
+	if ((error = run_query(backend->db, sql_refs, strlen(sql_refs))) < 0 ||
+	    (res = mysql_use_result(backend->db)) == NULL) {
+		error = GIT_ERROR;
+		goto done;
+	}
+	while (error == 0 && (row = mysql_fetch_row(res)) != NULL) {
+		error = snapshot_write_line(row[0], row[1], &data);
+	}
+	mysql_free_result(res);
+
+	if (error == 0 &&
+	    (error = snapshot_store(backend, &data, state.last)) == GIT_OK) {
+		error = snapshot_delete_deltas(backend, &state.deltas);
+	}
+
+ done:
+	if (error == GIT_OK) {
+		error = run_query(backend->db, "COMMIT", 6);
+	} else {
+		mysql_real_query(backend->db, "ROLLBACK", 8);
+	}
+
+	git_buf_free(&data);
+	snapshot_free(&state);
+	return error;
+}
+
+static int trigger_exists(int *exists, MYSQL * db, const char *name)
+{
+	git_buf sql = GIT_BUF_INIT;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int error;
+
+	git_buf_printf(&sql, "SELECT COUNT(*) FROM information_schema.TRIGGERS"
+		       " WHERE `TRIGGER_SCHEMA` = DATABASE()"
+		       " AND `TRIGGER_NAME` = '%s'", name);
+	error = run_buf(db, &sql);
+	git_buf_free(&sql);
+
+	if (error < 0 || (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	*exists = (row = mysql_fetch_row(res)) != NULL && row[0] != NULL &&
+	    atoi(row[0]) > 0;
+	mysql_free_result(res);
+
+	return GIT_OK;
+}
+
+/* `created` is set when the trigger was not there */
+static int
+create_trigger(int *created, MYSQL * db, const char *name, const char *sql)
+{
+	int exists;
+
+	if (trigger_exists(&exists, db, name) < 0) {
+		return GIT_ERROR;
+	}
+	if (exists) {
+		return GIT_OK;
+	}
+
+	*created = 1;
+	return run_query(db, sql, strlen(sql));
+}
+
+/* turn the mode on for the database, for every process that writes refs */
+static int init_snapshot(mysql_refdb_backend * backend)
+{
+	static const char *sql_snapshot =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_REFDB_SNAPSHOT_TABLE_NAME "` ("
+	    "  `id` tinyint(1) unsigned NOT NULL,"
+	    "  `seq` bigint(20) unsigned NOT NULL,"
+	    "  `data` longblob NOT NULL,"
+	    "  PRIMARY KEY (`id`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	static const char *sql_delta =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_REFDB_DELTA_TABLE_NAME "` ("
+	    "  `seq` bigint(20) unsigned NOT NULL AUTO_INCREMENT,"
+	    "  `refname` text NOT NULL,"
+	    "  `ref` text,"
+	    "  PRIMARY KEY (`seq`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	static const char *sql_insert =
+	    "CREATE TRIGGER `" REFDB_DELTA_INSERT_TRIGGER "` AFTER INSERT ON `"
+	    GIT2_REFDB_TABLE_NAME "` FOR EACH ROW"
+	    " INSERT INTO `" GIT2_REFDB_DELTA_TABLE_NAME "` (`refname`, `ref`)"
+	    " VALUES (NEW.`refname`, NEW.`ref`)";
+	// a peeled value filled in later is not a change of the ref
+	static const char *sql_update =
+	    "CREATE TRIGGER `" REFDB_DELTA_UPDATE_TRIGGER "` AFTER UPDATE ON `"
+	    GIT2_REFDB_TABLE_NAME "` FOR EACH ROW BEGIN"
+	    " IF NOT (NEW.`refname` <=> OLD.`refname`) THEN"
+	    "  INSERT INTO `" GIT2_REFDB_DELTA_TABLE_NAME "` (`refname`, `ref`)"
+	    "  VALUES (OLD.`refname`, NULL);"
+	    " END IF;"
+	    " IF NOT (NEW.`refname` <=> OLD.`refname` AND"
+	    "  NEW.`ref` <=> OLD.`ref`) THEN"
+	    "  INSERT INTO `" GIT2_REFDB_DELTA_TABLE_NAME "` (`refname`, `ref`)"
+	    "  VALUES (NEW.`refname`, NEW.`ref`);"
+	    " END IF;"
+	    " END";
+	static const char *sql_delete =
+	    "CREATE TRIGGER `" REFDB_DELTA_DELETE_TRIGGER "` AFTER DELETE ON `"
+	    GIT2_REFDB_TABLE_NAME "` FOR EACH ROW"
+	    " INSERT INTO `" GIT2_REFDB_DELTA_TABLE_NAME "` (`refname`, `ref`)"
+	    " VALUES (OLD.`refname`, NULL)";
+
+	static const char *sql_check =
+	    "SELECT 1 FROM `" GIT2_REFDB_SNAPSHOT_TABLE_NAME "` WHERE `id` = 1";
+
+	MYSQL_RES *res;
+	int created = 0, found;
+
+	if (run_query(backend->db, sql_snapshot, strlen(sql_snapshot)) < 0 ||
+	    run_query(backend->db, sql_delta, strlen(sql_delta)) < 0 ||
+	    create_trigger(&created, backend->db, REFDB_DELTA_INSERT_TRIGGER,
+			   sql_insert) < 0 ||
+	    create_trigger(&created, backend->db, REFDB_DELTA_UPDATE_TRIGGER,
+			   sql_update) < 0 ||
+	    create_trigger(&created, backend->db, REFDB_DELTA_DELETE_TRIGGER,
+			   sql_delete) < 0 ||
+	    run_query(backend->db, sql_check, strlen(sql_check)) < 0 ||
+	    (res = mysql_store_result(backend->db)) == NULL) {
+		return GIT_ERROR;
+	}
+	found = mysql_num_rows(res) > 0;
+	mysql_free_result(res);
+
+	backend->snapshot = 1;
+
+	// a blob kept while changes went unrecorded is rebuilt
+	return found && !created ? GIT_OK : snapshot_create(backend);
+}
+
+/* turn the mode off for the database */
+static int drop_snapshot(mysql_refdb_backend * backend)
+{
+	static const char *sql_drop[] = {
+		// listings fall back to `git2_refdb` from here on
+		"DELETE FROM `" GIT2_REFDB_SNAPSHOT_TABLE_NAME "` WHERE `id` = 1",
+		"DROP TRIGGER IF EXISTS `" REFDB_DELTA_INSERT_TRIGGER "`",
+		"DROP TRIGGER IF EXISTS `" REFDB_DELTA_UPDATE_TRIGGER "`",
+		"DROP TRIGGER IF EXISTS `" REFDB_DELTA_DELETE_TRIGGER "`",
+		"DELETE FROM `" GIT2_REFDB_DELTA_TABLE_NAME "`",
+	};
+	size_t i;
+
+	if (!backend->snapshot) {
+		return GIT_OK;
+	}
+
+	for (i = 0; i < sizeof(sql_drop) / sizeof(sql_drop[0]); i++) {
+		if (run_query(backend->db, sql_drop[i], strlen(sql_drop[i])) <
+		    0) {
+			return GIT_ERROR;
+		}
+	}
+
+	backend->snapshot = 0;
+	return GIT_OK;
+}
+
+/* whether the database may keep a snapshot, asked on every connection */
+static int detect_snapshot(mysql_refdb_backend * backend)
+{
+	static const char *sql =
+	    "SHOW TABLES LIKE '" GIT2_REFDB_SNAPSHOT_TABLE_NAME "'";
+	MYSQL_RES *res;
+
+	if (run_query(backend->db, sql, strlen(sql)) < 0 ||
+	    (res = mysql_store_result(backend->db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	backend->snapshot = mysql_num_rows(res) > 0;
+	mysql_free_result(res);
+
+	return GIT_OK;
+}
+
+/* set the mode as asked, then find out how the database has it */
+static int apply_snapshot(mysql_refdb_backend * backend)
+{
+	int error;
+
+	if ((error = detect_snapshot(backend)) < 0) {
+		return error;
+	}
+
+	if (backend->snapshot_request == 1) {
+		error = init_snapshot(backend);
+	} else if (backend->snapshot_request == 0) {
+		error = drop_snapshot(backend);
+	}
+
+	if (error == GIT_OK) {
+		backend->snapshot_request = -1;
+	}
+
+	return error;
+}
+
+typedef struct {
+	git_reference_iterator parent;
+
+	char *glob;
+
+	git_pool pool;
+	git_vector loose;
+
+	size_t loose_pos;
+
+	/* in snapshot mode, the refs of `loose` come with their values */
+	snapshot_state *snapshot;
+	git_vector values;
+} mysql_refdb_iter;
+
+static void mysql_refdb_backend__iterator_free(git_reference_iterator * _iter)
+{
+	mysql_refdb_iter *iter = (mysql_refdb_iter *) _iter;
+
+	if (iter->snapshot != NULL) {
+		snapshot_free(iter->snapshot);
+		git__free(iter->snapshot);
+	}
+	git_vector_free(&iter->values);
+	git_vector_free(&iter->loose);
+	git_pool_clear(&iter->pool);
+	git__free(iter);
+}
+
+static int
+iter_load_loose_paths(mysql_refdb_backend * backend, mysql_refdb_iter * iter)
+{
+	int error = GIT_ERROR;
+	MYSQL_ROW row;
+
+	if (prepare(backend, &backend->st_read_all, sql_read_all) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (mysql_stmt_execute(backend->st_read_all) != 0) {
+		return GIT_ERROR;
+	}
+	if (mysql_stmt_store_result(backend->st_read_all) != 0) {
+		return GIT_ERROR;
+	}
+
+	while ((row = mysql_fetch_row(backend->st_read_all))) {
+		char *ref_dup;
+		char *ref_name = row[0];
+
+		if (git__suffixcmp(ref_name, ".lock") == 0 ||
+		    (iter->glob && p_fnmatch(iter->glob, ref_name, 0) != 0))
+			continue;
+
+		ref_dup = git_pool_strdup(&iter->pool, ref_name);
+		if (!ref_dup)
+			error = -1;
+		else
+			error = git_vector_insert(&iter->loose, ref_dup);
+	}
+
+	mysql_stmt_reset(backend->st_read_all);
+
+	return error;
+}
+
+static int iter_add_snapshot_ref(const char *name, const char *value,
+				 void *payload)
+{
+	mysql_refdb_iter *iter = payload;
+
+	if (git__suffixcmp(name, ".lock") == 0 ||
+	    (iter->glob && p_fnmatch(iter->glob, name, 0) != 0))
+		return 0;
+
+	if (git_vector_insert(&iter->loose, (void *)name) < 0 ||
+	    git_vector_insert(&iter->values, (void *)value) < 0)
+		return -1;
+
+	return 0;
+}
+
+/* every ref with its value, from one blob and the deltas after it */
+static int
+iter_load_snapshot(mysql_refdb_backend * backend, mysql_refdb_iter * iter)
+{
+	static const char *sql_begin =
+	    "START TRANSACTION WITH CONSISTENT SNAPSHOT";
+	int error;
+
+	iter->snapshot = git__calloc(1, sizeof(snapshot_state));
+	GITERR_CHECK_ALLOC(iter->snapshot);
+
+	if ((error = snapshot_init(iter->snapshot)) < 0) {
+		git__free(iter->snapshot);
+		iter->snapshot = NULL;
+		return error;
+	}
+
+	if ((error = run_query(backend->db, sql_begin, strlen(sql_begin))) <
+	    0) {
+		return error;
+	}
+	error = snapshot_load(iter->snapshot, backend, 0);
+	mysql_real_query(backend->db, "COMMIT", 6);
+
+	// turned off since this connection was made
+	if (error == GIT_ENOTFOUND) {
+		snapshot_free(iter->snapshot);
+		git__free(iter->snapshot);
+		iter->snapshot = NULL;
+		giterr_clear();
+		return iter_load_loose_paths(backend, iter);
+	}
+
+	if (error == 0) {
+		error = snapshot_merge(iter->snapshot, iter_add_snapshot_ref,
+				       iter);
+	}
+
+	return error;
+}
+
+/* the iterator reads refs after the callback that made it has returned */
+static int
+locked_lookup(git_reference ** out, mysql_refdb_backend * backend,
+	      const char *ref_name)
+{
+	int error;
+
+	if ((error = refdb_enter(&backend->parent)) == GIT_OK) {
+		error = loose_lookup(out, backend, ref_name);
+		refdb_leave(&backend->parent);
+	}
+
+	return error;
+}
+
+static int
+mysql_refdb_backend__iterator_next(git_reference ** out,
+				   git_reference_iterator * _iter)
+{
+	int error = GIT_ITEROVER;
+	mysql_refdb_iter *iter = (mysql_refdb_iter *) _iter;
+	mysql_refdb_backend *backend =
+	    (mysql_refdb_backend *) iter->parent.db->backend;
+
+	while (iter->loose_pos < iter->loose.length) {
+		const char *path =
+		    git_vector_get(&iter->loose, iter->loose_pos++);
+
+		if (iter->snapshot != NULL) {
+			if (ref_from_value(out, path,
+					   git_vector_get(&iter->values,
+							  iter->loose_pos -
+							  1)) == 0)
+				return 0;
+		} else if (locked_lookup(out, backend, path) == 0)
+			return 0;
+
+		giterr_clear();
+	}
+
+	return error;
+}
+
+static int
+mysql_refdb_backend__iterator_next_name(const char **out,
+					git_reference_iterator * _iter)
+{
+	int error = GIT_ITEROVER;
+	mysql_refdb_iter *iter = (mysql_refdb_iter *) _iter;
+	mysql_refdb_backend *backend =
+	    (mysql_refdb_backend *) iter->parent.db->backend;
+
+	while (iter->loose_pos < iter->loose.length) {
+		const char *path =
+		    git_vector_get(&iter->loose, iter->loose_pos++);
+
+		// the snapshot lists live refs only
+		if (iter->snapshot != NULL ||
+		    locked_lookup(NULL, backend, path) == 0) {
+			*out = path;
+			return 0;
+		}
+
+		giterr_clear();
+	}
+
+	return error;
+}
+
+static int
+refdb_iterator(git_reference_iterator ** out,
+	       git_refdb_backend * _backend, const char *glob)
+{
+	mysql_refdb_iter *iter;
+	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+
+	assert(backend);
+
+	iter = git__calloc(1, sizeof(mysql_refdb_iter));
+	GITERR_CHECK_ALLOC(iter);
+
+	if (git_pool_init(&iter->pool, 1, 0) < 0 ||
+	    git_vector_init(&iter->loose, 8, NULL) < 0 ||
+	    git_vector_init(&iter->values, 8, NULL) < 0)
+		goto fail;
+
+	if (glob != NULL &&
+	    (iter->glob = git_pool_strdup(&iter->pool, glob)) == NULL)
+		goto fail;
+
+	iter->parent.next = mysql_refdb_backend__iterator_next;
+	iter->parent.next_name = mysql_refdb_backend__iterator_next_name;
+	iter->parent.free = mysql_refdb_backend__iterator_free;
+
+	if (backend->snapshot) {
+		if (iter_load_snapshot(backend, iter) < 0)
+			goto fail;
+	} else if (iter_load_loose_paths(backend, iter) < 0)
+		goto fail;
+
+	*out = (git_reference_iterator *) iter;
+	return 0;
+
+ fail:
+	mysql_refdb_backend__iterator_free((git_reference_iterator *) iter);
+	return -1;
+}
+
+static int
+mysql_refdb_backend__iterator(git_reference_iterator ** out,
+			      git_refdb_backend * _backend, const char *glob)
+{
+	mysql_trace_span span;
+	size_t rows = 0;
+	int error;
+
+	MYSQL_TRACE_START(&span, "refdb.iterator", NULL, glob);
+	if ((error = refdb_enter(_backend)) == GIT_OK) {
+		error = refdb_iterator(out, _backend, glob);
+		refdb_leave(_backend);
+	}
+	if (error == 0) {
+		rows = ((mysql_refdb_iter *) * out)->loose.length;
+	}
+	MYSQL_TRACE_FINISH(&span, 0, rows, error);
+
+	return error;
+}
+
+static int
+reference_path_available(mysql_refdb_backend * backend,
+			 const char *new_ref, const char *old_ref, int force)
+{
+	if (!force) {
+		int exists;
+
+		if (mysql_refdb_backend__exists
+		    (&exists, (git_refdb_backend *) backend, new_ref) < 0)
+			return -1;
+
+		if (exists) {
 			giterr_set(GITERR_REFERENCE,
 				   "Failed to write reference '%s': a reference with "
 				   "that name already exists.", new_ref);
@@ -342,15 +1324,92 @@ reference_path_available(mysql_refdb_backend * backend,
 	return 0;
 }
 
+/* where a chain of annotated tags ends; other objects peel to themselves */
 static int
-mysql_refdb_backend__write(git_refdb_backend * _backend,
-			   const git_reference * ref,
-			   int force,
-			   const git_signature * who, const char *message)
+peel_oid(git_oid * out, mysql_refdb_backend * backend, const git_oid * oid)
+{
+	git_odb_backend *odb = backend->odb;
+	git_oid current;
+	git_otype type;
+	size_t len;
+	void *data;
+	int depth, error;
+
+	git_oid_cpy(&current, oid);
+
+	for (depth = 0; depth < PEEL_MAX_DEPTH; depth++) {
+		if ((error = odb->read_header(&len, &type, odb, &current)) < 0) {
+			return error;
+		}
+
+		if (type != GIT_OBJ_TAG) {
+			git_oid_cpy(out, &current);
+			return GIT_OK;
+		}
+
+		if ((error = odb->read(&data, &len, &type, odb, &current)) < 0) {
+			return error;
+		}
+		error = mysql_parse_tag(&current, data, len);
+		free(data);
+
+		if (error < 0) {
+			return error;
+		}
+	}
+
+	giterr_set(GITERR_REFERENCE, "Tag chain too deep to peel");
+	return GIT_ERROR;
+}
+
+/*
+ * The `peeled` column of a ref: the hex OID its tags end at, "" when it
+ * does not point at a tag, or NULL (returned as 0) when that is unknown.
+ */
+static int
+peeled_value(char *out, mysql_refdb_backend * backend, const git_oid * oid,
+	     const git_oid * peel)
+{
+	git_oid peeled;
+	int error;
+
+	out[0] = '\0';
+
+	// packed refs read by libgit2 come peeled already
+	if (peel != NULL && !git_oid_iszero(peel)) {
+		git_oid_tostr(out, GIT_OID_HEXSZ + 1, peel);
+		return 1;
+	}
+
+	if (backend->odb == NULL) {
+		return 0;
+	}
+
+	if ((error = peel_oid(&peeled, backend, oid)) < 0) {
+		// the object may be written after its ref, advertise() retries
+		giterr_clear();
+		return 0;
+	}
+
+	if (git_oid_cmp(&peeled, oid) != 0) {
+		git_oid_tostr(out, GIT_OID_HEXSZ + 1, &peeled);
+	}
+
+	return 1;
+}
+
+static int
+refdb_write(git_refdb_backend * _backend,
+	    const git_reference * ref,
+	    int force,
+	    const git_signature * who, const char *message)
 {
 	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+	git_buf value = GIT_BUF_INIT;
+	char peeled[GIT_OID_HEXSZ + 1];
+	my_bool peeled_null = 1;
 	int error;
-	MYSQL_BIND bind_buffers[2];
+	MYSQL_BIND bind_buffers[3];
 
 	assert(backend);
 
@@ -359,49 +1418,77 @@ mysql_refdb_backend__write(git_refdb_backend * _backend,
 		return error;
 	}
 
-	error = GIT_ERROR;
-
-	bind_buffers[0].buffer = (void *)ref->name;
-	bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
 	if (ref->type == GIT_REF_OID) {
 		char oid[GIT_OID_HEXSZ + 1];
 		git_oid_nfmt(oid, sizeof(oid), &ref->target.oid);
 
-		bind_buffers[1].buffer = (void *)oid;
-		bind_buffers[1].buffer_type = MYSQL_TYPE_STRING;
-
+		git_buf_sets(&value, oid);
+		peeled_null = !peeled_value(peeled, backend, &ref->target.oid,
+					    git_reference_target_peel(ref));
 	} else if (ref->type == GIT_REF_SYMBOLIC) {
-		char *symbolic_ref =
-		    malloc(strlen(GIT_SYMREF) + strlen(ref->target.symbolic) +
-			   1);
-
-		strcpy(symbolic_ref, GIT_SYMREF);
-		strcat(symbolic_ref, ref->target.symbolic);
-
-		bind_buffers[1].buffer = (void *)symbolic_ref;
-		bind_buffers[1].buffer_type = MYSQL_TYPE_STRING;
+		git_buf_puts(&value, GIT_SYMREF);
+		git_buf_puts(&value, ref->target.symbolic);
 	}
-
-	if (mysql_stmt_bind_param(backend->st_write, bind_buffers) != 0) {
+	if (git_buf_oom(&value)) {
 		return GIT_ERROR;
 	}
 
+	error = GIT_ERROR;
+	memset(bind_buffers, 0, sizeof(bind_buffers));
+
+	bind_buffers[0].buffer = (void *)ref->name;
+	bind_buffers[0].buffer_length = strlen(ref->name);
+	bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
+	bind_buffers[1].buffer = (void *)git_buf_cstr(&value);
+	bind_buffers[1].buffer_length = git_buf_len(&value);
+	bind_buffers[1].buffer_type = MYSQL_TYPE_STRING;
+	bind_buffers[2].buffer = peeled;
+	bind_buffers[2].buffer_length = peeled_null ? 0 : strlen(peeled);
+	bind_buffers[2].buffer_type = MYSQL_TYPE_STRING;
+	bind_buffers[2].is_null = &peeled_null;
+
+	if (prepare(backend, &backend->st_write, sql_write) < 0 ||
+	    mysql_stmt_bind_param(backend->st_write, bind_buffers) != 0) {
+		goto done;
+	}
+
 	if (mysql_stmt_execute(backend->st_write) != 0) {
 		giterr_set(GITERR_ODB,
 			   "Error writing reference to Sqlite RefDB backend");
-		return GIT_ERROR;
+		goto done;
 	}
 
 	mysql_stmt_reset(backend->st_write);
+	error = GIT_OK;
 
-	return GIT_OK;
+ done:
+	git_buf_free(&value);
+	return error;
 }
 
 static int
-mysql_refdb_backend__delete(git_refdb_backend * _backend, const char *name)
+mysql_refdb_backend__write(git_refdb_backend * _backend,
+			   const git_reference * ref,
+			   int force,
+			   const git_signature * who, const char *message)
 {
-	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+	mysql_trace_span span;
 	int error;
+
+	MYSQL_TRACE_START(&span, "refdb.write", NULL, ref->name);
+	if ((error = refdb_enter(_backend)) == GIT_OK) {
+		error = refdb_write(_backend, ref, force, who, message);
+		refdb_leave(_backend);
+	}
+	MYSQL_TRACE_FINISH(&span, 0, error == GIT_OK, error);
+
+	return error;
+}
+
+static int
+refdb_delete(git_refdb_backend * _backend, const char *name)
+{
+	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
 	MYSQL_BIND bind_buffers[1];
 
 	assert(backend && name);
@@ -410,7 +1497,8 @@ mysql_refdb_backend__delete(git_refdb_backend * _backend, const char *name)
 	bind_buffers[0].buffer = (void *)name;
 	bind_buffers[0].buffer_type = MYSQL_TYPE_STRING;
 
-	if (mysql_stmt_bind_param(backend->st_delete, bind_buffers) != 0) {
+	if (prepare(backend, &backend->st_delete, sql_delete) < 0 ||
+	    mysql_stmt_bind_param(backend->st_delete, bind_buffers) != 0) {
 		return GIT_ERROR;
 	}
 	if (mysql_stmt_execute(backend->st_delete) != 0) {
@@ -418,16 +1506,31 @@ mysql_refdb_backend__delete(git_refdb_backend * _backend, const char *name)
 	}
 
 	return GIT_OK;
+}
 
+static int
+mysql_refdb_backend__delete(git_refdb_backend * _backend, const char *name)
+{
+	mysql_trace_span span;
+	int error;
+
+	MYSQL_TRACE_START(&span, "refdb.delete", NULL, name);
+	if ((error = refdb_enter(_backend)) == GIT_OK) {
+		error = refdb_delete(_backend, name);
+		refdb_leave(_backend);
+	}
+	MYSQL_TRACE_FINISH(&span, 0, error == GIT_OK, error);
+
+	return error;
 }
 
 static int
-mysql_refdb_backend__rename(git_reference ** out,
-			    git_refdb_backend * _backend,
-			    const char *old_name,
-			    const char *new_name,
-			    int force,
-			    const git_signature * who, const char *message)
+refdb_rename(git_reference ** out,
+	     git_refdb_backend * _backend,
+	     const char *old_name,
+	     const char *new_name,
+	     int force,
+	     const git_signature * who, const char *message)
 {
 	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
 	git_reference *old, *new;
@@ -463,9 +1566,44 @@ mysql_refdb_backend__rename(git_reference ** out,
 	return GIT_OK;
 }
 
+static int
+mysql_refdb_backend__rename(git_reference ** out,
+			    git_refdb_backend * _backend,
+			    const char *old_name,
+			    const char *new_name,
+			    int force,
+			    const git_signature * who, const char *message)
+{
+	mysql_trace_span span;
+	int error;
+
+	MYSQL_TRACE_START(&span, "refdb.rename", NULL, old_name);
+	if ((error = refdb_enter(_backend)) == GIT_OK) {
+		error = refdb_rename(out, _backend, old_name, new_name, force,
+				     who, message);
+		refdb_leave(_backend);
+	}
+	MYSQL_TRACE_FINISH(&span, 0, error == GIT_OK, error);
+
+	return error;
+}
+
 static int mysql_refdb_backend__compress(git_refdb_backend * _backend)
 {
-	return 0;
+	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+	mysql_trace_span span;
+	int error;
+
+	assert(backend);
+
+	MYSQL_TRACE_START(&span, "refdb.compress", NULL, NULL);
+	if ((error = refdb_enter(_backend)) == GIT_OK) {
+		error = backend->snapshot ? snapshot_compress(backend) : GIT_OK;
+		refdb_leave(_backend);
+	}
+	MYSQL_TRACE_FINISH(&span, 0, error == GIT_OK, error);
+
+	return error;
 }
 
 static int
@@ -483,22 +1621,21 @@ mysql_refdb_backend__ensure_log(git_refdb_backend * _backend, const char *name)
 static void mysql_refdb_backend__free(git_refdb_backend * _backend)
 {
 	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+	unsigned int epoch;
 
 	assert(backend);
 
-	if (backend->st_read) {
-		mysql_stmt_close(backend->st_read);
-	}
-	if (backend->st_read_all) {
-		mysql_stmt_close(backend->st_read_all);
-	}
-	if (backend->st_write) {
-		mysql_stmt_close(backend->st_write);
+	// other backends may be using the connection
+	if (backend->handle != NULL) {
+		mysql_conn_lock(&epoch, backend->handle);
+		close_statements(backend);
+		mysql_conn_leave(backend->handle);
+		mysql_conn_put(backend->handle);
 	}
-	if (backend->st_delete) {
-		mysql_stmt_close(backend->st_delete);
+	if (backend->odb) {
+		backend->odb->free(backend->odb);
 	}
-	mysql_close(backend->db);
+	mysql_conn_params_free(&backend->conn);
 
 	free(backend);
 }
@@ -536,7 +1673,8 @@ static int create_table(MYSQL * db)
 	static const char *sql_creat =
 	    "CREATE TABLE '" GIT2_REFDB_TABLE_NAME "' ("
 	    "'refname' TEXT PRIMARY KEY NOT NULL,"
-	    "'ref' TEXT NOT NULL"
+	    "'ref' TEXT NOT NULL,"
+	    "'peeled' varchar(40) DEFAULT NULL"
 	    ") ENGINE=" GIT2_STORAGE_ENGINE
 	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
 
@@ -549,6 +1687,27 @@ static int create_table(MYSQL * db)
 	return GIT_OK;
 }
 
+/* tables created before refs were stored peeled */
+static int add_peeled_column(MYSQL * db)
+{
+	static const char *sql_check =
+	    "SHOW COLUMNS FROM `" GIT2_REFDB_TABLE_NAME "` LIKE 'peeled'";
+	static const char *sql_alter =
+	    "ALTER TABLE `" GIT2_REFDB_TABLE_NAME "`"
+	    " ADD COLUMN `peeled` varchar(40) DEFAULT NULL";
+	MYSQL_RES *res;
+	int found;
+
+	if (run_query(db, sql_check, strlen(sql_check)) < 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+	found = mysql_num_rows(res) > 0;
+	mysql_free_result(res);
+
+	return found ? GIT_OK : run_query(db, sql_alter, strlen(sql_alter));
+}
+
 static int init_db(MYSQL * db)
 {
 	static const char *sql_check =
@@ -571,7 +1730,7 @@ static int init_db(MYSQL * db)
 	if (num_rows == 0) {
 		error = create_table(db);
 	} else if (num_rows > 0) {
-		error = GIT_OK;
+		error = add_peeled_column(db);
 	} else {
 		error = GIT_ERROR;
 	}
@@ -581,155 +1740,378 @@ static int init_db(MYSQL * db)
 	return error;
 }
 
-static int init_statements(mysql_refdb_backend * backend)
+int
+git_refdb_backend_mysql(git_refdb_backend ** backend_out,
+			const char *mysql_host,
+			unsigned int mysql_port,
+			const char *mysql_unix_socket, const char *mysql_db,
+			const char *mysql_user, const char *mysql_passwd,
+			unsigned long mysql_client_flag)
 {
-	my_bool truth = 1;
-	static const char *sql_read =
-	    "SELECT ref FROM '" GIT2_REFDB_TABLE_NAME "' WHERE refname = ?;";
+	mysql_refdb_backend *backend;
+
+	backend = calloc(1, sizeof(mysql_refdb_backend));
+	if (backend == NULL) {
+		return GITERR_NOMEMORY;
+	}
+	backend->snapshot_request = -1;
+
+	// the flags of the ODB backend, so that the two can share a
+	// connection; it is made on first use
+	if (mysql_conn_params_init(&backend->conn, mysql_host, mysql_port,
+				   mysql_unix_socket, mysql_db, mysql_user,
+				   mysql_passwd,
+				   mysql_client_flag | CLIENT_MULTI_STATEMENTS) <
+	    0 || mysql_conn_get(&backend->handle, &backend->conn, 0) < 0) {
+		goto cleanup;
+	}
+
+	backend->parent.exists = &mysql_refdb_backend__exists;
+	backend->parent.lookup = &mysql_refdb_backend__lookup;
+	backend->parent.iterator = &mysql_refdb_backend__iterator;
+	backend->parent.write = &mysql_refdb_backend__write;
+	backend->parent.del = &mysql_refdb_backend__delete;
+	backend->parent.rename = &mysql_refdb_backend__rename;
+	backend->parent.compress = &mysql_refdb_backend__compress;
+	backend->parent.has_log = &mysql_refdb_backend__has_log;
+	backend->parent.ensure_log = &mysql_refdb_backend__ensure_log;
+	backend->parent.free = &mysql_refdb_backend__free;
+	backend->parent.reflog_read = &mysql_refdb_backend__reflog_read;
+	backend->parent.reflog_write = &mysql_refdb_backend__reflog_write;
+	backend->parent.reflog_rename = &mysql_refdb_backend__reflog_rename;
+	backend->parent.reflog_delete = &mysql_refdb_backend__reflog_delete;
+
+	*backend_out = (git_refdb_backend *) backend;
+	return GIT_OK;
+
+ cleanup:
+	mysql_refdb_backend__free((git_refdb_backend *) backend);
+	return GIT_ERROR;
+}
 
-	static const char *sql_read_all =
-	    "SELECT refname FROM '" GIT2_REFDB_TABLE_NAME "';";
+int
+git_refdb_backend_mysql_set_snapshot(git_refdb_backend * _backend,
+				     int enabled)
+{
+	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+	int error = GIT_OK;
 
-	static const char *sql_write =
-	    "INSERT OR IGNORE INTO '" GIT2_REFDB_TABLE_NAME "' VALUES (?, ?);";
+	assert(backend);
 
-	static const char *sql_delete =
-	    "DELETE FROM '" GIT2_REFDB_TABLE_NAME "' WHERE refname = ?;";
+	backend->snapshot_request = enabled != 0;
 
-	backend->st_read = mysql_stmt_init(backend->db);
-	if (backend->st_read == NULL) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
-		return GIT_ERROR;
+	// otherwise the first call sets it
+	if (backend->epoch != 0 && (error = refdb_enter(_backend)) == GIT_OK) {
+		error = apply_snapshot(backend);
+		refdb_leave(_backend);
 	}
-	if (mysql_stmt_attr_set
-	    (backend->st_read, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
+
+	return error < 0 ? GIT_ERROR : GIT_OK;
+}
+
+int
+git_refdb_backend_mysql_set_shared_connection(git_refdb_backend * _backend,
+					      int shared)
+{
+	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+	mysql_conn *handle;
+
+	assert(backend);
+
+	if (backend->epoch != 0) {
+		giterr_set_str(GITERR_REFERENCE,
+			       "The MySql RefDB backend is connected already");
 		return GIT_ERROR;
 	}
-	if (mysql_stmt_prepare(backend->st_read, sql_read, strlen(sql_read)) !=
-	    0) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
+
+	if (mysql_conn_get(&handle, &backend->conn, shared) < 0) {
 		return GIT_ERROR;
 	}
 
-	backend->st_read_all = mysql_stmt_init(backend->db);
-	if (backend->st_read_all == NULL) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
-		return GIT_ERROR;
+	mysql_conn_put(backend->handle);
+	backend->handle = handle;
+
+	return GIT_OK;
+}
+
+int
+git_refdb_backend_mysql_set_odb(git_refdb_backend * _backend,
+				git_odb_backend * odb)
+{
+	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+
+	assert(backend);
+
+	if (backend->odb) {
+		backend->odb->free(backend->odb);
 	}
-	if (mysql_stmt_attr_set
-	    (backend->st_read_all, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
-		return GIT_ERROR;
+	backend->odb = odb;
+
+	return GIT_OK;
+}
+
+typedef struct {
+	char *name;
+	char *target;
+} advertise_symref;
+
+typedef struct {
+	char *name;
+	char ref[GIT_OID_HEXSZ + 1];	/* as streamed */
+	char peeled[GIT_OID_HEXSZ + 1];
+} advertise_backfill;
+
+static void
+put_pkt_ref(git_buf * out, const git_oid * oid, const char *name,
+	    const char *suffix, const char *caps)
+{
+	char hex[GIT_OID_HEXSZ + 1];
+	size_t len = GIT_OID_HEXSZ + 1 + strlen(name) + strlen(suffix) + 1;
+
+	if (caps != NULL) {
+		len += 1 + strlen(caps);
 	}
-	if (mysql_stmt_prepare
-	    (backend->st_read_all, sql_read_all, strlen(sql_read_all)) != 0) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
-		return GIT_ERROR;
+
+	git_oid_tostr(hex, sizeof(hex), oid);
+	git_buf_printf(out, "%04x%s %s%s", (unsigned int)(len + 4), hex, name,
+		       suffix);
+	if (caps != NULL) {
+		git_buf_putc(out, '\0');
+		git_buf_puts(out, caps);
 	}
+	git_buf_putc(out, '\n');
+}
 
-	backend->st_write = mysql_stmt_init(backend->db);
-	if (backend->st_write == NULL) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
-		return GIT_ERROR;
+/* the OID a ref ends at after following symbolic refs */
+static int
+resolve_ref(git_oid * out, mysql_refdb_backend * backend, const char *name)
+{
+	git_reference *ref = NULL;
+	char *current = git__strdup(name);
+	int depth, error = GIT_ENOTFOUND;
+
+	GITERR_CHECK_ALLOC(current);
+
+	for (depth = 0; depth < SYMREF_MAX_DEPTH; depth++) {
+		if ((error = loose_lookup(&ref, backend, current)) < 0) {
+			break;
+		}
+
+		git__free(current);
+		current = NULL;
+
+		if (git_reference_type(ref) == GIT_REF_OID) {
+			git_oid_cpy(out, git_reference_target(ref));
+			git_reference_free(ref);
+			return GIT_OK;
+		}
+
+		current = git__strdup(git_reference_symbolic_target(ref));
+		git_reference_free(ref);
+		GITERR_CHECK_ALLOC(current);
+		error = GIT_ENOTFOUND;
 	}
-	if (mysql_stmt_attr_set
-	    (backend->st_write, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
-		return GIT_ERROR;
+
+	git__free(current);
+	return error;
+}
+
+static int
+put_ref_line(git_buf * out, const git_oid * oid, const char *name,
+	     const char *caps, int *first)
+{
+	put_pkt_ref(out, oid, name, "", *first ? caps : NULL);
+	*first = 0;
+
+	return git_buf_oom(out) ? GIT_ERROR : GIT_OK;
+}
+
+static int store_backfill(mysql_refdb_backend * backend, git_vector * fills)
+{
+	git_buf sql = GIT_BUF_INIT;
+	advertise_backfill *fill;
+	size_t i;
+	int error = GIT_OK;
+
+	git_vector_foreach(fills, i, fill) {
+		if (error < 0) {
+			break;
+		}
+		git_buf_clear(&sql);
+		git_buf_puts(&sql, "UPDATE `" GIT2_REFDB_TABLE_NAME
+			     "` SET `peeled` = ");
+		put_string(&sql, backend->db, fill->peeled);
+		git_buf_puts(&sql, " WHERE `refname` = ");
+		put_string(&sql, backend->db, fill->name);
+		// the ref may have moved since it was streamed
+		git_buf_puts(&sql, " AND `ref` = ");
+		put_string(&sql, backend->db, fill->ref);
+		error = run_buf(backend->db, &sql);
 	}
-	if (mysql_stmt_prepare(backend->st_write, sql_write, strlen(sql_write))
-	    != 0) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
+
+	git_buf_free(&sql);
+	return error;
+}
+
+int
+git_refdb_backend_mysql_advertise(git_buf * out, git_refdb_backend * _backend,
+				  const char *capabilities)
+{
+	static const char *sql =
+	    "SELECT `refname`, `ref`, `peeled` FROM `" GIT2_REFDB_TABLE_NAME
+	    "` WHERE `refname` LIKE 'refs/%' ORDER BY `refname`";
+	mysql_refdb_backend *backend = (mysql_refdb_backend *) _backend;
+	git_vector symrefs, fills;
+	advertise_symref *symref;
+	advertise_backfill *fill;
+	const char *caps = capabilities ? capabilities : "";
+	mysql_trace_span span;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	git_oid oid, peeled;
+	size_t i, rows = 0;
+	int first = 1, error;
+
+	assert(out && backend);
+
+	MYSQL_TRACE_START(&span, "refdb.advertise", NULL, NULL);
+
+	if (refdb_enter(_backend) < 0) {
+		MYSQL_TRACE_FINISH(&span, 0, 0, GIT_ERROR);
 		return GIT_ERROR;
 	}
 
-	backend->st_delete = mysql_stmt_init(backend->db);
-	if (backend->st_delete == NULL) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
+	if (git_vector_init(&symrefs, 8, NULL) < 0 ||
+	    git_vector_init(&fills, 64, NULL) < 0) {
+		git_vector_free(&symrefs);
+		refdb_leave(_backend);
+		MYSQL_TRACE_FINISH(&span, 0, 0, GIT_ERROR);
 		return GIT_ERROR;
 	}
-	if (mysql_stmt_attr_set
-	    (backend->st_delete, STMT_ATTR_UPDATE_MAX_LENGTH, &truth) != 0) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
-		return GIT_ERROR;
+
+	// HEAD comes first, as upload-pack sends it
+	if ((error = resolve_ref(&oid, backend, GIT_HEAD_FILE)) == GIT_OK) {
+		error = put_ref_line(out, &oid, GIT_HEAD_FILE, caps, &first);
+	} else if (error == GIT_ENOTFOUND) {
+		giterr_clear();
+		error = GIT_OK;
 	}
-	if (mysql_stmt_prepare
-	    (backend->st_delete, sql_delete, strlen(sql_delete)) != 0) {
-		giterr_set(GITERR_REFERENCE,
-			   "Error creating prepared statement for MySql RefDB backend");
-		return GIT_ERROR;
+
+	if (error < 0 || (error = run_query(backend->db, sql, strlen(sql))) < 0) {
+		goto done;
+	}
+	if ((res = mysql_use_result(backend->db)) == NULL) {
+		error = GIT_ERROR;
+		goto done;
 	}
 
-	return GIT_OK;
-}
+	// one pass over the rows; other queries wait until it has ended
+	while (error == GIT_OK && (row = mysql_fetch_row(res)) != NULL) {
+		rows++;
+
+		if (git__prefixcmp(row[1], GIT_SYMREF) == 0) {
+			symref = git__calloc(1, sizeof(advertise_symref));
+			if (symref == NULL ||
+			    git_vector_insert(&symrefs, symref) < 0) {
+				git__free(symref);
+				error = GIT_ERROR;
+				break;
+			}
+			symref->name = git__strdup(row[0]);
+			symref->target = git__strdup(row[1] + strlen(GIT_SYMREF));
+			if (symref->name == NULL || symref->target == NULL) {
+				error = GIT_ERROR;
+			}
+			continue;
+		}
 
-int
-git_refdb_backend_mysql(git_refdb_backend ** backend_out,
-			const char *mysql_host,
-			unsigned int mysql_port,
-			const char *mysql_unix_socket, const char *mysql_db,
-			const char *mysql_user, const char *mysql_passwd,
-			unsigned long mysql_client_flag)
-{
-	mysql_refdb_backend *backend;
-	my_bool reconnect = 1;
+		if (git_oid_fromstrn(&oid, row[1], GIT_OID_HEXSZ) < 0) {
+			giterr_clear();
+			continue;
+		}
 
-	backend = calloc(1, sizeof(mysql_refdb_backend));
-	if (backend == NULL) {
-		return GITERR_NOMEMORY;
-	}
+		if ((error = put_ref_line(out, &oid, row[0], caps,
+					  &first)) < 0) {
+			break;
+		}
 
-	backend->db = mysql_init(backend->db);
+		if (row[2] == NULL && backend->odb != NULL) {
+			// stored before peeling, or before its tag arrived
+			fill = git__calloc(1, sizeof(advertise_backfill));
+			if (fill == NULL) {
+				error = GIT_ERROR;
+				break;
+			}
+			if (!peeled_value(fill->peeled, backend, &oid, NULL)) {
+				git__free(fill);
+				continue;
+			}
+			memcpy(fill->ref, row[1], GIT_OID_HEXSZ);
+			if ((fill->name = git__strdup(row[0])) == NULL ||
+			    git_vector_insert(&fills, fill) < 0) {
+				git__free(fill->name);
+				git__free(fill);
+				error = GIT_ERROR;
+				break;
+			}
+			row[2] = fill->peeled;
+		}
 
-	if (mysql_options(backend->db, MYSQL_OPT_RECONNECT, &reconnect) != 0) {
-		goto cleanup;
+		if (row[2] != NULL && row[2][0] != '\0' &&
+		    git_oid_fromstrn(&peeled, row[2], GIT_OID_HEXSZ) == 0) {
+			put_pkt_ref(out, &peeled, row[0], "^{}", NULL);
+		}
 	}
 
-	if (mysql_real_connect
-	    (backend->db, mysql_host, mysql_user, mysql_passwd, mysql_db,
-	     mysql_port, mysql_unix_socket, mysql_client_flag) != backend->db) {
-		goto cleanup;
+	if (error == GIT_OK && mysql_errno(backend->db) != 0) {
+		giterr_set_str(GITERR_REFERENCE, mysql_error(backend->db));
+		error = GIT_ERROR;
+	}
+	mysql_free_result(res);
+
+	// symbolic refs other than HEAD are rare, they go last
+	git_vector_foreach(&symrefs, i, symref) {
+		if (error < 0) {
+			break;
+		}
+		if (resolve_ref(&oid, backend, symref->target) == GIT_OK) {
+			error = put_ref_line(out, &oid, symref->name, caps,
+					     &first);
+		} else {
+			giterr_clear();
+		}
 	}
 
-	if (init_db(backend->db) < 0) {
-		goto cleanup;
+	if (error == GIT_OK && first) {
+		memset(&oid, 0, sizeof(oid));
+		put_pkt_ref(out, &oid, "capabilities^{}", "", caps);
 	}
+	git_buf_puts(out, "0000");
 
-	if (init_statements(backend) < 0) {
-		goto cleanup;
+	if (error == GIT_OK && git_buf_oom(out)) {
+		error = GIT_ERROR;
 	}
 
-	backend->parent.exists = &mysql_refdb_backend__exists;
-	backend->parent.lookup = &mysql_refdb_backend__lookup;
-	backend->parent.iterator = &mysql_refdb_backend__iterator;
-	backend->parent.write = &mysql_refdb_backend__write;
-	backend->parent.del = &mysql_refdb_backend__delete;
-	backend->parent.rename = &mysql_refdb_backend__rename;
-	backend->parent.compress = &mysql_refdb_backend__compress;
-	backend->parent.has_log = &mysql_refdb_backend__has_log;
-	backend->parent.ensure_log = &mysql_refdb_backend__ensure_log;
-	backend->parent.free = &mysql_refdb_backend__free;
-	backend->parent.reflog_read = &mysql_refdb_backend__reflog_read;
-	backend->parent.reflog_write = &mysql_refdb_backend__reflog_write;
-	backend->parent.reflog_rename = &mysql_refdb_backend__reflog_rename;
-	backend->parent.reflog_delete = &mysql_refdb_backend__reflog_delete;
+	// a failed backfill only costs the next advertisement the peeling
+	if (error == GIT_OK &&
+	    store_backfill(backend, &fills) < 0) {
+		giterr_clear();
+	}
 
-	*backend_out = (git_refdb_backend *) backend;
-	return GIT_OK;
+ done:
+	git_vector_foreach(&symrefs, i, symref) {
+		git__free(symref->name);
+		git__free(symref->target);
+		git__free(symref);
+	}
+	git_vector_foreach(&fills, i, fill) {
+		git__free(fill->name);
+		git__free(fill);
+	}
+	git_vector_free(&symrefs);
+	git_vector_free(&fills);
+	refdb_leave(_backend);
 
- cleanup:
-	mysql_refdb_backend__free((git_refdb_backend *) backend);
-	return GIT_ERROR;
+	MYSQL_TRACE_FINISH(&span, out->size, rows, error);
+	return error;
 }
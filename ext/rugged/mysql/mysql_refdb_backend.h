@@ -0,0 +1,53 @@
+#ifndef MYSQL_REFDB_BACKEND_H
+#define MYSQL_REFDB_BACKEND_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+#include <buffer.h>
+
+int
+git_refdb_backend_mysql(git_refdb_backend ** backend_out,
+			const char *mysql_host,
+			unsigned int mysql_port,
+			const char *mysql_unix_socket, const char *mysql_db,
+			const char *mysql_user, const char *mysql_passwd,
+			unsigned long mysql_client_flag);
+
+/*
+ * Keep a compressed snapshot of all refs, plus a table of the changes made
+ * since, filled by triggers. Full listings then read one blob instead of
+ * one row per ref, and compress() folds the changes into a new snapshot.
+ * This is a setting of the database: every backend on it maintains and
+ * uses the snapshot once one turns it on, until one turns it off.
+ */
+int git_refdb_backend_mysql_set_snapshot(git_refdb_backend * backend,
+					 int enabled);
+
+/*
+ * Share the connection with the other backends of this process that ask
+ * for one to the same server and database, see mysql_conn_get(). Only
+ * before the backend is first used.
+ */
+int git_refdb_backend_mysql_set_shared_connection(git_refdb_backend *
+						  backend, int shared);
+
+/*
+ * Read tags through `odb` to store the peeled target next to each ref. The
+ * refdb takes ownership of the backend and frees it. The advertisement
+ * reads tags while it streams the refs, so `odb` must not share the
+ * refdb's connection.
+ */
+int git_refdb_backend_mysql_set_odb(git_refdb_backend * backend,
+				    git_odb_backend * odb);
+
+/*
+ * Append the ref advertisement of upload-pack to `out`, as pkt-lines ending
+ * with a flush. HEAD comes first, then every ref under refs/ in name order
+ * with its peeled line. `capabilities` goes after the first ref.
+ */
+int git_refdb_backend_mysql_advertise(git_buf * out,
+				      git_refdb_backend * backend,
+				      const char *capabilities);
+
+#endif
@@ -0,0 +1,657 @@
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_refdb_backend.h"
+#include "mysql_replay.h"
+
+#define REPLAY_MAX_WORKERS 256
+
+// log-linear latency buckets: 8 per power of two, within 12.5%
+#define REPLAY_SUB_BITS 3
+#define REPLAY_BUCKETS 512
+
+typedef struct {
+	uint64_t start_ns;
+	uint64_t duration_ns;
+	uint64_t bytes;
+	int error;
+	unsigned char op;
+	unsigned char flags;
+	git_oid oid;
+	char *refname;
+} replay_op;
+
+typedef struct replay_state replay_state;
+
+typedef struct {
+	replay_state *state;
+	unsigned int index;
+	git_odb_backend *odb;
+	git_refdb_backend *refdb;
+	uint64_t written;
+	uint64_t skipped;
+	mysql_replay_op_stats ops[MYSQL_TRACE_OP__COUNT];
+	uint32_t buckets[MYSQL_TRACE_OP__COUNT][REPLAY_BUCKETS];
+} replay_worker;
+
+struct replay_state {
+	replay_op *ops;
+	size_t count;
+	size_t next;
+	double speedup;
+	int read_only;
+	uint64_t started_ns;
+};
+
+static int get_varint(uint64_t * out, const unsigned char **p,
+		      const unsigned char *end)
+{
+	uint64_t value = 0;
+	unsigned int shift = 0;
+
+	while (*p < end && shift < 64) {
+		unsigned char c = *(*p)++;
+
+		value |= (uint64_t) (c & 0x7f) << shift;
+		if ((c & 0x80) == 0) {
+			*out = value;
+			return 0;
+		}
+		shift += 7;
+	}
+
+	return -1;
+}
+
+/* 0 for a record, 1 at the end, -1 for a torn or unknown one */
+static int
+parse_op(replay_op * op, const unsigned char **p, const unsigned char *end)
+{
+	uint64_t thread, rows, error = 0, name_len;
+
+	if (*p == end) {
+		return 1;
+	}
+	if (end - *p < 2) {
+		return -1;
+	}
+
+	memset(op, 0, sizeof(*op));
+	op->op = *(*p)++;
+	op->flags = *(*p)++;
+
+	if (op->op == 0 || op->op >= MYSQL_TRACE_OP__COUNT ||
+	    get_varint(&thread, p, end) < 0 ||
+	    get_varint(&op->start_ns, p, end) < 0 ||
+	    get_varint(&op->duration_ns, p, end) < 0 ||
+	    get_varint(&op->bytes, p, end) < 0 ||
+	    get_varint(&rows, p, end) < 0) {
+		return -1;
+	}
+
+	if ((op->flags & MYSQL_TRACE_HAS_ERROR) &&
+	    get_varint(&error, p, end) < 0) {
+		return -1;
+	}
+	op->error = -(int)error;
+
+	if (op->flags & MYSQL_TRACE_HAS_OID) {
+		if (end - *p < GIT_OID_RAWSZ) {
+			return -1;
+		}
+		git_oid_fromraw(&op->oid, *p);
+		*p += GIT_OID_RAWSZ;
+	}
+
+	if (op->flags & MYSQL_TRACE_HAS_REFNAME) {
+		if (get_varint(&name_len, p, end) < 0 ||
+		    (uint64_t) (end - *p) < name_len) {
+			return -1;
+		}
+		if ((op->refname = malloc(name_len + 1)) == NULL) {
+			giterr_set_oom();
+			return -2;
+		}
+		memcpy(op->refname, *p, name_len);
+		op->refname[name_len] = '\0';
+		*p += name_len;
+	}
+
+	return 0;
+}
+
+static int op_cmp(const void *a, const void *b)
+{
+	const replay_op *x = a, *y = b;
+
+	if (x->start_ns != y->start_ns) {
+		return x->start_ns < y->start_ns ? -1 : 1;
+	}
+	return 0;
+}
+
+static int read_file(unsigned char **out, size_t * len, const char *path)
+{
+	struct stat st;
+	FILE *f;
+
+	if ((f = fopen(path, "rb")) == NULL) {
+		giterr_set_str(GITERR_OS, "Failed to open the trace recording");
+		return GIT_ERROR;
+	}
+
+	if (fstat(fileno(f), &st) < 0 || st.st_size < 8) {
+		fclose(f);
+		giterr_set_str(GITERR_INVALID, "Not a trace recording");
+		return GIT_ERROR;
+	}
+
+	*len = (size_t) st.st_size;
+	if ((*out = malloc(*len)) == NULL) {
+		fclose(f);
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	if (fread(*out, 1, *len, f) != *len) {
+		fclose(f);
+		free(*out);
+		giterr_set_str(GITERR_OS, "Failed to read the trace recording");
+		return GIT_ERROR;
+	}
+
+	fclose(f);
+	return GIT_OK;
+}
+
+static void free_ops(replay_state * state)
+{
+	size_t i;
+
+	for (i = 0; i < state->count; i++) {
+		free(state->ops[i].refname);
+	}
+	free(state->ops);
+}
+
+static int load_ops(replay_state * state, const char *path)
+{
+	unsigned char *data;
+	const unsigned char *p, *end;
+	size_t len, alloc = 0;
+	int error;
+
+	if ((error = read_file(&data, &len, path)) < 0) {
+		return error;
+	}
+
+	if (memcmp(data, MYSQL_TRACE_FILE_MAGIC, 8) != 0) {
+		free(data);
+		giterr_set_str(GITERR_INVALID, "Not a trace recording");
+		return GIT_ERROR;
+	}
+
+	p = data + 8;
+	end = data + len;
+
+	for (;;) {
+		if (state->count == alloc) {
+			size_t new_alloc = alloc ? alloc * 2 : 1024;
+			replay_op *ops = realloc(state->ops,
+						 new_alloc * sizeof(replay_op));
+
+			if (ops == NULL) {
+				giterr_set_oom();
+				error = GIT_ERROR;
+				break;
+			}
+			state->ops = ops;
+			alloc = new_alloc;
+		}
+
+		// a recording that was not stopped may end in a torn record
+		if ((error = parse_op(&state->ops[state->count], &p, end)) != 0) {
+			error = error == -2 ? GIT_ERROR : GIT_OK;
+			break;
+		}
+		state->count++;
+	}
+
+	free(data);
+
+	if (error < 0) {
+		free_ops(state);
+		state->ops = NULL;
+		state->count = 0;
+		return error;
+	}
+
+	qsort(state->ops, state->count, sizeof(replay_op), op_cmp);
+	return GIT_OK;
+}
+
+static unsigned int bucket_of(uint64_t ns)
+{
+	unsigned int exp;
+
+	if (ns < (1 << REPLAY_SUB_BITS)) {
+		return (unsigned int)ns;
+	}
+
+	exp = 63 - __builtin_clzll(ns);
+	return ((exp - REPLAY_SUB_BITS + 1) << REPLAY_SUB_BITS) +
+	    (unsigned int)((ns >> (exp - REPLAY_SUB_BITS)) &
+			   ((1 << REPLAY_SUB_BITS) - 1));
+}
+
+/* the largest latency that falls in the bucket */
+static uint64_t bucket_top(unsigned int bucket)
+{
+	unsigned int exp, sub;
+
+	if (bucket < (1 << REPLAY_SUB_BITS)) {
+		return bucket;
+	}
+
+	exp = (bucket >> REPLAY_SUB_BITS) + REPLAY_SUB_BITS - 1;
+	sub = bucket & ((1 << REPLAY_SUB_BITS) - 1);
+	return ((((uint64_t) (1 << REPLAY_SUB_BITS) + sub + 1)) <<
+		(exp - REPLAY_SUB_BITS)) - 1;
+}
+
+static void wait_for(replay_state * state, const replay_op * op)
+{
+	struct timespec ts;
+	uint64_t at;
+
+	if (state->speedup <= 0) {
+		return;
+	}
+
+	at = state->started_ns + (uint64_t) (op->start_ns / state->speedup);
+	ts.tv_sec = at / 1000000000ULL;
+	ts.tv_nsec = at % 1000000000ULL;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+	       EINTR) ;
+}
+
+static int replay_write(replay_worker * worker, const replay_op * op)
+{
+	git_odb_backend *odb = worker->odb;
+	size_t len = (size_t) op->bytes, tag_len;
+	char tag[96];
+	char *data;
+	git_oid oid;
+	int error;
+
+	// a blob of the recorded size that nobody wrote before
+	tag_len = snprintf(tag, sizeof(tag), "replay %llu %u %llu\n",
+			   (unsigned long long)worker->state->started_ns,
+			   worker->index, (unsigned long long)worker->written++);
+
+	if ((data = malloc(len > 0 ? len : 1)) == NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+	memset(data, '.', len);
+	memcpy(data, tag, tag_len < len ? tag_len : len);
+
+	if ((error = git_odb_hash(&oid, data, len, GIT_OBJ_BLOB)) == GIT_OK) {
+		error = odb->write(odb, &oid, data, len, GIT_OBJ_BLOB);
+	}
+
+	free(data);
+	return error;
+}
+
+static int replay_iterator(replay_worker * worker, const replay_op * op)
+{
+	git_reference_iterator *iter;
+	const char *name;
+	int error;
+
+	if ((error = worker->refdb->iterator(&iter, worker->refdb,
+					     op->refname)) < 0) {
+		return error;
+	}
+
+	while ((error = iter->next_name(&name, iter)) == GIT_OK) ;
+	iter->free(iter);
+
+	return error == GIT_ITEROVER ? GIT_OK : error;
+}
+
+/* the ref's current value stands in for the one that was written */
+static int replay_ref_write(replay_worker * worker, const replay_op * op)
+{
+	git_reference *ref;
+	int error;
+
+	if ((error = worker->refdb->lookup(&ref, worker->refdb,
+					   op->refname)) < 0) {
+		if (error == GIT_ENOTFOUND) {
+			giterr_clear();
+			return GIT_PASSTHROUGH;
+		}
+		return error;
+	}
+
+	error = worker->refdb->write(worker->refdb, ref, 1, NULL, NULL);
+	git_reference_free(ref);
+
+	return error;
+}
+
+/* GIT_PASSTHROUGH for an operation that cannot be replayed */
+static int run_op(replay_worker * worker, const replay_op * op)
+{
+	git_odb_backend *odb = worker->odb;
+	git_refdb_backend *refdb = worker->refdb;
+	git_reference *ref;
+	git_buf buf = GIT_BUF_INIT;
+	git_otype type;
+	size_t len, size;
+	void *data;
+	int error, exists;
+
+	switch (op->op) {
+	case MYSQL_TRACE_OP_ODB_READ:
+		if ((error = odb->read(&data, &len, &type, odb, &op->oid)) ==
+		    GIT_OK) {
+			free(data);
+		}
+		return error;
+	case MYSQL_TRACE_OP_ODB_READ_HEADER:
+		return odb->read_header(&len, &type, odb, &op->oid);
+	case MYSQL_TRACE_OP_ODB_EXISTS:
+		odb->exists(odb, &op->oid);
+		return GIT_OK;
+	case MYSQL_TRACE_OP_ODB_READ_RANGE:
+		// only the length was recorded, read a prefix as long
+		if ((error = git_odb_backend_mysql_read_range(&data, &len,
+							      &type, &size,
+							      odb, &op->oid, 0,
+							      op->bytes)) ==
+		    GIT_OK) {
+			free(data);
+		}
+		return error;
+	case MYSQL_TRACE_OP_ODB_WRITE:
+		return worker->state->read_only ? GIT_PASSTHROUGH :
+		    replay_write(worker, op);
+	case MYSQL_TRACE_OP_REFDB_ADVERTISE:
+		error = git_refdb_backend_mysql_advertise(&buf, refdb, NULL);
+		git_buf_free(&buf);
+		return error;
+	case MYSQL_TRACE_OP_REFDB_COMPRESS:
+		return worker->state->read_only ? GIT_PASSTHROUGH :
+		    refdb->compress(refdb);
+	case MYSQL_TRACE_OP_REFDB_ITERATOR:
+		return replay_iterator(worker, op);
+	}
+
+	if (op->refname == NULL) {
+		return GIT_PASSTHROUGH;
+	}
+
+	switch (op->op) {
+	case MYSQL_TRACE_OP_REFDB_EXISTS:
+		return refdb->exists(&exists, refdb, op->refname);
+	case MYSQL_TRACE_OP_REFDB_LOOKUP:
+		if ((error = refdb->lookup(&ref, refdb, op->refname)) ==
+		    GIT_OK) {
+			git_reference_free(ref);
+		}
+		return error;
+	case MYSQL_TRACE_OP_REFDB_WRITE:
+		return worker->state->read_only ? GIT_PASSTHROUGH :
+		    replay_ref_write(worker, op);
+	case MYSQL_TRACE_OP_REFDB_DELETE:
+		return worker->state->read_only ? GIT_PASSTHROUGH :
+		    refdb->del(refdb, op->refname);
+	}
+
+	// renames record the old name only
+	return GIT_PASSTHROUGH;
+}
+
+static int needs_refdb(int op)
+{
+	return op >= MYSQL_TRACE_OP_REFDB_EXISTS &&
+	    op <= MYSQL_TRACE_OP_REFDB_ADVERTISE;
+}
+
+static void *replay_thread(void *payload)
+{
+	replay_worker *worker = payload;
+	replay_state *state = worker->state;
+	size_t i;
+
+	mysql_thread_init();
+
+	while ((i = __sync_fetch_and_add(&state->next, 1)) < state->count) {
+		const replay_op *op = &state->ops[i];
+		mysql_replay_op_stats *stats = &worker->ops[op->op];
+		uint64_t started, took;
+		int error;
+
+		if (needs_refdb(op->op) ? worker->refdb == NULL :
+		    worker->odb == NULL) {
+			worker->skipped++;
+			continue;
+		}
+
+		wait_for(state, op);
+
+		started = mysql_trace_now_ns();
+		error = run_op(worker, op);
+		took = mysql_trace_now_ns() - started;
+
+		if (error == GIT_PASSTHROUGH) {
+			worker->skipped++;
+			continue;
+		}
+
+		// a miss that was a miss when recorded is no error
+		if (error < 0) {
+			if (op->error == 0) {
+				stats->errors++;
+			}
+			giterr_clear();
+		}
+
+		stats->count++;
+		stats->total_ns += took;
+		stats->recorded_ns += op->duration_ns;
+		if (took > stats->max_ns) {
+			stats->max_ns = took;
+		}
+		worker->buckets[op->op][bucket_of(took)]++;
+	}
+
+	mysql_thread_end();
+	return NULL;
+}
+
+static uint64_t
+percentile(uint64_t * buckets, uint64_t count, double fraction, uint64_t max)
+{
+	uint64_t rank = (uint64_t) (count * fraction), seen = 0;
+	unsigned int b;
+
+	for (b = 0; b < REPLAY_BUCKETS; b++) {
+		seen += buckets[b];
+		if (seen > rank) {
+			return bucket_top(b) < max ? bucket_top(b) : max;
+		}
+	}
+
+	return max;
+}
+
+static void
+merge_stats(mysql_replay_stats * stats, replay_worker * workers,
+	    unsigned int count)
+{
+	uint64_t buckets[REPLAY_BUCKETS];
+	unsigned int w, b;
+	int op;
+
+	for (op = 1; op < MYSQL_TRACE_OP__COUNT; op++) {
+		mysql_replay_op_stats *total = &stats->ops[op];
+
+		memset(buckets, 0, sizeof(buckets));
+
+		for (w = 0; w < count; w++) {
+			const mysql_replay_op_stats *part = &workers[w].ops[op];
+
+			total->count += part->count;
+			total->errors += part->errors;
+			total->total_ns += part->total_ns;
+			total->recorded_ns += part->recorded_ns;
+			if (part->max_ns > total->max_ns) {
+				total->max_ns = part->max_ns;
+			}
+
+			for (b = 0; b < REPLAY_BUCKETS; b++) {
+				buckets[b] += workers[w].buckets[op][b];
+			}
+		}
+
+		if (total->count == 0) {
+			continue;
+		}
+
+		total->p50_ns = percentile(buckets, total->count, 0.50,
+					   total->max_ns);
+		total->p95_ns = percentile(buckets, total->count, 0.95,
+					   total->max_ns);
+		total->p99_ns = percentile(buckets, total->count, 0.99,
+					   total->max_ns);
+		stats->operations += total->count;
+	}
+
+	for (w = 0; w < count; w++) {
+		stats->skipped += workers[w].skipped;
+	}
+}
+
+int
+mysql_replay(mysql_replay_stats * stats, const char *path,
+	     const mysql_replay_opts * opts, mysql_replay_open_cb open,
+	     void *payload)
+{
+	mysql_replay_opts defaults = MYSQL_REPLAY_OPTS_INIT;
+	replay_state state;
+	replay_worker *workers;
+	pthread_t threads[REPLAY_MAX_WORKERS];
+	unsigned int count, started = 0, i;
+	int need_odb = 0, need_refdb = 0;
+	int error = GIT_OK;
+	size_t o;
+
+	assert(stats && path && open);
+
+	if (opts == NULL) {
+		opts = &defaults;
+	}
+
+	count = opts->concurrency;
+	if (count == 0) {
+		count = 1;
+	} else if (count > REPLAY_MAX_WORKERS) {
+		count = REPLAY_MAX_WORKERS;
+	}
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&state, 0, sizeof(state));
+	state.speedup = opts->speedup;
+	state.read_only = opts->read_only;
+
+	if ((error = load_ops(&state, path)) < 0) {
+		return error;
+	}
+
+	for (o = 0; o < state.count; o++) {
+		if (needs_refdb(state.ops[o].op)) {
+			need_refdb = 1;
+		} else {
+			need_odb = 1;
+		}
+	}
+
+	if ((workers = calloc(count, sizeof(replay_worker))) == NULL) {
+		free_ops(&state);
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	// connect everyone before the clock starts
+	for (i = 0; i < count && error == GIT_OK; i++) {
+		workers[i].state = &state;
+		workers[i].index = i;
+		error = open(&workers[i].odb, &workers[i].refdb, payload);
+		if (error == GIT_OK && !need_odb && workers[i].odb != NULL) {
+			workers[i].odb->free(workers[i].odb);
+			workers[i].odb = NULL;
+		}
+		if (error == GIT_OK && !need_refdb &&
+		    workers[i].refdb != NULL) {
+			workers[i].refdb->free(workers[i].refdb);
+			workers[i].refdb = NULL;
+		}
+	}
+
+	if (error == GIT_OK) {
+		state.started_ns = mysql_trace_now_ns();
+
+		for (i = 0; i < count; i++) {
+			if (pthread_create(&threads[started], NULL,
+					   replay_thread, &workers[i]) == 0) {
+				started++;
+			}
+		}
+
+		if (started == 0) {
+			giterr_set_str(GITERR_OS,
+				       "Failed to start the replay workers");
+			error = GIT_ERROR;
+		}
+
+		for (i = 0; i < started; i++) {
+			pthread_join(threads[i], NULL);
+		}
+
+		stats->elapsed_ns = mysql_trace_now_ns() - state.started_ns;
+		merge_stats(stats, workers, count);
+	}
+
+	for (i = 0; i < count; i++) {
+		if (workers[i].odb != NULL) {
+			workers[i].odb->free(workers[i].odb);
+		}
+		if (workers[i].refdb != NULL) {
+			workers[i].refdb->free(workers[i].refdb);
+		}
+	}
+
+	free(workers);
+	free_ops(&state);
+
+	return error;
+}
@@ -0,0 +1,61 @@
+#ifndef MYSQL_REPLAY_H
+#define MYSQL_REPLAY_H
+
+#include <stdint.h>
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+
+#include "mysql_trace.h"
+
+/*
+ * Replay of a trace recording, see mysql_trace_record_start().
+ *
+ * Operations are issued by a pool of workers in the order they started,
+ * each no earlier than its recorded start divided by the speedup. Every
+ * worker has backends of its own, so the pool is also the number of
+ * connections. The recording carries no object contents: writes store a
+ * made-up blob of the recorded size, and a ref write stores the ref's
+ * current value again.
+ */
+
+typedef struct {
+	unsigned int concurrency;	/* workers, 8 by default */
+	double speedup;		/* 2.0 replays twice as fast, 0 without waits */
+	int read_only;		/* skip writes, deletes and compress */
+} mysql_replay_opts;
+
+#define MYSQL_REPLAY_OPTS_INIT { 8, 1.0, 0 }
+
+typedef struct {
+	uint64_t count;
+	uint64_t errors;	/* failed here but not when recorded */
+	uint64_t total_ns;
+	uint64_t recorded_ns;	/* total duration in the recording */
+	uint64_t p50_ns;
+	uint64_t p95_ns;
+	uint64_t p99_ns;
+	uint64_t max_ns;
+} mysql_replay_op_stats;
+
+typedef struct {
+	uint64_t operations;
+	uint64_t skipped;	/* renames, and writes when read_only */
+	uint64_t elapsed_ns;
+	mysql_replay_op_stats ops[MYSQL_TRACE_OP__COUNT];
+} mysql_replay_stats;
+
+/*
+ * Open the backends of one worker, on the calling thread. Either may be
+ * set to NULL when the trace has no operation for it. The replay frees
+ * them.
+ */
+typedef int (*mysql_replay_open_cb) (git_odb_backend ** odb,
+				     git_refdb_backend ** refdb,
+				     void *payload);
+
+int mysql_replay(mysql_replay_stats * stats, const char *path,
+		 const mysql_replay_opts * opts, mysql_replay_open_cb open,
+		 void *payload);
+
+#endif
@@ -0,0 +1,318 @@
+/*
+ * Object counters.
+ *
+ * Every path that adds or deletes object rows keeps `git2_stats` up to
+ * date in the transaction that touches the rows: a single write with one
+ * prepared upsert, and bulk writes (packs, imports) and gc by summing the
+ * rows they touch. Objects only referenced in a shared pool are not
+ * counted. Moving an object between the hot table and the archive leaves
+ * the counters as they are.
+ *
+ * A row of type 0 marks the counters as kept. Every backend looks for it
+ * when it connects, so that one process turning them on is enough.
+ */
+
+#include <assert.h>
+#include <string.h>
+#include <stdlib.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_stats.h"
+
+#define STATS_ENABLED_TYPE 0
+
+static int run_query(MYSQL * db, const char *sql, size_t len)
+{
+	if (mysql_real_query(db, sql, len) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int run_buf(MYSQL * db, git_buf * sql)
+{
+	if (git_buf_oom(sql)) {
+		return GIT_ERROR;
+	}
+
+	return run_query(db, sql->ptr, sql->size);
+}
+
+static int init_table(MYSQL * db)
+{
+	static const char *sql_create =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_STATS_TABLE_NAME "` ("
+	    "  `type` tinyint(1) unsigned NOT NULL,"
+	    "  `objects` bigint(20) unsigned NOT NULL DEFAULT 0,"
+	    "  `size` bigint(20) unsigned NOT NULL DEFAULT 0,"
+	    "  PRIMARY KEY (`type`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	return run_query(db, sql_create, strlen(sql_create));
+}
+
+static int apply_request(mysql_odb_backend * backend)
+{
+	static const char *sql_enable =
+	    "INSERT IGNORE INTO `" GIT2_STATS_TABLE_NAME
+	    "` (`type`) VALUES (0)";
+	static const char *sql_disable =
+	    "DELETE FROM `" GIT2_STATS_TABLE_NAME "` WHERE `type` = 0";
+	int error = GIT_OK;
+
+	if (backend->stats_request == 1) {
+		error = run_query(backend->db, sql_enable, strlen(sql_enable));
+	} else if (backend->stats_request == 0) {
+		error = run_query(backend->db, sql_disable,
+				  strlen(sql_disable));
+	}
+
+	if (error == GIT_OK) {
+		backend->stats_request = -1;
+	}
+
+	return error;
+}
+
+static int read_enabled(int *enabled, mysql_odb_backend * backend)
+{
+	static const char *sql =
+	    "SELECT 1 FROM `" GIT2_STATS_TABLE_NAME "` WHERE `type` = 0";
+	MYSQL_RES *res;
+
+	if (run_query(backend->db, sql, strlen(sql)) < 0 ||
+	    (res = mysql_store_result(backend->db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	*enabled = mysql_num_rows(res) > 0;
+	mysql_free_result(res);
+	return GIT_OK;
+}
+
+int mysql_stats__init(mysql_odb_backend * backend)
+{
+	static const char *sql_add =
+	    "INSERT INTO `" GIT2_STATS_TABLE_NAME
+	    "` (`type`, `objects`, `size`) VALUES (?, 1, ?)"
+	    " ON DUPLICATE KEY UPDATE `objects` = `objects` + 1,"
+	    " `size` = `size` + VALUES(`size`);";
+	int enabled;
+
+	if (mysql_conn_init_table(backend->db, &backend->conn,
+				  GIT2_STATS_TABLE_NAME, init_table) < 0 ||
+	    apply_request(backend) < 0 ||
+	    read_enabled(&enabled, backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (!enabled) {
+		return GIT_OK;
+	}
+
+	backend->st_stats_add = mysql_stmt_init(backend->db);
+	if (backend->st_stats_add == NULL ||
+	    mysql_stmt_prepare(backend->st_stats_add, sql_add,
+			       strlen(sql_add)) != 0) {
+		return GIT_ERROR;
+	}
+
+	backend->stats = 1;
+	return GIT_OK;
+}
+
+void mysql_stats__free(mysql_odb_backend * backend)
+{
+	if (backend->st_stats_add) {
+		mysql_conn_stmt_close(backend->st_stats_add, backend->epoch);
+	}
+
+	backend->st_stats_add = NULL;
+	backend->stats = 0;
+}
+
+int
+mysql_stats__add(mysql_odb_backend * backend, git_otype type, size_t len)
+{
+	MYSQL_BIND bind_buffers[2];
+	signed char type_value = (signed char)type;
+	unsigned long long size = len;
+
+	memset(bind_buffers, 0, sizeof(bind_buffers));
+
+	bind_buffers[0].buffer = &type_value;
+	bind_buffers[0].buffer_type = MYSQL_TYPE_TINY;
+	bind_buffers[1].buffer = &size;
+	bind_buffers[1].buffer_type = MYSQL_TYPE_LONGLONG;
+	bind_buffers[1].is_unsigned = 1;
+
+	if (mysql_stmt_bind_param(backend->st_stats_add, bind_buffers) != 0 ||
+	    mysql_stmt_execute(backend->st_stats_add) != 0) {
+		giterr_set_str(GITERR_ODB,
+			       mysql_stmt_error(backend->st_stats_add));
+		mysql_stmt_reset(backend->st_stats_add);
+		return GIT_ERROR;
+	}
+
+	mysql_stmt_reset(backend->st_stats_add);
+	return GIT_OK;
+}
+
+int
+mysql_stats__apply_rows(mysql_odb_backend * backend, const char *table,
+			const git_buf * where, int sign)
+{
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	if (sign > 0) {
+		git_buf_puts(&sql, "INSERT INTO `" GIT2_STATS_TABLE_NAME
+			     "` (`type`, `objects`, `size`)"
+			     " SELECT `type`, COUNT(*), SUM(`size`) FROM ");
+		git_buf_puts(&sql, table);
+		git_buf_puts(&sql, " WHERE ");
+		git_buf_put(&sql, where->ptr, where->size);
+		git_buf_puts(&sql, " GROUP BY `type` ON DUPLICATE KEY UPDATE"
+			     " `objects` = `objects` + VALUES(`objects`),"
+			     " `size` = `size` + VALUES(`size`)");
+	} else {
+		// the columns are unsigned, counters that drifted stop at 0
+		git_buf_puts(&sql, "UPDATE `" GIT2_STATS_TABLE_NAME "` s JOIN"
+			     " (SELECT `type`, COUNT(*) AS `objects`,"
+			     " SUM(`size`) AS `size` FROM ");
+		git_buf_puts(&sql, table);
+		git_buf_puts(&sql, " WHERE ");
+		git_buf_put(&sql, where->ptr, where->size);
+		git_buf_puts(&sql, " GROUP BY `type`) d ON d.`type` = s.`type`"
+			     " SET s.`objects` = s.`objects` -"
+			     " LEAST(s.`objects`, d.`objects`),"
+			     " s.`size` = s.`size` - LEAST(s.`size`, d.`size`)");
+	}
+
+	error = run_buf(backend->db, &sql);
+	git_buf_free(&sql);
+	return error;
+}
+
+static int stats_enabled(mysql_odb_backend * backend)
+{
+	if (!backend->stats) {
+		giterr_set_str(GITERR_ODB,
+			       "Statistics are not enabled on the MySql ODB backend");
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+int mysql_stats_read(mysql_stats * out, git_odb_backend * odb)
+{
+	static const char *sql =
+	    "SELECT `type`, `objects`, `size` FROM `" GIT2_STATS_TABLE_NAME "`";
+	mysql_odb_backend *backend = (mysql_odb_backend *) odb;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int type;
+
+	assert(out && backend);
+
+	memset(out, 0, sizeof(*out));
+
+	if (mysql_odb__enter(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	if (stats_enabled(backend) < 0 ||
+	    run_query(backend->db, sql, strlen(sql)) < 0 ||
+	    (res = mysql_store_result(backend->db)) == NULL) {
+		mysql_odb__leave(backend);
+		return GIT_ERROR;
+	}
+
+	while ((row = mysql_fetch_row(res)) != NULL) {
+		mysql_stats_count count;
+
+		if ((type = atoi(row[0])) == STATS_ENABLED_TYPE) {
+			continue;
+		}
+		count.objects = strtoull(row[1], NULL, 10);
+		count.size = strtoull(row[2], NULL, 10);
+
+		if (type > 0 && type <= GIT_OBJ_TAG) {
+			out->types[type] = count;
+		}
+		out->total.objects += count.objects;
+		out->total.size += count.size;
+	}
+
+	mysql_free_result(res);
+	mysql_odb__leave(backend);
+	return GIT_OK;
+}
+
+int mysql_stats_rebuild(git_odb_backend * odb)
+{
+	static const char *sql_clear =
+	    "DELETE FROM `" GIT2_STATS_TABLE_NAME "` WHERE `type` <> 0";
+	mysql_odb_backend *backend = (mysql_odb_backend *) odb;
+	git_buf all = GIT_BUF_INIT;
+	int error;
+
+	assert(backend);
+
+	if (mysql_odb__enter(backend) < 0) {
+		return GIT_ERROR;
+	}
+
+	if ((error = stats_enabled(backend)) < 0) {
+		mysql_odb__leave(backend);
+		return error;
+	}
+
+	git_buf_puts(&all, "1");
+
+	if ((error = run_query(backend->db, "START TRANSACTION", 17)) < 0) {
+		goto done;
+	}
+
+	if ((error = run_query(backend->db, sql_clear,
+			       strlen(sql_clear))) < 0 ||
+	    (error = mysql_stats__apply_rows(backend,
+					     "`" GIT2_ODB_TABLE_NAME "`",
+					     &all, 1)) < 0) {
+		goto rollback;
+	}
+
+	if (backend->tier_sample_rate != 0 &&
+	    (error = mysql_stats__apply_rows(backend,
+					     "`" GIT2_ODB_ARCHIVE_TABLE_NAME "`",
+					     &all, 1)) < 0) {
+		goto rollback;
+	}
+
+	if (backend->packed &&
+	    (error = mysql_stats__apply_rows(backend,
+					     "`" GIT2_PACK_INDEX_TABLE_NAME "`",
+					     &all, 1)) < 0) {
+		goto rollback;
+	}
+
+	error = run_query(backend->db, "COMMIT", 6);
+	goto done;
+
+ rollback:
+	run_query(backend->db, "ROLLBACK", 8);
+
+ done:
+	mysql_odb__leave(backend);
+	git_buf_free(&all);
+	return error;
+}
@@ -0,0 +1,33 @@
+#ifndef MYSQL_STATS_H
+#define MYSQL_STATS_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+/*
+ * Object counters, see mysql_stats.c.
+ *
+ * `git2_stats` holds the number and total size of the objects stored in
+ * the repository's own tables, one row per object type. Reading them costs
+ * one small query, however large the repository is.
+ */
+
+typedef struct {
+	unsigned long long objects;
+	unsigned long long size;	/* bytes before compression */
+} mysql_stats_count;
+
+typedef struct {
+	mysql_stats_count total;
+	mysql_stats_count types[GIT_OBJ_TAG + 1];	/* by git_otype */
+} mysql_stats;
+
+int mysql_stats_read(mysql_stats * out, git_odb_backend * odb);
+
+/*
+ * Count everything again with a full scan, for a repository that had
+ * objects before the counters were turned on.
+ */
+int mysql_stats_rebuild(git_odb_backend * odb);
+
+#endif
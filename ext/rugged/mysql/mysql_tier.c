@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <buffer.h>
+#include <mysql.h>
+
+#include "mysql_odb_backend.h"
+#include "mysql_tier.h"
+
+#define GIT2_TIER_STATE_TABLE_NAME "git2_tier_state"
+#define TIER_LOCK_NAME "git2_tier"
+
+typedef struct {
+	mysql_odb_backend *backend;
+	mysql_tier_opts opts;
+	mysql_tier_stats *stats;
+	git_oid last_oid;	/* scan position */
+	size_t rows;		/* rows handled by this run */
+
+	git_oid *oids;
+	size_t count;
+} tier_state;
+
+static int run_query(MYSQL * db, const char *sql, size_t len)
+{
+	if (mysql_real_query(db, sql, len) != 0) {
+		giterr_set_str(GITERR_ODB, mysql_error(db));
+		return GIT_ERROR;
+	}
+
+	return GIT_OK;
+}
+
+static int run_buf(MYSQL * db, git_buf * sql)
+{
+	if (git_buf_oom(sql)) {
+		return GIT_ERROR;
+	}
+
+	return run_query(db, sql->ptr, sql->size);
+}
+
+static int init_tables(MYSQL * db)
+{
+	static const char *sql_state =
+	    "CREATE TABLE IF NOT EXISTS `" GIT2_TIER_STATE_TABLE_NAME "` ("
+	    "  `id` tinyint(1) unsigned NOT NULL,"
+	    "  `last_oid` binary(20) NOT NULL DEFAULT '',"
+	    "  `updated_at` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP"
+	    "    ON UPDATE CURRENT_TIMESTAMP,"
+	    "  PRIMARY KEY (`id`)"
+	    ") ENGINE=" GIT2_STORAGE_ENGINE
+	    " DEFAULT CHARSET=utf8 COLLATE=utf8_bin;";
+
+	return run_query(db, sql_state, strlen(sql_state));
+}
+
+static int lock_tier(MYSQL * db)
+{
+	static const char *sql = "SELECT GET_LOCK('" TIER_LOCK_NAME "', 0)";
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+	int locked = 0;
+
+	if (run_query(db, sql, strlen(sql)) < 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	if ((row = mysql_fetch_row(res)) != NULL && row[0] != NULL) {
+		locked = atoi(row[0]) == 1;
+	}
+	mysql_free_result(res);
+
+	if (!locked) {
+		giterr_set_str(GITERR_ODB, "Another archiver is running");
+		return GIT_ELOCKED;
+	}
+
+	return GIT_OK;
+}
+
+static void unlock_tier(MYSQL * db)
+{
+	static const char *sql = "DO RELEASE_LOCK('" TIER_LOCK_NAME "')";
+
+	mysql_real_query(db, sql, strlen(sql));
+}
+
+static int read_state(tier_state * state)
+{
+	static const char *sql =
+	    "SELECT `last_oid` FROM `" GIT2_TIER_STATE_TABLE_NAME
+	    "` WHERE `id` = 1";
+	MYSQL *db = state->backend->db;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	memset(&state->last_oid, 0, sizeof(git_oid));
+
+	if (run_query(db, sql, strlen(sql)) < 0 ||
+	    (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	if ((row = mysql_fetch_row(res)) != NULL &&
+	    mysql_fetch_lengths(res)[0] == GIT_OID_RAWSZ) {
+		git_oid_fromraw(&state->last_oid, (const unsigned char *)row[0]);
+	}
+
+	mysql_free_result(res);
+	return GIT_OK;
+}
+
+static int write_state(tier_state * state)
+{
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	git_buf_puts(&sql, "INSERT INTO `" GIT2_TIER_STATE_TABLE_NAME
+		     "` (`id`, `last_oid`) VALUES (1, ");
+	mysql_buf_put_oid(&sql, &state->last_oid);
+	git_buf_puts(&sql, ") ON DUPLICATE KEY UPDATE"
+		     " `last_oid` = VALUES(`last_oid`)");
+
+	error = run_buf(state->backend->db, &sql);
+	git_buf_free(&sql);
+	return error;
+}
+
+static void put_oid_list(git_buf * sql, const git_oid * oids, size_t count)
+{
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (i > 0) {
+			git_buf_putc(sql, ',');
+		}
+		mysql_buf_put_oid(sql, &oids[i]);
+	}
+}
+
+static int select_oids(tier_state * state, git_buf * sql)
+{
+	MYSQL *db = state->backend->db;
+	MYSQL_RES *res;
+	MYSQL_ROW row;
+
+	state->count = 0;
+
+	if (run_buf(db, sql) < 0 || (res = mysql_store_result(db)) == NULL) {
+		return GIT_ERROR;
+	}
+
+	while ((row = mysql_fetch_row(res)) != NULL &&
+	       state->count < state->opts.batch_size) {
+		if (mysql_fetch_lengths(res)[0] == GIT_OID_RAWSZ) {
+			git_oid_fromraw(&state->oids[state->count++],
+					(const unsigned char *)row[0]);
+		}
+	}
+
+	mysql_free_result(res);
+	return GIT_OK;
+}
+
+static void throttle(tier_state * state, size_t rows,
+		     const struct timespec *start)
+{
+	struct timespec now, wait;
+	double due, spent;
+
+	if (state->opts.rows_per_second == 0 || rows == 0) {
+		return;
+	}
+
+	due = (double)rows / state->opts.rows_per_second;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	spent = (double)(now.tv_sec - start->tv_sec) +
+	    (double)(now.tv_nsec - start->tv_nsec) / 1e9;
+
+	if (spent < due) {
+		wait.tv_sec = (time_t) (due - spent);
+		wait.tv_nsec = (long)((due - spent - wait.tv_sec) * 1e9);
+		nanosleep(&wait, NULL);
+	}
+}
+
+/* copy the cold rows of the batch to the archive, then drop the hot ones */
+static int archive_cold(tier_state * state, size_t * archived)
+{
+	MYSQL *db = state->backend->db;
+	git_buf sql = GIT_BUF_INIT;
+	int error;
+
+	*archived = 0;
+
+	git_buf_puts(&sql, "INSERT IGNORE INTO `" GIT2_ODB_ARCHIVE_TABLE_NAME
+		     "` (`oid`, `type`, `size`, `data`)"
+		     " SELECT `oid`, `type`, `size`, `data` FROM `"
+		     GIT2_ODB_TABLE_NAME "` WHERE `oid` IN (");
+	put_oid_list(&sql, state->oids, state->count);
+	git_buf_putc(&sql, ')');
+	if ((error = run_buf(db, &sql)) < 0) {
+		goto done;
+	}
+
+	// only rows that made it across, a promotion may race with us
+	git_buf_clear(&sql);
+	git_buf_puts(&sql, "DELETE o FROM `" GIT2_ODB_TABLE_NAME "` o JOIN `"
+		     GIT2_ODB_ARCHIVE_TABLE_NAME "` a ON a.`oid` = o.`oid`"
+		     " WHERE o.`oid` IN (");
+	put_oid_list(&sql, state->oids, state->count);
+	git_buf_putc(&sql, ')');
+	if ((error = run_buf(db, &sql)) < 0) {
+		goto done;
+	}
+	*archived = (size_t) mysql_affected_rows(db);
+
+	// a promoted object starts over with the time it comes back
+	git_buf_clear(&sql);
+	git_buf_puts(&sql, "DELETE FROM `" GIT2_ODB_ACCESS_TABLE_NAME
+		     "` WHERE `oid` IN (");
+	put_oid_list(&sql, state->oids, state->count);
+	git_buf_putc(&sql, ')');
+	error = run_buf(db, &sql);
+
+ done:
+	git_buf_free(&sql);
+	return error;
+}
+
+/* go through the next rows of the hot table; `found` is 0 at its end */
+static int step(tier_state * state, size_t * found)
+{
+	MYSQL *db = state->backend->db;
+	git_buf sql = GIT_BUF_INIT;
+	struct timespec start;
+	size_t archived = 0, i;
+	int error;
+
+	*found = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	git_buf_puts(&sql, "SELECT `oid` FROM `" GIT2_ODB_TABLE_NAME
+		     "` WHERE `oid` > ");
+	mysql_buf_put_oid(&sql, &state->last_oid);
+	git_buf_printf(&sql, " ORDER BY `oid` LIMIT %llu",
+		       (unsigned long long)state->opts.batch_size);
+	if ((error = select_oids(state, &sql)) < 0 || state->count == 0) {
+		goto done;
+	}
+
+	*found = state->count;
+	git_oid_cpy(&state->last_oid, &state->oids[state->count - 1]);
+
+	// objects never read count from now on, like freshly written ones
+	git_buf_clear(&sql);
+	git_buf_puts(&sql, "INSERT IGNORE INTO `" GIT2_ODB_ACCESS_TABLE_NAME
+		     "` (`oid`) VALUES ");
+	for (i = 0; i < state->count; i++) {
+		git_buf_puts(&sql, i ? ",(" : "(");
+		mysql_buf_put_oid(&sql, &state->oids[i]);
+		git_buf_putc(&sql, ')');
+	}
+	if ((error = run_buf(db, &sql)) < 0) {
+		goto done;
+	}
+
+	git_buf_clear(&sql);
+	git_buf_printf(&sql, "SELECT `oid` FROM `" GIT2_ODB_ACCESS_TABLE_NAME
+		       "` WHERE `last_access` < NOW() - INTERVAL %u SECOND"
+		       " AND `oid` IN (", state->opts.cold_after);
+	put_oid_list(&sql, state->oids, state->count);
+	git_buf_putc(&sql, ')');
+	if ((error = select_oids(state, &sql)) < 0 || state->count == 0) {
+		goto done;
+	}
+
+	if ((error = archive_cold(state, &archived)) < 0) {
+		goto done;
+	}
+
+	state->stats->archived += archived;
+	throttle(state, archived, &start);
+
+ done:
+	state->stats->scanned += *found;
+	state->rows += *found;
+	git_buf_free(&sql);
+	return error;
+}
+
+/* with the connection entered, for the whole run */
+static int archive(tier_state * state)
+{
+	mysql_tier_stats *stats = state->stats;
+	size_t found;
+	int error;
+
+	// the archive and access tables come with tiering
+	if (state->backend->tier_sample_rate == 0) {
+		giterr_set_str(GITERR_ODB,
+			       "Tiering is not enabled on the MySql ODB backend");
+		return GIT_ERROR;
+	}
+
+	if ((state->oids = malloc(state->opts.batch_size * sizeof(git_oid))) ==
+	    NULL) {
+		giterr_set_oom();
+		return GIT_ERROR;
+	}
+
+	if ((error = init_tables(state->backend->db)) < 0 ||
+	    (error = lock_tier(state->backend->db)) < 0) {
+		free(state->oids);
+		return error;
+	}
+
+	if ((error = read_state(state)) == GIT_OK) {
+		do {
+			if ((error = step(state, &found)) < 0) {
+				break;
+			}
+
+			if (found == 0) {
+				memset(&state->last_oid, 0, sizeof(git_oid));
+				stats->done = 1;
+			}
+
+			error = write_state(state);
+		} while (error == GIT_OK && !stats->done &&
+			 (state->opts.max_rows == 0 ||
+			  state->rows < state->opts.max_rows));
+	}
+
+	unlock_tier(state->backend->db);
+	free(state->oids);
+	return error;
+}
+
+int
+mysql_tier_archive(mysql_tier_stats * stats, git_odb_backend * odb,
+		   const mysql_tier_opts * given_opts)
+{
+	mysql_tier_opts opts = MYSQL_TIER_OPTS_INIT;
+	tier_state state;
+	int error;
+
+	memset(stats, 0, sizeof(*stats));
+	memset(&state, 0, sizeof(state));
+
+	state.opts = opts;
+	if (given_opts != NULL) {
+		state.opts = *given_opts;
+	}
+	if (state.opts.batch_size == 0) {
+		state.opts.batch_size = 500;
+	}
+
+	state.backend = (mysql_odb_backend *) odb;
+	state.stats = stats;
+
+	if ((error = mysql_odb__enter(state.backend)) == GIT_OK) {
+		error = archive(&state);
+		mysql_odb__leave(state.backend);
+	}
+
+	return error;
+}
@@ -0,0 +1,36 @@
+#ifndef MYSQL_TIER_H
+#define MYSQL_TIER_H
+
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+
+/*
+ * The archiver of hot/cold tiering, see mysql_odb_tier.c.
+ *
+ * It goes through `git2_odb` in OID order, in batches, and keeps its place
+ * in `git2_tier_state`, so a run can stop at any point and the next one
+ * carries on. An object with no recorded read gets one with the time it is
+ * first seen. Objects not read for `cold_after` seconds are moved to
+ * `git2_odb_archive`. Moves are throttled to a number of rows per second.
+ * One run at a time holds a named lock.
+ */
+
+typedef struct {
+	unsigned int cold_after;	/* seconds, default 30 days */
+	size_t batch_size;	/* objects per step, default 500 */
+	unsigned int rows_per_second;	/* move throttle, 0 for none */
+	size_t max_rows;	/* stop after this many rows, 0 to finish */
+} mysql_tier_opts;
+
+#define MYSQL_TIER_OPTS_INIT { 30 * 24 * 3600, 500, 1000, 0 }
+
+typedef struct {
+	int done;		/* the whole table was gone through in this run */
+	size_t scanned;
+	size_t archived;
+} mysql_tier_stats;
+
+int mysql_tier_archive(mysql_tier_stats * stats, git_odb_backend * odb,
+		       const mysql_tier_opts * opts);
+
+#endif
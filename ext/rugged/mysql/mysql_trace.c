@@ -0,0 +1,336 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "mysql_trace.h"
+
+#define TRACE_RECORD_BUFFER (64 * 1024)
+#define TRACE_RECORD_MAX_FIXED 64	/* two bytes, six varints */
+
+volatile int mysql_trace__enabled = 0;
+
+static struct {
+	mysql_trace_cb start;
+	mysql_trace_cb finish;
+	void *payload;
+	unsigned int sample_rate;
+} hooks;
+
+static __thread unsigned int sample_tick;
+
+static const char *op_names[MYSQL_TRACE_OP__COUNT] = {
+	NULL,
+	"odb.read",
+	"odb.read_header",
+	"odb.exists",
+	"odb.write",
+	"refdb.exists",
+	"refdb.lookup",
+	"refdb.iterator",
+	"refdb.write",
+	"refdb.delete",
+	"refdb.rename",
+	"refdb.compress",
+	"refdb.advertise",
+	"odb.read_range",
+};
+
+static volatile int recording = 0;
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+
+static struct {
+	pthread_mutex_t lock;
+	int fd;
+	int failed;
+	uint64_t started_ns;
+	unsigned int threads;
+	size_t used;
+	unsigned char buf[TRACE_RECORD_BUFFER];
+} recorder = {
+PTHREAD_MUTEX_INITIALIZER, -1};
+
+static __thread unsigned int record_thread;
+
+uint64_t mysql_trace_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static void update_enabled(void)
+{
+	__sync_synchronize();
+	mysql_trace__enabled = (hooks.start != NULL || hooks.finish != NULL ||
+				recording);
+}
+
+int
+mysql_trace_set_hooks(mysql_trace_cb start, mysql_trace_cb finish,
+		      void *payload, unsigned int sample_rate)
+{
+	mysql_trace__enabled = recording;
+	__sync_synchronize();
+
+	hooks.start = start;
+	hooks.finish = finish;
+	hooks.payload = payload;
+	hooks.sample_rate = sample_rate > 1 ? sample_rate : 1;
+
+	update_enabled();
+
+	return 0;
+}
+
+void mysql_trace_clear_hooks(void)
+{
+	mysql_trace_set_hooks(NULL, NULL, NULL, 1);
+}
+
+const char *mysql_trace_op_name(int op)
+{
+	if (op <= 0 || op >= MYSQL_TRACE_OP__COUNT)
+		return NULL;
+
+	return op_names[op];
+}
+
+int mysql_trace_op_code(const char *name)
+{
+	int op;
+
+	for (op = 1; op < MYSQL_TRACE_OP__COUNT; op++) {
+		if (strcmp(op_names[op], name) == 0)
+			return op;
+	}
+
+	return 0;
+}
+
+/* called with the recorder lock held */
+static void record_flush(void)
+{
+	size_t done = 0;
+
+	while (done < recorder.used && !recorder.failed) {
+		ssize_t n = write(recorder.fd, recorder.buf + done,
+				  recorder.used - done);
+
+		if (n < 0 && errno != EINTR)
+			recorder.failed = 1;
+		else if (n > 0)
+			done += (size_t) n;
+	}
+
+	recorder.used = 0;
+}
+
+static unsigned char *put_varint(unsigned char *p, uint64_t value)
+{
+	while (value >= 0x80) {
+		*p++ = (unsigned char)(value | 0x80);
+		value >>= 7;
+	}
+	*p++ = (unsigned char)value;
+
+	return p;
+}
+
+static void record_event(const mysql_trace_span * span)
+{
+	const mysql_trace_event *event = &span->event;
+	size_t name_len = event->refname ? strlen(event->refname) : 0;
+	size_t max_len = TRACE_RECORD_MAX_FIXED + GIT_OID_RAWSZ + name_len;
+	unsigned char *p, flags = 0;
+	int op = mysql_trace_op_code(event->operation);
+
+	if (op == 0 || max_len > TRACE_RECORD_BUFFER)
+		return;
+
+	if (event->oid != NULL)
+		flags |= MYSQL_TRACE_HAS_OID;
+	if (event->refname != NULL)
+		flags |= MYSQL_TRACE_HAS_REFNAME;
+	if (event->error < 0)
+		flags |= MYSQL_TRACE_HAS_ERROR;
+
+	pthread_mutex_lock(&recorder.lock);
+
+	// stopped since the operation started
+	if (recorder.fd < 0) {
+		pthread_mutex_unlock(&recorder.lock);
+		return;
+	}
+
+	if (record_thread == 0)
+		record_thread = ++recorder.threads;
+
+	if (recorder.used + max_len > TRACE_RECORD_BUFFER)
+		record_flush();
+
+	p = recorder.buf + recorder.used;
+	*p++ = (unsigned char)op;
+	*p++ = flags;
+	p = put_varint(p, record_thread);
+	p = put_varint(p, span->started_ns > recorder.started_ns ?
+		       span->started_ns - recorder.started_ns : 0);
+	p = put_varint(p, event->duration_ns);
+	p = put_varint(p, event->bytes);
+	p = put_varint(p, event->rows);
+
+	if (flags & MYSQL_TRACE_HAS_ERROR)
+		p = put_varint(p, (uint64_t) - event->error);
+
+	if (flags & MYSQL_TRACE_HAS_OID) {
+		memcpy(p, event->oid->id, GIT_OID_RAWSZ);
+		p += GIT_OID_RAWSZ;
+	}
+
+	if (flags & MYSQL_TRACE_HAS_REFNAME) {
+		p = put_varint(p, name_len);
+		memcpy(p, event->refname, name_len);
+		p += name_len;
+	}
+
+	recorder.used = (size_t) (p - recorder.buf);
+
+	pthread_mutex_unlock(&recorder.lock);
+}
+
+/* the buffer holds records of the parent, it writes them itself */
+static void record_atfork_child(void)
+{
+	pthread_mutex_init(&recorder.lock, NULL);
+
+	if (recorder.fd >= 0) {
+		close(recorder.fd);
+		recorder.fd = -1;
+	}
+	recorder.used = 0;
+	recording = 0;
+	update_enabled();
+}
+
+static void record_register_atfork(void)
+{
+	pthread_atfork(NULL, NULL, record_atfork_child);
+}
+
+int mysql_trace_record_start(const char *path)
+{
+	int fd;
+
+	pthread_once(&atfork_once, record_register_atfork);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		giterr_set_str(GITERR_OS, "Failed to open the trace recording");
+		return GIT_ERROR;
+	}
+
+	pthread_mutex_lock(&recorder.lock);
+
+	if (recorder.fd >= 0) {
+		pthread_mutex_unlock(&recorder.lock);
+		close(fd);
+		unlink(path);
+		giterr_set_str(GITERR_INVALID, "A trace recording is running");
+		return GIT_ERROR;
+	}
+
+	recorder.fd = fd;
+	recorder.failed = 0;
+	recorder.threads = 0;
+	recorder.started_ns = mysql_trace_now_ns();
+
+	memcpy(recorder.buf, MYSQL_TRACE_FILE_MAGIC, 8);
+	recorder.used = 8;
+
+	// threads are numbered again in each recording
+	record_thread = 0;
+
+	pthread_mutex_unlock(&recorder.lock);
+
+	recording = 1;
+	update_enabled();
+
+	return GIT_OK;
+}
+
+int mysql_trace_record_stop(void)
+{
+	int error = GIT_OK;
+
+	recording = 0;
+	update_enabled();
+
+	pthread_mutex_lock(&recorder.lock);
+
+	if (recorder.fd >= 0) {
+		record_flush();
+		if (close(recorder.fd) < 0)
+			recorder.failed = 1;
+		recorder.fd = -1;
+
+		if (recorder.failed) {
+			giterr_set_str(GITERR_OS,
+				       "Failed to write the trace recording");
+			error = GIT_ERROR;
+		}
+	}
+
+	pthread_mutex_unlock(&recorder.lock);
+
+	return error;
+}
+
+void
+mysql_trace__begin(mysql_trace_span * span, const char *operation,
+		   const git_oid * oid, const char *refname)
+{
+	int hooked = hooks.start != NULL || hooks.finish != NULL;
+
+	if (hooked && hooks.sample_rate > 1 &&
+	    (sample_tick++ % hooks.sample_rate) != 0)
+		hooked = 0;
+
+	if (!hooked && !recording)
+		return;
+
+	memset(&span->event, 0, sizeof(span->event));
+	span->event.operation = operation;
+	span->event.oid = oid;
+	span->event.refname = refname;
+
+	// keep the hooks we started with, so a concurrent clear cannot
+	// hand the finish event to a different payload
+	span->finish = hooked ? hooks.finish : NULL;
+	span->payload = hooks.payload;
+	span->recorded = recording;
+	span->sampled = 1;
+
+	if (hooked && hooks.start != NULL)
+		hooks.start(&span->event, span->payload);
+
+	span->started_ns = mysql_trace_now_ns();
+}
+
+void
+mysql_trace__end(mysql_trace_span * span, size_t bytes, unsigned long rows,
+		 int error)
+{
+	span->event.duration_ns = mysql_trace_now_ns() - span->started_ns;
+	span->event.bytes = bytes;
+	span->event.rows = rows;
+	span->event.error = error;
+
+	if (span->finish != NULL)
+		span->finish(&span->event, span->payload);
+
+	if (span->recorded)
+		record_event(span);
+}
@@ -0,0 +1,126 @@
+#ifndef MYSQL_TRACE_H
+#define MYSQL_TRACE_H
+
+#include <stdint.h>
+#include <git2.h>
+
+/*
+ * Tracing hooks around every backend operation.
+ *
+ * A single pair of start/finish callbacks can be registered per process.
+ * When no hook is registered each instrumented operation only tests one
+ * global flag; with a sample rate of N only every Nth operation (per
+ * thread) is timed and reported.
+ */
+
+typedef struct {
+	const char *operation;	/* "odb.read", "refdb.lookup", ... */
+	const git_oid *oid;	/* NULL for reference operations */
+	const char *refname;	/* NULL for object operations */
+	size_t bytes;		/* payload bytes read or written */
+	unsigned long rows;	/* rows returned or affected */
+	uint64_t duration_ns;	/* always 0 in the start callback */
+	int error;		/* libgit2 error code, 0 on success */
+} mysql_trace_event;
+
+typedef void (*mysql_trace_cb) (const mysql_trace_event * event,
+				void *payload);
+
+typedef struct {
+	mysql_trace_event event;
+	mysql_trace_cb finish;
+	void *payload;
+	uint64_t started_ns;
+	int sampled;		/* for the hooks, or the recording */
+	int recorded;
+} mysql_trace_span;
+
+extern volatile int mysql_trace__enabled;
+
+/*
+ * Register the hooks. Either callback may be NULL. A sample_rate of 0 or 1
+ * traces every operation. Hooks are process wide and should be installed
+ * before operations are issued from other threads.
+ */
+int mysql_trace_set_hooks(mysql_trace_cb start, mysql_trace_cb finish,
+			  void *payload, unsigned int sample_rate);
+void mysql_trace_clear_hooks(void);
+
+uint64_t mysql_trace_now_ns(void);
+
+/*
+ * Trace recording.
+ *
+ * While a recording runs, every instrumented operation, whatever the
+ * sample rate of the hooks, is appended to a binary file that
+ * mysql_replay.h can play back. Records are buffered and written 64KB at
+ * a time under one lock. A forked child does not record into its
+ * parent's file; it can start a recording of its own.
+ *
+ * The file starts with the 8 bytes of MYSQL_TRACE_FILE_MAGIC. Each record
+ * is, in order:
+ *
+ *   byte      operation, MYSQL_TRACE_OP_*
+ *   byte      flags, MYSQL_TRACE_HAS_*
+ *   varint    thread, numbered in the order threads first record
+ *   varint    start, in ns since the recording started
+ *   varint    duration_ns
+ *   varint    bytes
+ *   varint    rows
+ *   varint    -error, with MYSQL_TRACE_HAS_ERROR
+ *   20 bytes  oid, with MYSQL_TRACE_HAS_OID
+ *   varint    length, then the refname, with MYSQL_TRACE_HAS_REFNAME
+ *
+ * Varints are LEB128: 7 bits a byte, lowest first. Records are written as
+ * operations finish, so their starts are not quite in order.
+ */
+
+#define MYSQL_TRACE_FILE_MAGIC "RMTRACE1"
+
+enum {
+	MYSQL_TRACE_OP_ODB_READ = 1,
+	MYSQL_TRACE_OP_ODB_READ_HEADER,
+	MYSQL_TRACE_OP_ODB_EXISTS,
+	MYSQL_TRACE_OP_ODB_WRITE,
+	MYSQL_TRACE_OP_REFDB_EXISTS,
+	MYSQL_TRACE_OP_REFDB_LOOKUP,
+	MYSQL_TRACE_OP_REFDB_ITERATOR,
+	MYSQL_TRACE_OP_REFDB_WRITE,
+	MYSQL_TRACE_OP_REFDB_DELETE,
+	MYSQL_TRACE_OP_REFDB_RENAME,
+	MYSQL_TRACE_OP_REFDB_COMPRESS,
+	MYSQL_TRACE_OP_REFDB_ADVERTISE,
+	MYSQL_TRACE_OP_ODB_READ_RANGE,
+	MYSQL_TRACE_OP__COUNT
+};
+
+#define MYSQL_TRACE_HAS_OID 1
+#define MYSQL_TRACE_HAS_REFNAME 2
+#define MYSQL_TRACE_HAS_ERROR 4
+
+/* the "odb.read", ... name of an operation code, and back; 0 if unknown */
+const char *mysql_trace_op_name(int op);
+int mysql_trace_op_code(const char *name);
+
+/* start recording to `path`, which is truncated */
+int mysql_trace_record_start(const char *path);
+/* write out what is buffered and close the file */
+int mysql_trace_record_stop(void);
+
+void mysql_trace__begin(mysql_trace_span * span, const char *operation,
+			const git_oid * oid, const char *refname);
+void mysql_trace__end(mysql_trace_span * span, size_t bytes,
+		      unsigned long rows, int error);
+
+#define MYSQL_TRACE_START(span, operation, oid, refname) do { \
+	(span)->sampled = 0; \
+	if (mysql_trace__enabled) \
+		mysql_trace__begin((span), (operation), (oid), (refname)); \
+} while (0)
+
+#define MYSQL_TRACE_FINISH(span, bytes, rows, error) do { \
+	if ((span)->sampled) \
+		mysql_trace__end((span), (bytes), (rows), (error)); \
+} while (0)
+
+#endif
@@ -1,13 +1,57 @@
+#include <ruby.h>
+#include <ruby/thread.h>
+
 #include "rugged_mysql.h"
 
 VALUE rb_mRugged;
 VALUE rb_mRuggedMysql;
 VALUE rb_cRuggedBackend;
 
+/* set while this thread runs without the GVL */
+static __thread int released;
+
+void rugged_mysql_without_gvl(void *(*func) (void *), void *data)
+{
+	int was = released;
+
+	released = 1;
+	rb_thread_call_without_gvl(func, data, RUBY_UBF_IO, NULL);
+	released = was;
+}
+
+void rugged_mysql_with_gvl(void *(*func) (void *), void *data)
+{
+	int was = released;
+
+	released = 0;
+	rb_thread_call_with_gvl(func, data);
+	released = was;
+}
+
+/* native threads of ours never hold it */
+int rugged_mysql_has_gvl(void)
+{
+	return ruby_native_thread_p() && !released;
+}
+
 void Init_rugged_mysql(void)
 {
 	rb_mRugged = rb_const_get(rb_cObject, rb_intern("Rugged"));
 	rb_cRuggedBackend = rb_const_get(rb_mRugged, rb_intern("Backend"));
 	rb_mRuggedMysql = rb_const_get(rb_mRugged, rb_intern("Mysql"));
 	Init_rugged_mysql_backend();
+	Init_rugged_mysql_trace();
+	Init_rugged_mysql_commit_graph();
+	Init_rugged_mysql_pipeline();
+	Init_rugged_mysql_fetch();
+	Init_rugged_mysql_import();
+	Init_rugged_mysql_export();
+	Init_rugged_mysql_gc();
+	Init_rugged_mysql_pool();
+	Init_rugged_mysql_tier();
+	Init_rugged_mysql_refdb();
+	Init_rugged_mysql_stats();
+	Init_rugged_mysql_replay();
+	Init_rugged_mysql_meta();
+	Init_rugged_mysql_path_history();
 }
@@ -1,4 +1,70 @@
 #include <ruby.h>
+#include <git2.h>
+#include <git2/sys/odb_backend.h>
+#include <git2/sys/refdb_backend.h>
+
+typedef struct _rugged_backend {
+	int (*odb_backend) (git_odb_backend ** backend_out,
+			    struct _rugged_backend * backend);
+	int (*refdb_backend) (git_refdb_backend ** backend_out,
+			      struct _rugged_backend * backend);
+} rugged_backend;
+
+typedef struct {
+	rugged_backend backend;
+	char *host;
+	int port;
+	char *socket;
+	char *username;
+	char *password;
+	char *database;
+	char *disk_cache;
+	size_t disk_cache_size;
+	char *shared_cache;	/* shm name, instead of disk_cache */
+	int packed;
+	size_t pack_segment_size;
+	int layout;		/* GIT_ODB_MYSQL_LAYOUT_* of a new git2_odb */
+	int commit_graph;
+	int path_history;
+	unsigned int prefetch_depth;
+	size_t prefetch_memory;
+	int header_index;
+	char *pool;
+	int pool_policy;
+	unsigned int tier_sample_rate;	/* 0 without tiering */
+	int statistics;
+	int ref_snapshot;
+	int peel_refs;
+	int share_connection;
+	char *write_behind;	/* journal directory, NULL to write directly */
+	git_odb_backend *odb;	/* created on first use by the query methods */
+} rugged_mysql_backend;
+
+extern VALUE rb_cRuggedMysqlBackend;
+
+git_odb_backend *rugged_mysql_backend_odb(rugged_mysql_backend * backend);
+
+/*
+ * rb_thread_call_without_gvl() and rb_thread_call_with_gvl(), keeping track
+ * of whether the calling thread holds the GVL for rugged_mysql_has_gvl().
+ */
+void rugged_mysql_without_gvl(void *(*func) (void *), void *data);
+void rugged_mysql_with_gvl(void *(*func) (void *), void *data);
+int rugged_mysql_has_gvl(void);
 
 void Init_rugged_mysql(void);
 void Init_rugged_mysql_backend(void);
+void Init_rugged_mysql_trace(void);
+void Init_rugged_mysql_commit_graph(void);
+void Init_rugged_mysql_pipeline(void);
+void Init_rugged_mysql_fetch(void);
+void Init_rugged_mysql_import(void);
+void Init_rugged_mysql_export(void);
+void Init_rugged_mysql_gc(void);
+void Init_rugged_mysql_pool(void);
+void Init_rugged_mysql_tier(void);
+void Init_rugged_mysql_refdb(void);
+void Init_rugged_mysql_stats(void);
+void Init_rugged_mysql_replay(void);
+void Init_rugged_mysql_meta(void);
+void Init_rugged_mysql_path_history(void);
@@ -4,6 +4,8 @@
 #include <rugged.h>
 
 #include "rugged_mysql.h"
+#include "mysql_odb_backend.h"
+#include "mysql_refdb_backend.h"
 
 extern VALUE rb_mRuggedMysql;
 extern VALUE rb_cRuggedBackend;
@@ -14,23 +16,6 @@ int git_odb__error_ambiguous(char *);
 int git_odb__error_notfound(char *);
 int git_odb__error_ambiguous(char *);
 
-typedef struct _rugged_backend {
-	int (*odb_backend) (git_odb_backend ** backend_out,
-			    struct _rugged_backend * backend);
-	int (*refdb_backend) (git_refdb_backend ** backend_out,
-			      struct _rugged_backend * backend);
-} rugged_backend;
-
-typedef struct {
-	rugged_backend backend;
-	char *host;
-	int port;
-	char *socket;
-	char *username;
-	char *password;
-	char *database;
-} rugged_mysql_backend;
-
 static void rb_rugged_mysql_backend__free(rugged_mysql_backend * backend)
 {
 	free(backend->host);
@@ -40,21 +25,125 @@ static void rb_rugged_mysql_backend__free(rugged_mysql_backend * backend)
 		free(backend->password);
 	}
 	free(backend->database);
+	free(backend->disk_cache);
+	free(backend->shared_cache);
+	free(backend->pool);
+	free(backend->write_behind);
+	if (backend->odb != NULL) {
+		backend->odb->free(backend->odb);
+	}
 	free(backend);
 }
 
+static int
+rugged_mysql__new_odb(git_odb_backend ** backend_out,
+		      rugged_mysql_backend * rugged_backend, int shared)
+{
+	int error;
+
+	error = git_odb_backend_mysql(backend_out, rugged_backend->host,
+				      rugged_backend->port,
+				      rugged_backend->socket,
+				      rugged_backend->database,
+				      rugged_backend->username,
+				      rugged_backend->password, 0);
+	if (error < 0) {
+		return error;
+	}
+
+	if (shared) {
+		error = git_odb_backend_mysql_set_shared_connection(*backend_out,
+				1);
+	}
+
+	if (error == GIT_OK) {
+		error = git_odb_backend_mysql_set_layout(*backend_out,
+				rugged_backend->layout);
+	}
+
+	if (error == GIT_OK && rugged_backend->disk_cache != NULL) {
+		error = git_odb_backend_mysql_set_disk_cache(*backend_out,
+				rugged_backend->disk_cache,
+				rugged_backend->disk_cache_size);
+	} else if (error == GIT_OK && rugged_backend->shared_cache != NULL) {
+		error = git_odb_backend_mysql_set_shared_cache(*backend_out,
+				rugged_backend->shared_cache,
+				rugged_backend->disk_cache_size);
+	}
+
+	if (error == GIT_OK && rugged_backend->packed) {
+		error = git_odb_backend_mysql_set_packed(*backend_out,
+				rugged_backend->pack_segment_size);
+	}
+
+	if (error == GIT_OK && rugged_backend->prefetch_depth > 0) {
+		error = git_odb_backend_mysql_set_prefetch(*backend_out,
+				rugged_backend->prefetch_depth,
+				rugged_backend->prefetch_memory);
+	}
+
+	if (error == GIT_OK && rugged_backend->commit_graph) {
+		error = git_odb_backend_mysql_set_commit_graph(*backend_out, 1);
+	}
+
+	if (error == GIT_OK && rugged_backend->path_history) {
+		error = git_odb_backend_mysql_set_path_history(*backend_out, 1);
+	}
+
+	if (error == GIT_OK && rugged_backend->pool != NULL) {
+		error = git_odb_backend_mysql_set_pool(*backend_out,
+				rugged_backend->pool,
+				rugged_backend->pool_policy);
+	}
+
+	if (error == GIT_OK && rugged_backend->tier_sample_rate > 0) {
+		error = git_odb_backend_mysql_set_tiering(*backend_out,
+				rugged_backend->tier_sample_rate);
+	}
+
+	if (error == GIT_OK && rugged_backend->statistics) {
+		error = git_odb_backend_mysql_set_statistics(*backend_out, 1);
+	}
+
+	// after the settings the journaled objects are stored with
+	if (error == GIT_OK && rugged_backend->write_behind != NULL) {
+		error = git_odb_backend_mysql_set_write_behind(*backend_out,
+				rugged_backend->write_behind);
+	}
+
+	// after set_packed, so the scan covers both tables
+	if (error == GIT_OK && rugged_backend->header_index) {
+		error = git_odb_backend_mysql_set_header_index(*backend_out, 1);
+	}
+
+	if (error < 0) {
+		(*backend_out)->free(*backend_out);
+	}
+
+	return error;
+}
+
 static int
 rugged_mysql__odb_backend(git_odb_backend ** backend_out,
 			  rugged_backend * backend)
 {
 	rugged_mysql_backend *rugged_backend = (rugged_mysql_backend *) backend;
 
-	return git_odb_backend_mysql(backend_out, rugged_backend->host,
-				     rugged_backend->port,
-				     rugged_backend->socket,
-				     rugged_backend->username,
-				     rugged_backend->password,
-				     rugged_backend->database, NULL);
+	return rugged_mysql__new_odb(backend_out, rugged_backend,
+				     rugged_backend->share_connection);
+}
+
+git_odb_backend *rugged_mysql_backend_odb(rugged_mysql_backend * backend)
+{
+	// a connection of its own, the query methods hold it for long
+	if (backend->odb == NULL &&
+	    rugged_mysql__new_odb(&backend->odb, backend, 0) < 0) {
+		backend->odb = NULL;
+		rugged_exception_check(GIT_ERROR);
+	}
+
+	// the query methods enter the connection themselves
+	return backend->odb;
 }
 
 static int
@@ -62,20 +151,66 @@ rugged_mysql__refdb_backend(git_refdb_backend ** backend_out,
 			    rugged_backend * backend)
 {
 	rugged_mysql_backend *rugged_backend = (rugged_mysql_backend *) backend;
+	git_odb_backend *odb;
+	int error;
+
+	error = git_refdb_backend_mysql(backend_out, rugged_backend->host,
+					rugged_backend->port,
+					rugged_backend->socket,
+					rugged_backend->database,
+					rugged_backend->username,
+					rugged_backend->password, 0);
+	if (error < 0) {
+		return error;
+	}
+
+	if (rugged_backend->share_connection) {
+		error = git_refdb_backend_mysql_set_shared_connection
+		    (*backend_out, 1);
+	}
+
+	if (error == GIT_OK && rugged_backend->ref_snapshot) {
+		error = git_refdb_backend_mysql_set_snapshot(*backend_out, 1);
+	}
+
+	// a connection of its own, the refdb frees it
+	if (error == GIT_OK && rugged_backend->peel_refs &&
+	    (error = rugged_mysql__new_odb(&odb, rugged_backend, 0)) ==
+	    GIT_OK) {
+		error = git_refdb_backend_mysql_set_odb(*backend_out, odb);
+	}
 
-	return git_refdb_backend_mysql(backend_out, rugged_backend->host,
-				       rugged_backend->port,
-				       rugged_backend->socket,
-				       rugged_backend->username,
-				       rugged_backend->password,
-				       rugged_backend->database, NULL);
+	if (error < 0) {
+		(*backend_out)->free(*backend_out);
+	}
+
+	return error;
 }
 
 static rugged_mysql_backend *rugged_mysql_backend_new(char *host, int port,
 						      char *socket,
 						      char *username,
 						      char *password,
-						      char *database)
+						      char *database,
+						      char *disk_cache,
+						      size_t disk_cache_size,
+						      char *shared_cache,
+						      int packed,
+						      size_t pack_segment_size,
+						      int layout,
+						      int commit_graph,
+						      int path_history,
+						      unsigned int prefetch_depth,
+						      size_t prefetch_memory,
+						      int header_index,
+						      char *pool,
+						      int pool_policy,
+						      unsigned int tier_sample_rate,
+						      int statistics,
+						      int ref_snapshot,
+						      int peel_refs,
+						      int share_connection,
+						      char *write_behind)
 {
 	rugged_mysql_backend *mysql_backend =
 	    malloc(sizeof(rugged_mysql_backend));
@@ -88,6 +223,30 @@ static rugged_mysql_backend *rugged_mysql_backend_new(char *host, int port,
 	mysql_backend->socket = strdup(socket);
 	mysql_backend->username = strdup(username);
 	mysql_backend->password = password == NULL ? NULL : strdup(password);
+	mysql_backend->database = strdup(database);
+	mysql_backend->disk_cache =
+	    disk_cache == NULL ? NULL : strdup(disk_cache);
+	mysql_backend->disk_cache_size = disk_cache_size;
+	mysql_backend->shared_cache =
+	    shared_cache == NULL ? NULL : strdup(shared_cache);
+	mysql_backend->packed = packed;
+	mysql_backend->pack_segment_size = pack_segment_size;
+	mysql_backend->layout = layout;
+	mysql_backend->commit_graph = commit_graph;
+	mysql_backend->path_history = path_history;
+	mysql_backend->prefetch_depth = prefetch_depth;
+	mysql_backend->prefetch_memory = prefetch_memory;
+	mysql_backend->header_index = header_index;
+	mysql_backend->pool = pool == NULL ? NULL : strdup(pool);
+	mysql_backend->pool_policy = pool_policy;
+	mysql_backend->tier_sample_rate = tier_sample_rate;
+	mysql_backend->statistics = statistics;
+	mysql_backend->ref_snapshot = ref_snapshot;
+	mysql_backend->peel_refs = peel_refs;
+	mysql_backend->share_connection = share_connection;
+	mysql_backend->write_behind =
+	    write_behind == NULL ? NULL : strdup(write_behind);
+	mysql_backend->odb = NULL;
 
 	return mysql_backend;
 }
@@ -101,16 +260,86 @@ opts - hash containing the connection options.
 :socket - (optional) string, default /var/run/mysqld/mysqld.sock
 :username - (optional) string, default root
 :database - string
+:disk_cache - (optional) string, path of a local object cache file shared
+  by all processes on the host, default none
+:disk_cache_size - (optional) integer, size of that file (or of the
+  shared cache) in bytes, default 256MB
+:shared_cache - (optional) string, POSIX shared memory name such as
+  "/git-objects" of an object cache shared by forked workers, instead of
+  :disk_cache, default none
+:storage - (optional) symbol, :packed keeps pushed packs as large segments
+  in git2_packs instead of one row per object, default :loose
+:pack_segment_size - (optional) integer, bytes per segment, default 2MB
+:layout - (optional) symbol, how a new git2_odb is clustered: :sequential
+  by an auto-increment id, so objects written together share pages, or
+  :oid, default :oid
+:commit_graph - (optional) boolean, keep git2_commit_graph up to date for
+  history queries, default false
+:path_history - (optional) boolean, queue written commits for
+  git2_path_history, see backfill_path_history, turns on :commit_graph too,
+  default false
+:prefetch_depth - (optional) integer, load the entries of every tree read
+  in the background, this many levels deep, default 0 (off)
+:prefetch_memory - (optional) integer, bytes of prefetched objects held
+  at once, default 64MB
+:header_index - (optional) boolean, keep the type and size of every object
+  in memory (about 28 bytes each) for read_header and exists, default false
+:pool - (optional) string, database of an object pool shared with forks
+  on the same server, read after this repository's own objects,
+  default none
+:pool_writes - (optional) symbol, which new objects go to the pool:
+  :existing only those already there, :all every one, or :local none,
+  default :existing
+:tiering - (optional) boolean, move objects nobody reads to
+  git2_odb_archive with archive_cold, default false
+:access_sample_rate - (optional) integer, record one in this many reads
+  for tiering, default 64
+:statistics - (optional) boolean, keep the number and size of the objects
+  of each type in git2_stats; this turns them on for the database, and
+  every backend that connects to it then keeps them, default false
+:ref_snapshot - (optional) boolean, also keep all refs in one compressed
+  blob plus a table of recent changes, for fast full listings; this turns
+  it on for the database, and every backend on it then uses it, default
+  false
+:peel_refs - (optional) boolean, store the peeled target of every tag ref
+  as it is written, for advertise_refs, default false
+:share_connection - (optional) boolean, let the repositories opened with
+  this backend use one MySQL connection per process, opened on first use,
+  default true
+:write_behind - (optional) string, local directory of a journal that
+  objects are written to, and stored in MySQL from in the background,
+  default none
 */
 static VALUE rb_rugged_mysql_backend_new(VALUE klass, VALUE rb_opts)
 {
 	VALUE val;
-	char *host;
+	char *host = "localhost";
 	char *socket = "/var/run/mysqld/mysqld.sock";
 	char *database;
 	char *username = "root";
 	char *password = NULL;
 	int port = 3306;
+	char *disk_cache = NULL;
+	size_t disk_cache_size = 256 * 1024 * 1024;
+	char *shared_cache = NULL;
+	int packed = 0;
+	size_t pack_segment_size = 0;
+	int layout = GIT_ODB_MYSQL_LAYOUT_OID;
+	int commit_graph = 0;
+	int path_history = 0;
+	unsigned int prefetch_depth = 0;
+	size_t prefetch_memory = 64 * 1024 * 1024;
+	int header_index = 0;
+	char *pool = NULL;
+	int pool_policy = GIT_ODB_MYSQL_POOL_EXISTING;
+	int tiering = 0;
+	unsigned int tier_sample_rate = 64;
+	int statistics = 0;
+	int ref_snapshot = 0;
+	int peel_refs = 0;
+	int share_connection = 1;
+	char *write_behind = NULL;
+	rugged_mysql_backend *backend;
 
 	Check_Type(rb_opts, T_HASH);
 
@@ -145,10 +374,250 @@ static VALUE rb_rugged_mysql_backend_new(VALUE klass, VALUE rb_opts)
 	Check_Type(val, T_STRING);
 	database = StringValueCStr(val);
 
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("disk_cache")))) != Qnil) {
+		Check_Type(val, T_STRING);
+		disk_cache = StringValueCStr(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts,
+			  ID2SYM(rb_intern("disk_cache_size")))) != Qnil) {
+		disk_cache_size = NUM2SIZET(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("shared_cache")))) != Qnil) {
+		Check_Type(val, T_STRING);
+		shared_cache = StringValueCStr(val);
+		if (disk_cache != NULL) {
+			rb_raise(rb_eArgError,
+				 "Use either disk_cache or shared_cache");
+		}
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("storage")))) != Qnil) {
+		Check_Type(val, T_SYMBOL);
+		if (SYM2ID(val) == rb_intern("packed")) {
+			packed = 1;
+		} else if (SYM2ID(val) != rb_intern("loose")) {
+			rb_raise(rb_eArgError, "Invalid storage mode");
+		}
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("layout")))) != Qnil) {
+		Check_Type(val, T_SYMBOL);
+		if (SYM2ID(val) == rb_intern("sequential")) {
+			layout = GIT_ODB_MYSQL_LAYOUT_SEQUENTIAL;
+		} else if (SYM2ID(val) != rb_intern("oid")) {
+			rb_raise(rb_eArgError, "Invalid layout");
+		}
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts,
+			  ID2SYM(rb_intern("pack_segment_size")))) != Qnil) {
+		pack_segment_size = NUM2SIZET(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("commit_graph")))) != Qnil) {
+		commit_graph = RTEST(val);
+	}
+
+	// its rows are keyed by generation numbers from the graph
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("path_history")))) != Qnil) {
+		path_history = RTEST(val);
+		commit_graph = commit_graph || path_history;
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts,
+			  ID2SYM(rb_intern("prefetch_depth")))) != Qnil) {
+		prefetch_depth = NUM2UINT(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts,
+			  ID2SYM(rb_intern("prefetch_memory")))) != Qnil) {
+		prefetch_memory = NUM2SIZET(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("header_index")))) != Qnil) {
+		header_index = RTEST(val);
+	}
+
+	if ((val = rb_hash_aref(rb_opts, ID2SYM(rb_intern("pool")))) != Qnil) {
+		Check_Type(val, T_STRING);
+		pool = StringValueCStr(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("pool_writes")))) != Qnil) {
+		Check_Type(val, T_SYMBOL);
+		if (SYM2ID(val) == rb_intern("local")) {
+			pool_policy = GIT_ODB_MYSQL_POOL_LOCAL;
+		} else if (SYM2ID(val) == rb_intern("all")) {
+			pool_policy = GIT_ODB_MYSQL_POOL_ALL;
+		} else if (SYM2ID(val) != rb_intern("existing")) {
+			rb_raise(rb_eArgError, "Invalid pool write policy");
+		}
+	}
+
+	if ((val = rb_hash_aref(rb_opts, ID2SYM(rb_intern("tiering")))) != Qnil) {
+		tiering = RTEST(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts,
+			  ID2SYM(rb_intern("access_sample_rate")))) != Qnil) {
+		tier_sample_rate = NUM2UINT(val);
+		if (tier_sample_rate == 0) {
+			rb_raise(rb_eArgError, "Invalid access sample rate");
+		}
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("statistics")))) != Qnil) {
+		statistics = RTEST(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("ref_snapshot")))) != Qnil) {
+		ref_snapshot = RTEST(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("peel_refs")))) != Qnil) {
+		peel_refs = RTEST(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts,
+			  ID2SYM(rb_intern("share_connection")))) != Qnil) {
+		share_connection = RTEST(val);
+	}
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("write_behind")))) != Qnil) {
+		Check_Type(val, T_STRING);
+		write_behind = StringValueCStr(val);
+	}
+
+	backend = rugged_mysql_backend_new(host, port, socket, username,
+					   password, database, disk_cache,
+					   disk_cache_size, shared_cache,
+					   packed, pack_segment_size, layout,
+					   commit_graph, path_history,
+					   prefetch_depth,
+					   prefetch_memory, header_index, pool,
+					   pool_policy,
+					   tiering ? tier_sample_rate : 0,
+					   statistics, ref_snapshot, peel_refs,
+					   share_connection, write_behind);
+
+	// holds the journal open while the backend lives, repositories
+	// come and go; it connects on first use only
+	if (write_behind != NULL &&
+	    rugged_mysql__new_odb(&backend->odb, backend, 0) < 0) {
+		backend->odb = NULL;
+		rb_rugged_mysql_backend__free(backend);
+		rugged_exception_check(GIT_ERROR);
+	}
+
 	return Data_Wrap_Struct(klass, NULL, rb_rugged_mysql_backend__free,
-				rugged_mysql_backend_new(host, port, socket,
-							 username, password,
-							 database));
+				backend);
+}
+
+typedef struct {
+	git_odb_backend *odb;
+	int error;
+} rugged_mysql_flush_args;
+
+static void *rugged_mysql_flush__without_gvl(void *_args)
+{
+	rugged_mysql_flush_args *args = _args;
+
+	args->error = git_odb_backend_mysql_flush(args->odb);
+	return NULL;
+}
+
+/*
+Public: Wait until the objects written so far are stored in MySQL, with
+write_behind. Other processes and the query methods only find them then.
+Returns nil.
+*/
+static VALUE rb_rugged_mysql_backend_flush_writes(VALUE self)
+{
+	rugged_mysql_backend *backend;
+	rugged_mysql_flush_args args;
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+
+	// without write_behind, nothing is journaled
+	if (backend->odb == NULL) {
+		return Qnil;
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.odb = backend->odb;
+
+	rugged_mysql_without_gvl(rugged_mysql_flush__without_gvl, &args);
+	rugged_exception_check(args.error);
+
+	return Qnil;
+}
+
+/*
+Public: Read part of an object, such as the first lines of a blob for a
+preview or enough of it to tell whether it is binary. Only that part is
+transferred from MySQL and inflated.
+oid - hex OID string
+offset - integer, first byte to read
+length - integer, most bytes to read
+Returns a Hash with :type, :len (the size of the whole object) and :data,
+the bytes read, or nil if the object does not exist.
+*/
+static VALUE rb_rugged_mysql_backend_read_range(VALUE self, VALUE rb_oid,
+						VALUE rb_offset,
+						VALUE rb_length)
+{
+	rugged_mysql_backend *backend;
+	git_oid oid;
+	git_otype type;
+	size_t len, size;
+	void *data;
+	int error;
+	VALUE rb_result;
+
+	Check_Type(rb_oid, T_STRING);
+	rugged_exception_check(git_oid_fromstrn(&oid, RSTRING_PTR(rb_oid),
+						RSTRING_LEN(rb_oid)));
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+
+	error = git_odb_backend_mysql_read_range(&data, &len, &type, &size,
+						 rugged_mysql_backend_odb
+						 (backend), &oid,
+						 NUM2SIZET(rb_offset),
+						 NUM2SIZET(rb_length));
+	if (error == GIT_ENOTFOUND) {
+		giterr_clear();
+		return Qnil;
+	}
+	rugged_exception_check(error);
+
+	rb_result = rb_hash_new();
+	rb_hash_aset(rb_result, CSTR2SYM("type"), rugged_otype_new(type));
+	rb_hash_aset(rb_result, CSTR2SYM("len"), SIZET2NUM(size));
+	rb_hash_aset(rb_result, CSTR2SYM("data"), rb_str_new(data, len));
+	free(data);
+
+	return rb_result;
 }
 
 void Init_rugged_mysql_backend(void)
@@ -158,4 +627,8 @@ void Init_rugged_mysql_backend(void)
 				  rb_cRuggedBackend);
 	rb_define_singleton_method(rb_cRuggedMysqlBackend, "new",
 				   rb_rugged_mysql_backend_new, 1);
+	rb_define_method(rb_cRuggedMysqlBackend, "flush_writes",
+			 rb_rugged_mysql_backend_flush_writes, 0);
+	rb_define_method(rb_cRuggedMysqlBackend, "read_range",
+			 rb_rugged_mysql_backend_read_range, 3);
 }
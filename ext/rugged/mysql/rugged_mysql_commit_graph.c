@@ -0,0 +1,180 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_odb_backend.h"
+#include "mysql_commit_graph.h"
+
+static git_odb_backend *rugged_mysql_commit_graph__odb(VALUE self)
+{
+	rugged_mysql_backend *backend;
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+	return rugged_mysql_backend_odb(backend);
+}
+
+static void rugged_mysql_commit_graph__oid(git_oid * oid, VALUE rb_oid)
+{
+	Check_Type(rb_oid, T_STRING);
+	rugged_exception_check(git_oid_fromstrn(oid, RSTRING_PTR(rb_oid),
+						RSTRING_LEN(rb_oid)));
+}
+
+static int
+rugged_mysql_commit_graph__collect(const mysql_commit_graph_entry * entry,
+				   void *payload)
+{
+	VALUE rb_entry = rb_hash_new();
+	VALUE rb_parents = rb_ary_new2(entry->parent_count);
+	size_t i;
+
+	for (i = 0; i < entry->parent_count; i++) {
+		rb_ary_push(rb_parents, rugged_create_oid(&entry->parents[i]));
+	}
+
+	rb_hash_aset(rb_entry, ID2SYM(rb_intern("oid")),
+		     rugged_create_oid(&entry->oid));
+	rb_hash_aset(rb_entry, ID2SYM(rb_intern("tree")),
+		     rugged_create_oid(&entry->tree));
+	rb_hash_aset(rb_entry, ID2SYM(rb_intern("parents")), rb_parents);
+	rb_hash_aset(rb_entry, ID2SYM(rb_intern("generation")),
+		     UINT2NUM(entry->generation));
+	rb_hash_aset(rb_entry, ID2SYM(rb_intern("time")),
+		     LL2NUM(entry->commit_time));
+
+	rb_ary_push((VALUE) payload, rb_entry);
+	return 0;
+}
+
+/*
+Public: Add rows to git2_commit_graph for commits stored before the graph
+was enabled, and compute their generation numbers.
+limit - (optional) integer, most commits to add, default all
+Returns the number of commits added.
+*/
+static VALUE rb_rugged_mysql_backend_backfill_commit_graph(int argc,
+							   VALUE * argv,
+							   VALUE self)
+{
+	VALUE rb_limit;
+	size_t added, limit = 0;
+
+	rb_scan_args(argc, argv, "01", &rb_limit);
+
+	if (!NIL_P(rb_limit)) {
+		limit = NUM2SIZET(rb_limit);
+	}
+
+	rugged_exception_check(mysql_commit_graph_backfill
+			       (&added, rugged_mysql_commit_graph__odb(self),
+				limit));
+
+	return SIZET2NUM(added);
+}
+
+/*
+Public: List the ancestry of a commit from git2_commit_graph, newest
+generation first, without reading any commit object.
+oid - string, hex OID of the commit to start from
+opts - (optional) hash
+:limit - (optional) integer, most commits to return, default all
+:min_generation - (optional) integer, skip commits below this generation
+Returns an Array of Hashes with :oid, :tree, :parents, :generation and :time.
+*/
+static VALUE rb_rugged_mysql_backend_history(int argc, VALUE * argv,
+					     VALUE self)
+{
+	VALUE rb_oid, rb_opts, val, rb_result;
+	git_oid oid;
+	size_t limit = 0;
+	uint32_t min_generation = 0;
+
+	rb_scan_args(argc, argv, "11", &rb_oid, &rb_opts);
+	rugged_mysql_commit_graph__oid(&oid, rb_oid);
+
+	if (!NIL_P(rb_opts)) {
+		Check_Type(rb_opts, T_HASH);
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("limit")))) != Qnil) {
+			limit = NUM2SIZET(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("min_generation")))) !=
+		    Qnil) {
+			min_generation = NUM2UINT(val);
+		}
+	}
+
+	rb_result = rb_ary_new();
+	rugged_exception_check(mysql_commit_graph_walk
+			       (rugged_mysql_commit_graph__odb(self), &oid, 1,
+				min_generation, limit,
+				rugged_mysql_commit_graph__collect,
+				(void *)rb_result));
+
+	return rb_result;
+}
+
+/*
+Public: Count the commits reachable from only one of two commits.
+local - string, hex OID
+upstream - string, hex OID
+Returns [ahead, behind].
+*/
+static VALUE rb_rugged_mysql_backend_ahead_behind(VALUE self, VALUE rb_local,
+						  VALUE rb_upstream)
+{
+	git_oid local, upstream;
+	size_t ahead, behind;
+
+	rugged_mysql_commit_graph__oid(&local, rb_local);
+	rugged_mysql_commit_graph__oid(&upstream, rb_upstream);
+
+	rugged_exception_check(mysql_commit_graph_ahead_behind
+			       (&ahead, &behind,
+				rugged_mysql_commit_graph__odb(self), &local,
+				&upstream));
+
+	return rb_ary_new3(2, SIZET2NUM(ahead), SIZET2NUM(behind));
+}
+
+/*
+Public: Find a best common ancestor of two commits.
+one - string, hex OID
+two - string, hex OID
+Returns the hex OID of the merge base, or nil if there is none.
+*/
+static VALUE rb_rugged_mysql_backend_merge_base(VALUE self, VALUE rb_one,
+						VALUE rb_two)
+{
+	git_oid one, two, base;
+	int error;
+
+	rugged_mysql_commit_graph__oid(&one, rb_one);
+	rugged_mysql_commit_graph__oid(&two, rb_two);
+
+	error = mysql_commit_graph_merge_base(&base,
+					      rugged_mysql_commit_graph__odb
+					      (self), &one, &two);
+	if (error == GIT_ENOTFOUND) {
+		return Qnil;
+	}
+	rugged_exception_check(error);
+
+	return rugged_create_oid(&base);
+}
+
+void Init_rugged_mysql_commit_graph(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "backfill_commit_graph",
+			 rb_rugged_mysql_backend_backfill_commit_graph, -1);
+	rb_define_method(rb_cRuggedMysqlBackend, "history",
+			 rb_rugged_mysql_backend_history, -1);
+	rb_define_method(rb_cRuggedMysqlBackend, "ahead_behind",
+			 rb_rugged_mysql_backend_ahead_behind, 2);
+	rb_define_method(rb_cRuggedMysqlBackend, "merge_base",
+			 rb_rugged_mysql_backend_merge_base, 2);
+}
@@ -0,0 +1,96 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_export.h"
+
+extern VALUE rb_mRuggedMysql;
+
+typedef struct {
+	git_odb_backend *odb;
+	git_refdb_backend *refdb;
+	const char *dir;
+	mysql_export_opts opts;
+	git_oid name;
+	size_t objects;
+	int error;
+} rugged_mysql_export_args;
+
+static void *rugged_mysql_export__without_gvl(void *_args)
+{
+	rugged_mysql_export_args *args = _args;
+
+	args->error = mysql_export(&args->name, &args->objects, args->odb,
+				   args->refdb, args->dir, &args->opts);
+	return NULL;
+}
+
+/*
+Public: Write the objects stored in MySQL to a packfile and its index.
+backend - Rugged::Mysql::Backend to export from
+dir - string, directory to write pack-<name>.pack and pack-<name>.idx into
+opts - (optional) hash
+:reachable - (optional) boolean, only the objects reachable from the refs,
+  with deltas, default false
+:threads - (optional) integer, delta search threads in reachable mode,
+  default one per CPU
+Returns a Hash with :name, the hex pack name, and :objects.
+*/
+static VALUE rb_rugged_mysql_export(int argc, VALUE * argv, VALUE self)
+{
+	VALUE rb_backend, rb_dir, rb_opts, val, rb_result;
+	rugged_mysql_backend *backend;
+	rugged_mysql_export_args args;
+	mysql_export_opts opts = MYSQL_EXPORT_OPTS_INIT;
+
+	rb_scan_args(argc, argv, "21", &rb_backend, &rb_dir, &rb_opts);
+	if (!rb_obj_is_kind_of(rb_backend, rb_cRuggedMysqlBackend)) {
+		rb_raise(rb_eTypeError,
+			 "Expecting an instance of Rugged::Mysql::Backend");
+	}
+	Check_Type(rb_dir, T_STRING);
+
+	memset(&args, 0, sizeof(args));
+	args.opts = opts;
+
+	if (!NIL_P(rb_opts)) {
+		Check_Type(rb_opts, T_HASH);
+
+		args.opts.reachable =
+		    RTEST(rb_hash_aref(rb_opts, ID2SYM(rb_intern("reachable"))));
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("threads")))) !=
+		    Qnil) {
+			args.opts.threads = NUM2UINT(val);
+		}
+	}
+
+	Data_Get_Struct(rb_backend, rugged_mysql_backend, backend);
+	args.odb = rugged_mysql_backend_odb(backend);
+	args.dir = StringValueCStr(rb_dir);
+
+	if (args.opts.reachable) {
+		rugged_exception_check(backend->backend.refdb_backend
+				       (&args.refdb, &backend->backend));
+	}
+
+	rugged_mysql_without_gvl(rugged_mysql_export__without_gvl, &args);
+	if (args.refdb != NULL) {
+		args.refdb->free(args.refdb);
+	}
+	rugged_exception_check(args.error);
+
+	rb_result = rb_hash_new();
+	rb_hash_aset(rb_result, CSTR2SYM("name"),
+		     rugged_create_oid(&args.name));
+	rb_hash_aset(rb_result, CSTR2SYM("objects"), SIZET2NUM(args.objects));
+
+	return rb_result;
+}
+
+void Init_rugged_mysql_export(void)
+{
+	rb_define_module_function(rb_mRuggedMysql, "export",
+				  rb_rugged_mysql_export, -1);
+}
@@ -0,0 +1,140 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_fetch.h"
+
+typedef struct {
+	git_odb_backend *backend;
+	git_oid *oids;
+	size_t count;
+	unsigned int workers;
+	int ordered;
+	int error;
+	int exception;		/* rb_protect state of the block */
+
+	/* the object being yielded */
+	const git_oid *oid;
+	git_otype type;
+	const void *data;
+	size_t len;
+} rugged_mysql_fetch_args;
+
+static VALUE rugged_mysql_fetch__yield(VALUE _args)
+{
+	rugged_mysql_fetch_args *args = (rugged_mysql_fetch_args *) _args;
+
+	return rb_yield_values(3, rugged_create_oid(args->oid),
+			       rugged_otype_new(args->type),
+			       rb_str_new(args->data, args->len));
+}
+
+static void *rugged_mysql_fetch__with_gvl(void *_args)
+{
+	rugged_mysql_fetch_args *args = _args;
+
+	// never unwind through the fetch threads
+	rb_protect(rugged_mysql_fetch__yield, (VALUE) args, &args->exception);
+	return NULL;
+}
+
+static int
+rugged_mysql_fetch__cb(const git_oid * oid, git_otype type, const void *data,
+		       size_t len, void *payload)
+{
+	rugged_mysql_fetch_args *args = payload;
+
+	args->oid = oid;
+	args->type = type;
+	args->data = data;
+	args->len = len;
+
+	rugged_mysql_with_gvl(rugged_mysql_fetch__with_gvl, args);
+	return args->exception;
+}
+
+static void *rugged_mysql_fetch__without_gvl(void *_args)
+{
+	rugged_mysql_fetch_args *args = _args;
+
+	args->error = mysql_fetch_parallel(args->backend, args->oids,
+					   args->count, args->workers,
+					   args->ordered,
+					   rugged_mysql_fetch__cb, args);
+	return NULL;
+}
+
+/*
+Public: Read many objects over several connections at once, for serving
+clones and fetches.
+oids - Array of hex OID strings
+opts - (optional) hash
+:workers - (optional) integer, connections and threads to use, default 4
+:ordered - (optional) boolean, yield in the order of `oids`, default true;
+  when false objects are yielded as soon as they arrive
+Yields the hex OID, the type symbol and the data of every object.
+Returns nil.
+*/
+static VALUE rb_rugged_mysql_backend_fetch_parallel(int argc, VALUE * argv,
+						    VALUE self)
+{
+	VALUE rb_oids, rb_opts, val;
+	rugged_mysql_backend *backend;
+	rugged_mysql_fetch_args args;
+	long i;
+
+	rb_scan_args(argc, argv, "11", &rb_oids, &rb_opts);
+	Check_Type(rb_oids, T_ARRAY);
+	rb_need_block();
+
+	memset(&args, 0, sizeof(args));
+	args.workers = 4;
+	args.ordered = 1;
+
+	if (!NIL_P(rb_opts)) {
+		Check_Type(rb_opts, T_HASH);
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("workers")))) !=
+		    Qnil) {
+			args.workers = NUM2UINT(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("ordered")))) !=
+		    Qnil) {
+			args.ordered = RTEST(val);
+		}
+	}
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+	args.backend = rugged_mysql_backend_odb(backend);
+	args.count = RARRAY_LEN(rb_oids);
+	args.oids = ALLOC_N(git_oid, args.count ? args.count : 1);
+
+	for (i = 0; i < (long)args.count; i++) {
+		val = rb_ary_entry(rb_oids, i);
+		if (TYPE(val) != T_STRING ||
+		    git_oid_fromstrn(&args.oids[i], RSTRING_PTR(val),
+				     RSTRING_LEN(val)) < 0) {
+			xfree(args.oids);
+			rb_raise(rb_eTypeError, "Invalid OID");
+		}
+	}
+
+	rugged_mysql_without_gvl(rugged_mysql_fetch__without_gvl, &args);
+	xfree(args.oids);
+
+	if (args.exception) {
+		rb_jump_tag(args.exception);
+	}
+	rugged_exception_check(args.error);
+
+	return Qnil;
+}
+
+void Init_rugged_mysql_fetch(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "fetch_parallel",
+			 rb_rugged_mysql_backend_fetch_parallel, -1);
+}
@@ -0,0 +1,106 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_gc.h"
+
+typedef struct {
+	git_odb_backend *odb;
+	git_refdb_backend *refdb;
+	mysql_gc_opts opts;
+	mysql_gc_stats stats;
+	int error;
+} rugged_mysql_gc_args;
+
+static void *rugged_mysql_gc__without_gvl(void *_args)
+{
+	rugged_mysql_gc_args *args = _args;
+
+	args->error = mysql_gc(&args->stats, args->odb, args->refdb,
+			       &args->opts);
+	return NULL;
+}
+
+/*
+Public: Collect objects that are not reachable from any ref. The work is
+done in small batches and can be spread over several calls: a call that
+stops at :max_rows is picked up by the next one.
+opts - (optional) hash
+:batch_size - (optional) integer, objects per step, default 500
+:rows_per_second - (optional) integer, most rows deleted per second,
+  0 for no limit, default 1000
+:grace_period - (optional) integer, seconds an object must stay
+  unreachable before it is deleted, default two weeks
+:max_rows - (optional) integer, stop after this many rows, default none
+Returns a Hash with :done, true once a whole collection has finished, and
+the :marked, :swept and :deleted counts of this call.
+*/
+static VALUE rb_rugged_mysql_backend_gc(int argc, VALUE * argv, VALUE self)
+{
+	VALUE rb_opts, val, rb_result;
+	rugged_mysql_backend *backend;
+	rugged_mysql_gc_args args;
+	mysql_gc_opts opts = MYSQL_GC_OPTS_INIT;
+
+	rb_scan_args(argc, argv, "01", &rb_opts);
+
+	memset(&args, 0, sizeof(args));
+	args.opts = opts;
+
+	if (!NIL_P(rb_opts)) {
+		Check_Type(rb_opts, T_HASH);
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("batch_size")))) != Qnil) {
+			args.opts.batch_size = NUM2SIZET(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("rows_per_second")))) !=
+		    Qnil) {
+			args.opts.rows_per_second = NUM2UINT(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("grace_period")))) !=
+		    Qnil) {
+			args.opts.grace_period = NUM2UINT(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("max_rows")))) !=
+		    Qnil) {
+			args.opts.max_rows = NUM2SIZET(val);
+		}
+	}
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+	args.odb = rugged_mysql_backend_odb(backend);
+
+	rugged_exception_check(backend->backend.refdb_backend
+			       (&args.refdb, &backend->backend));
+
+	rugged_mysql_without_gvl(rugged_mysql_gc__without_gvl, &args);
+	args.refdb->free(args.refdb);
+	rugged_exception_check(args.error);
+
+	rb_result = rb_hash_new();
+	rb_hash_aset(rb_result, CSTR2SYM("done"),
+		     args.stats.done ? Qtrue : Qfalse);
+	rb_hash_aset(rb_result, CSTR2SYM("marked"),
+		     SIZET2NUM(args.stats.marked));
+	rb_hash_aset(rb_result, CSTR2SYM("swept"), SIZET2NUM(args.stats.swept));
+	rb_hash_aset(rb_result, CSTR2SYM("deleted"),
+		     SIZET2NUM(args.stats.deleted));
+
+	return rb_result;
+}
+
+void Init_rugged_mysql_gc(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "gc",
+			 rb_rugged_mysql_backend_gc, -1);
+}
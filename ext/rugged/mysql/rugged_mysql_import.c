@@ -0,0 +1,148 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_import.h"
+
+extern VALUE rb_mRuggedMysql;
+
+typedef struct {
+	git_odb_backend *odb;
+	git_refdb_backend *refdb;
+	const char *path;
+	mysql_import_opts opts;
+	mysql_import_stats stats;
+	VALUE rb_progress;
+	int error;
+	int exception;		/* rb_protect state of the progress proc */
+} rugged_mysql_import_args;
+
+static VALUE rugged_mysql_import__stats(const mysql_import_stats * stats)
+{
+	VALUE rb_stats = rb_hash_new();
+
+	rb_hash_aset(rb_stats, CSTR2SYM("objects"), SIZET2NUM(stats->objects));
+	rb_hash_aset(rb_stats, CSTR2SYM("skipped"), SIZET2NUM(stats->skipped));
+	rb_hash_aset(rb_stats, CSTR2SYM("total"), SIZET2NUM(stats->total));
+	rb_hash_aset(rb_stats, CSTR2SYM("refs"), SIZET2NUM(stats->refs));
+
+	return rb_stats;
+}
+
+static VALUE rugged_mysql_import__call(VALUE _args)
+{
+	rugged_mysql_import_args *args = (rugged_mysql_import_args *) _args;
+
+	return rb_funcall(args->rb_progress, rb_intern("call"), 1,
+			  rugged_mysql_import__stats(&args->stats));
+}
+
+static void *rugged_mysql_import__with_gvl(void *_args)
+{
+	rugged_mysql_import_args *args = _args;
+
+	rb_protect(rugged_mysql_import__call, (VALUE) args, &args->exception);
+	return NULL;
+}
+
+static int
+rugged_mysql_import__progress(const mysql_import_stats * stats, void *payload)
+{
+	rugged_mysql_import_args *args = payload;
+
+	args->stats = *stats;
+	rugged_mysql_with_gvl(rugged_mysql_import__with_gvl, args);
+	return args->exception;
+}
+
+static void *rugged_mysql_import__without_gvl(void *_args)
+{
+	rugged_mysql_import_args *args = _args;
+
+	args->error = mysql_import(&args->stats, args->odb, args->refdb,
+				   args->path, &args->opts);
+	return NULL;
+}
+
+/*
+Public: Import an on-disk repository into MySQL, much faster than writing
+its objects one at a time. An interrupted import resumes where it stopped
+when run again.
+path - string, path of the repository
+backend - Rugged::Mysql::Backend to import into
+opts - (optional) hash
+:workers - (optional) integer, compression threads, default 4
+:batch_size - (optional) integer, bytes of objects per batch, default 8MB
+:progress - (optional) proc, called after every batch with a Hash of
+  :objects, :skipped, :total and :refs
+Returns a Hash with :objects, :skipped, :total and :refs.
+*/
+static VALUE rb_rugged_mysql_import(int argc, VALUE * argv, VALUE self)
+{
+	VALUE rb_path, rb_backend, rb_opts, val;
+	rugged_mysql_backend *backend;
+	rugged_mysql_import_args args;
+	mysql_import_opts opts = MYSQL_IMPORT_OPTS_INIT;
+
+	rb_scan_args(argc, argv, "21", &rb_path, &rb_backend, &rb_opts);
+	Check_Type(rb_path, T_STRING);
+	if (!rb_obj_is_kind_of(rb_backend, rb_cRuggedMysqlBackend)) {
+		rb_raise(rb_eTypeError,
+			 "Expecting an instance of Rugged::Mysql::Backend");
+	}
+
+	memset(&args, 0, sizeof(args));
+	args.opts = opts;
+	args.rb_progress = Qnil;
+
+	if (!NIL_P(rb_opts)) {
+		Check_Type(rb_opts, T_HASH);
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("workers")))) !=
+		    Qnil) {
+			args.opts.workers = NUM2UINT(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("batch_size")))) != Qnil) {
+			args.opts.batch_size = NUM2SIZET(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("progress")))) !=
+		    Qnil) {
+			if (!rb_respond_to(val, rb_intern("call"))) {
+				rb_raise(rb_eArgError,
+					 "Expected a Proc or an object that responds to #call (:progress).");
+			}
+			args.rb_progress = val;
+			args.opts.progress = rugged_mysql_import__progress;
+			args.opts.progress_payload = &args;
+		}
+	}
+
+	Data_Get_Struct(rb_backend, rugged_mysql_backend, backend);
+	args.odb = rugged_mysql_backend_odb(backend);
+	args.path = StringValueCStr(rb_path);
+
+	rugged_exception_check(backend->backend.refdb_backend
+			       (&args.refdb, &backend->backend));
+
+	rugged_mysql_without_gvl(rugged_mysql_import__without_gvl, &args);
+	args.refdb->free(args.refdb);
+
+	if (args.exception) {
+		rb_jump_tag(args.exception);
+	}
+	rugged_exception_check(args.error);
+
+	return rugged_mysql_import__stats(&args.stats);
+}
+
+void Init_rugged_mysql_import(void)
+{
+	rb_define_module_function(rb_mRuggedMysql, "import",
+				  rb_rugged_mysql_import, -1);
+}
@@ -0,0 +1,94 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_meta_migrate.h"
+
+typedef struct {
+	git_odb_backend *odb;
+	mysql_meta_migrate_opts opts;
+	mysql_meta_migrate_stats stats;
+	int error;
+} rugged_mysql_meta_args;
+
+static void *rugged_mysql_meta__without_gvl(void *_args)
+{
+	rugged_mysql_meta_args *args = _args;
+
+	args->error = mysql_meta_migrate(&args->stats, args->odb, &args->opts);
+	return NULL;
+}
+
+/*
+Public: Move the object headers to the narrow git2_odb_meta table, while
+the repository stays in use. The first call creates the table and the
+triggers that keep it up to date, and read_header and exists look there
+from then on. The headers of the objects already stored are copied in
+small batches, over one call or several: a call that stops at :max_rows
+is picked up by the next one. The MySQL user needs the TRIGGER privilege.
+opts - (optional) hash
+:batch_size - (optional) integer, objects per step, default 1000
+:rows_per_second - (optional) integer, most rows copied per second,
+  0 for no limit, default 5000
+:max_rows - (optional) integer, stop after this many rows, default none
+Returns a Hash with :done, true once every object is in the table, and
+the :scanned and :copied counts of this call.
+*/
+static VALUE rb_rugged_mysql_backend_migrate_meta(int argc, VALUE * argv,
+						  VALUE self)
+{
+	VALUE rb_opts, val, rb_result;
+	rugged_mysql_backend *backend;
+	rugged_mysql_meta_args args;
+	mysql_meta_migrate_opts opts = MYSQL_META_MIGRATE_OPTS_INIT;
+
+	rb_scan_args(argc, argv, "01", &rb_opts);
+
+	memset(&args, 0, sizeof(args));
+	args.opts = opts;
+
+	if (!NIL_P(rb_opts)) {
+		Check_Type(rb_opts, T_HASH);
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("batch_size")))) != Qnil) {
+			args.opts.batch_size = NUM2SIZET(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("rows_per_second")))) !=
+		    Qnil) {
+			args.opts.rows_per_second = NUM2UINT(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("max_rows")))) !=
+		    Qnil) {
+			args.opts.max_rows = NUM2SIZET(val);
+		}
+	}
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+	args.odb = rugged_mysql_backend_odb(backend);
+
+	rugged_mysql_without_gvl(rugged_mysql_meta__without_gvl, &args);
+	rugged_exception_check(args.error);
+
+	rb_result = rb_hash_new();
+	rb_hash_aset(rb_result, CSTR2SYM("done"),
+		     args.stats.done ? Qtrue : Qfalse);
+	rb_hash_aset(rb_result, CSTR2SYM("scanned"),
+		     SIZET2NUM(args.stats.scanned));
+	rb_hash_aset(rb_result, CSTR2SYM("copied"),
+		     SIZET2NUM(args.stats.copied));
+
+	return rb_result;
+}
+
+void Init_rugged_mysql_meta(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "migrate_meta",
+			 rb_rugged_mysql_backend_migrate_meta, -1);
+}
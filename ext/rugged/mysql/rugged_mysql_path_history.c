@@ -0,0 +1,117 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_path_history.h"
+
+static git_odb_backend *rugged_mysql_path_history__odb(VALUE self)
+{
+	rugged_mysql_backend *backend;
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+	return rugged_mysql_backend_odb(backend);
+}
+
+static int
+rugged_mysql_path_history__collect(const mysql_path_history_entry * entry,
+				   void *payload)
+{
+	VALUE rb_entry = rb_hash_new();
+
+	rb_hash_aset(rb_entry, ID2SYM(rb_intern("commit")),
+		     rugged_create_oid(&entry->commit));
+	rb_hash_aset(rb_entry, ID2SYM(rb_intern("blob")),
+		     git_oid_iszero(&entry->blob) ? Qnil :
+		     rugged_create_oid(&entry->blob));
+	rb_hash_aset(rb_entry, ID2SYM(rb_intern("generation")),
+		     UINT2NUM(entry->generation));
+
+	rb_ary_push((VALUE) payload, rb_entry);
+	return 0;
+}
+
+/*
+Public: Add rows to git2_path_history for the commits queued by writes,
+then for commits stored before it was enabled. Run it regularly. Commits
+need a generation number: run backfill_commit_graph first.
+limit - (optional) integer, most commits to index, default all
+Returns the number of commits indexed.
+*/
+static VALUE rb_rugged_mysql_backend_backfill_path_history(int argc,
+							   VALUE * argv,
+							   VALUE self)
+{
+	VALUE rb_limit;
+	size_t added, limit = 0;
+
+	rb_scan_args(argc, argv, "01", &rb_limit);
+
+	if (!NIL_P(rb_limit)) {
+		limit = NUM2SIZET(rb_limit);
+	}
+
+	rugged_exception_check(mysql_path_history_backfill
+			       (&added, rugged_mysql_path_history__odb(self),
+				limit));
+
+	return SIZET2NUM(added);
+}
+
+/*
+Public: List the commits that changed a file, newest generation first,
+from git2_path_history, without reading any tree.
+path - string, relative to the root of the repository, like "lib/foo.rb"
+opts - (optional) hash
+:tip - (optional) string, hex OID of a commit: only its ancestors are
+  listed, like `git log tip -- path`, default every indexed commit
+:limit - (optional) integer, most commits to return, default all
+Returns an Array of Hashes with :commit, :blob (nil where the commit
+deleted the file) and :generation.
+*/
+static VALUE rb_rugged_mysql_backend_path_history(int argc, VALUE * argv,
+						  VALUE self)
+{
+	VALUE rb_path, rb_opts, val, rb_result;
+	git_oid tip;
+	int has_tip = 0;
+	size_t limit = 0;
+
+	rb_scan_args(argc, argv, "11", &rb_path, &rb_opts);
+	Check_Type(rb_path, T_STRING);
+
+	if (!NIL_P(rb_opts)) {
+		Check_Type(rb_opts, T_HASH);
+
+		if ((val = rb_hash_aref(rb_opts, ID2SYM(rb_intern("tip")))) !=
+		    Qnil) {
+			Check_Type(val, T_STRING);
+			rugged_exception_check(git_oid_fromstrn
+					       (&tip, RSTRING_PTR(val),
+						RSTRING_LEN(val)));
+			has_tip = 1;
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("limit")))) != Qnil) {
+			limit = NUM2SIZET(val);
+		}
+	}
+
+	rb_result = rb_ary_new();
+	rugged_exception_check(mysql_path_history_log
+			       (rugged_mysql_path_history__odb(self),
+				StringValueCStr(rb_path),
+				has_tip ? &tip : NULL, limit,
+				rugged_mysql_path_history__collect,
+				(void *)rb_result));
+
+	return rb_result;
+}
+
+void Init_rugged_mysql_path_history(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "backfill_path_history",
+			 rb_rugged_mysql_backend_backfill_path_history, -1);
+	rb_define_method(rb_cRuggedMysqlBackend, "path_history",
+			 rb_rugged_mysql_backend_path_history, -1);
+}
@@ -0,0 +1,106 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_pipeline.h"
+
+typedef struct {
+	VALUE rb_result;
+	int header_only;
+} rugged_mysql_pipeline_payload;
+
+static int
+rugged_mysql_pipeline__collect(size_t i, const git_oid * oid, int error,
+			       void *data, size_t len, git_otype type,
+			       void *_payload)
+{
+	rugged_mysql_pipeline_payload *payload = _payload;
+	VALUE rb_entry = Qnil;
+
+	if (error == GIT_OK) {
+		rb_entry = rb_hash_new();
+		rb_hash_aset(rb_entry, CSTR2SYM("type"), rugged_otype_new(type));
+		rb_hash_aset(rb_entry, CSTR2SYM("len"), SIZET2NUM(len));
+		if (!payload->header_only) {
+			rb_hash_aset(rb_entry, CSTR2SYM("data"),
+				     rb_str_new(data, len));
+		}
+	}
+	free(data);
+
+	rb_ary_store(payload->rb_result, (long)i, rb_entry);
+	return 0;
+}
+
+/*
+Public: Look up many objects at once. The lookups are sent to MySQL in
+batches, a round trip per batch instead of one round trip each.
+oids - Array of hex OID strings
+opts - (optional) hash
+:headers - (optional) boolean, only fetch :type and :len, default false
+Returns an Array with, for each OID in order, a Hash with :type, :len and
+:data, or nil if the object does not exist.
+*/
+static VALUE rb_rugged_mysql_backend_read_many(int argc, VALUE * argv,
+					       VALUE self)
+{
+	VALUE rb_oids, rb_opts, val;
+	rugged_mysql_backend *backend;
+	rugged_mysql_pipeline_payload payload;
+	mysql_pipeline *pipeline;
+	git_oid oid;
+	long i;
+	int error = GIT_OK;
+
+	rb_scan_args(argc, argv, "11", &rb_oids, &rb_opts);
+	Check_Type(rb_oids, T_ARRAY);
+
+	payload.header_only = 0;
+	if (!NIL_P(rb_opts)) {
+		Check_Type(rb_opts, T_HASH);
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("headers")))) !=
+		    Qnil) {
+			payload.header_only = RTEST(val);
+		}
+	}
+
+	for (i = 0; i < RARRAY_LEN(rb_oids); i++) {
+		val = rb_ary_entry(rb_oids, i);
+		Check_Type(val, T_STRING);
+		rugged_exception_check(git_oid_fromstrn(&oid, RSTRING_PTR(val),
+							RSTRING_LEN(val)));
+	}
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+	rugged_exception_check(mysql_pipeline_new
+			       (&pipeline,
+				rugged_mysql_backend_odb(backend)));
+
+	for (i = 0; i < RARRAY_LEN(rb_oids) && error == GIT_OK; i++) {
+		val = rb_ary_entry(rb_oids, i);
+		git_oid_fromstrn(&oid, RSTRING_PTR(val), RSTRING_LEN(val));
+
+		error = payload.header_only ?
+		    mysql_pipeline_read_header(pipeline, &oid) :
+		    mysql_pipeline_read(pipeline, &oid);
+	}
+
+	payload.rb_result = rb_ary_new2(RARRAY_LEN(rb_oids));
+	if (error == GIT_OK) {
+		error = mysql_pipeline_flush(pipeline,
+					     rugged_mysql_pipeline__collect,
+					     &payload);
+	}
+
+	mysql_pipeline_free(pipeline);
+	rugged_exception_check(error);
+
+	return payload.rb_result;
+}
+
+void Init_rugged_mysql_pipeline(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "read_many",
+			 rb_rugged_mysql_backend_read_many, -1);
+}
@@ -0,0 +1,80 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_odb_backend.h"
+
+typedef struct {
+	git_odb_backend *odb;
+	size_t batch_size;
+	size_t deleted;
+	int error;
+} rugged_mysql_prune_args;
+
+static void *rugged_mysql_prune__without_gvl(void *_args)
+{
+	rugged_mysql_prune_args *args = _args;
+
+	args->error = git_odb_backend_mysql_prune_pool(&args->deleted,
+						       args->odb,
+						       args->batch_size);
+	return NULL;
+}
+
+/*
+Public: Delete the objects of the shared pool that no member repository
+refers to any more. Any member of the pool can run it.
+batch_size - (optional) integer, objects per delete, default 500
+Returns the number of objects deleted.
+*/
+static VALUE rb_rugged_mysql_backend_prune_pool(int argc, VALUE * argv,
+						VALUE self)
+{
+	VALUE rb_batch_size;
+	rugged_mysql_backend *backend;
+	rugged_mysql_prune_args args;
+
+	rb_scan_args(argc, argv, "01", &rb_batch_size);
+
+	memset(&args, 0, sizeof(args));
+	if (!NIL_P(rb_batch_size)) {
+		args.batch_size = NUM2SIZET(rb_batch_size);
+	}
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+	args.odb = rugged_mysql_backend_odb(backend);
+
+	rugged_mysql_without_gvl(rugged_mysql_prune__without_gvl, &args);
+	rugged_exception_check(args.error);
+
+	return SIZET2NUM(args.deleted);
+}
+
+/*
+Public: Drop every reference this repository holds into the shared pool,
+for example before the repository is deleted. Objects it only had in the
+pool can no longer be read through it, and are deleted by the next
+prune_pool. Backends created from this one afterwards do not use the pool.
+Returns nil.
+*/
+static VALUE rb_rugged_mysql_backend_leave_pool(VALUE self)
+{
+	rugged_mysql_backend *backend;
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+	rugged_exception_check(git_odb_backend_mysql_leave_pool
+			       (rugged_mysql_backend_odb(backend)));
+
+	free(backend->pool);
+	backend->pool = NULL;
+
+	return Qnil;
+}
+
+void Init_rugged_mysql_pool(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "prune_pool",
+			 rb_rugged_mysql_backend_prune_pool, -1);
+	rb_define_method(rb_cRuggedMysqlBackend, "leave_pool",
+			 rb_rugged_mysql_backend_leave_pool, 0);
+}
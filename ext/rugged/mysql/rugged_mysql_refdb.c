@@ -0,0 +1,80 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_refdb_backend.h"
+
+/*
+Public: Fold the ref changes recorded since the last snapshot into a new
+one. Does nothing unless the database keeps a ref snapshot, see
+ref_snapshot: true.
+Returns nil.
+*/
+static VALUE rb_rugged_mysql_backend_compress_refs(VALUE self)
+{
+	rugged_mysql_backend *backend;
+	git_refdb_backend *refdb;
+	int error;
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+
+	rugged_exception_check(backend->backend.refdb_backend
+			       (&refdb, &backend->backend));
+	error = refdb->compress(refdb);
+	refdb->free(refdb);
+	rugged_exception_check(error);
+
+	return Qnil;
+}
+
+/*
+Public: Build the ref advertisement of upload-pack in one query: HEAD, then
+every ref under refs/ with the peeled line of each annotated tag, as
+pkt-lines ending with a flush.
+
+capabilities - (optional) string sent after the first ref, default empty
+
+With peel_refs: true, tags stored before are peeled on the way and the
+result is saved for the next call.
+Returns a String.
+*/
+static VALUE rb_rugged_mysql_backend_advertise_refs(int argc, VALUE * argv,
+						    VALUE self)
+{
+	rugged_mysql_backend *backend;
+	git_refdb_backend *refdb;
+	git_buf buf = GIT_BUF_INIT;
+	VALUE rb_caps, result;
+	const char *caps = "";
+	int error;
+
+	rb_scan_args(argc, argv, "01", &rb_caps);
+	if (!NIL_P(rb_caps)) {
+		Check_Type(rb_caps, T_STRING);
+		caps = StringValueCStr(rb_caps);
+	}
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+
+	rugged_exception_check(backend->backend.refdb_backend
+			       (&refdb, &backend->backend));
+	error = git_refdb_backend_mysql_advertise(&buf, refdb, caps);
+	refdb->free(refdb);
+	if (error < 0) {
+		git_buf_free(&buf);
+		rugged_exception_check(error);
+	}
+
+	result = rb_str_new(buf.ptr, buf.size);
+	git_buf_free(&buf);
+
+	return result;
+}
+
+void Init_rugged_mysql_refdb(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "compress_refs",
+			 rb_rugged_mysql_backend_compress_refs, 0);
+	rb_define_method(rb_cRuggedMysqlBackend, "advertise_refs",
+			 rb_rugged_mysql_backend_advertise_refs, -1);
+}
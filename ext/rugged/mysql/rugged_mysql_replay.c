@@ -0,0 +1,160 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_replay.h"
+
+typedef struct {
+	rugged_mysql_backend *backend;
+	const char *path;
+	mysql_replay_opts opts;
+	mysql_replay_stats stats;
+	int error;
+} rugged_mysql_replay_args;
+
+static int
+rugged_mysql_replay__open(git_odb_backend ** odb, git_refdb_backend ** refdb,
+			  void *payload)
+{
+	rugged_mysql_backend *backend = payload;
+	int error;
+
+	if ((error = backend->backend.odb_backend(odb, &backend->backend)) < 0) {
+		return error;
+	}
+
+	if ((error = backend->backend.refdb_backend(refdb,
+						    &backend->backend)) < 0) {
+		(*odb)->free(*odb);
+		*odb = NULL;
+	}
+
+	return error;
+}
+
+static void *rugged_mysql_replay__without_gvl(void *_args)
+{
+	rugged_mysql_replay_args *args = _args;
+
+	args->error = mysql_replay(&args->stats, args->path, &args->opts,
+				   rugged_mysql_replay__open, args->backend);
+	return NULL;
+}
+
+static VALUE rugged_mysql_replay__op(const mysql_replay_op_stats * op)
+{
+	VALUE rb_op = rb_hash_new();
+
+	rb_hash_aset(rb_op, CSTR2SYM("count"), ULL2NUM(op->count));
+	rb_hash_aset(rb_op, CSTR2SYM("errors"), ULL2NUM(op->errors));
+	rb_hash_aset(rb_op, CSTR2SYM("mean_ns"),
+		     ULL2NUM(op->total_ns / op->count));
+	rb_hash_aset(rb_op, CSTR2SYM("recorded_mean_ns"),
+		     ULL2NUM(op->recorded_ns / op->count));
+	rb_hash_aset(rb_op, CSTR2SYM("p50_ns"), ULL2NUM(op->p50_ns));
+	rb_hash_aset(rb_op, CSTR2SYM("p95_ns"), ULL2NUM(op->p95_ns));
+	rb_hash_aset(rb_op, CSTR2SYM("p99_ns"), ULL2NUM(op->p99_ns));
+	rb_hash_aset(rb_op, CSTR2SYM("max_ns"), ULL2NUM(op->max_ns));
+
+	return rb_op;
+}
+
+/*
+Public: Play back a trace recorded with Rugged::Mysql.start_recording
+against the database of this backend, with the settings of this backend.
+Writes, deletes and compress change the database: replay against a copy.
+path - the trace file.
+opts - (optional) hash
+:concurrency - (optional) integer, workers, each with connections of its
+  own, default 8
+:speedup - (optional) number, 2.0 replays twice as fast as recorded, 0 as
+  fast as the workers go, default 1.0
+:read_only - (optional) boolean, skip the operations that write
+Returns a Hash with the :operations replayed, the :skipped ones, the
+:seconds it took, the :per_second throughput, and :latency, a Hash from
+operation name ("odb.read", ...) to a Hash with :count, :errors (failed now
+but not when recorded), :mean_ns, :p50_ns, :p95_ns, :p99_ns, :max_ns and
+:recorded_mean_ns.
+*/
+static VALUE
+rb_rugged_mysql_backend_replay(int argc, VALUE * argv, VALUE self)
+{
+	VALUE rb_path, rb_opts, val, rb_result, rb_latency;
+	rugged_mysql_backend *backend, copy;
+	rugged_mysql_replay_args args;
+	mysql_replay_opts opts = MYSQL_REPLAY_OPTS_INIT;
+	double seconds;
+	int op;
+
+	rb_scan_args(argc, argv, "11", &rb_path, &rb_opts);
+	Check_Type(rb_path, T_STRING);
+
+	memset(&args, 0, sizeof(args));
+	args.opts = opts;
+
+	if (!NIL_P(rb_opts)) {
+		Check_Type(rb_opts, T_HASH);
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("concurrency")))) != Qnil) {
+			args.opts.concurrency = NUM2UINT(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("speedup")))) !=
+		    Qnil) {
+			args.opts.speedup = NUM2DBL(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("read_only")))) != Qnil) {
+			args.opts.read_only = RTEST(val);
+		}
+	}
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+
+	// the workers would queue on a shared connection
+	copy = *backend;
+	copy.share_connection = 0;
+	copy.odb = NULL;
+
+	args.backend = &copy;
+	args.path = StringValueCStr(rb_path);
+
+	rugged_mysql_without_gvl(rugged_mysql_replay__without_gvl, &args);
+	rugged_exception_check(args.error);
+
+	seconds = args.stats.elapsed_ns / 1e9;
+
+	rb_result = rb_hash_new();
+	rb_hash_aset(rb_result, CSTR2SYM("operations"),
+		     ULL2NUM(args.stats.operations));
+	rb_hash_aset(rb_result, CSTR2SYM("skipped"),
+		     ULL2NUM(args.stats.skipped));
+	rb_hash_aset(rb_result, CSTR2SYM("seconds"), DBL2NUM(seconds));
+	rb_hash_aset(rb_result, CSTR2SYM("per_second"),
+		     DBL2NUM(seconds > 0 ? args.stats.operations / seconds :
+			     0));
+
+	rb_latency = rb_hash_new();
+	for (op = 1; op < MYSQL_TRACE_OP__COUNT; op++) {
+		if (args.stats.ops[op].count > 0) {
+			rb_hash_aset(rb_latency,
+				     rb_str_new2(mysql_trace_op_name(op)),
+				     rugged_mysql_replay__op(&args.stats.
+							     ops[op]));
+		}
+	}
+	rb_hash_aset(rb_result, CSTR2SYM("latency"), rb_latency);
+
+	return rb_result;
+}
+
+void Init_rugged_mysql_replay(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "replay",
+			 rb_rugged_mysql_backend_replay, -1);
+}
@@ -0,0 +1,91 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_stats.h"
+
+typedef struct {
+	git_odb_backend *odb;
+	int error;
+} rugged_mysql_stats_args;
+
+static void *rugged_mysql_stats__without_gvl(void *_args)
+{
+	rugged_mysql_stats_args *args = _args;
+
+	args->error = mysql_stats_rebuild(args->odb);
+	return NULL;
+}
+
+static VALUE rugged_mysql_stats__count(const mysql_stats_count * count)
+{
+	VALUE rb_count = rb_hash_new();
+
+	rb_hash_aset(rb_count, CSTR2SYM("objects"), ULL2NUM(count->objects));
+	rb_hash_aset(rb_count, CSTR2SYM("size"), ULL2NUM(count->size));
+
+	return rb_count;
+}
+
+/*
+Public: Read the object counters of the repository, kept in git2_stats
+as objects are written and collected. A backend opened with
+statistics: true must have turned them on for the database.
+Returns a Hash with the total :objects and :size (in bytes, before
+compression), and a Hash with the same keys for each of :commit, :tree,
+:blob and :tag.
+*/
+static VALUE rb_rugged_mysql_backend_statistics(VALUE self)
+{
+	rugged_mysql_backend *backend;
+	mysql_stats stats;
+	VALUE rb_result;
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+	rugged_exception_check(mysql_stats_read
+			       (&stats, rugged_mysql_backend_odb(backend)));
+
+	rb_result = rb_hash_new();
+	rb_hash_aset(rb_result, CSTR2SYM("objects"),
+		     ULL2NUM(stats.total.objects));
+	rb_hash_aset(rb_result, CSTR2SYM("size"), ULL2NUM(stats.total.size));
+	rb_hash_aset(rb_result, CSTR2SYM("commit"),
+		     rugged_mysql_stats__count(&stats.types[GIT_OBJ_COMMIT]));
+	rb_hash_aset(rb_result, CSTR2SYM("tree"),
+		     rugged_mysql_stats__count(&stats.types[GIT_OBJ_TREE]));
+	rb_hash_aset(rb_result, CSTR2SYM("blob"),
+		     rugged_mysql_stats__count(&stats.types[GIT_OBJ_BLOB]));
+	rb_hash_aset(rb_result, CSTR2SYM("tag"),
+		     rugged_mysql_stats__count(&stats.types[GIT_OBJ_TAG]));
+
+	return rb_result;
+}
+
+/*
+Public: Count every object again with a full scan, once after turning on
+statistics: true for a repository that already has objects.
+Returns nil.
+*/
+static VALUE rb_rugged_mysql_backend_rebuild_statistics(VALUE self)
+{
+	rugged_mysql_backend *backend;
+	rugged_mysql_stats_args args;
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+
+	memset(&args, 0, sizeof(args));
+	args.odb = rugged_mysql_backend_odb(backend);
+
+	rugged_mysql_without_gvl(rugged_mysql_stats__without_gvl, &args);
+	rugged_exception_check(args.error);
+
+	return Qnil;
+}
+
+void Init_rugged_mysql_stats(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "statistics",
+			 rb_rugged_mysql_backend_statistics, 0);
+	rb_define_method(rb_cRuggedMysqlBackend, "rebuild_statistics",
+			 rb_rugged_mysql_backend_rebuild_statistics, 0);
+}
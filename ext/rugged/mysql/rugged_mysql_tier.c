@@ -0,0 +1,100 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_tier.h"
+
+typedef struct {
+	git_odb_backend *odb;
+	mysql_tier_opts opts;
+	mysql_tier_stats stats;
+	int error;
+} rugged_mysql_tier_args;
+
+static void *rugged_mysql_tier__without_gvl(void *_args)
+{
+	rugged_mysql_tier_args *args = _args;
+
+	args->error = mysql_tier_archive(&args->stats, args->odb, &args->opts);
+	return NULL;
+}
+
+/*
+Public: Move the objects that have not been read for a while from git2_odb
+to git2_odb_archive. The backend must be opened with tiering: true. The
+work is done in small batches and can be spread over several calls: a
+call that stops at :max_rows is picked up by the next one.
+opts - (optional) hash
+:cold_after - (optional) integer, seconds without a recorded read before
+  an object is archived, default 30 days
+:batch_size - (optional) integer, objects per step, default 500
+:rows_per_second - (optional) integer, most rows moved per second,
+  0 for no limit, default 1000
+:max_rows - (optional) integer, stop after this many rows, default none
+Returns a Hash with :done, true once the whole table has been gone
+through, and the :scanned and :archived counts of this call.
+*/
+static VALUE rb_rugged_mysql_backend_archive_cold(int argc, VALUE * argv,
+						  VALUE self)
+{
+	VALUE rb_opts, val, rb_result;
+	rugged_mysql_backend *backend;
+	rugged_mysql_tier_args args;
+	mysql_tier_opts opts = MYSQL_TIER_OPTS_INIT;
+
+	rb_scan_args(argc, argv, "01", &rb_opts);
+
+	memset(&args, 0, sizeof(args));
+	args.opts = opts;
+
+	if (!NIL_P(rb_opts)) {
+		Check_Type(rb_opts, T_HASH);
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("cold_after")))) != Qnil) {
+			args.opts.cold_after = NUM2UINT(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("batch_size")))) != Qnil) {
+			args.opts.batch_size = NUM2SIZET(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts,
+				  ID2SYM(rb_intern("rows_per_second")))) !=
+		    Qnil) {
+			args.opts.rows_per_second = NUM2UINT(val);
+		}
+
+		if ((val =
+		     rb_hash_aref(rb_opts, ID2SYM(rb_intern("max_rows")))) !=
+		    Qnil) {
+			args.opts.max_rows = NUM2SIZET(val);
+		}
+	}
+
+	Data_Get_Struct(self, rugged_mysql_backend, backend);
+	args.odb = rugged_mysql_backend_odb(backend);
+
+	rugged_mysql_without_gvl(rugged_mysql_tier__without_gvl, &args);
+	rugged_exception_check(args.error);
+
+	rb_result = rb_hash_new();
+	rb_hash_aset(rb_result, CSTR2SYM("done"),
+		     args.stats.done ? Qtrue : Qfalse);
+	rb_hash_aset(rb_result, CSTR2SYM("scanned"),
+		     SIZET2NUM(args.stats.scanned));
+	rb_hash_aset(rb_result, CSTR2SYM("archived"),
+		     SIZET2NUM(args.stats.archived));
+
+	return rb_result;
+}
+
+void Init_rugged_mysql_tier(void)
+{
+	rb_define_method(rb_cRuggedMysqlBackend, "archive_cold",
+			 rb_rugged_mysql_backend_archive_cold, -1);
+}
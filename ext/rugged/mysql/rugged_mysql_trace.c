@@ -0,0 +1,172 @@
+#include <git2.h>
+#include <rugged.h>
+
+#include "rugged_mysql.h"
+#include "mysql_trace.h"
+
+extern VALUE rb_mRuggedMysql;
+
+static VALUE rb_trace_start = Qnil;
+static VALUE rb_trace_finish = Qnil;
+
+static VALUE rugged_mysql_trace__event_new(const mysql_trace_event * event)
+{
+	VALUE rb_event = rb_hash_new();
+
+	rb_hash_aset(rb_event, ID2SYM(rb_intern("operation")),
+		     rb_str_new2(event->operation));
+
+	if (event->oid != NULL) {
+		char hex[GIT_OID_HEXSZ];
+		git_oid_fmt(hex, event->oid);
+		rb_hash_aset(rb_event, ID2SYM(rb_intern("oid")),
+			     rb_str_new(hex, GIT_OID_HEXSZ));
+	}
+
+	if (event->refname != NULL) {
+		rb_hash_aset(rb_event, ID2SYM(rb_intern("refname")),
+			     rb_str_new2(event->refname));
+	}
+
+	rb_hash_aset(rb_event, ID2SYM(rb_intern("bytes")),
+		     ULL2NUM(event->bytes));
+	rb_hash_aset(rb_event, ID2SYM(rb_intern("rows")),
+		     ULONG2NUM(event->rows));
+	rb_hash_aset(rb_event, ID2SYM(rb_intern("duration_ns")),
+		     ULL2NUM(event->duration_ns));
+	rb_hash_aset(rb_event, ID2SYM(rb_intern("error")),
+		     INT2FIX(event->error));
+
+	return rb_event;
+}
+
+static VALUE rugged_mysql_trace__call(VALUE args)
+{
+	VALUE *argv = (VALUE *) args;
+
+	return rb_funcall(argv[0], rb_intern("call"), 1, argv[1]);
+}
+
+static void
+rugged_mysql_trace__dispatch(VALUE proc, const mysql_trace_event * event)
+{
+	VALUE argv[2];
+	int state = 0;
+
+	// hooks may fire from native worker threads, or from Ruby threads
+	// that released the GVL (fetch_parallel), which must never touch
+	// the interpreter
+	if (NIL_P(proc) || !rugged_mysql_has_gvl()) {
+		return;
+	}
+
+	argv[0] = proc;
+	argv[1] = rugged_mysql_trace__event_new(event);
+
+	// never unwind through libgit2 frames
+	rb_protect(rugged_mysql_trace__call, (VALUE) argv, &state);
+	if (state) {
+		rb_set_errinfo(Qnil);
+	}
+}
+
+static void
+rugged_mysql_trace__start(const mysql_trace_event * event, void *payload)
+{
+	rugged_mysql_trace__dispatch(rb_trace_start, event);
+}
+
+static void
+rugged_mysql_trace__finish(const mysql_trace_event * event, void *payload)
+{
+	rugged_mysql_trace__dispatch(rb_trace_finish, event);
+}
+
+/*
+Public: Register tracing hooks around every backend operation.
+opts - hash containing the hooks.
+:start - (optional) callable, receives an event hash before the operation
+:finish - (optional) callable, receives an event hash after the operation
+:sample_rate - (optional) integer, trace one in every N operations, default 1
+
+Events carry :operation, :oid or :refname, :bytes, :rows, :duration_ns and
+:error. Exceptions raised by a hook are discarded.
+*/
+static VALUE rb_rugged_mysql_set_trace_hooks(VALUE self, VALUE rb_opts)
+{
+	VALUE val;
+	unsigned int sample_rate = 1;
+
+	Check_Type(rb_opts, T_HASH);
+
+	if ((val =
+	     rb_hash_aref(rb_opts, ID2SYM(rb_intern("sample_rate")))) != Qnil) {
+		Check_Type(val, T_FIXNUM);
+		sample_rate = NUM2UINT(val);
+	}
+
+	rb_trace_start = rb_hash_aref(rb_opts, ID2SYM(rb_intern("start")));
+	rb_trace_finish = rb_hash_aref(rb_opts, ID2SYM(rb_intern("finish")));
+
+	mysql_trace_set_hooks(NIL_P(rb_trace_start) ? NULL :
+			      rugged_mysql_trace__start,
+			      NIL_P(rb_trace_finish) ? NULL :
+			      rugged_mysql_trace__finish, NULL, sample_rate);
+
+	return Qnil;
+}
+
+/*
+Public: Remove the tracing hooks.
+*/
+static VALUE rb_rugged_mysql_clear_trace_hooks(VALUE self)
+{
+	mysql_trace_clear_hooks();
+
+	rb_trace_start = Qnil;
+	rb_trace_finish = Qnil;
+
+	return Qnil;
+}
+
+/*
+Public: Record every backend operation of this process to a trace file,
+whatever the sample rate of the hooks, until stop_recording. Play it back
+with Backend#replay.
+path - the file to write, truncated first.
+A forked child does not record into its parent's file.
+*/
+static VALUE rb_rugged_mysql_start_recording(VALUE self, VALUE rb_path)
+{
+	Check_Type(rb_path, T_STRING);
+
+	rugged_exception_check(mysql_trace_record_start
+			       (StringValueCStr(rb_path)));
+
+	return Qnil;
+}
+
+/*
+Public: Write out the buffered records and close the trace file.
+*/
+static VALUE rb_rugged_mysql_stop_recording(VALUE self)
+{
+	rugged_exception_check(mysql_trace_record_stop());
+
+	return Qnil;
+}
+
+void Init_rugged_mysql_trace(void)
+{
+	rb_gc_register_address(&rb_trace_start);
+	rb_gc_register_address(&rb_trace_finish);
+
+	rb_define_singleton_method(rb_mRuggedMysql, "set_trace_hooks",
+				   rb_rugged_mysql_set_trace_hooks, 1);
+	rb_define_singleton_method(rb_mRuggedMysql, "clear_trace_hooks",
+				   rb_rugged_mysql_clear_trace_hooks, 0);
+	rb_define_singleton_method(rb_mRuggedMysql, "start_recording",
+				   rb_rugged_mysql_start_recording, 1);
+	rb_define_singleton_method(rb_mRuggedMysql, "stop_recording",
+				   rb_rugged_mysql_stop_recording, 0);
+}